@@ -21,6 +21,7 @@
 
 #include "test_core.h"
 #include "test_tree.h"
+#include "test_gm.h"
 
 
 int main()
@@ -30,6 +31,7 @@ int main()
 
     sr = srunner_create(make_core_suite());
     srunner_add_suite(sr, make_tree_suite());
+    srunner_add_suite(sr, make_gm_suite());
     srunner_run_all(sr, CK_NORMAL);
     n_failures = srunner_ntests_failed(sr);
     srunner_free(sr);
@@ -29,8 +29,6 @@
 #define CHECKMATE 2
 #define STALEMATE 3
 
-#define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
-
 int
 check_status(char *fen)
 {
@@ -128,7 +126,7 @@ START_TEST(test_castle)
     ck_assert_ptr_ne(res, NULL);
     ck_assert_str_eq(
         res->post_board->fen,
-        "2kr1bnr/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR w - - - 1");
+        "2kr1bnr/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR w - - 1 2");
 
     /* castle not available */
     res = apply_moves_to_fen(
@@ -142,7 +140,7 @@ START_TEST(test_castle)
     ck_assert_ptr_ne(res, NULL);
     ck_assert_str_eq(
         res->post_board->fen,
-        "r4rk1/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR w - - - 1");
+        "r4rk1/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR w - - 1 2");
 
     res = apply_moves_to_fen(
         "r3k2r/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR b kq - - -",
@@ -150,7 +148,7 @@ START_TEST(test_castle)
     ck_assert_ptr_ne(res, NULL);
     ck_assert_str_eq(
         res->post_board->fen,
-        "2kr3r/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR w - - - 1");
+        "2kr3r/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR w - - 1 2");
 
     res = apply_moves_to_fen(
         "r3k2r/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR b kq - - -",
@@ -158,7 +156,7 @@ START_TEST(test_castle)
     ck_assert_ptr_ne(res, NULL);
     ck_assert_str_eq(
         res->post_board->fen,
-        "r4rk1/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR w - - - 1");
+        "r4rk1/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR w - - 1 2");
 
     res = apply_moves_to_fen(
         "r3k2r/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR b kq - - -",
@@ -166,7 +164,7 @@ START_TEST(test_castle)
     ck_assert_ptr_ne(res, NULL);
     ck_assert_str_eq(
         res->post_board->fen,
-        "1r3rk1/p1pp1ppp/8/8/1p6/P1P1p3/1P1PPPPP/RNBQKBNR w - - - 2");
+        "1r3rk1/p1pp1ppp/8/8/1p6/P1P1p3/1P1PPPPP/RNBQKBNR w - - 1 3");
 
     res = apply_moves_to_fen(
         "r3k2r/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR b kq - - -",
@@ -179,12 +177,19 @@ START_TEST(test_castle)
     ck_assert_ptr_ne(res, NULL);
     ck_assert_str_eq(
         res->post_board->fen,
-        "2kr2r1/p1pp1ppp/8/8/1p6/P1P1p3/1P1PPPPP/RNBQKBNR w - - - 2");
+        "2kr2r1/p1pp1ppp/8/8/1p6/P1P1p3/1P1PPPPP/RNBQKBNR w - - 1 3");
 
     res = apply_moves_to_fen(
         "r3k2r/p1pp1ppp/8/8/1p6/P3p3/1PPPPPPP/RNBQKBNR b kq - - -",
         3, ks_rook_ks_castle);
     ck_assert_ptr_eq(res, NULL);
+
+    /* the other king can't castle across the board into this king */
+    res = apply_moves_to_fen(
+        "4k2r/8/8/8/8/8/5P2/4K2R w Kk - - -", 1, ks_castle);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert_str_eq(
+        res->post_board->fen, "4k2r/8/8/8/8/8/5P2/5RK1 b k - 1 1");
 }
 END_TEST
 
@@ -199,7 +204,7 @@ START_TEST(test_en_passant)
     ck_assert_ptr_ne(res, NULL);
     ck_assert_str_eq(
         res->post_board->fen,
-        "3k4/p7/2P5/8/8/8/P7/3K4 b - - - 1");
+        "3k4/p7/2P5/8/8/8/P7/3K4 b - - 0 2");
 
     res = apply_moves_to_fen(
         "3k4/p1p5/8/3P4/8/8/P7/3K4 b - - - -", 4, invalid_moves);
@@ -277,6 +282,425 @@ START_TEST(test_stalemate)
 }
 END_TEST
 
+START_TEST(test_san)
+{
+    struct san san;
+    struct move *res;
+    char *promote[1] = {"a8=Q+"};
+    char *underpromote[1] = {"axb8N"};
+    char *no_promotion[1] = {"a8"};
+    char *king_promotion[1] = {"a8=K"};
+    char *blocked_castle[1] = {"O-O-O"};
+
+    ck_assert(parse_san("Nbxd7+!?", 8, &san));
+    ck_assert_int_eq(KNIGHT, san.piece);
+    ck_assert_int_eq(1, san.start.file);
+    ck_assert_int_eq(-1, san.start.rank);
+    ck_assert_int_eq(3, san.end.file);
+    ck_assert_int_eq(6, san.end.rank);
+    ck_assert(san.capture);
+    ck_assert_int_eq('+', san.check);
+    ck_assert_int_eq(6, san.len);
+
+    ck_assert(parse_san("exd8=Q#", 7, &san));
+    ck_assert_int_eq(PAWN, san.piece);
+    ck_assert_int_eq(4, san.start.file);
+    ck_assert_int_eq(QUEEN, san.promotion);
+    ck_assert_int_eq('#', san.check);
+
+    ck_assert(parse_san("Qh4e1", 5, &san));
+    ck_assert_int_eq(7, san.start.file);
+    ck_assert_int_eq(3, san.start.rank);
+    ck_assert(!san.capture);
+
+    ck_assert(parse_san("0-0-0", 5, &san));
+    ck_assert_int_eq(WHITE_QUEENSIDE, san.castle);
+    ck_assert(parse_san("O-O+", 4, &san));
+    ck_assert_int_eq(WHITE_KINGSIDE, san.castle);
+
+    ck_assert(!parse_san("e", 1, &san));
+    ck_assert(!parse_san("e4e", 3, &san));
+    ck_assert(!parse_san("Nxxd7", 5, &san));
+    ck_assert(!parse_san("Nxbd7", 5, &san));
+    ck_assert(!parse_san("e4 ", 3, &san));
+    ck_assert(!parse_san("d5xe4", 5, &san));
+    ck_assert(!parse_san("e4=Q", 4, &san));
+
+    res = apply_moves_to_fen("7k/P7/8/8/8/8/8/K7 w - - - -", 1, promote);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert_int_eq(QUEEN, res->post_board->board[7][0].piece_type);
+    ck_assert_int_eq(WHITE, res->post_board->board[7][0].color);
+    ck_assert_str_eq("a8=Q+", res->algebraic);
+    res = apply_moves_to_fen("1r5k/P7/8/8/8/8/8/K7 w - - - -", 1, underpromote);
+    ck_assert_ptr_ne(res, NULL);
+    ck_assert_int_eq(KNIGHT, res->post_board->board[7][1].piece_type);
+    ck_assert_int_eq(0, res->post_board->board[6][0].piece_type);
+    res = apply_moves_to_fen("7k/P7/8/8/8/8/8/K7 w - - - -", 1, no_promotion);
+    ck_assert_ptr_eq(res, NULL);
+    res = apply_moves_to_fen("7k/P7/8/8/8/8/8/K7 w - - - -", 1, king_promotion);
+    ck_assert_ptr_eq(res, NULL);
+
+    /* the castle is only found to be blocked once its board has been made */
+    res = apply_moves_to_fen(
+        "rn2k2r/8/8/8/8/8/8/4K3 b kq - - -", 1, blocked_castle);
+    ck_assert_ptr_eq(res, NULL);
+}
+END_TEST
+
+/* Make a move in coordinate notation from a FEN position, and return its
+ * SAN, or NULL if the move couldn't be made. */
+static char *
+coordinates_san(char *fen, char *coordinates)
+{
+    struct move *last;
+    struct move *res;
+
+    last = parse_fen(fen, strlen(fen));
+    parse_coordinates(coordinates, strlen(coordinates), last, &res);
+    return res == NULL ? NULL : res->algebraic;
+}
+
+START_TEST(test_coordinates)
+{
+    struct move *last;
+    struct move *res;
+
+    ck_assert_str_eq("e4", coordinates_san(START_FEN, "e2e4"));
+    ck_assert_str_eq("Nf3", coordinates_san(START_FEN, "g1f3"));
+    ck_assert_ptr_eq(NULL, coordinates_san(START_FEN, "e2e5"));
+    ck_assert_ptr_eq(NULL, coordinates_san(START_FEN, "e7e5"));
+    ck_assert_ptr_eq(NULL, coordinates_san(START_FEN, "e3e4"));
+    ck_assert_ptr_eq(NULL, coordinates_san(START_FEN, "e2e4q"));
+    ck_assert_ptr_eq(NULL, coordinates_san(START_FEN, "e2"));
+
+    /* disambiguation by file, by rank, and by both */
+    ck_assert_str_eq("Nbd2", coordinates_san(
+        "4k3/8/8/8/8/8/8/1N2KN2 w - - - -", "b1d2"));
+    ck_assert_str_eq("R1a2", coordinates_san(
+        "4k3/8/8/8/8/R7/8/R3K3 w - - - -", "a1a2"));
+    ck_assert_str_eq("Qa1e5+", coordinates_san(
+        "7k/8/8/Q7/8/8/8/Q3Q2K w - - - -", "a1e5"));
+    /* a pinned knight can't go there, so it doesn't need telling apart */
+    ck_assert_str_eq("Nd2", coordinates_san(
+        "4k3/8/8/8/8/8/8/1N2KN1r w - - - -", "b1d2"));
+
+    ck_assert_str_eq("O-O", coordinates_san(
+        "r3k2r/8/8/8/8/8/8/R3K2R w KQkq - - -", "e1g1"));
+    ck_assert_str_eq("O-O-O", coordinates_san(
+        "r3k2r/8/8/8/8/8/8/R3K2R b KQkq - - -", "e8c8"));
+    ck_assert_str_eq("a8=Q+", coordinates_san(
+        "7k/P7/8/8/8/8/8/K7 w - - - -", "a7a8q"));
+    ck_assert_str_eq("axb8=N", coordinates_san(
+        "1r5k/P7/8/8/8/8/8/K7 w - - - -", "a7b8n"));
+    ck_assert_ptr_eq(NULL, coordinates_san(
+        "7k/P7/8/8/8/8/8/K7 w - - - -", "a7a8"));
+    ck_assert_str_eq("Ra8#", coordinates_san(
+        "6k1/5ppp/8/8/8/8/8/R3K3 w - - - -", "a1a8"));
+
+    last = parse_fen("3k4/p1p5/8/3P4/8/8/P7/3K4 b - - - -", 36);
+    parse_coordinates("c7c5", 4, last, &res);
+    ck_assert_ptr_ne(NULL, res);
+    parse_coordinates("d5c6", 4, res, &res);
+    ck_assert_ptr_ne(NULL, res);
+    ck_assert_str_eq("dxc6", res->algebraic);
+    ck_assert_int_eq(0, res->post_board->board[4][2].piece_type);
+}
+END_TEST
+
+/* Make a move in SAN from a FEN position, and return the SAN it was stored
+ * with, or NULL if the move couldn't be made. */
+static char *
+canonical_san(char *fen, char *san)
+{
+    struct move *last;
+    struct move *res;
+
+    last = parse_fen(fen, strlen(fen));
+    parse_algebraic(san, last, &res);
+    return res == NULL ? NULL : res->algebraic;
+}
+
+START_TEST(test_canonical_san)
+{
+    struct move *last;
+    struct move *res;
+
+    ck_assert_str_eq("Nf3", canonical_san(START_FEN, "Nf3"));
+    ck_assert_str_eq("Nf3", canonical_san(START_FEN, "Ngf3"));
+    ck_assert_str_eq("Nf3", canonical_san(START_FEN, "Ng1f3"));
+    ck_assert_str_eq("Nf3", canonical_san(START_FEN, "Nf3+"));
+    ck_assert_str_eq("O-O", canonical_san(
+        "r3k2r/8/8/8/8/8/8/R3K2R w KQkq - - -", "0-0"));
+    ck_assert_str_eq("O-O-O+", canonical_san(
+        "3k3r/8/8/8/8/8/8/R3K2R w KQ - - -", "O-O-O"));
+    ck_assert_str_eq("Nbd2", canonical_san(
+        "4k3/8/8/8/8/8/8/1N2KN2 w - - - -", "Nbd2"));
+    ck_assert_str_eq("Nd2", canonical_san(
+        "4k3/8/8/8/8/8/8/1N2KN1r w - - - -", "Nbd2"));
+    ck_assert_str_eq("Ra8#", canonical_san(
+        "6k1/5ppp/8/8/8/8/8/R3K3 w - - - -", "Ra8"));
+
+    last = parse_fen(START_FEN, strlen(START_FEN));
+    parse_algebraic("Nf3", last, &res);
+    ck_assert(!res->post_board->in_check);
+    last = parse_fen("4k3/8/8/8/8/8/8/4K2Q w - - - -", 30);
+    parse_algebraic("Qh5", last, &res);
+    ck_assert_str_eq("Qh5+", res->algebraic);
+    ck_assert(res->post_board->in_check);
+}
+END_TEST
+
+START_TEST(test_legal_moves)
+{
+    struct move *last;
+    struct legal_moves *legal;
+    const struct legal_move *m;
+    struct position start;
+    struct position end;
+
+    last = parse_fen(START_FEN, strlen(START_FEN));
+    legal = find_legal_moves(last);
+    ck_assert_int_eq(20, legal->n);
+    m = legal_move_by_san(legal, "Nf3", 3);
+    ck_assert_ptr_ne(NULL, m);
+    ck_assert_str_eq("Nf3", m->san);
+    ck_assert_ptr_eq(m, legal_move_by_san(legal, "Ng1f3!", 6));
+    ck_assert_ptr_eq(NULL, legal_move_by_san(legal, "Nf4", 3));
+    ck_assert_ptr_eq(NULL, legal_move_by_san(legal, "e5", 2));
+    read_location("e2", &start);
+    read_location("e4", &end);
+    m = legal_move_by_squares(legal, start, end, 0);
+    ck_assert_ptr_ne(NULL, m);
+    ck_assert_str_eq("e4", m->san);
+    ck_assert_ptr_eq(NULL, legal_move_by_squares(legal, end, start, 0));
+    free_legal_moves(legal);
+
+    /* castles, each promotion, and disambiguation */
+    last = parse_fen("1r2k3/P7/8/8/8/8/8/R3K2R w KQ - - -", 35);
+    legal = find_legal_moves(last);
+    ck_assert_ptr_ne(NULL, legal_move_by_san(legal, "O-O", 3));
+    ck_assert_ptr_ne(NULL, legal_move_by_san(legal, "0-0-0", 5));
+    ck_assert_ptr_ne(NULL, legal_move_by_san(legal, "a8=N", 4));
+    ck_assert_ptr_ne(NULL, legal_move_by_san(legal, "axb8Q", 5));
+    ck_assert_ptr_ne(NULL, legal_move_by_san(legal, "Rad1", 4));
+    ck_assert_ptr_eq(NULL, legal_move_by_san(legal, "a8", 2));
+    read_location("a7", &start);
+    read_location("a8", &end);
+    m = legal_move_by_squares(legal, start, end, ROOK);
+    ck_assert_ptr_ne(NULL, m);
+    ck_assert_str_eq("a8=R", m->san);
+    free_legal_moves(legal);
+
+    /* stalemate */
+    last = parse_fen("7k/5Q2/6K1/8/8/8/8/8 b - - - -", 30);
+    legal = find_legal_moves(last);
+    ck_assert_int_eq(0, legal->n);
+    free_legal_moves(legal);
+}
+END_TEST
+
+START_TEST(test_pgn_lexer)
+{
+    struct pgn_lexer lex;
+    struct pgn_token tok;
+    const char *value;
+    size_t value_len;
+    int i;
+    static const char pgn[] =
+        "[White \"Kasparov, \\\"Gazza\\\"\"]\r\n"
+        "[Round \"4\"]\n"
+        "% an escaped line\n"
+        "1. e4 {best by test} e5!? 2.Nf3 $14 (2.f4 ; the gambit\n"
+        "2...exf4) 0-0 1/2-1/2";
+    static const pgn_token_type_t types[] = {
+        PGN_TOKEN_TAG, PGN_TOKEN_TAG,
+        PGN_TOKEN_MOVE_NUMBER, PGN_TOKEN_SAN, PGN_TOKEN_COMMENT,
+        PGN_TOKEN_SAN, PGN_TOKEN_NAG, PGN_TOKEN_MOVE_NUMBER, PGN_TOKEN_SAN,
+        PGN_TOKEN_NAG, PGN_TOKEN_VARIATION_START, PGN_TOKEN_MOVE_NUMBER,
+        PGN_TOKEN_SAN, PGN_TOKEN_COMMENT, PGN_TOKEN_MOVE_NUMBER,
+        PGN_TOKEN_SAN, PGN_TOKEN_VARIATION_END, PGN_TOKEN_SAN,
+        PGN_TOKEN_RESULT, PGN_TOKEN_END, PGN_TOKEN_END,
+    };
+
+    pgn_lexer_init(&lex, pgn, sizeof(pgn) - 1);
+    for (i = 0; i < (int) (sizeof(types) / sizeof(types[0])); i++) {
+        ck_assert_int_eq(types[i], pgn_next_token(&lex, &tok));
+        switch (i) {
+        case 0:
+            ck_assert_int_eq(5, tok.name_len);
+            ck_assert(!strncmp("White", tok.name, 5));
+            ck_assert_int_eq(19, tok.value_len);
+            break;
+        case 4:
+            ck_assert_int_eq(12, tok.value_len);
+            ck_assert(!strncmp("best by test", tok.value, 12));
+            break;
+        case 5:
+            ck_assert_int_eq(2, tok.len);
+            break;
+        case 6:
+            ck_assert_int_eq(5, tok.number);
+            break;
+        case 9:
+            ck_assert_int_eq(14, tok.number);
+            break;
+        case 14:
+            ck_assert_int_eq(2, tok.number);
+            ck_assert_int_eq(4, tok.len);
+            break;
+        case 17:
+            ck_assert(!strncmp("0-0", tok.text, tok.len));
+            break;
+        }
+    }
+
+    ck_assert(pgn_find_tag(pgn, sizeof(pgn) - 1, "Round", &value, &value_len));
+    ck_assert_int_eq(1, value_len);
+    ck_assert_int_eq('4', value[0]);
+    ck_assert(!pgn_find_tag(pgn, sizeof(pgn) - 1, "Event", &value, &value_len));
+
+    /* nothing is read past a bad token */
+    pgn_lexer_init(&lex, "e4 {oops", 8);
+    ck_assert_int_eq(PGN_TOKEN_SAN, pgn_next_token(&lex, &tok));
+    ck_assert_int_eq(PGN_TOKEN_ERROR, pgn_next_token(&lex, &tok));
+    ck_assert_int_eq(3, lex.pos);
+}
+END_TEST
+
+/* Parse a FEN and say whether it's a legal position, or -1 if it can't be
+ * parsed at all. */
+static int
+fen_legal(char *fen)
+{
+    struct move *m;
+    int res;
+
+    m = parse_fen(fen, strlen(fen));
+    if (m == NULL)
+        return -1;
+    res = illegal_position(m) == NULL;
+    free_move(m);
+    return res;
+}
+
+START_TEST(test_fen)
+{
+    struct move *m;
+    struct move *res;
+    struct legal_moves *legal;
+    static const char *sicilian =
+        "rnbqkbnr/pp1ppppp/8/2p5/4P3/8/PPPP1PPP/RNBQKBNR w KQkq c6 0 2";
+    static const char *endgame = "4k3/8/8/8/8/8/8/4K2R b K - 99 60";
+    static const char *mate = "3k4/3Q4/8/3P4/B7/8/8/3K4 b - - 0 1";
+    /* counters can be left out, and whitespace can follow */
+    static const char *stalemate = "3k4/8/8/8/8/1r6/2r5/K7 w - -\n";
+    static const char *passant = "4k3/8/8/4pP2/8/8/8/4K3 w - e6 0 1";
+    static const char *pinned = "8/8/8/K2pP2r/8/8/8/7k w - d6 0 1";
+    static const char *passant_only = "7k/8/5p2/4pP2/8/8/2q5/K7 w - e6 0 1";
+    static const char *passant_check = "8/8/8/Ppk5/K7/7r/8/8 w - b6 0 1";
+
+    m = parse_fen(START_FEN, strlen(START_FEN));
+    ck_assert_ptr_ne(NULL, m);
+    ck_assert_str_eq(START_FEN, m->post_board->fen);
+    ck_assert_str_eq("", m->post_board->pgn);
+    ck_assert_int_eq(0, m->post_board->ply_index);
+    free_move(m);
+
+    /* the en passant square and both counters are read back out */
+    m = parse_fen(sicilian, strlen(sicilian));
+    ck_assert_ptr_ne(NULL, m);
+    ck_assert_str_eq(sicilian, m->post_board->fen);
+    ck_assert_int_eq(2, m->post_board->passant_file);
+    ck_assert_int_eq(2, m->post_board->ply_index);
+    parse_algebraic("e5", m, &res);
+    ck_assert_ptr_ne(NULL, res);
+    parse_algebraic("d5", res, &res);
+    ck_assert_ptr_ne(NULL, res);
+    parse_algebraic("exd6", res, &res);
+    ck_assert_ptr_ne(NULL, res);
+    ck_assert_str_eq("2.e5 d5 3.exd6", res->post_board->pgn);
+    free_move(m);
+
+    /* the capture can be made on the FEN's own en passant square too */
+    m = parse_fen(passant, strlen(passant));
+    ck_assert_ptr_ne(NULL, m);
+    parse_algebraic("fxe6", m, &res);
+    ck_assert_ptr_ne(NULL, res);
+    ck_assert_str_eq("4k3/8/4P3/8/8/8/8/4K3 b - - 0 1", res->post_board->fen);
+    free_move(res);
+    parse_coordinates("f5e6", 4, m, &res);
+    ck_assert_ptr_ne(NULL, res);
+    ck_assert_str_eq("fxe6", res->algebraic);
+    free_move(res);
+    free_move(m);
+    /* but not if taking both pawns off the rank leaves the king in check */
+    m = parse_fen(pinned, strlen(pinned));
+    ck_assert_ptr_ne(NULL, m);
+    parse_algebraic("exd6", m, &res);
+    ck_assert_ptr_eq(NULL, res);
+    free_move(m);
+
+    m = parse_fen(endgame, strlen(endgame));
+    ck_assert_ptr_ne(NULL, m);
+    ck_assert_int_eq(119, m->post_board->ply_index);
+    ck_assert_int_eq(DRAW_NONE, m->post_board->draws);
+    parse_algebraic("Kd7", m, &res);
+    ck_assert_ptr_ne(NULL, res);
+    ck_assert_int_eq(DRAW_50, res->post_board->draws);
+    ck_assert_str_eq("60...Kd7", res->post_board->pgn);
+    ck_assert_str_eq("8/3k4/8/8/8/8/8/4K2R w K - 100 61",
+                     res->post_board->fen);
+    free_move(m);
+
+    /* check and the end of the game are worked out as the position is read */
+    m = parse_fen(mate, strlen(mate));
+    ck_assert(m->post_board->in_check);
+    ck_assert_int_eq(VICTORY_WHITE, m->post_board->termination);
+    free_move(m);
+    m = parse_fen(stalemate, strlen(stalemate));
+    ck_assert(!m->post_board->in_check);
+    ck_assert_str_eq(
+        "stalemate", termination_str(m->post_board->termination));
+    free_move(m);
+
+    /* nor is a position whose only legal move is en passant, whether it
+     * gets out of check or not */
+    m = parse_fen(passant_only, strlen(passant_only));
+    ck_assert_int_eq(AVAILABLE_MOVE, m->post_board->termination);
+    legal = find_legal_moves(m);
+    ck_assert_int_eq(1, legal->n);
+    ck_assert_str_eq("fxe6", legal->moves[0].san);
+    free_legal_moves(legal);
+    free_move(m);
+    m = parse_fen(passant_check, strlen(passant_check));
+    ck_assert(m->post_board->in_check);
+    ck_assert_int_eq(AVAILABLE_MOVE, m->post_board->termination);
+    legal = find_legal_moves(m);
+    ck_assert_int_eq(1, legal->n);
+    ck_assert_str_eq("axb6", legal->moves[0].san);
+    free_legal_moves(legal);
+    free_move(m);
+
+    ck_assert_int_eq(1, fen_legal(START_FEN));
+    ck_assert_int_eq(-1, fen_legal("rnbqkbnr/pppppppp/9/8/8/8/PPPPPPPP/RNBQKBNR"
+                                   " w KQkq - 0 1"));
+    ck_assert_int_eq(-1, fen_legal("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBN"
+                                   " w KQkq - 0 1"));
+    ck_assert_int_eq(-1, fen_legal("4k3/8/8/8/8/8/8/8 w - - 0 1"));
+    ck_assert_int_eq(-1, fen_legal("4k3/8/8/8/8/8/8/4K3 x - - 0 1"));
+    ck_assert_int_eq(-1, fen_legal("4k3/8/8/8/8/8/8/4K3 w - e3 0 1"));
+    ck_assert_int_eq(-1, fen_legal("4k3/8/8/8/8/8/8/4K3 w - - x 1"));
+    ck_assert_int_eq(-1, fen_legal("4k3/8/8/8/8/8/8/4K3 w - - 0 1 x"));
+    /* well formed, but not a position a game could get to */
+    ck_assert_int_eq(0, fen_legal("P3k3/8/8/8/8/8/8/4K3 w - - 0 1"));
+    ck_assert_int_eq(0, fen_legal("4k3/8/8/8/8/8/8/4K3 w K - 0 1"));
+    ck_assert_int_eq(0, fen_legal("4k3/8/8/8/8/8/8/4K3 w - e6 0 1"));
+    ck_assert_int_eq(0, fen_legal("3k4/8/8/B2P4/8/8/8/3K1r2 b - - 0 1"));
+    ck_assert_int_eq(0, fen_legal("QQQQk3/QQQQQ3/Q7/8/8/8/8/4K3 b - - 0 1"));
+    ck_assert_int_eq(1, fen_legal("4k3/8/8/4pP2/8/8/8/4K3 w - e6 0 1"));
+}
+END_TEST
+
 Suite *
 make_core_suite()
 {
@@ -300,5 +724,17 @@ make_core_suite()
     tcase_add_test(tc, test_check_movement);
     suite_add_tcase(s, tc);
 
+    tc = tcase_create("pgn");
+    tcase_add_test(tc, test_san);
+    tcase_add_test(tc, test_coordinates);
+    tcase_add_test(tc, test_canonical_san);
+    tcase_add_test(tc, test_legal_moves);
+    tcase_add_test(tc, test_pgn_lexer);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("fen");
+    tcase_add_test(tc, test_fen);
+    suite_add_tcase(s, tc);
+
     return s;
 }
@@ -0,0 +1,486 @@
+/*
+ * test_gm.h: tests for the parts of gm that read messages from clients
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "grandmaster/core.h"
+#include "grandmaster/tree.h"
+#include "grandmaster/gmutil.h"
+
+#include <check.h>
+#include <jansson.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Encode a value, check that it decodes to the same thing, and return the
+ * encoding, which the caller must free. */
+static struct gm_buf
+wire_round_trip(json_t *val)
+{
+    struct gm_buf buf;
+    json_t *decoded;
+
+    memset(&buf, 0x00, sizeof(struct gm_buf));
+    ck_assert_int_eq(0, wire_encode(&buf, val, NULL));
+    decoded = wire_decode(buf.data, buf.len);
+    ck_assert_ptr_ne(NULL, decoded);
+    ck_assert(json_equal(val, decoded));
+    json_decref(decoded);
+    return buf;
+}
+
+START_TEST(test_wire_round_trip)
+{
+    struct gm_buf buf;
+    json_t *val;
+    json_t *board;
+    json_t *map;
+    json_t *rank;
+    json_t *square;
+    int r;
+    int f;
+
+    val = json_pack(
+        "{sssIsIsIsIs[nbbfs]s{}s[]}",
+        "kind", "move",
+        "game_id", (json_int_t) 12,
+        "player", (json_int_t) -3,
+        "player_white", (json_int_t) INT64_MAX,
+        "player_black", (json_int_t) INT64_MIN,
+        "not a known key", 1, 0, 1.5, "caf\xc3\xa9",
+        "empty", "none");
+    buf = wire_round_trip(val);
+    buf_free(&buf);
+    json_decref(val);
+
+    /* grids of pieces and of positions go out as boards and access maps */
+    board = json_array();
+    map = json_array();
+    for (r = 0; r < 8; r++) {
+        rank = json_array();
+        for (f = 0; f < 8; f++)
+            json_array_append_new(rank, r == 0 ? json_string("wR")
+                : r == 6 ? json_string("bp") : json_null());
+        json_array_append_new(board, rank);
+        rank = json_array();
+        for (f = 0; f < 8; f++) {
+            square = json_array();
+            if (f % 3 == 0)
+                json_array_append_new(square, json_pack("[ii]", r, f));
+            if (r == 7 && f == 7)
+                json_array_append_new(square, json_pack("[ii]", 0, 0));
+            json_array_append_new(rank, square);
+        }
+        json_array_append_new(map, rank);
+    }
+    val = json_pack("{soso}", "board", board, "access_map", map);
+    buf = wire_round_trip(val);
+    /* 1 tag, 1 member count, 2 keys, 1 + 32 for the board, 1 + 64 + 25 for
+     * the access map */
+    ck_assert_int_eq(127, buf.len);
+    buf_free(&buf);
+    json_decref(val);
+}
+END_TEST
+
+START_TEST(test_wire_state)
+{
+    struct game_tree *gt;
+    struct state_node *current;
+    struct gm_buf json_buf;
+    struct gm_buf wire_buf;
+    termination_t termination;
+    json_t *from_json;
+    json_t *from_wire;
+    game_id_t g;
+
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+    g = new_game(gt, 1, 2);
+    ck_assert(make_move(gt, g, 1, "e4"));
+    ck_assert(make_move(gt, g, 2, "d5"));
+    read_game(get_game(gt, g), &current, &termination);
+
+    /* a state in the binary encoding decodes to the same thing as the JSON
+     * rendering of it */
+    memset(&json_buf, 0x00, sizeof(struct gm_buf));
+    memset(&wire_buf, 0x00, sizeof(struct gm_buf));
+    ck_assert_int_eq(0, state_write_json(
+        &json_buf, current, ALL_BOARD_FIELDS | FIELD_LAST_MOVE, termination));
+    ck_assert_int_eq(0, wire_write_state(
+        &wire_buf, current, ALL_BOARD_FIELDS | FIELD_LAST_MOVE, termination));
+    from_json = json_loadb(json_buf.data, json_buf.len, 0, NULL);
+    from_wire = wire_decode(wire_buf.data, wire_buf.len);
+    ck_assert_ptr_ne(NULL, from_json);
+    ck_assert_ptr_ne(NULL, from_wire);
+    ck_assert(json_equal(from_json, from_wire));
+
+    json_decref(from_json);
+    json_decref(from_wire);
+    buf_free(&json_buf);
+    buf_free(&wire_buf);
+    free_game_tree(gt);
+}
+END_TEST
+
+START_TEST(test_wire_truncated)
+{
+    struct gm_buf buf;
+    json_t *val;
+    json_t *decoded;
+    size_t len;
+
+    val = json_pack("{sssIs[sf]}", "kind", "move", "game_id",
+                    (json_int_t) 300, "moves", "e4", 0.25);
+    buf = wire_round_trip(val);
+    for (len = 0; len < buf.len; len++)
+        ck_assert_ptr_eq(NULL, wire_decode(buf.data, len));
+
+    /* nor can there be anything after the value */
+    ck_assert_int_eq(0, buf_append(&buf, "", 1));
+    ck_assert_ptr_eq(NULL, wire_decode(buf.data, buf.len));
+
+    /* lengths can't run past the end of the message */
+    ck_assert_ptr_eq(NULL, wire_decode("\x05\x03" "ab", 4));
+    ck_assert_ptr_eq(NULL, wire_decode("\x06\x02\x00", 3));
+    ck_assert_ptr_eq(NULL, wire_decode("\x08\x00\x00", 3));
+    decoded = wire_decode("\x05\x02" "ab", 4);
+    ck_assert_str_eq("ab", json_string_value(decoded));
+
+    json_decref(decoded);
+    json_decref(val);
+    buf_free(&buf);
+}
+END_TEST
+
+START_TEST(test_wire_bad_varint)
+{
+    json_t *val;
+
+    /* a varint may not go on forever */
+    ck_assert_ptr_eq(NULL, wire_decode(
+        "\x03\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 12));
+    /* nor may it have more than 64 bits */
+    ck_assert_ptr_eq(NULL, wire_decode(
+        "\x03\xff\xff\xff\xff\xff\xff\xff\xff\xff\x02", 11));
+    ck_assert_ptr_eq(NULL, wire_decode("\x03\x80", 2));
+
+    /* the largest zigzag varint there is is the smallest integer */
+    val = wire_decode("\x03\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 11);
+    ck_assert_ptr_ne(NULL, val);
+    ck_assert(json_integer_value(val) == INT64_MIN);
+    json_decref(val);
+
+    /* a string whose length doesn't fit in the message */
+    ck_assert_ptr_eq(NULL, wire_decode(
+        "\x05\xff\xff\xff\xff\xff\xff\xff\xff\x7f" "ab", 12));
+    /* an object key that isn't in the table of known keys */
+    ck_assert_ptr_eq(NULL, wire_decode("\x07\x01\xc8\x01\x00", 5));
+    /* an unknown tag */
+    ck_assert_ptr_eq(NULL, wire_decode("\x0a", 1));
+}
+END_TEST
+
+START_TEST(test_wire_depth)
+{
+    char msg[2 * 64 + 1];
+    json_t *val;
+    int depth;
+    int i;
+
+    /* arrays of one element each, nested depth deep around a null; wire.c
+     * allows values up to 32 deep, counting from 0 at the top */
+    for (depth = 0; depth < 64; depth++) {
+        for (i = 0; i < depth; i++) {
+            msg[2 * i] = 0x06;
+            msg[2 * i + 1] = 0x01;
+        }
+        msg[2 * depth] = 0x00;
+        val = wire_decode(msg, 2 * depth + 1);
+        if (depth <= 32)
+            ck_assert_ptr_ne(NULL, val);
+        else
+            ck_assert_ptr_eq(NULL, val);
+        json_decref(val);
+    }
+}
+END_TEST
+
+START_TEST(test_wire_bad_pieces)
+{
+    char msg[33];
+    json_t *val;
+    int code;
+
+    memset(msg, 0x00, sizeof(msg));
+    msg[0] = 0x08;
+    for (code = 0; code < 16; code++) {
+        msg[1] = code << 4;
+        val = wire_decode(msg, sizeof(msg));
+        /* 0 is empty, 1-6 and 9-14 are pieces and the rest aren't anything */
+        if (code == 7 || code == 8 || code == 15) {
+            ck_assert_ptr_eq(NULL, val);
+            continue;
+        }
+        ck_assert_ptr_ne(NULL, val);
+        if (code == 1)
+            ck_assert_str_eq(
+                "wp", json_string_value(json_array_get(
+                    json_array_get(val, 0), 0)));
+        if (code == 14)
+            ck_assert_str_eq(
+                "bK", json_string_value(json_array_get(
+                    json_array_get(val, 0), 0)));
+        json_decref(val);
+    }
+}
+END_TEST
+
+START_TEST(test_wire_bad_access_map)
+{
+    char msg[1 + 64 + 1];
+    json_t *val;
+    json_t *square;
+
+    /* every square has no accessors, except the first, which has one */
+    memset(msg, 0x00, sizeof(msg));
+    msg[0] = 0x09;
+    msg[1] = 0x01;
+    msg[2] = 63;
+    val = wire_decode(msg, sizeof(msg));
+    ck_assert_ptr_ne(NULL, val);
+    square = json_array_get(json_array_get(val, 0), 0);
+    ck_assert_int_eq(1, json_array_size(square));
+    ck_assert_int_eq(7, json_integer_value(
+        json_array_get(json_array_get(square, 0), 0)));
+    ck_assert_int_eq(7, json_integer_value(
+        json_array_get(json_array_get(square, 0), 1)));
+    json_decref(val);
+
+    /* there is no square 64 */
+    msg[2] = 64;
+    ck_assert_ptr_eq(NULL, wire_decode(msg, sizeof(msg)));
+    msg[2] = (char) 0xff;
+    ck_assert_ptr_eq(NULL, wire_decode(msg, sizeof(msg)));
+    /* nor can a square have more accessors than the message has bytes */
+    msg[1] = 0x7f;
+    msg[2] = 0;
+    ck_assert_ptr_eq(NULL, wire_decode(msg, sizeof(msg)));
+}
+END_TEST
+
+static bool
+same_slice(struct gm_slice a, struct gm_slice b)
+{
+    return a.len == b.len && (a.len == 0 || memcmp(a.data, b.data, a.len) == 0);
+}
+
+/* Check that the fast decoder reads a request, and reads it the same way as
+ * going through jansson does. */
+static void
+check_decoded(const char *msg, struct gm_request *decoded)
+{
+    struct gm_request from_json;
+    json_t *json;
+
+    ck_assert_int_eq(0, decode_request(msg, strlen(msg), decoded));
+    json = json_loads(msg, 0, NULL);
+    ck_assert_ptr_ne(NULL, json);
+    ck_assert(request_from_json(json, &from_json));
+
+    ck_assert_int_eq(from_json.kind, decoded->kind);
+    /* the request ID is left in the JSON, for the caller to echo back */
+    ck_assert_int_eq(from_json.present, decoded->present & ~REQ_REQUEST_ID);
+    ck_assert(from_json.game_id == decoded->game_id);
+    ck_assert(from_json.player == decoded->player);
+    ck_assert(from_json.player_white == decoded->player_white);
+    ck_assert(from_json.player_black == decoded->player_black);
+    ck_assert(same_slice(from_json.move, decoded->move));
+    ck_assert(same_slice(from_json.coordinates, decoded->coordinates));
+    ck_assert(same_slice(from_json.pgn, decoded->pgn));
+    ck_assert(same_slice(from_json.fen, decoded->fen));
+    ck_assert(same_slice(from_json.termination, decoded->termination));
+    ck_assert_int_eq(from_json.fields, decoded->fields);
+    ck_assert(!from_json.unknown_field);
+    ck_assert(!decoded->unknown_field);
+    json_decref(json);
+}
+
+/* Check that the fast decoder leaves a request to jansson, and return what
+ * jansson makes of it. */
+static void
+check_left_to_jansson(const char *msg, struct gm_request *from_json)
+{
+    struct gm_request decoded;
+    json_t *json;
+
+    ck_assert_int_eq(-1, decode_request(msg, strlen(msg), &decoded));
+    json = json_loads(msg, 0, NULL);
+    ck_assert_ptr_ne(NULL, json);
+    ck_assert(request_from_json(json, from_json));
+    /* the slices pointed into the JSON value, so only their lengths are
+     * still good after this */
+    json_decref(json);
+}
+
+static bool
+decodes(const char *msg)
+{
+    struct gm_request req;
+    return decode_request(msg, strlen(msg), &req) == 0;
+}
+
+START_TEST(test_decode_request)
+{
+    struct gm_request req;
+
+    check_decoded(
+        "{\"kind\":\"new_game\",\"player_white\":1,\"player_black\":2}", &req);
+    ck_assert_int_eq(REQ_NEW_GAME, req.kind);
+    ck_assert_int_eq(SLIM_FIELDS, req.fields);
+
+    check_decoded(
+        "{\"kind\":\"move\",\"game_id\":7,\"player\":-1,\"move\":\"Nxe4+\","
+        "\"request_id\":\"abc\"}", &req);
+    ck_assert(req.player == (player_id_t) -1);
+    ck_assert(same_slice(req.move, (struct gm_slice) { "Nxe4+", 5 }));
+    ck_assert(same_slice(req.request_id, (struct gm_slice) { "\"abc\"", 5 }));
+
+    check_decoded(
+        "{\"kind\":\"move\",\"game_id\":0,\"player\":9223372036854775807,"
+        "\"coordinates\":\"e7e8q\",\"request_id\":12}", &req);
+    ck_assert(req.player == INT64_MAX);
+    ck_assert(same_slice(req.request_id, (struct gm_slice) { "12", 2 }));
+
+    check_decoded(
+        " {\n\t\"kind\" : \"legal_moves\" ,\r\n"
+        "  \"game_id\" : -9223372036854775808 } ", &req);
+    ck_assert(req.game_id == (game_id_t) INT64_MIN);
+
+    check_decoded(
+        "{\"kind\":\"get_state\",\"game_id\":3,"
+        "\"fields\":[\"board\",\"fen\",\"last_move\"]}", &req);
+    ck_assert_int_eq(FIELD_BOARD | FIELD_FEN | FIELD_LAST_MOVE, req.fields);
+    check_decoded(
+        "{\"kind\":\"get_state\",\"game_id\":3,\"fields\":\"all\"}", &req);
+    check_decoded("{\"kind\":\"get_state\",\"game_id\":3,\"fields\":[]}", &req);
+    ck_assert_int_eq(0, req.fields);
+
+    check_decoded(
+        "{\"kind\":\"end_game\",\"game_id\":1,\"player\":2,"
+        "\"termination\":\"resignation\"}", &req);
+    check_decoded(
+        "{\"kind\":\"game_from_pgn\",\"player_white\":1,\"player_black\":2,"
+        "\"pgn\":\"1. e4 e5 *\"}", &req);
+    check_decoded(
+        "{\"kind\":\"game_from_fen\",\"player_white\":1,\"player_black\":2,"
+        "\"fen\":\"8/8/8/8/8/8/8/K6k w - - 0 1\"}", &req);
+}
+END_TEST
+
+START_TEST(test_decode_request_fallback)
+{
+    struct gm_request req;
+
+    /* escapes are unescaped by jansson */
+    check_left_to_jansson(
+        "{\"kind\":\"move\",\"game_id\":1,\"player\":1,\"move\":\"e\\u0034\"}",
+        &req);
+    ck_assert_int_eq(2, req.move.len);
+    check_left_to_jansson(
+        "{\"kind\":\"move\",\"game_id\":1,\"player\":1,\"move\":\"e4\","
+        "\"request_id\":\"a\\\"b\"}", &req);
+
+    /* jansson keeps the last of a repeated member */
+    check_left_to_jansson(
+        "{\"kind\":\"get_state\",\"game_id\":1,\"game_id\":2}", &req);
+    ck_assert(req.game_id == 2);
+    check_left_to_jansson(
+        "{\"kind\":\"get_state\",\"fields\":[],\"fields\":\"all\"}", &req);
+
+    /* members the decoder doesn't know about are ignored */
+    check_left_to_jansson(
+        "{\"kind\":\"get_state\",\"game_id\":1,\"extra\":[true]}", &req);
+    ck_assert_int_eq(REQ_GAME_ID, req.present);
+    check_left_to_jansson(
+        "{\"kind\":\"get_state\",\"game_id\":1,\"fields\":[\"nope\"]}", &req);
+    ck_assert(req.unknown_field);
+
+    /* non-ASCII strings and keys need checking for valid UTF-8 */
+    check_left_to_jansson(
+        "{\"kind\":\"move\",\"game_id\":1,\"player\":1,"
+        "\"move\":\"\xc3\xa9" "4\"}", &req);
+    check_left_to_jansson(
+        "{\"kind\":\"get_state\",\"game_id\":1,\"\xc3\xa9\":1}", &req);
+    check_left_to_jansson(
+        "{\"kind\":\"move\",\"game_id\":1,\"player\":1,\"move\":\"e4\x7f\"}",
+        &req);
+
+    /* only integers jansson would also read as integers are read */
+    ck_assert(!decodes("{\"kind\":\"get_state\",\"game_id\":01}"));
+    check_left_to_jansson("{\"kind\":\"get_state\",\"game_id\":1.0}", &req);
+    check_left_to_jansson("{\"kind\":\"get_state\",\"game_id\":1e2}", &req);
+    ck_assert(!decodes(
+        "{\"kind\":\"get_state\",\"game_id\":9223372036854775808}"));
+
+    /* a game ID that isn't an integer doesn't say which game's lock to
+     * take, so it doesn't count */
+    check_left_to_jansson(
+        "{\"kind\":\"move\",\"game_id\":\"0\",\"player\":1,\"move\":\"e4\"}",
+        &req);
+    ck_assert(!(req.present & REQ_GAME_ID));
+    check_left_to_jansson(
+        "{\"kind\":\"move\",\"game_id\":true,\"player\":1,\"move\":\"e4\"}",
+        &req);
+    ck_assert(!(req.present & REQ_GAME_ID));
+
+    /* and anything that isn't a request at all is left alone */
+    ck_assert(!decodes(""));
+    ck_assert(!decodes("{}"));
+    ck_assert(!decodes("{\"kind\":\"batch\"}"));
+    ck_assert(!decodes("{\"kind\":\"move\""));
+    ck_assert(!decodes("{\"kind\":\"move\"}x"));
+    ck_assert(!decodes("{\"kind\":\"move\",}"));
+    ck_assert(!decodes("[\"kind\",\"move\"]"));
+}
+END_TEST
+
+Suite *
+make_gm_suite()
+{
+    Suite *s;
+    TCase *tc;
+
+    s = suite_create("gm");
+    tc = tcase_create("wire");
+    tcase_add_test(tc, test_wire_round_trip);
+    tcase_add_test(tc, test_wire_state);
+    tcase_add_test(tc, test_wire_truncated);
+    tcase_add_test(tc, test_wire_bad_varint);
+    tcase_add_test(tc, test_wire_depth);
+    tcase_add_test(tc, test_wire_bad_pieces);
+    tcase_add_test(tc, test_wire_bad_access_map);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("request");
+    tcase_add_test(tc, test_decode_request);
+    tcase_add_test(tc, test_decode_request_fallback);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
@@ -22,6 +22,7 @@
 
 #include <check.h>
 #include <jansson.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -60,6 +61,101 @@ START_TEST(test_tree_notation_dedup)
     ck_assert_int_eq(2, gt->n_states);
     ck_assert_ptr_eq(gt->games[g1]->current, gt->games[g2]->current);
 
+    /* moves are stored with their canonical SAN whichever way they came */
+    ck_assert(make_move(gt, g1, 56, "f6"));
+    ck_assert(make_move(gt, g2, 56, "f6"));
+    ck_assert(make_move(gt, g1, 12, "Qh5"));
+    ck_assert(make_move(gt, g2, 34, "Qd1h5+"));
+    ck_assert_int_eq(4, gt->n_states);
+    ck_assert_ptr_eq(gt->games[g1]->current, gt->games[g2]->current);
+    ck_assert_str_eq("Qh5+", gt->games[g1]->current->move->algebraic);
+
+    free_game_tree(gt);
+}
+END_TEST
+
+START_TEST(test_make_move_coordinates)
+{
+    struct game_tree *gt;
+    game_id_t g1, g2;
+
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+
+    g1 = new_game(gt, 12, 56);
+    g2 = new_game(gt, 34, 56);
+
+    ck_assert(!make_move_coordinates(gt, g1, 56, "e2e4", 4));
+    ck_assert(make_move_coordinates(gt, g1, 12, "e2e4", 4));
+    ck_assert_str_eq("e4", gt->games[g1]->current->move->algebraic);
+    ck_assert(make_move_coordinates(gt, g1, 56, "e7e5", 4));
+
+    /* moves made either way end up at the same nodes */
+    ck_assert(make_move(gt, g2, 34, "e4"));
+    ck_assert_ptr_eq(
+        gt->games[g1]->current->parent, gt->games[g2]->current);
+    ck_assert(make_move(gt, g2, 56, "e5"));
+    ck_assert_ptr_eq(gt->games[g1]->current, gt->games[g2]->current);
+    ck_assert_int_eq(3, gt->n_states);
+
+    ck_assert(!make_move_coordinates(gt, g1, 12, "e4e5", 4));
+    ck_assert(!make_move_coordinates(gt, g1, 12, "e2e4", 4));
+
+    free_game_tree(gt);
+}
+END_TEST
+
+START_TEST(test_legal_move_cache)
+{
+    struct game_tree *gt;
+    struct state_node *e4;
+    struct legal_move *moves;
+    size_t n;
+    size_t i;
+    bool found;
+
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+
+    ck_assert(tree_legal_moves(gt, gt->root, &moves, &n));
+    ck_assert_int_eq(20, n);
+    ck_assert_ptr_ne(NULL, gt->root->legal);
+    free(moves);
+    /* nothing is added to the tree just by listing its moves */
+    ck_assert_int_eq(1, gt->n_states);
+
+    ck_assert_ptr_eq(NULL, tree_child(gt, gt->root, "Nf4"));
+    e4 = tree_child(gt, gt->root, "e4");
+    ck_assert_ptr_ne(NULL, e4);
+    ck_assert_ptr_eq(e4, tree_child_coordinates(gt, gt->root, "e2e4", 4));
+    ck_assert_ptr_eq(NULL, tree_child_coordinates(gt, e4, "e2e4", 4));
+    tree_child(gt, e4, "f6");
+    ck_assert_int_eq(3, gt->n_states);
+
+    /* the SAN of a move that gives check says so */
+    ck_assert(tree_legal_moves(gt, e4->first_child, &moves, &n));
+    found = false;
+    for (i = 0; i < n; i++)
+        found |= strcmp(moves[i].san, "Qh5+") == 0;
+    ck_assert(found);
+    free(moves);
+
+    /* with room for one position, caching another evicts the first */
+    ck_assert(set_legal_cache_size(gt, 1));
+    ck_assert_ptr_eq(NULL, gt->root->legal);
+    ck_assert_ptr_ne(NULL, tree_child(gt, gt->root, "d4"));
+    ck_assert_ptr_ne(NULL, gt->root->legal);
+    ck_assert_ptr_ne(NULL, tree_child(gt, e4, "e5"));
+    ck_assert_ptr_eq(NULL, gt->root->legal);
+    ck_assert_ptr_ne(NULL, e4->legal);
+
+    /* and moves still resolve with the cache turned off */
+    ck_assert(set_legal_cache_size(gt, 0));
+    ck_assert_ptr_ne(NULL, tree_child(gt, gt->root, "Nc3"));
+    ck_assert_ptr_eq(NULL, tree_child(gt, gt->root, "Nc4"));
+    ck_assert_ptr_eq(NULL, gt->root->legal);
+    ck_assert_int_eq(6, gt->n_states);
+
     free_game_tree(gt);
 }
 END_TEST
@@ -88,6 +184,346 @@ START_TEST(test_tree)
 }
 END_TEST
 
+START_TEST(test_truncate_games)
+{
+    struct game_tree *gt;
+    game_id_t g1, g2;
+
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+
+    g1 = new_game(gt, 1, 2);
+    ck_assert(make_move(gt, g1, 1, "e4"));
+    truncate_games(gt, 1);
+    ck_assert_int_eq(1, gt->n_games);
+    truncate_games(gt, 0);
+    ck_assert_int_eq(0, gt->n_games);
+    ck_assert_ptr_eq(NULL, get_game(gt, g1));
+
+    /* IDs are handed out again once their games are gone */
+    g2 = new_game(gt, 1, 2);
+    ck_assert_int_eq(g1, g2);
+    ck_assert(make_move(gt, g2, 1, "e4"));
+    ck_assert_int_eq(2, gt->n_states);
+
+    free_game_tree(gt);
+}
+END_TEST
+
+START_TEST(test_import_pgn)
+{
+    struct game_tree *gt;
+    struct pgn_import imp;
+    FILE *in;
+    int n_workers;
+    static const char pgn[] =
+        "[Event \"one\"]\n"
+        "[Result \"1-0\"]\n"
+        "\n"
+        "1.e4 e5 2.Qh5 Nc6 3.Bc4 Nf6 4.Qxf7# 1-0\n"
+        "\n"
+        "[Event \"two\"]\r\n"
+        "\r\n"
+        "1.d4 d5 2.Kd2 *\r\n"
+        "[Event \"three\"]\n"
+        "1.e4 e4 0-1\n"
+        "[Event \"four\"]\n"
+        "1.c4\n"
+        "[Event \"five\"]\n"
+        "{ annotated } 1.e4! e5 $1 (1...c5 2.Nf3) 2.Nf3 ; the main line\n"
+        "2...Nc6 *\n";
+
+    for (n_workers = 1; n_workers <= 4; n_workers += 3) {
+        gt = calloc(1, sizeof(struct game_tree));
+        init_gametree(gt);
+        memset(&imp, 0x00, sizeof(struct pgn_import));
+        imp.white = 1;
+        imp.black = 2;
+        imp.n_workers = n_workers;
+
+        in = fmemopen((void *) pgn, sizeof(pgn) - 1, "r");
+        ck_assert_int_eq(0, import_pgn(gt, in, &imp));
+        fclose(in);
+
+        ck_assert_int_eq(4, imp.games);
+        ck_assert_int_eq(15, imp.moves);
+        ck_assert_int_eq(1, imp.rejects);
+        /* the rejected game doesn't leave a half-played game behind, and
+         * games are numbered in the order they were read */
+        ck_assert_int_eq(4, gt->n_games);
+        ck_assert_int_eq(VICTORY_WHITE, get_game(gt, 0)->termination);
+        ck_assert_int_eq(
+            3, get_game(gt, 1)->current->move->post_board->ply_index);
+        ck_assert_int_eq(
+            1, get_game(gt, 2)->current->move->post_board->ply_index);
+        /* comments, annotations and variations are read past, and the
+         * annotated moves are the same moves as the plain ones */
+        ck_assert_int_eq(
+            4, get_game(gt, 3)->current->move->post_board->ply_index);
+        ck_assert_ptr_eq(
+            get_game(gt, 0)->current->parent->parent->parent->parent->parent,
+            get_game(gt, 3)->current->parent->parent);
+
+        free_game_tree(gt);
+    }
+}
+END_TEST
+
+/* Export a subtree to a string. */
+static char *
+pgn_tree_str(struct state_node *node)
+{
+    char *buf;
+    size_t len;
+    FILE *out;
+
+    out = open_memstream(&buf, &len);
+    ck_assert_int_eq(0, write_pgn_tree(node, out));
+    fclose(out);
+    return buf;
+}
+
+START_TEST(test_pgn_variations)
+{
+    struct game_tree *gt;
+    struct state_node *node;
+    game_id_t g;
+    char *pgn;
+    static const char in[] =
+        "[Event \"repertoire\"]\n"
+        "1.e4 e5 (1...c5 2.Nf3 (2.Nc3) d6) 2.Nf3 (2.f4 {gambit} exf4)\n"
+        "Nc6 *\n";
+    static const char out[] =
+        "1.e4 e5 (1...c5 2.Nf3 (2.Nc3) 2...d6) 2.Nf3 (2.f4 exf4) 2...Nc6 *\n";
+
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+    g = new_game_from_pgn(gt, 1, 2, in);
+    ck_assert_int_ne(NO_GAME, g);
+    /* the game follows the main line, and the variations are branches */
+    ck_assert_int_eq(11, gt->n_states);
+    node = get_game(gt, g)->current;
+    ck_assert_int_eq(4, node->move->post_board->ply_index);
+    ck_assert_str_eq("Nc6", node->move->algebraic);
+
+    pgn = pgn_tree_str(gt->root);
+    ck_assert_str_eq(out, pgn);
+
+    /* reading the export back gives the same tree */
+    free_game_tree(gt);
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+    ck_assert_int_ne(NO_GAME, new_game_from_pgn(gt, 1, 2, pgn));
+    ck_assert_int_eq(11, gt->n_states);
+    free(pgn);
+    pgn = pgn_tree_str(gt->root);
+    ck_assert_str_eq(out, pgn);
+    free(pgn);
+
+    /* a subtree comes with the moves that lead to it */
+    node = gt->root->first_child->first_child->first_child->next_sibling;
+    ck_assert_str_eq("Nf3", node->move->algebraic);
+    pgn = pgn_tree_str(node);
+    ck_assert_str_eq("1.e4 c5 2.Nf3 d6 *\n", pgn);
+    free(pgn);
+
+    ck_assert_int_eq(NO_GAME, new_game_from_pgn(gt, 1, 2, "1.e4 (1.d4"));
+    ck_assert_int_eq(NO_GAME, new_game_from_pgn(gt, 1, 2, "(1.d4) 1.e4"));
+    ck_assert_int_eq(NO_GAME, new_game_from_pgn(gt, 1, 2, "1.e4 e5)"));
+
+    free_game_tree(gt);
+}
+END_TEST
+
+START_TEST(test_game_from_fen)
+{
+    struct game_tree *gt;
+    struct state_node *node;
+    struct state_node *roots[40];
+    game_id_t g1, g2;
+    char fen[64];
+    char *pgn;
+    size_t n_states;
+    int i;
+    static const char *endgame = "4k3/8/8/8/8/8/4P3/4K3 b - - 3 40";
+    static const char *mate = "3k4/3Q4/8/3P4/B7/8/8/3K4 b - - 0 1";
+    static const char exported[] =
+        "[SetUp \"1\"]\n[FEN \"4k3/8/8/8/8/8/4P3/4K3 b - - 3 40\"]\n\n"
+        "40...Kd7 (40...Kf7) 41.e4 *\n";
+
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+
+    g1 = new_game_from_fen(gt, 1, 2, endgame, strlen(endgame));
+    ck_assert_int_ne(NO_GAME, g1);
+    node = get_game(gt, g1)->current;
+    ck_assert_ptr_eq(NULL, node->parent);
+    ck_assert_int_eq(2, gt->n_states);
+
+    /* games started from the same position share its node */
+    g2 = new_game_from_fen(gt, 3, 4, endgame, strlen(endgame));
+    ck_assert_ptr_eq(node, get_game(gt, g2)->current);
+    ck_assert_int_eq(2, gt->n_states);
+    ck_assert_ptr_eq(
+        gt->root, tree_root_from_fen(gt, START_FEN, strlen(START_FEN)));
+    ck_assert_ptr_ne(node, tree_root_from_fen(
+        gt, "4k3/8/8/8/8/8/4P3/4K3 b - - 0 40", 32));
+    ck_assert_int_eq(3, gt->n_states);
+
+    /* enough roots that the table has to grow */
+    for (i = 0; i < 40; i++) {
+        snprintf(fen, sizeof(fen), "4k3/8/8/8/8/8/4P3/4K3 w - - 0 %d", i + 1);
+        roots[i] = tree_root_from_fen(gt, fen, strlen(fen));
+        ck_assert_ptr_ne(NULL, roots[i]);
+    }
+    n_states = gt->n_states;
+    for (i = 0; i < 40; i++) {
+        snprintf(fen, sizeof(fen), "4k3/8/8/8/8/8/4P3/4K3 w - - 0 %d", i + 1);
+        ck_assert_ptr_eq(roots[i], tree_root_from_fen(gt, fen, strlen(fen)));
+    }
+    ck_assert_int_eq(n_states, gt->n_states);
+
+    /* move numbers carry on from the FEN's */
+    ck_assert(make_move(gt, g1, 2, "Kd7"));
+    ck_assert(make_move(gt, g1, 1, "e4"));
+    ck_assert_str_eq("40...Kd7 41.e4",
+                     get_game(gt, g1)->current->move->post_board->pgn);
+    /* a tree that starts from a FEN is exported with it */
+    ck_assert(make_move(gt, g2, 4, "Kf7"));
+    pgn = pgn_tree_str(node);
+    ck_assert_str_eq(exported, pgn);
+    free(pgn);
+
+    /* the export reads back in from the same position */
+    free_game_tree(gt);
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+    g1 = new_game_from_pgn(gt, 1, 2, exported);
+    ck_assert_int_ne(NO_GAME, g1);
+    ck_assert_str_eq("40...Kd7 41.e4",
+                     get_game(gt, g1)->current->move->post_board->pgn);
+    node = get_game(gt, g1)->current->parent->parent;
+    ck_assert_ptr_eq(
+        node, tree_root_from_fen(gt, endgame, strlen(endgame)));
+    pgn = pgn_tree_str(node);
+    ck_assert_str_eq(exported, pgn);
+    free(pgn);
+
+    g2 = new_game_from_fen(gt, 1, 2, mate, strlen(mate));
+    ck_assert_int_eq(VICTORY_WHITE, get_game(gt, g2)->termination);
+    g2 = new_game_from_pgn(
+        gt, 1, 2, "[FEN \"3k4/3Q4/8/3P4/B7/8/8/3K4 b - -\"]\n\n*\n");
+    ck_assert_int_eq(VICTORY_WHITE, get_game(gt, g2)->termination);
+    ck_assert_int_eq(NO_GAME, new_game_from_fen(gt, 1, 2, "8/8/8/8", 7));
+    ck_assert_int_eq(NO_GAME, new_game_from_fen(
+        gt, 1, 2, "P3k3/8/8/8/8/8/8/4K3 w - - 0 1", 30));
+    ck_assert_int_eq(NO_GAME, new_game_from_pgn(
+        gt, 1, 2, "[FEN \"8/8/8/8\"]\n\n1.e4 *\n"));
+    /* moves that can't be made from the FEN's position are rejected */
+    ck_assert_int_eq(NO_GAME, new_game_from_pgn(
+        gt, 1, 2, "[FEN \"4k3/8/8/8/8/8/4P3/4K3 w - - 0 1\"]\n\n1.d4 *\n"));
+
+    free_game_tree(gt);
+}
+END_TEST
+
+static int
+write_to_file(const char *data, size_t len, void *arg)
+{
+    return fwrite(data, 1, len, arg) == len ? 0 : -1;
+}
+
+START_TEST(test_tree_write_json)
+{
+    struct game_tree *gt;
+    struct json_writer w;
+    game_id_t g1, g2;
+    json_t *expected;
+    json_t *written;
+    json_error_t err;
+    FILE *f;
+    char *text;
+    size_t len;
+
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+
+    g1 = new_game(gt, 12, 56);
+    g2 = new_game(gt, 34, 56);
+    ck_assert(make_move(gt, g1, 12, "e4"));
+    ck_assert(make_move(gt, g1, 56, "d5"));
+    ck_assert(make_move(gt, g2, 34, "Nf3"));
+
+    f = open_memstream(&text, &len);
+    jw_init(&w, write_to_file, f);
+    ck_assert_int_eq(0, game_tree_write_json(gt, &w));
+    fclose(f);
+
+    written = json_loadb(text, len, 0, &err);
+    ck_assert_ptr_ne(NULL, written);
+    expected = game_tree_to_json(gt);
+    ck_assert(json_equal(expected, written));
+
+    json_decref(expected);
+    json_decref(written);
+    free(text);
+    free_game_tree(gt);
+}
+END_TEST
+
+#define CONCURRENT_GAMES 8
+
+struct concurrent_game {
+    struct game_tree *gt;
+    game_id_t game;
+    bool ok;
+};
+
+static void *
+play_concurrent_game(void *arg)
+{
+    struct concurrent_game *cg;
+    const char *moves[] = {"e4", "e5", "Nf3", "Nc6", "Bb5", "a6", "Ba4", "Nf6"};
+    size_t i;
+
+    cg = arg;
+    cg->ok = true;
+    for (i = 0; i < sizeof(moves) / sizeof(moves[0]); i++)
+        cg->ok &= make_move(cg->gt, cg->game, i % 2 ? 2 : 1, moves[i]);
+    return NULL;
+}
+
+START_TEST(test_tree_concurrent_dedup)
+{
+    struct game_tree *gt;
+    struct concurrent_game games[CONCURRENT_GAMES];
+    pthread_t threads[CONCURRENT_GAMES];
+    int i;
+
+    gt = calloc(1, sizeof(struct game_tree));
+    init_gametree(gt);
+
+    for (i = 0; i < CONCURRENT_GAMES; i++) {
+        games[i].gt = gt;
+        games[i].game = new_game(gt, 1, 2);
+    }
+    for (i = 0; i < CONCURRENT_GAMES; i++)
+        pthread_create(&threads[i], NULL, play_concurrent_game, &games[i]);
+    for (i = 0; i < CONCURRENT_GAMES; i++)
+        pthread_join(threads[i], NULL);
+
+    /* every game went through the same positions, so they should all have
+     * ended up sharing a single line of nodes. */
+    ck_assert_int_eq(9, gt->n_states);
+    for (i = 0; i < CONCURRENT_GAMES; i++) {
+        ck_assert(games[i].ok);
+        ck_assert_ptr_eq(gt->games[0]->current, gt->games[i]->current);
+    }
+
+    free_game_tree(gt);
+}
+END_TEST
+
 Suite *
 make_tree_suite()
 {
@@ -99,6 +535,14 @@ make_tree_suite()
     tcase_add_test(tc, test_tree);
     tcase_add_test(tc, test_tree_notation_dedup);
     tcase_add_test(tc, test_make_move_wrong_player);
+    tcase_add_test(tc, test_make_move_coordinates);
+    tcase_add_test(tc, test_legal_move_cache);
+    tcase_add_test(tc, test_tree_concurrent_dedup);
+    tcase_add_test(tc, test_truncate_games);
+    tcase_add_test(tc, test_tree_write_json);
+    tcase_add_test(tc, test_import_pgn);
+    tcase_add_test(tc, test_pgn_variations);
+    tcase_add_test(tc, test_game_from_fen);
     suite_add_tcase(s, tc);
 
     return s;
@@ -0,0 +1,177 @@
+/*
+ * arena.c: per-worker arenas for JSON values
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Every allocation made through the hooks is preceded by a header saying
+ * where it came from, so that it can be freed by any thread, whether or not
+ * that thread has an arena of its own. The header is big enough to keep the
+ * allocation after it aligned for anything jansson stores. */
+#define HEADER_LEN 16
+#define FROM_MALLOC 0
+#define FROM_ARENA 1
+
+/* Arenas hand out memory from chunks of this size. One is enough for all but
+ * the biggest responses. */
+#define ARENA_CHUNK_LEN (64 * 1024)
+
+/* Allocations bigger than this get a chunk of their own rather than taking
+ * up most of a regular one. */
+#define MAX_SMALL_ALLOC (ARENA_CHUNK_LEN / 4)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t len;
+    /* the chunk's memory follows, aligned like an allocation header */
+};
+#define CHUNK_HEADER_LEN \
+    ((sizeof(struct arena_chunk) + HEADER_LEN - 1) / HEADER_LEN * HEADER_LEN)
+
+/* the arena that jansson allocations on this thread come from, if any */
+static __thread struct gm_arena *current = NULL;
+
+static struct arena_chunk *
+new_chunk(size_t len)
+{
+    struct arena_chunk *chunk;
+
+    chunk = malloc(CHUNK_HEADER_LEN + len);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->len = len;
+    return chunk;
+}
+
+static char *
+chunk_data(struct arena_chunk *chunk)
+{
+    return (char *) chunk + CHUNK_HEADER_LEN;
+}
+
+static void *
+arena_take(struct gm_arena *arena, size_t len)
+{
+    struct arena_chunk *chunk;
+    char *res;
+
+    len = (len + HEADER_LEN - 1) / HEADER_LEN * HEADER_LEN;
+    if (len > MAX_SMALL_ALLOC || arena->used + len > arena->cur->len) {
+        chunk = new_chunk(len > MAX_SMALL_ALLOC ? len : ARENA_CHUNK_LEN);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = arena->extra;
+        arena->extra = chunk;
+        arena->stats.chunks++;
+        /* what's left of the current chunk is still good for small
+         * allocations after a big one */
+        if (len > MAX_SMALL_ALLOC)
+            return chunk_data(chunk);
+        arena->cur = chunk;
+        arena->used = 0;
+    }
+    res = chunk_data(arena->cur) + arena->used;
+    arena->used += len;
+    return res;
+}
+
+static void *
+hooked_malloc(size_t len)
+{
+    char *block;
+    struct gm_arena *arena;
+
+    arena = current;
+    if (arena != NULL) {
+        block = arena_take(arena, HEADER_LEN + len);
+        if (block != NULL) {
+            arena->stats.allocs++;
+            arena->stats.bytes += len;
+            *(int *) block = FROM_ARENA;
+            return block + HEADER_LEN;
+        }
+    }
+    block = malloc(HEADER_LEN + len);
+    if (block == NULL)
+        return NULL;
+    *(int *) block = FROM_MALLOC;
+    return block + HEADER_LEN;
+}
+
+static void
+hooked_free(void *ptr)
+{
+    char *block;
+
+    if (ptr == NULL)
+        return;
+    block = (char *) ptr - HEADER_LEN;
+    /* arena memory is only given back all at once, by arena_reset */
+    if (*(int *) block == FROM_MALLOC)
+        free(block);
+}
+
+void
+arena_install(void)
+{
+    json_set_alloc_funcs(hooked_malloc, hooked_free);
+}
+
+int
+arena_init(struct gm_arena *arena)
+{
+    memset(arena, 0x00, sizeof(struct gm_arena));
+    arena->base = new_chunk(ARENA_CHUNK_LEN);
+    arena->cur = arena->base;
+    return arena->base == NULL ? -1 : 0;
+}
+
+void
+arena_begin(struct gm_arena *arena)
+{
+    memset(&arena->stats, 0x00, sizeof(struct gm_arena_stats));
+    current = arena;
+}
+
+void
+arena_reset(struct gm_arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    current = NULL;
+    while (arena->extra != NULL) {
+        chunk = arena->extra;
+        arena->extra = chunk->next;
+        free(chunk);
+    }
+    arena->cur = arena->base;
+    arena->used = 0;
+}
+
+void
+arena_free(struct gm_arena *arena)
+{
+    arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+    arena->cur = NULL;
+}
@@ -0,0 +1,355 @@
+/*
+ * bench.c: load generator for measuring gm server throughput
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <jansson.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each simulated client plays this opening over and over, in new games. */
+static const char *opening[] = {
+    "e4", "e5", "Nf3", "Nc6", "Bb5", "a6", "Ba4", "Nf6"
+};
+#define OPENING_LEN (sizeof(opening) / sizeof(opening[0]))
+
+/* What the fields member of each request asks for, when the clients ask for
+ * full game states. */
+#define ALL_FIELDS ", \"fields\": \"all\""
+
+/* Games are created in batches of this many requests. */
+#define CREATE_BATCH 64
+
+/* What the simulated clients do: play through the opening, which is
+ * dominated by the cost of validating moves, or just create games, which is
+ * cheap enough that the cost of I/O dominates. */
+enum workload {
+    PLAY_OPENING,
+    CREATE_GAMES,
+};
+
+struct bench_client {
+    pthread_t thread;
+    enum workload workload;
+    int n_requests;
+    int depth;
+    /* whether to talk to the server in the binary encoding */
+    bool binary;
+    /* whether to ask for full game states rather than slim ones */
+    bool full;
+    int done;
+    double latency;
+    bool failed;
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Send a request, given as JSON, in the client's encoding. */
+static int
+send_req(int sockfd, struct bench_client *bc, const char *req)
+{
+    json_t *t;
+    json_error_t json_err;
+    struct gm_buf buf;
+    int res;
+
+    if (!bc->binary)
+        return send_str(sockfd, (char *) req);
+
+    t = json_loads(req, 0, &json_err);
+    if (t == NULL)
+        return -1;
+    memset(&buf, 0x00, sizeof(struct gm_buf));
+    res = wire_encode(&buf, t, NULL) ? -1 : send_msg(sockfd, buf.data, buf.len);
+    json_decref(t);
+    buf_free(&buf);
+    return res;
+}
+
+/* Read a response in the client's encoding, returning the parsed response. */
+static json_t *
+read_resp(int sockfd, struct bench_client *bc)
+{
+    char *resp_msg;
+    size_t len;
+    json_t *resp;
+    json_error_t json_err;
+
+    resp_msg = read_msg(sockfd, MAX_MSG_LEN, &len);
+    if (resp_msg == NULL)
+        return NULL;
+    if (bc->binary)
+        resp = wire_decode(resp_msg, len);
+    else
+        resp = json_loadb(resp_msg, len, 0, &json_err);
+    free(resp_msg);
+    return resp;
+}
+
+/* Send a request and wait for its response, returning the parsed response. */
+static json_t *
+roundtrip(int sockfd, struct bench_client *bc, const char *req)
+{
+    if (send_req(sockfd, bc, req))
+        return NULL;
+    return read_resp(sockfd, bc);
+}
+
+/* Play one game's worth of the opening, with up to depth moves in flight at
+ * once. Returns the number of requests made, or -1 on error. */
+static int
+play_opening(int sockfd, struct bench_client *bc)
+{
+    char req[256];
+    double sent_at[OPENING_LEN];
+    json_t *resp;
+    json_int_t game_id;
+    size_t sent;
+    size_t received;
+    double start;
+
+    start = now();
+    snprintf(req, sizeof(req),
+             "{\"kind\": \"new_game\", \"player_white\": 1, "
+             "\"player_black\": 2%s}", bc->full ? ALL_FIELDS : "");
+    resp = roundtrip(sockfd, bc, req);
+    if (resp == NULL)
+        return -1;
+    game_id = json_integer_value(json_object_get(resp, "game_id"));
+    json_decref(resp);
+    bc->latency += now() - start;
+
+    sent = 0;
+    received = 0;
+    while (received < OPENING_LEN) {
+        while (sent < OPENING_LEN && sent - received < (size_t) bc->depth) {
+            snprintf(req, sizeof(req),
+                     "{\"kind\": \"move\", \"game_id\": %" JSON_INTEGER_FORMAT
+                     ", \"player\": %d, \"move\": \"%s\"%s}",
+                     game_id, sent % 2 ? 2 : 1, opening[sent],
+                     bc->full ? ALL_FIELDS : "");
+            sent_at[sent] = now();
+            if (send_req(sockfd, bc, req))
+                return -1;
+            sent++;
+        }
+        resp = read_resp(sockfd, bc);
+        if (resp == NULL)
+            return -1;
+        json_decref(resp);
+        bc->latency += now() - sent_at[received];
+        received++;
+    }
+    return 1 + OPENING_LEN;
+}
+
+/* Create games, with up to depth requests in flight at once. Returns the
+ * number of requests made, or -1 on error. */
+static int
+create_games(int sockfd, struct bench_client *bc)
+{
+    char req[256];
+    json_t *resp;
+    double sent_at[CREATE_BATCH];
+    size_t sent;
+    size_t received;
+
+    snprintf(req, sizeof(req),
+             "{\"kind\": \"new_game\", \"player_white\": 1, "
+             "\"player_black\": 2%s}", bc->full ? ALL_FIELDS : "");
+    sent = 0;
+    received = 0;
+    while (received < CREATE_BATCH) {
+        while (sent < CREATE_BATCH && sent - received < (size_t) bc->depth) {
+            sent_at[sent] = now();
+            if (send_req(sockfd, bc, req))
+                return -1;
+            sent++;
+        }
+        resp = read_resp(sockfd, bc);
+        if (resp == NULL)
+            return -1;
+        json_decref(resp);
+        bc->latency += now() - sent_at[received];
+        received++;
+    }
+    return CREATE_BATCH;
+}
+
+static void *
+run_client(void *arg)
+{
+    struct bench_client *bc;
+    json_t *resp;
+    int sockfd;
+    int n;
+    bool bin;
+
+    bc = arg;
+    sockfd = connect_gm();
+    if (sockfd == -1) {
+        bc->failed = true;
+        return NULL;
+    }
+
+    /* the session is always started in JSON; the encoding only changes
+     * once the server has seen this request. */
+    bin = bc->binary;
+    bc->binary = false;
+    resp = roundtrip(sockfd, bc,
+                     bin ? "{\"kind\": \"start_session\", "
+                           "\"encoding\": \"binary\"}"
+                         : "{\"kind\": \"start_session\"}");
+    bc->binary = bin;
+    if (resp == NULL) {
+        bc->failed = true;
+        goto close;
+    }
+    json_decref(resp);
+
+    while (bc->done < bc->n_requests) {
+        if (bc->workload == PLAY_OPENING)
+            n = play_opening(sockfd, bc);
+        else
+            n = create_games(sockfd, bc);
+        if (n < 0) {
+            bc->failed = true;
+            break;
+        }
+        bc->done += n;
+    }
+
+close:
+    close(sockfd);
+    return NULL;
+}
+
+int
+bench_main(int argc, char *argv[])
+{
+    struct bench_client *clients;
+    enum workload workload;
+    int n_clients;
+    int n_requests;
+    int depth;
+    bool binary;
+    bool full;
+    int opt;
+    int i;
+    int done;
+    double latency;
+    double start;
+    double elapsed;
+
+    n_clients = 8;
+    n_requests = 10000;
+    depth = 1;
+    workload = PLAY_OPENING;
+    binary = false;
+    full = false;
+    while ((opt = getopt(argc, argv, "c:e:f:n:p:w:")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "slim") == 0) {
+                full = false;
+            } else if (strcmp(optarg, "all") == 0) {
+                full = true;
+            } else {
+                n_clients = 0;
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "json") == 0) {
+                binary = false;
+            } else if (strcmp(optarg, "binary") == 0) {
+                binary = true;
+            } else {
+                n_clients = 0;
+            }
+            break;
+        case 'w':
+            if (strcmp(optarg, "play") == 0) {
+                workload = PLAY_OPENING;
+            } else if (strcmp(optarg, "create") == 0) {
+                workload = CREATE_GAMES;
+            } else {
+                n_clients = 0;
+            }
+            break;
+        case 'c':
+            n_clients = atoi(optarg);
+            break;
+        case 'n':
+            n_requests = atoi(optarg);
+            break;
+        case 'p':
+            depth = atoi(optarg);
+            break;
+        default:
+            n_clients = 0;
+        }
+    }
+    if (n_clients < 1 || n_requests < 1 || depth < 1) {
+        printf("usage: gm bench [-c clients] [-n requests per client] "
+               "[-p pipeline depth] [-w play|create] [-e json|binary] "
+               "[-f slim|all]\n");
+        return 1;
+    }
+
+    clients = calloc(n_clients, sizeof(struct bench_client));
+    if (clients == NULL)
+        return 1;
+
+    start = now();
+    for (i = 0; i < n_clients; i++) {
+        clients[i].workload = workload;
+        clients[i].n_requests = n_requests;
+        clients[i].depth = depth;
+        clients[i].binary = binary;
+        clients[i].full = full;
+        pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+    }
+    done = 0;
+    latency = 0;
+    for (i = 0; i < n_clients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        if (clients[i].failed)
+            fprintf(stderr, "E: client %d failed\n", i);
+        done += clients[i].done;
+        latency += clients[i].latency;
+    }
+    elapsed = now() - start;
+    free(clients);
+
+    printf("%d requests from %d clients in %.3fs\n", done, n_clients, elapsed);
+    printf("%.0f requests/s, mean latency %.1fus\n",
+           done / elapsed, done ? 1e6 * latency / done : 0);
+    return 0;
+}
@@ -0,0 +1,467 @@
+/*
+ * conn.c: request and response bookkeeping for client connections
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Requests waiting for the request ahead of them in their lane to finish. Only
+ * one request per lane is with the workers at any time. */
+struct lane {
+    bool busy;
+    struct gm_job *head;
+    struct gm_job *tail;
+};
+
+static struct lane lanes[N_LANES];
+
+/* the number of jobs with the workers */
+static unsigned int n_running = 0;
+/* whether a barrier job is with the workers */
+static bool barrier_running = false;
+/* jobs that arrived after a barrier job that hasn't finished yet */
+static struct gm_job *held_head = NULL;
+static struct gm_job *held_tail = NULL;
+
+static void
+start_job(struct gm_job *job)
+{
+    n_running++;
+    submit_job(job);
+}
+
+/* Carry out a job in the loop lane. */
+static void
+run_on_loop(struct gm_job *job)
+{
+    const char *req_kind;
+
+    /* the connection may have closed while a batch held the job up */
+    if (job->conn->fd == -1) {
+        return_job(job);
+        return;
+    }
+    req_kind = json_string_value(json_object_get(job->req, "kind"));
+    if (strcmp(req_kind, "subscribe") == 0)
+        subscribe(job);
+    else
+        wait_for_move(job);
+}
+
+/* Hand a job to the workers, or queue it behind the job already running in
+ * its lane. Returns false if it's a barrier job that has to wait for the jobs
+ * that are already running. */
+static bool
+try_schedule(struct gm_job *job)
+{
+    struct lane *lane;
+
+    if (job->lane == LOOP_LANE) {
+        run_on_loop(job);
+        return true;
+    }
+    if (job->lane == BARRIER_LANE) {
+        if (n_running > 0)
+            return false;
+        barrier_running = true;
+        start_job(job);
+        return true;
+    }
+    if (job->lane < 0) {
+        start_job(job);
+        return true;
+    }
+    lane = &lanes[job->lane];
+    if (!lane->busy) {
+        lane->busy = true;
+        start_job(job);
+        return true;
+    }
+    job->next = NULL;
+    if (lane->tail == NULL)
+        lane->head = job;
+    else
+        lane->tail->next = job;
+    lane->tail = job;
+    return true;
+}
+
+static void
+schedule(struct gm_job *job)
+{
+    if (held_head == NULL && !barrier_running && try_schedule(job))
+        return;
+    job->next = NULL;
+    if (held_tail == NULL)
+        held_head = job;
+    else
+        held_tail->next = job;
+    held_tail = job;
+}
+
+/* Schedule the jobs held up by a barrier, up to the next barrier that has to
+ * wait. */
+static void
+release_held(void)
+{
+    struct gm_job *job;
+
+    while (held_head != NULL && !barrier_running) {
+        job = held_head;
+        held_head = job->next;
+        if (held_head == NULL)
+            held_tail = NULL;
+        if (!try_schedule(job)) {
+            job->next = held_head;
+            held_head = job;
+            if (held_tail == NULL)
+                held_tail = job;
+            return;
+        }
+    }
+}
+
+void
+finish_lane(struct gm_job *job)
+{
+    struct lane *lane;
+    struct gm_job *next;
+
+    n_running--;
+    if (job->lane == BARRIER_LANE) {
+        barrier_running = false;
+    } else if (job->lane >= 0) {
+        lane = &lanes[job->lane];
+        next = lane->head;
+        if (next == NULL) {
+            lane->busy = false;
+        } else {
+            lane->head = next->next;
+            if (lane->head == NULL)
+                lane->tail = NULL;
+            start_job(next);
+        }
+    }
+    release_held();
+}
+
+static void
+free_waiting(struct gm_conn *conn)
+{
+    struct gm_job *job;
+
+    while (conn->waiting != NULL) {
+        job = conn->waiting;
+        conn->waiting = job->next;
+        free_job(job);
+    }
+}
+
+void
+release_conn(struct gm_conn *conn)
+{
+    conn->fd = -1;
+    drop_watches(conn);
+    buf_free(&conn->in);
+    buf_free(&conn->out);
+    free_waiting(conn);
+    if (conn->in_flight == 0)
+        free(conn);
+}
+
+static void
+queue_response(struct gm_conn *conn, struct gm_job *job)
+{
+    if (job->resp_msg == NULL)
+        return;
+    if (frame_append(&conn->out, job->resp_msg, job->resp_len))
+        fprintf(stderr, "E: couldn't queue response\n");
+    free(job->resp_msg);
+    job->resp_msg = NULL;
+}
+
+/* Create a job for a request that arrived on the connection, and give it its
+ * place in the connection's response order. req may be NULL if the request
+ * couldn't be parsed, or was decoded without being parsed. */
+static struct gm_job *
+new_job(struct gm_conn *conn, json_t *req, bool tagged)
+{
+    struct gm_job *job;
+
+    job = calloc(1, sizeof(struct gm_job));
+    if (job == NULL)
+        return NULL;
+    job->conn = conn;
+    job->lane = -1;
+    job->binary = conn->binary;
+    job->req = req;
+    job->tagged = tagged;
+    if (!job->tagged)
+        job->seq = conn->next_seq++;
+    return job;
+}
+
+/* Queue the response of a finished job. Responses to requests with a
+ * request_id go out right away; the rest go out in the order their requests
+ * arrived, so they wait for the responses to any earlier requests. */
+static void
+deliver(struct gm_conn *conn, struct gm_job *job)
+{
+    struct gm_job **p;
+
+    if (job->tagged) {
+        queue_response(conn, job);
+        free_job(job);
+        return;
+    }
+
+    for (p = &conn->waiting; *p != NULL && (*p)->seq < job->seq;
+            p = &(*p)->next);
+    job->next = *p;
+    *p = job;
+
+    while (conn->waiting != NULL && conn->waiting->seq == conn->next_send) {
+        job = conn->waiting;
+        conn->waiting = job->next;
+        queue_response(conn, job);
+        free_job(job);
+        conn->next_send++;
+    }
+}
+
+struct gm_conn *
+return_job(struct gm_job *job)
+{
+    struct gm_conn *conn;
+
+    publish_updates(job);
+    conn = job->conn;
+    conn->in_flight--;
+    if (conn->fd == -1) {
+        free_job(job);
+        if (conn->in_flight == 0)
+            free(conn);
+        return NULL;
+    }
+    deliver(conn, job);
+    return conn;
+}
+
+/* Respond to a request without involving the workers, in the given
+ * encoding, filling in the states the response is waiting on, if any. */
+static void
+respond_now(
+    struct gm_conn *conn,
+    json_t *req,
+    json_t *resp,
+    struct deferred_states *states,
+    bool binary)
+{
+    struct gm_job *job;
+
+    job = new_job(
+        conn, req, req != NULL && json_object_get(req, "request_id") != NULL);
+    if (job == NULL) {
+        fprintf(stderr, "E: couldn't allocate job\n");
+        json_decref(resp);
+        free_deferred_states(states);
+        if (req != NULL)
+            json_decref(req);
+        conn->close_after_write = true;
+        return;
+    }
+    job->binary = binary;
+    job->resp_msg = response_str(resp, states, binary, &job->resp_len);
+    deliver(conn, job);
+}
+
+/* Hand a JSON request to the workers without parsing it, if decode_request
+ * understands it. Returns false if it has to be parsed after all. */
+static bool
+dispatch_decoded(struct gm_conn *conn, const char *req_msg, size_t req_len)
+{
+    struct gm_job *job;
+    struct gm_request decoded;
+    char *msg;
+
+    /* the decoded request points into the copy of the message that's kept
+     * for the log, so that's what gets decoded. */
+    msg = malloc(req_len);
+    if (msg == NULL)
+        return false;
+    memcpy(msg, req_msg, req_len);
+    if (decode_request(msg, req_len, &decoded) != 0) {
+        free(msg);
+        return false;
+    }
+
+    job = new_job(conn, NULL, decoded.present & REQ_REQUEST_ID);
+    if (job == NULL) {
+        fprintf(stderr, "E: couldn't allocate job\n");
+        free(msg);
+        conn->close_after_write = true;
+        return true;
+    }
+    job->decoded = decoded;
+    job->req_msg = msg;
+    job->req_len = req_len;
+    job->lane = decoded_request_lane(&decoded);
+    conn->in_flight++;
+    schedule(job);
+    return true;
+}
+
+/* Start work on a single request message. Requests that only concern the
+ * connection are handled right here; everything else is handed to the
+ * workers. */
+static void
+dispatch(struct gm_conn *conn, const char *req_msg, size_t req_len)
+{
+    json_t *req;
+    json_t *req_id;
+    json_t *resp;
+    json_error_t json_err;
+    struct gm_job *job;
+    const char *req_kind;
+    bool binary;
+
+    binary = conn->binary;
+    if (!binary && dispatch_decoded(conn, req_msg, req_len))
+        return;
+    if (binary) {
+        req = wire_decode(req_msg, req_len);
+    } else {
+        req = json_loadb(req_msg, req_len, 0, &json_err);
+    }
+    if (!req) {
+        fprintf(stderr, "I: unable to parse request\n");
+        resp = json_pack("{ss}", "error",
+                         binary ? "couldn't decode message" :
+                                  "couldn't parse json");
+        respond_now(conn, NULL, resp, NULL, binary);
+        return;
+    }
+
+    resp = handle_session(req, conn);
+    if (resp != NULL) {
+        req_id = json_object_get(req, "request_id");
+        if (req_id != NULL)
+            json_object_set(resp, "request_id", req_id);
+        respond_now(conn, req, resp, NULL, binary);
+        return;
+    }
+
+    job = new_job(conn, req, json_object_get(req, "request_id") != NULL);
+    if (job == NULL) {
+        fprintf(stderr, "E: couldn't allocate job\n");
+        json_decref(req);
+        conn->close_after_write = true;
+        return;
+    }
+    /* waits are parked on the event loop rather than taking up a worker
+     * while they wait, but they still go through the scheduler, so that
+     * they don't look at games while a batch is adding or dropping them. */
+    req_kind = json_string_value(json_object_get(req, "kind"));
+    if (req_kind != NULL && (strcmp(req_kind, "subscribe") == 0
+                || strcmp(req_kind, "wait_for_move") == 0)) {
+        job->lane = LOOP_LANE;
+        conn->in_flight++;
+        schedule(job);
+        return;
+    }
+
+    /* binary requests are logged as JSON, which is only worth producing once
+     * we know the request succeeded. */
+    if (!binary) {
+        job->req_msg = malloc(req_len);
+        if (job->req_msg == NULL) {
+            fprintf(stderr, "E: couldn't allocate job\n");
+            free_job(job);
+            conn->close_after_write = true;
+            return;
+        }
+        memcpy(job->req_msg, req_msg, req_len);
+        job->req_len = req_len;
+    }
+    job->lane = request_lane(req);
+    conn->in_flight++;
+    schedule(job);
+}
+
+bool
+process_input(struct gm_conn *conn)
+{
+    size_t offset;
+    size_t msg_len;
+    int ready;
+    json_t *resp;
+    bool stalled;
+
+    offset = 0;
+    stalled = false;
+    while (!conn->close_after_write && conn->in_flight < MAX_IN_FLIGHT) {
+        ready = frame_ready(conn->in.data + offset, conn->in.len - offset,
+                            MAX_MSG_LEN, &msg_len);
+        if (ready == 0)
+            break;
+        if (conn->out.len - conn->out_sent >= MAX_PENDING_OUT) {
+            stalled = ready > 0;
+            break;
+        }
+
+        if (ready < 0) {
+            fprintf(stderr, "I: unable to load message string\n");
+            resp = json_pack("{ss}", "error", "couldn't load message string");
+            respond_now(conn, NULL, resp, NULL, conn->binary);
+            conn->close_after_write = true;
+            offset = conn->in.len;
+            break;
+        }
+
+        dispatch(conn, conn->in.data + offset + MSG_HEADER_LEN, msg_len);
+        offset += MSG_HEADER_LEN + msg_len;
+        if (!conn->session)
+            conn->close_after_write = true;
+    }
+
+    buf_consume(&conn->in, offset);
+    /* updates this client skipped are owed to it as soon as it has room */
+    if (conn->subs_behind > 0 && !catch_up(conn))
+        stalled = true;
+    return stalled;
+}
+
+bool
+conn_wants_input(const struct gm_conn *conn)
+{
+    return !conn->close_after_write
+        && conn->out.len - conn->out_sent < MAX_PENDING_OUT
+        && conn->in_flight < MAX_IN_FLIGHT;
+}
+
+bool
+conn_done(const struct gm_conn *conn)
+{
+    return conn->close_after_write
+        && conn->in_flight == 0
+        && conn->waiting == NULL
+        && conn->out_sent == conn->out.len;
+}
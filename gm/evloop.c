@@ -0,0 +1,281 @@
+/*
+ * evloop.c: epoll backend for the grandmaster server
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+/* epoll tags for the eventfd the workers use to tell us they've finished
+ * jobs and for the timer of parked waits; the listening socket is tagged with
+ * NULL and connections with themselves. */
+static int wake_tag;
+static int timer_tag;
+
+static void
+close_conn(int epfd, struct gm_conn *conn)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    release_conn(conn);
+}
+
+/* Update the set of events we're waiting on for this connection: we only ask
+ * about writability while there's output waiting to go out. */
+static int
+watch_conn(int epfd, struct gm_conn *conn, int op)
+{
+    struct epoll_event ev;
+    unsigned int events;
+
+    events = 0;
+    if (conn_wants_input(conn))
+        events |= EPOLLIN;
+    if (conn->out.len > conn->out_sent)
+        events |= EPOLLOUT;
+    if (op == EPOLL_CTL_MOD && events == conn->watched)
+        return 0;
+
+    memset(&ev, 0x00, sizeof(struct epoll_event));
+    ev.events = events;
+    ev.data.ptr = conn;
+    conn->watched = events;
+    return epoll_ctl(epfd, op, conn->fd, &ev);
+}
+
+static void
+accept_conns(int epfd, int listen_fd)
+{
+    int fd;
+    struct gm_conn *conn;
+
+    for (;;) {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("E: accept error");
+            return;
+        }
+
+        conn = calloc(1, sizeof(struct gm_conn));
+        if (conn == NULL) {
+            fprintf(stderr, "E: couldn't allocate connection\n");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        set_nodelay(fd);
+        if (watch_conn(epfd, conn, EPOLL_CTL_ADD)) {
+            perror("E: couldn't watch connection");
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+/* Make whatever progress we can on a connection: start on the requests that
+ * have arrived, write out the responses that are ready, and close the
+ * connection once it's done. Returns false if the connection has been
+ * closed. */
+static bool
+pump_conn(int epfd, struct gm_conn *conn, bool peer_done)
+{
+    int flushed;
+    bool stalled;
+
+    /* keep handling pipelined requests for as long as the client keeps up
+     * with the responses. */
+    do {
+        stalled = process_input(conn);
+        flushed = conn_flush(conn);
+        if (flushed < 0)
+            goto close;
+    } while (stalled && flushed);
+
+    /* the peer has hung up; nothing more is coming, but we still try to
+     * deliver responses to anything it managed to send. */
+    if (peer_done && !stalled && conn->in_flight < MAX_IN_FLIGHT)
+        conn->close_after_write = true;
+
+    if (conn_done(conn))
+        goto close;
+    if (watch_conn(epfd, conn, EPOLL_CTL_MOD))
+        goto close;
+    return true;
+
+close:
+    close_conn(epfd, conn);
+    return false;
+}
+
+/* Service a readiness event on a client connection. Returns false if the
+ * connection has been closed. */
+static bool
+service_conn(int epfd, struct gm_conn *conn, uint32_t events)
+{
+    ssize_t read_len;
+
+    if (events & EPOLLERR) {
+        close_conn(epfd, conn);
+        return false;
+    }
+
+    read_len = -1;
+    if (events & (EPOLLIN | EPOLLHUP) && !conn->close_after_write) {
+        read_len = conn_read(conn);
+        if (read_len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            close_conn(epfd, conn);
+            return false;
+        }
+    }
+    return pump_conn(epfd, conn, read_len == 0);
+}
+
+/* Send what has been pushed to connections other than the ones we were
+ * dealing with: updates to subscribers, and answers to parked waits. */
+static void
+pump_pushed(int epfd)
+{
+    struct gm_conn *conn;
+
+    while ((conn = take_pushed_conn()) != NULL)
+        pump_conn(epfd, conn, false);
+}
+
+/* Hand the responses to finished jobs back to their connections. */
+static void
+collect_jobs(int epfd, int wake_fd)
+{
+    uint64_t count;
+    struct gm_job *job;
+    struct gm_job *next;
+    struct gm_conn *conn;
+
+    if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("E: couldn't read from worker eventfd");
+
+    for (job = take_finished_jobs(); job != NULL; job = next) {
+        next = job->next;
+        finish_lane(job);
+        conn = return_job(job);
+        if (conn != NULL)
+            pump_conn(epfd, conn, false);
+    }
+    pump_pushed(epfd);
+}
+
+void
+run_event_loop(
+    int listen_fd,
+    struct game_tree *gt,
+    struct gm_log *log,
+    int n_workers)
+{
+    int epfd;
+    int wake_fd;
+    int n_events;
+    int i;
+    bool woken;
+    bool timed_out;
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("E: epoll_create error");
+        return;
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("E: eventfd error");
+        close(epfd);
+        return;
+    }
+
+    memset(&ev, 0x00, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+        perror("E: couldn't watch listening socket");
+        goto close;
+    }
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev)) {
+        perror("E: couldn't watch worker eventfd");
+        goto close;
+    }
+    ev.data.ptr = &timer_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, waiters_timer(), &ev)) {
+        perror("E: couldn't watch wait timer");
+        goto close;
+    }
+
+    if (start_workers(gt, log, n_workers, wake_fd))
+        goto close;
+
+    while (!server_stopping()) {
+        n_events = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n_events == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("E: epoll_wait error");
+            break;
+        }
+        woken = false;
+        timed_out = false;
+        for (i = 0; i < n_events; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_conns(epfd, listen_fd);
+            else if (events[i].data.ptr == &wake_tag)
+                woken = true;
+            else if (events[i].data.ptr == &timer_tag)
+                timed_out = true;
+            else
+                service_conn(epfd, events[i].data.ptr, events[i].events);
+        }
+        /* finished jobs can close their connections, so we only pick them up
+         * once we're done with the events that might refer to those
+         * connections. */
+        if (woken)
+            collect_jobs(epfd, wake_fd);
+        if (timed_out) {
+            expire_waiters();
+            pump_pushed(epfd);
+        }
+    }
+
+    /* let the workers finish what they've started, so that everything that
+     * has been carried out has also been logged. */
+    stop_workers();
+
+close:
+    close(wake_fd);
+    close(epfd);
+}
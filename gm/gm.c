@@ -20,23 +20,36 @@
 #include <stdio.h>
 #include <string.h>
 
-extern int client_main();
+extern int client_main(int argc, char *argv[]);
 extern int server_main();
+extern int bench_main(int argc, char *argv[]);
+extern int export_main(int argc, char *argv[]);
+extern int import_main(int argc, char *argv[]);
+extern int validate_main(int argc, char *argv[]);
 
 int
 main(int argc, char *argv[])
 {
     char *op_mode;
     if (argc < 2) {
-        fprintf(stderr, "usage: gm [client|server]\n");
+        fprintf(stderr, "usage: gm [client [-s]|server|bench|export|import|"
+                "validate]\n");
         return 1;
     }
     op_mode = argv[1];
     argc--; argv++;
     if (strcmp(op_mode, "client") == 0)
-        return client_main();
+        return client_main(argc, argv);
     if (strcmp(op_mode, "server") == 0)
         return server_main(argc, argv);
+    if (strcmp(op_mode, "bench") == 0)
+        return bench_main(argc, argv);
+    if (strcmp(op_mode, "export") == 0)
+        return export_main(argc, argv);
+    if (strcmp(op_mode, "import") == 0)
+        return import_main(argc, argv);
+    if (strcmp(op_mode, "validate") == 0)
+        return validate_main(argc, argv);
     fprintf(stderr, "unrecognized operating mode %s\n", op_mode);
     return 1;
 }
@@ -30,18 +30,12 @@
 #define GM_PORT ("7100")
 
 int
-client_main()
+connect_gm()
 {
     int err;
-    int msglen;
     int sockfd;
-    char *buf;
     struct addrinfo *self;
     struct addrinfo hints;
-    char msg[MAX_MSG_LEN];
-
-    msglen = read(STDIN_FILENO, msg, MAX_MSG_LEN - 1);
-    msg[msglen++] = 0;
 
     memset(&hints, 0x00, sizeof(struct addrinfo));
     hints.ai_family = AF_UNSPEC;
@@ -57,14 +51,85 @@ client_main()
     sockfd = socket(self->ai_family, self->ai_socktype, self->ai_protocol);
     if (sockfd == -1) {
         perror("E: socket error");
+        freeaddrinfo(self);
         return -1;
     }
 
     err = connect(sockfd, self->ai_addr, self->ai_addrlen);
+    freeaddrinfo(self);
     if (err) {
         perror("E: connect error");
+        close(sockfd);
         return -1;
     }
+    return sockfd;
+}
+
+/* Send each line of stdin as a request in a single session, pipelining all of
+ * them before reading any of the responses. */
+int
+run_session(int sockfd)
+{
+    char *line;
+    char *buf;
+    size_t line_cap;
+    ssize_t line_len;
+    int n_requests;
+    int i;
+
+    if (send_str(sockfd, "{\"kind\": \"start_session\"}"))
+        return -1;
+
+    n_requests = 0;
+    line = NULL;
+    line_cap = 0;
+    while ((line_len = getline(&line, &line_cap, stdin)) != -1) {
+        while (line_len > 0 && line[line_len - 1] == '\n')
+            line[--line_len] = 0;
+        if (line_len == 0)
+            continue;
+        if (send_str(sockfd, line))
+            break;
+        n_requests++;
+    }
+    free(line);
+    send_str(sockfd, "{\"kind\": \"end_session\"}");
+
+    /* one response for each request, plus the start and end of the
+     * session. */
+    for (i = 0; i < n_requests + 2; i++) {
+        buf = read_str(sockfd, MAX_MSG_LEN);
+        if (!buf) {
+            fprintf(stderr, "E: got %d of %d responses\n", i, n_requests + 2);
+            return -1;
+        }
+        if (i > 0 && i <= n_requests)
+            printf("%s\n", buf);
+        free(buf);
+    }
+    fprintf(stderr, "OK\n");
+    return 0;
+}
+
+int
+client_main(int argc, char *argv[])
+{
+    int msglen;
+    int sockfd;
+    char *buf;
+    char msg[MAX_MSG_LEN];
+
+    sockfd = connect_gm();
+    if (sockfd == -1)
+        return -1;
+
+    if (argc > 1 && strcmp(argv[1], "-s") == 0)
+        return run_session(sockfd);
+
+    msglen = read(STDIN_FILENO, msg, MAX_MSG_LEN - 1);
+    if (msglen < 0)
+        msglen = 0;
+    msg[msglen++] = 0;
 
     send_str(sockfd, msg);
     buf = read_str(sockfd, MAX_MSG_LEN);
@@ -23,8 +23,10 @@
 
 #include <jansson.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -32,33 +34,54 @@
 
 #define GM_PORT ("7100")
 
+/* The default memory budget for the state cache, in megabytes. */
+#define DEFAULT_CACHE_MB 64
+
+/* The append-only log is read this much at a time. */
+#define AOL_READ_LEN (64 * 1024)
+
 static int sockfd = -1;
+static volatile sig_atomic_t stopping = 0;
+
+static pthread_mutex_t creation_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t game_locks[GAME_SHARDS];
+
+/* What a game looked like before a batch touched it, so that the batch can be
+ * undone. */
+struct game_snapshot {
+    struct game *game;
+    struct state_node *current;
+    termination_t termination;
+};
+
+static json_t *
+handle_batch(
+    struct game_tree *gt,
+    json_t *req,
+    struct deferred_states *states);
 
 json_t *
 handle_json(
     struct game_tree *gt,
-    json_t *req)
+    json_t *req,
+    struct deferred_states *states)
 {
     const char *req_kind;
-    size_t req_kind_len;
     json_t *resp;
     json_t *t;
+    struct gm_request decoded;
 
     t = json_object_get(req, "kind");
     if (t == NULL) {
         resp = json_pack("{ss}", "error", "no kind in request");
+    } else if (request_from_json(req, &decoded)) {
+        resp = handle_request(gt, &decoded, states);
     } else {
         req_kind = json_string_value(t);
-        req_kind_len = strnlen(req_kind, MAX_MSG_LEN);
-
-        if (strncmp(req_kind, "new_game", req_kind_len) == 0) {
-            resp = handle_new_game(gt, req);
-        } else if (strncmp(req_kind, "move", req_kind_len) == 0) {
-            resp = handle_move(gt, req);
-        } else if (strncmp(req_kind, "game_from_pgn", req_kind_len) == 0) {
-            resp = handle_game_from_pgn(gt, req);
-        } else if (strncmp(req_kind, "end_game", req_kind_len) == 0) {
-            resp = handle_end_game(gt, req);
+        if (req_kind != NULL && strcmp(req_kind, "batch") == 0) {
+            resp = handle_batch(gt, req, states);
+        } else if (req_kind != NULL && strcmp(req_kind, "multi_get") == 0) {
+            resp = handle_multi_get(gt, req, states);
         } else {
             resp = json_pack("{ss}", "error", "unknown kind");
         }
@@ -67,131 +90,588 @@ handle_json(
     return resp;
 }
 
+/* Remember what the game a request is about looks like, if we haven't
+ * already. Games created since the batch started don't need remembering,
+ * since undoing the batch drops them altogether. */
+static void
+snapshot_game(
+    struct game_tree *gt,
+    json_t *req,
+    size_t n_games,
+    struct game_snapshot *snaps,
+    size_t *n_snaps)
+{
+    json_t *t;
+    struct game *game;
+    size_t i;
+
+    t = json_object_get(req, "game_id");
+    if (!json_is_integer(t))
+        return;
+    game = get_game(gt, json_integer_value(t));
+    if (game == NULL || game->id >= n_games)
+        return;
+    for (i = 0; i < *n_snaps; i++)
+        if (snaps[i].game == game)
+            return;
+    snaps[*n_snaps].game = game;
+    snaps[*n_snaps].current = game->current;
+    snaps[*n_snaps].termination = game->termination;
+    (*n_snaps)++;
+}
+
+static bool
+batchable(const char *req_kind)
+{
+    return strcmp(req_kind, "new_game") == 0
+        || strcmp(req_kind, "move") == 0
+        || strcmp(req_kind, "game_from_pgn") == 0
+        || strcmp(req_kind, "game_from_fen") == 0
+        || strcmp(req_kind, "end_game") == 0;
+}
+
+/* Carry out each of the requests in a batch, in order, collecting their
+ * responses. If the batch is atomic, stop at the first request that fails and
+ * undo the ones before it. */
+static json_t *
+handle_batch(
+    struct game_tree *gt,
+    json_t *req,
+    struct deferred_states *states)
+{
+    json_t *items;
+    json_t *item;
+    json_t *resps;
+    json_t *resp;
+    json_t *t;
+    const char *req_kind;
+    struct game_snapshot *snaps;
+    size_t n_snaps;
+    size_t n_games;
+    size_t i;
+    bool atomic;
+    char err[64];
+
+    items = json_object_get(req, "requests");
+    if (!json_is_array(items))
+        return json_pack("{ss}", "error", "missing field requests");
+    atomic = json_is_true(json_object_get(req, "atomic"));
+
+    snaps = NULL;
+    n_snaps = 0;
+    n_games = gt->n_games;
+    if (atomic) {
+        snaps = calloc(json_array_size(items) + 1,
+                       sizeof(struct game_snapshot));
+        if (snaps == NULL)
+            return json_pack("{ss}", "error", "couldn't allocate batch");
+    }
+
+    resps = json_array();
+    json_array_foreach(items, i, item) {
+        req_kind = json_string_value(json_object_get(item, "kind"));
+        if (req_kind == NULL || !batchable(req_kind)) {
+            resp = json_pack("{ss}", "error", "request can't be batched");
+        } else {
+            if (atomic)
+                snapshot_game(gt, item, n_games, snaps, &n_snaps);
+            resp = handle_json(gt, item, states);
+        }
+
+        t = json_object_get(item, "request_id");
+        if (t != NULL)
+            json_object_set(resp, "request_id", t);
+        json_array_append_new(resps, resp);
+
+        if (atomic && json_string_value(json_object_get(resp, "error"))) {
+            /* put the games back the way they were before dropping the ones
+             * the batch created, since the snapshots point into the list of
+             * games. */
+            while (n_snaps > 0) {
+                n_snaps--;
+                set_game(snaps[n_snaps].game, snaps[n_snaps].current,
+                         snaps[n_snaps].termination);
+            }
+            truncate_games(gt, n_games);
+            free(snaps);
+            snprintf(err, sizeof(err),
+                     "request %zu failed, batch rolled back", i);
+            return json_pack("{soss}", "responses", resps, "error", err);
+        }
+    }
+
+    free(snaps);
+    return json_pack("{sosn}", "responses", resps, "error");
+}
+
+/* Build the log record for a batch: the requests in it that succeeded, so that
+ * replaying the log doesn't depend on requests failing the same way twice.
+ * Returns NULL if none of them succeeded. */
+static json_t *
+batch_record(json_t *req, json_t *resp)
+{
+    json_t *items;
+    json_t *resps;
+    json_t *done;
+    json_t *t;
+    size_t i;
+    json_t *res;
+
+    items = json_object_get(req, "requests");
+    resps = json_object_get(resp, "responses");
+    done = json_array();
+    for (i = 0; i < json_array_size(resps); i++) {
+        t = json_array_get(resps, i);
+        if (json_string_value(json_object_get(t, "error")) == NULL)
+            json_array_append(done, json_array_get(items, i));
+    }
+
+    res = NULL;
+    if (json_array_size(done) > 0) {
+        res = json_pack("{ssso}", "kind", "batch", "requests", done);
+    } else {
+        json_decref(done);
+    }
+    return res;
+}
+
+/* Carry out a record from the append-only log, which is NUL-terminated at
+ * rec[len]. Returns nonzero if it couldn't be read. */
+static int
+replay_record(struct game_tree *gt, const char *rec, size_t len, int msg_n)
+{
+    json_t *req;
+    json_t *resp;
+    json_error_t json_err;
+    struct gm_request decoded;
+    struct deferred_states states;
+
+    memset(&states, 0x00, sizeof(struct deferred_states));
+    if (decode_request(rec, len, &decoded) == 0) {
+        resp = handle_request(gt, &decoded, &states);
+    } else {
+        req = json_loads(rec, 0, &json_err);
+        if (!req) {
+            printf("E: unable to parse record %d\n", msg_n);
+            return 1;
+        }
+        resp = handle_json(gt, req, &states);
+        json_decref(req);
+    }
+    free_deferred_states(&states);
+    if (resp == NULL) {
+        printf("E: failed to parse record %d\n", msg_n);
+        return 1;
+    }
+    json_decref(resp);
+    return 0;
+}
+
+/* Replay the append-only log into the game tree. Records have no length
+ * limit: requests on binary sessions are logged as JSON, which can be longer
+ * than the message they arrived in. */
 int
 load_aol(struct game_tree *gt, FILE *aol)
 {
-    int msg_n;
-    long region_start;
-    long region_end;
-    char buf[MAX_MSG_LEN];
+    struct gm_buf pending;
+    char *end;
+    size_t start;
+    size_t scanned;
     size_t read_len;
-    size_t i;
+    int msg_n;
     int res;
-    json_t *req;
-    json_error_t json_err;
 
     rewind(aol);
+    memset(&pending, 0x00, sizeof(struct gm_buf));
     msg_n = 0;
+    res = 0;
+    scanned = 0;
 
-    while (!feof(aol)) {
-        region_start = ftell(aol);
-        if (region_start < 0) {
-            perror("E: aol ftell failed");
-            return 1;
+    while (res == 0) {
+        if (buf_reserve(&pending, AOL_READ_LEN) != 0) {
+            printf("E: out of memory reading aol record %d\n", msg_n);
+            res = 1;
+            break;
         }
-
-        read_len = fread(buf, sizeof(char), MAX_MSG_LEN, aol);
+        read_len = fread(pending.data + pending.len, sizeof(char),
+                         AOL_READ_LEN, aol);
         if (read_len == 0)
             break;
-        for (i = 0; i < read_len; i++)
-            if (buf[i] == 0)
-                break;
-        if (buf[i] == 0) {
-            region_end = region_start + i;
-        } else {
-            printf("E: no trailing NUL on aol record %d\n", msg_n);
-            return 1;
+        pending.len += read_len;
+
+        /* everything before scanned is part of a record whose end hasn't
+         * been read yet */
+        start = 0;
+        while (res == 0 && (end = memchr(pending.data + scanned, '\0',
+                        pending.len - scanned)) != NULL) {
+            res = replay_record(
+                gt, pending.data + start, end - pending.data - start, msg_n);
+            start = end - pending.data + 1;
+            scanned = start;
+            msg_n++;
         }
+        buf_consume(&pending, start);
+        scanned = pending.len;
+    }
 
-        req = json_loads(buf, 0, &json_err);
-        if (!req) {
-            printf("E: unable to parse record %d\n", msg_n);
-            return 1;
-        }
-        if (handle_json(gt, req) == NULL) {
-            printf("E: failed to parse record %d\n", msg_n);
-            return 1;
-        }
+    if (res == 0 && ferror(aol)) {
+        perror("E: aol read failed");
+        res = 1;
+    } else if (res == 0 && pending.len > 0) {
+        printf("E: no trailing NUL on aol record %d\n", msg_n);
+        res = 1;
+    }
+    buf_free(&pending);
+    if (res == 0)
+        printf("I: read %d records from aol\n", msg_n);
+    return res;
+}
 
-        res = fseek(aol, region_end + 1, SEEK_SET);
-        if (res != 0) {
-            perror("E: aol seek failed");
-            return 1;
+/* Handle requests that change the state of the connection they arrive on
+ * rather than the state of the game tree. Returns NULL if the request isn't a
+ * session request. */
+json_t *
+handle_session(json_t *req, struct gm_conn *conn)
+{
+    const char *req_kind;
+    const char *encoding;
+    bool binary;
+
+    req_kind = json_string_value(json_object_get(req, "kind"));
+    if (req_kind == NULL)
+        return NULL;
+
+    if (strcmp(req_kind, "start_session") == 0) {
+        if (conn == NULL)
+            return json_pack("{ss}", "error", "no connection for session");
+        encoding = json_string_value(json_object_get(req, "encoding"));
+        if (encoding == NULL || strcmp(encoding, "json") == 0)
+            binary = false;
+        else if (strcmp(encoding, "binary") == 0)
+            binary = true;
+        else
+            return json_pack("{ss}", "error", "unknown encoding");
+        conn->session = true;
+        conn->binary = binary;
+        return json_pack("{sbsssn}", "session", 1,
+                         "encoding", binary ? "binary" : "json", "error");
+    }
+    if (strcmp(req_kind, "end_session") == 0) {
+        if (conn == NULL || !conn->session)
+            return json_pack("{ss}", "error", "no session in progress");
+        conn->session = false;
+        return json_pack("{sbsn}", "session", 0, "error");
+    }
+    if (strcmp(req_kind, "unsubscribe") == 0)
+        return unsubscribe(req, conn);
+    return NULL;
+}
+
+/* Whether a request only reads the game tree. Such requests are never
+ * logged, and don't wait for anything but batches. */
+static bool
+read_only(json_t *req, const struct gm_request *decoded)
+{
+    const char *req_kind;
+
+    if (req == NULL)
+        return decoded->kind == REQ_GET_STATE
+            || decoded->kind == REQ_LEGAL_MOVES;
+    req_kind = json_string_value(json_object_get(req, "kind"));
+    return req_kind != NULL && (strcmp(req_kind, "get_state") == 0
+                                || strcmp(req_kind, "multi_get") == 0
+                                || strcmp(req_kind, "legal_moves") == 0);
+}
+
+int
+request_lane(json_t *req)
+{
+    const char *req_kind;
+    json_t *t;
+
+    req_kind = json_string_value(json_object_get(req, "kind"));
+    if (req_kind == NULL)
+        return -1;
+    if (strcmp(req_kind, "batch") == 0)
+        return BARRIER_LANE;
+    if (read_only(req, NULL))
+        return -1;
+    if (strcmp(req_kind, "new_game") == 0
+            || strcmp(req_kind, "game_from_pgn") == 0
+            || strcmp(req_kind, "game_from_fen") == 0)
+        return CREATION_LANE;
+
+    t = json_object_get(req, "game_id");
+    if (!json_is_integer(t))
+        return -1;
+    return (game_id_t) json_integer_value(t) % GAME_SHARDS;
+}
+
+/* Take the lock that a request must hold while it's carried out and logged.
+ * The event loop already runs requests one at a time per lane; the locks
+ * additionally keep games from being moved in before their creation has been
+ * logged. A request that creates a game holds the creation lock, under which
+ * it knows the ID the new game will get, and the lock for that game's shard.
+ * Sets *creating if the creation lock was taken, and returns the shard lock
+ * that was taken, or NULL if the request doesn't need one. */
+static pthread_mutex_t *
+lock_request(struct game_tree *gt, int lane, bool *creating)
+{
+    pthread_mutex_t *lock;
+
+    *creating = false;
+    /* batches run with nothing else going on, so they don't need locks */
+    if (lane < 0 || lane == BARRIER_LANE)
+        return NULL;
+
+    if (lane == CREATION_LANE) {
+        pthread_mutex_lock(&creation_lock);
+        *creating = true;
+        pthread_rwlock_rdlock(&gt->games_lock);
+        lane = gt->n_games % GAME_SHARDS;
+        pthread_rwlock_unlock(&gt->games_lock);
+    }
+
+    lock = &game_locks[lane];
+    pthread_mutex_lock(lock);
+    return lock;
+}
+
+/* Find the game a request other than a batch changes, if it changes one
+ * that already existed. */
+static bool
+changed_game(json_t *req, const struct gm_request *decoded, game_id_t *id)
+{
+    const char *req_kind;
+    json_t *t;
+
+    if (req == NULL) {
+        *id = decoded->game_id;
+        return (decoded->kind == REQ_MOVE || decoded->kind == REQ_END_GAME)
+            && decoded->present & REQ_GAME_ID;
+    }
+    req_kind = json_string_value(json_object_get(req, "kind"));
+    t = json_object_get(req, "game_id");
+    *id = json_integer_value(t);
+    return req_kind != NULL && json_is_integer(t)
+        && (strcmp(req_kind, "move") == 0 || strcmp(req_kind, "end_game") == 0);
+}
+
+static void
+add_update(struct game_tree *gt, struct gm_job *job, game_id_t id)
+{
+    struct game *game;
+    struct gm_update *u;
+
+    game = get_game(gt, id);
+    if (game == NULL)
+        return;
+    u = &job->updates[job->n_updates++];
+    u->game_id = id;
+    u->version = read_game(game, &u->node, &u->termination);
+}
+
+/* Note down what the games a successful request changed look like now, for
+ * their subscribers. This has to happen while the request still holds its
+ * lane, before anything else can change the games. */
+static void
+record_updates(struct game_tree *gt, struct gm_job *job, json_t *resp)
+{
+    json_t *items;
+    json_t *item_resp;
+    size_t i;
+    game_id_t id;
+
+    if (job->lane != BARRIER_LANE) {
+        if (changed_game(job->req, &job->decoded, &id)) {
+            job->updates = &job->one_update;
+            add_update(gt, job, id);
         }
-        msg_n++;
+        return;
     }
 
-    printf("I: read %d records from aol\n", msg_n);
-    return 0;
+    items = json_object_get(job->req, "requests");
+    job->updates = calloc(json_array_size(items), sizeof(struct gm_update));
+    if (job->updates == NULL)
+        return;
+    /* a game moved more than once gets an update for each move, all of them
+     * with its final state; subscribers only see the first. */
+    json_array_foreach(json_object_get(resp, "responses"), i, item_resp) {
+        if (json_string_value(json_object_get(item_resp, "error")) == NULL
+                && changed_game(json_array_get(items, i), NULL, &id))
+            add_update(gt, job, id);
+    }
 }
 
-bool
-handle_client(
-    struct game_tree *gt,
-    int insock,
-    FILE *aol)
+/* Append a record to the log as compact JSON. Returns the position in the
+ * log just past it, or 0 if it couldn't be encoded. */
+static uint64_t
+log_json(struct gm_log *log, json_t *record)
+{
+    struct gm_buf buf;
+    uint64_t res;
+
+    memset(&buf, 0x00, sizeof(struct gm_buf));
+    res = 0;
+    if (json_encode(&buf, record, NULL) == 0)
+        res = log_append(log, buf.data, buf.len);
+    buf_free(&buf);
+    return res;
+}
+
+void
+execute_request(struct game_tree *gt, struct gm_log *log, struct gm_job *job)
 {
-    char *req_msg;
-    char *resp_msg;
     json_t *req;
-    size_t req_len;
+    json_t *req_id;
     json_t *resp;
     json_t *t;
-    json_error_t json_err;
-    bool ok;
+    pthread_mutex_t *lock;
+    bool creating;
+    json_t *record;
+    struct deferred_states states;
+
+    req = job->req;
+    job->log_end = 0;
+    memset(&states, 0x00, sizeof(struct deferred_states));
+    lock = lock_request(gt, job->lane, &creating);
+    if (req != NULL)
+        resp = handle_json(gt, req, &states);
+    else
+        resp = handle_request(gt, &job->decoded, &states);
+    if (resp != NULL && !read_only(req, &job->decoded)) {
+        t = json_object_get(resp, "error");
+        if (json_string_value(t) == NULL)
+            record_updates(gt, job, resp);
+        /* changes to a game are logged before its lock is released, so the
+         * log has them in the same order they were made. */
+        if (job->lane == BARRIER_LANE) {
+            /* a batch with an error was rolled back */
+            record = json_string_value(t) == NULL
+                ? batch_record(req, resp) : NULL;
+            if (record != NULL)
+                job->log_end = log_json(log, record);
+            json_decref(record);
+        } else if (json_string_value(t) == NULL && job->req_msg != NULL) {
+            job->log_end = log_append(log, job->req_msg, job->req_len);
+        } else if (json_string_value(t) == NULL) {
+            job->log_end = log_json(log, req);
+        }
+    }
+    if (lock != NULL)
+        pthread_mutex_unlock(lock);
+    if (creating)
+        pthread_mutex_unlock(&creation_lock);
 
-    ok = false;
+    if (resp == NULL) {
+        free_deferred_states(&states);
+        return;
+    }
 
-    req_msg = read_str(insock, MAX_MSG_LEN);
-    if (req_msg == NULL) {
-        fprintf(stderr, "I: unable to load message string\n");
-        resp = json_pack("{ss}", "error", "couldn't load message string");
-        goto close;
+    /* echo the request ID back so that pipelining clients can match up
+     * responses with requests. */
+    if (req != NULL) {
+        req_id = json_object_get(req, "request_id");
+        if (req_id != NULL)
+            json_object_set(resp, "request_id", req_id);
+    } else if (job->decoded.present & REQ_REQUEST_ID) {
+        req_id = json_loadb(job->decoded.request_id.data,
+                            job->decoded.request_id.len,
+                            JSON_DECODE_ANY, NULL);
+        if (req_id != NULL)
+            json_object_set_new(resp, "request_id", req_id);
     }
-    req_len = strlen(req_msg);
+    job->resp_msg = response_str(
+        resp, &states, job->binary, &job->resp_len);
+}
 
-    req = json_loads(req_msg, 0, &json_err);
-    if (!req) {
-        fprintf(stderr, "I: unable to parse json\n");
-        resp = json_pack("{ss}", "error", "couldn't parse json");
-        goto close;
+char *
+response_str(
+    json_t *resp,
+    struct deferred_states *states,
+    bool binary,
+    size_t *len)
+{
+    struct gm_buf buf;
+    int err;
+    const char nul = '\0';
+
+    memset(&buf, 0x00, sizeof(struct gm_buf));
+    if (binary) {
+        err = wire_encode(&buf, resp, states);
+    } else {
+        /* NUL-terminated for the benefit of anyone who wants to print it */
+        err = json_encode(&buf, resp, states) || buf_append(&buf, &nul, 1);
+        if (!err)
+            buf.len--;
     }
+    json_decref(resp);
+    free_deferred_states(states);
+    if (err) {
+        buf_free(&buf);
+        return NULL;
+    }
+    *len = buf.len;
+    return buf.data;
+}
 
-    resp = handle_json(gt, req);
-    if (resp == NULL)
-        goto close;
+void
+log_init(struct gm_log *log, FILE *f, bool deferred)
+{
+    log->f = f;
+    log->deferred = deferred;
+    pthread_mutex_init(&log->lock, NULL);
+    memset(&log->pending, 0x00, sizeof(struct gm_buf));
+    log->appended = 0;
+}
 
-    t = json_object_get(resp, "error");
-    if (json_string_value(t) == NULL) {
-        /* +1 to account for null byte, which acts as a delimiter */
-        fwrite(req_msg, req_len + 1, 1, aol);
-        fflush(aol);
-        ok = true;
+uint64_t
+log_append(struct gm_log *log, const char *msg, size_t len)
+{
+    uint64_t res;
+    const char nul = '\0';
+
+    pthread_mutex_lock(&log->lock);
+    /* records are NUL-delimited in the log */
+    if (log->deferred) {
+        if (buf_reserve(&log->pending, len + 1) == 0) {
+            buf_append(&log->pending, msg, len);
+            buf_append(&log->pending, &nul, 1);
+        } else {
+            fprintf(stderr, "E: couldn't queue log record\n");
+        }
+    } else {
+        fwrite(msg, len, 1, log->f);
+        fputc(nul, log->f);
+        fflush(log->f);
     }
+    log->appended += len + 1;
+    res = log->appended;
+    pthread_mutex_unlock(&log->lock);
+    return res;
+}
 
-close:
-    free(req_msg);
-    if (req != NULL)
-        json_decref(req);
-    if (resp != NULL) {
-        resp_msg = json_dumps(resp, JSON_PRESERVE_ORDER | JSON_INDENT(4));
-        send_str(insock, resp_msg);
-        free(resp_msg);
-        json_decref(resp);
-    }
-    close(insock);
-    return ok;
+void
+log_take_pending(struct gm_log *log, struct gm_buf *out)
+{
+    struct gm_buf t;
+
+    pthread_mutex_lock(&log->lock);
+    t = log->pending;
+    log->pending = *out;
+    *out = t;
+    pthread_mutex_unlock(&log->lock);
 }
 
 void
-run_gm(struct game_tree *gt, FILE *aol)
+run_gm(struct game_tree *gt, FILE *aol, int n_workers, bool use_uring)
 {
+    struct gm_log log;
+
     int err;
-    int insock;
+    int reuse;
     struct addrinfo *self;
     struct addrinfo hints;
-    struct sockaddr inaddr;
-    socklen_t inaddr_len;
 
     sockfd = -1;
 
@@ -209,30 +689,50 @@ run_gm(struct game_tree *gt, FILE *aol)
     sockfd = socket(self->ai_family, self->ai_socktype, self->ai_protocol);
     if (sockfd == -1) {
         perror("E: socket error");
-        return;
+        goto close;
+    }
+
+    /* let the server restart while connections from its previous run are
+     * still in TIME_WAIT */
+    reuse = 1;
+    err = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (err) {
+        perror("E: setsockopt error");
+        goto close;
     }
 
     err = bind(sockfd, self->ai_addr, self->ai_addrlen);
     if (err) {
         perror("E: bind error");
-        return;
+        goto close;
     }
 
-    err = listen(sockfd, 10);
+    err = listen(sockfd, SOMAXCONN);
     if (err) {
         perror("E: listen error");
-        return;
+        goto close;
+    }
+
+    err = set_nonblocking(sockfd);
+    if (err) {
+        perror("E: couldn't make listening socket nonblocking");
+        goto close;
+    }
+
+    err = subscriptions_init(gt);
+    if (err) {
+        perror("E: couldn't create wait timer");
+        goto close;
     }
 
-    for (;;) {
-        inaddr_len = sizeof(struct sockaddr);
-        insock = accept(sockfd, &inaddr, &inaddr_len);
-        if (insock == -1) {
-            perror("E: accept error");
+    if (use_uring) {
+        log_init(&log, aol, true);
+        if (run_uring_loop(sockfd, gt, &log, n_workers) == 0)
             goto close;
-        }
-        handle_client(gt, insock, aol);
+        fprintf(stderr, "W: io_uring unavailable, falling back to epoll\n");
     }
+    log_init(&log, aol, false);
+    run_event_loop(sockfd, gt, &log, n_workers);
 
 close:
     freeaddrinfo(self);
@@ -240,21 +740,22 @@ close:
         close(sockfd);
 }
 
+bool
+server_stopping(void)
+{
+    return stopping;
+}
+
 void
 handle_signal(int sig)
 {
-    int old_sockfd;
     switch (sig) {
     case SIGTERM:
     case SIGINT:
-        if (sockfd != -1) {
-            /* set sockfd to -1 before closing it, so that the event loop
-             * doesn't try to close the socket a second time immediately after
-             * the call to accept fails. */
-            old_sockfd = sockfd;
-            sockfd = -1;
-            close(old_sockfd);
-        }
+        /* the event loop notices this as soon as its wait is interrupted by
+         * the signal, and run_gm closes the listening socket on its way
+         * out. */
+        stopping = 1;
     }
 }
 
@@ -264,13 +765,61 @@ server_main(int argc, char *argv[])
     struct game_tree gt;
     FILE *aol;
     char *aol_path;
+    int n_workers;
+    bool use_uring;
+    long cache_mb;
     int res;
-
-    if (argc < 2) {
-        printf("usage: gm server path/to/append-only.log\n");
+    int opt;
+    int i;
+
+    /* before anything makes a JSON value that the hooks would later be asked
+     * to free */
+    arena_install();
+
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers < 1)
+        n_workers = 1;
+
+    use_uring = false;
+    cache_mb = DEFAULT_CACHE_MB;
+    while ((opt = getopt(argc, argv, "b:j:m:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "uring") == 0) {
+                use_uring = true;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                use_uring = false;
+            } else {
+                fprintf(stderr, "E: unknown backend %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            n_workers = atoi(optarg);
+            if (n_workers < 1) {
+                fprintf(stderr, "E: need at least one worker\n");
+                return 1;
+            }
+            break;
+        case 'm':
+            cache_mb = atol(optarg);
+            if (cache_mb < 0) {
+                fprintf(stderr, "E: cache size can't be negative\n");
+                return 1;
+            }
+            break;
+        default:
+            printf("usage: gm server [-b epoll|uring] [-j workers] "
+                   "[-m cache MB] path/to/append-only.log\n");
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        printf("usage: gm server [-b epoll|uring] [-j workers] "
+               "[-m cache MB] path/to/append-only.log\n");
         return 1;
     }
-    aol_path = argv[1];
+    aol_path = argv[optind];
 
     signal(SIGTERM, handle_signal);
     signal(SIGINT, handle_signal);
@@ -281,10 +830,92 @@ server_main(int argc, char *argv[])
         return 1;
     }
 
+    for (i = 0; i < GAME_SHARDS; i++)
+        pthread_mutex_init(&game_locks[i], NULL);
+
+    state_cache_init((size_t) cache_mb << 20);
+    init_gametree(&gt);
+    res = load_aol(&gt, aol);
+    if (res != 0)
+        return res;
+    printf("I: serving with %d workers\n", n_workers);
+    run_gm(&gt, aol, n_workers, use_uring);
+    return 0;
+}
+
+static int
+write_to_file(const char *data, size_t len, void *arg)
+{
+    return fwrite(data, 1, len, (FILE *) arg) == len ? 0 : -1;
+}
+
+/* Replay an append-only log and write out the game tree it builds, as JSON.
+ * The tree is written as it's walked, so that logs too big to hold twice in
+ * memory can still be exported. */
+int
+export_main(int argc, char *argv[])
+{
+    struct game_tree gt;
+    struct json_writer w;
+    FILE *aol;
+    FILE *out;
+    size_t i;
+    bool pgn;
+    int res;
+    int opt;
+
+    pgn = false;
+    res = 0;
+    while ((opt = getopt(argc, argv, "p")) != -1) {
+        switch (opt) {
+        case 'p':
+            pgn = true;
+            break;
+        default:
+            res = 1;
+        }
+    }
+    if (res != 0 || argc - optind != 2) {
+        printf("usage: gm export [-p] path/to/append-only.log "
+               "path/to/output\n");
+        return 1;
+    }
+    aol = fopen(argv[optind], "r");
+    if (aol == NULL) {
+        perror("E: append-only log couldn't be opened");
+        return 1;
+    }
     init_gametree(&gt);
     res = load_aol(&gt, aol);
+    fclose(aol);
     if (res != 0)
         return res;
-    run_gm(&gt, aol);
+
+    out = fopen(argv[optind + 1], "w");
+    if (out == NULL) {
+        perror("E: output file couldn't be opened");
+        return 1;
+    }
+    /* as PGN, the whole tree is one game, and every line that any game has
+     * taken is a variation of it; games started from a FEN make trees of
+     * their own, which follow it. */
+    if (pgn) {
+        res = write_pgn_tree(gt.root, out);
+        for (i = 1; i < gt.n_states && res == 0; i++) {
+            if (gt.states[i]->parent != NULL)
+                continue;
+            fputc('\n', out);
+            res = write_pgn_tree(gt.states[i], out);
+        }
+    } else {
+        jw_init(&w, write_to_file, out);
+        res = game_tree_write_json(&gt, &w);
+    }
+    if (fclose(out) != 0)
+        res = -1;
+    if (res != 0) {
+        fprintf(stderr, "E: couldn't write game tree\n");
+        return 1;
+    }
     return 0;
 }
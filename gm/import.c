@@ -0,0 +1,222 @@
+/*
+ * import.c: bulk importer for PGN databases
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/core.h>
+#include <grandmaster/tree.h>
+#include <grandmaster/gmutil.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The log is written through a buffer this big, so that the records of many
+ * small games go out in each write. */
+#define LOG_BUF_LEN (1024 * 1024)
+
+struct import_log {
+    FILE *f;
+    player_id_t white;
+    player_id_t black;
+    struct gm_buf record;
+    size_t too_long;
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+per_second(double n, double secs)
+{
+    return secs > 0 ? n / secs : 0;
+}
+
+static int
+buf_sink(const char *data, size_t len, void *arg)
+{
+    return buf_append(arg, data, len);
+}
+
+/* Skip a game's tag section, so that only the movetext ends up in the
+ * log. */
+static size_t
+movetext_start(const char *pgn, size_t len)
+{
+    struct pgn_lexer lex;
+    struct pgn_token tok;
+
+    pgn_lexer_init(&lex, pgn, len);
+    while (pgn_next_token(&lex, &tok) == PGN_TOKEN_TAG);
+    return tok.text - pgn;
+}
+
+/* Log each imported game as the game_from_pgn request that would have
+ * created it, so that a server started on the log has the imported games. */
+static int
+log_game(const char *pgn, size_t len, void *arg)
+{
+    struct import_log *log;
+    struct json_writer w;
+    const char *fen;
+    size_t fen_len;
+    size_t start;
+
+    log = arg;
+    /* the server ignores every tag but FEN, which says where the game
+     * starts */
+    start = 0;
+    if (!pgn_find_tag(pgn, len, "FEN", &fen, &fen_len))
+        start = movetext_start(pgn, len);
+    log->record.len = 0;
+    jw_init(&w, buf_sink, &log->record);
+    jw_begin_object(&w);
+    jw_key(&w, "kind");
+    jw_string(&w, "game_from_pgn");
+    jw_key(&w, "player_white");
+    jw_integer(&w, log->white);
+    jw_key(&w, "player_black");
+    jw_integer(&w, log->black);
+    jw_key(&w, "pgn");
+    jw_stringn(&w, pgn + start, len - start);
+    jw_end_object(&w);
+    if (w.err == 0)
+        w.err = buf_append(&log->record, "", 1);
+    if (w.err != 0) {
+        fprintf(stderr, "E: out of memory\n");
+        return -1;
+    }
+
+    /* the server couldn't read the record back, so the game can't be
+     * imported after all */
+    if (log->record.len > MAX_MSG_LEN) {
+        log->too_long++;
+        return 1;
+    }
+    if (fwrite(log->record.data, 1, log->record.len, log->f)
+            != log->record.len) {
+        perror("E: couldn't write to append-only log");
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a PGN database and add its games to a game tree, optionally writing
+ * them to an append-only log for a server to start from. */
+int
+import_main(int argc, char *argv[])
+{
+    struct game_tree gt;
+    struct pgn_import imp;
+    struct import_log log;
+    FILE *in;
+    double start;
+    double elapsed;
+    int res;
+    int opt;
+
+    memset(&imp, 0x00, sizeof(struct pgn_import));
+    memset(&log, 0x00, sizeof(struct import_log));
+    imp.white = 0;
+    imp.black = 1;
+    imp.n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    res = 0;
+    while ((opt = getopt(argc, argv, "b:j:w:")) != -1) {
+        switch (opt) {
+        case 'j':
+            imp.n_workers = atoi(optarg);
+            if (imp.n_workers < 1)
+                res = 1;
+            break;
+        case 'w':
+            imp.white = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            imp.black = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            res = 1;
+        }
+    }
+    if (res != 0 || optind >= argc || argc - optind > 2) {
+        printf("usage: gm import [-j workers] [-w white player] "
+               "[-b black player] path/to/games.pgn "
+               "[path/to/append-only.log]\n");
+        return 1;
+    }
+
+    if (strcmp(argv[optind], "-") == 0) {
+        in = stdin;
+    } else {
+        in = fopen(argv[optind], "r");
+        if (in == NULL) {
+            perror("E: PGN file couldn't be opened");
+            return 1;
+        }
+    }
+    if (optind + 1 < argc) {
+        log.f = fopen(argv[optind + 1], "a");
+        if (log.f == NULL) {
+            perror("E: append-only log couldn't be opened");
+            return 1;
+        }
+        setvbuf(log.f, NULL, _IOFBF, LOG_BUF_LEN);
+        log.white = imp.white;
+        log.black = imp.black;
+        imp.on_game = log_game;
+        imp.arg = &log;
+    }
+
+    init_gametree(&gt);
+    start = now();
+    res = import_pgn(&gt, in, &imp);
+    if (log.f != NULL && fclose(log.f) != 0) {
+        perror("E: couldn't write to append-only log");
+        res = -1;
+    }
+    elapsed = now() - start;
+    if (in != stdin)
+        fclose(in);
+    buf_free(&log.record);
+
+    if (res != 0)
+        fprintf(stderr, "E: import stopped after %zu games\n", imp.games);
+    if (log.too_long > 0)
+        fprintf(stderr, "W: %zu games were too long to log\n", log.too_long);
+    printf("I: imported %zu games (%zu moves) in %.3fs, %zu rejected\n",
+           imp.games, imp.moves, elapsed, imp.rejects);
+    printf("I: %.0f games/s, %.0f moves/s\n",
+           per_second(imp.games, elapsed), per_second(imp.moves, elapsed));
+    /* the time the workers spent playing is summed across them, so its rate
+     * is per worker */
+    printf("I: scan: %.3fs, %.1f MB/s\n",
+           imp.scan_time, per_second(imp.bytes, imp.scan_time) / 1e6);
+    printf("I: play: %.3fs on %d workers, %.0f moves/s per worker\n",
+           imp.play_time, imp.n_workers > 1 ? imp.n_workers : 1,
+           per_second(imp.moves, imp.play_time));
+    printf("I: commit: %.3fs, %.0f games/s\n",
+           imp.commit_time, per_second(imp.games, imp.commit_time));
+    return res == 0 ? 0 : 1;
+}
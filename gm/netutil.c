@@ -23,50 +23,92 @@
 #include <arpa/inet.h>
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 
+/* Number of bytes we try to pull off of a socket in a single recv. */
+#define READ_CHUNK 4096
+
+
+/* Receive exactly len bytes from a blocking socket. Returns 0 on success or -1
+ * if the connection closed or failed before len bytes arrived. */
+static int
+recv_all(int sock, void *buf, size_t len)
+{
+    ssize_t read_len;
+    size_t total;
+
+    total = 0;
+    while (total < len) {
+        read_len = recv(sock, (char *) buf + total, len - total, 0);
+        if (read_len < 0 && errno == EINTR)
+            continue;
+        if (read_len <= 0)
+            return -1;
+        total += read_len;
+    }
+    return 0;
+}
 
 char *
 read_str(int sock, ssize_t max_len)
 {
-    ssize_t read_len;
+    size_t len;
+
+    return read_msg(sock, max_len, &len);
+}
+
+char *
+read_msg(int sock, ssize_t max_len, size_t *len)
+{
     int32_t msg_len;
     char *str;
 
-    read_len = recv(sock, &msg_len, sizeof(msg_len), 0);
-    if (read_len < (ssize_t) sizeof(msg_len)) {
+    if (recv_all(sock, &msg_len, sizeof(msg_len)))
         return NULL;
-    }
     msg_len = ntohl(msg_len);
-    if (msg_len > max_len) {
+    if (msg_len < 0 || msg_len > max_len) {
         fprintf(stderr, "W: msg len %d too big: max len %ld. discarding.\n",
                 msg_len, max_len);
         return NULL;
     }
     str = malloc(msg_len + 1);
-    read_len = recv(sock, str, msg_len, 0);
-    if (read_len < msg_len) {
+    if (str == NULL)
+        return NULL;
+    if (recv_all(sock, str, msg_len)) {
         free(str);
         return NULL;
     }
     str[msg_len] = 0;
+    *len = msg_len;
     return str;
 }
 
 int
 send_str(int sock, char *str)
+{
+    return send_msg(sock, str, strlen(str));
+}
+
+int
+send_msg(int sock, const char *msg, size_t len)
 {
     ssize_t msg_len;
     ssize_t sent;
     ssize_t total_sent;
     uint32_t msg_len_n;
 
-    msg_len = strlen(str);
+    msg_len = len;
     msg_len_n = htonl(msg_len);
-    sent = send(sock, &msg_len_n, sizeof(msg_len_n), 0);
+    /* hold the header back until the body is sent with it, so that the
+     * message doesn't get split across two packets. */
+    sent = send(sock, &msg_len_n, sizeof(msg_len_n), MSG_MORE);
     if (sent == -1) {
         perror("E: failed to send message");
     }
@@ -77,11 +119,173 @@ send_str(int sock, char *str)
 
     total_sent = 0;
     while (total_sent < msg_len) {
-        sent = send(sock, str + total_sent, msg_len - total_sent, 0);
+        sent = send(sock, msg + total_sent, msg_len - total_sent, 0);
         if (sent == -1) {
             perror("E: failed to send message");
+            return -1;
         }
         total_sent += sent;
     }
     return 0;
 }
+
+int
+buf_reserve(struct gm_buf *buf, size_t len)
+{
+    size_t new_cap;
+    char *new_data;
+
+    if (buf->cap - buf->len >= len)
+        return 0;
+    new_cap = buf->cap ? buf->cap : 256;
+    while (new_cap - buf->len < len)
+        new_cap *= 2;
+    new_data = realloc(buf->data, new_cap);
+    if (new_data == NULL)
+        return -1;
+    buf->data = new_data;
+    buf->cap = new_cap;
+    return 0;
+}
+
+int
+buf_append(struct gm_buf *buf, const void *data, size_t len)
+{
+    if (buf_reserve(buf, len))
+        return -1;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+void
+buf_consume(struct gm_buf *buf, size_t n)
+{
+    if (n >= buf->len) {
+        buf->len = 0;
+        return;
+    }
+    memmove(buf->data, buf->data + n, buf->len - n);
+    buf->len -= n;
+}
+
+void
+buf_free(struct gm_buf *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+int
+frame_ready(
+    const char *data,
+    size_t data_len,
+    ssize_t max_len,
+    size_t *msg_len)
+{
+    int32_t len_n;
+    int32_t len;
+
+    if (data_len < MSG_HEADER_LEN)
+        return 0;
+    memcpy(&len_n, data, MSG_HEADER_LEN);
+    len = ntohl(len_n);
+    if (len < 0 || len > max_len) {
+        fprintf(stderr, "W: msg len %d too big: max len %ld. discarding.\n",
+                len, max_len);
+        return -1;
+    }
+    if (data_len - MSG_HEADER_LEN < (size_t) len)
+        return 0;
+    *msg_len = len;
+    return 1;
+}
+
+int
+frame_append(struct gm_buf *buf, const char *msg, size_t msg_len)
+{
+    uint32_t len_n;
+
+    if (buf_reserve(buf, MSG_HEADER_LEN + msg_len))
+        return -1;
+    len_n = htonl(msg_len);
+    buf_append(buf, &len_n, MSG_HEADER_LEN);
+    buf_append(buf, msg, msg_len);
+    return 0;
+}
+
+int
+set_nodelay(int fd)
+{
+    int on;
+
+    on = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int
+set_nonblocking(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+ssize_t
+conn_read(struct gm_conn *conn)
+{
+    ssize_t read_len;
+    ssize_t total;
+
+    total = 0;
+    for (;;) {
+        if (buf_reserve(&conn->in, READ_CHUNK))
+            return -1;
+        read_len = recv(
+            conn->fd, conn->in.data + conn->in.len, READ_CHUNK, 0);
+        if (read_len == 0)
+            return 0;
+        if (read_len < 0) {
+            if (errno == EINTR)
+                continue;
+            /* report what we got so far; the caller will see EAGAIN on the
+             * next call once it has processed this data. */
+            if (total > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return total;
+            return -1;
+        }
+        conn->in.len += read_len;
+        total += read_len;
+        if (read_len < READ_CHUNK)
+            return total;
+    }
+}
+
+int
+conn_flush(struct gm_conn *conn)
+{
+    ssize_t sent;
+
+    while (conn->out_sent < conn->out.len) {
+        sent = send(conn->fd,
+                    conn->out.data + conn->out_sent,
+                    conn->out.len - conn->out_sent,
+                    MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+    conn->out.len = 0;
+    conn->out_sent = 0;
+    return 1;
+}
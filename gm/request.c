@@ -0,0 +1,454 @@
+/*
+ * request.c: reading requests into a struct gm_request
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <string.h>
+
+static const struct {
+    const char *name;
+    request_kind_t kind;
+} kind_names[] = {
+    { "new_game", REQ_NEW_GAME },
+    { "game_from_pgn", REQ_GAME_FROM_PGN },
+    { "game_from_fen", REQ_GAME_FROM_FEN },
+    { "move", REQ_MOVE },
+    { "end_game", REQ_END_GAME },
+    { "get_state", REQ_GET_STATE },
+    { "legal_moves", REQ_LEGAL_MOVES },
+};
+#define N_KIND_NAMES (sizeof(kind_names) / sizeof(kind_names[0]))
+
+static const struct {
+    const char *name;
+    unsigned int field;
+} field_names[] = {
+    { "board", FIELD_BOARD },
+    { "available_castles", FIELD_AVAILABLE_CASTLES },
+    { "passant_file", FIELD_PASSANT_FILE },
+    { "access_map", FIELD_ACCESS_MAP },
+    { "ply_index", FIELD_PLY_INDEX },
+    { "pgn", FIELD_PGN },
+    { "fen", FIELD_FEN },
+    { "termination", FIELD_TERMINATION },
+    { "draws", FIELD_DRAWS },
+    { "in_check", FIELD_IN_CHECK },
+    { "last_move", FIELD_LAST_MOVE },
+};
+#define N_FIELD_NAMES (sizeof(field_names) / sizeof(field_names[0]))
+
+/* Members of a request that decode_request understands, other than the ones
+ * with a REQ_* bit of their own. */
+#define SEEN_KIND 0x1000
+#define SEEN_FIELDS 0x2000
+
+struct tokenizer {
+    const char *data;
+    size_t len;
+    size_t off;
+};
+
+static bool
+slice_is(struct gm_slice s, const char *str)
+{
+    return s.len == strlen(str) && memcmp(s.data, str, s.len) == 0;
+}
+
+static bool
+kind_from_name(struct gm_slice name, request_kind_t *kind)
+{
+    size_t i;
+
+    for (i = 0; i < N_KIND_NAMES; i++) {
+        if (slice_is(name, kind_names[i].name)) {
+            *kind = kind_names[i].kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned int
+field_from_name(const char *name, size_t len)
+{
+    struct gm_slice s;
+    size_t i;
+
+    s.data = name;
+    s.len = len;
+    for (i = 0; i < N_FIELD_NAMES; i++)
+        if (slice_is(s, field_names[i].name))
+            return field_names[i].field;
+    return 0;
+}
+
+static void
+skip_space(struct tokenizer *t)
+{
+    while (t->off < t->len && (t->data[t->off] == ' '
+                || t->data[t->off] == '\t' || t->data[t->off] == '\n'
+                || t->data[t->off] == '\r'))
+        t->off++;
+}
+
+/* Consume c, and any whitespace before it. */
+static bool
+expect(struct tokenizer *t, char c)
+{
+    skip_space(t);
+    if (t->off == t->len || t->data[t->off] != c)
+        return false;
+    t->off++;
+    return true;
+}
+
+static bool
+peek(struct tokenizer *t, char c)
+{
+    skip_space(t);
+    return t->off < t->len && t->data[t->off] == c;
+}
+
+/* Read a string into a slice of the message. Strings with escapes or with
+ * anything outside of printable ASCII are left to the general parser, which
+ * knows how to unescape them and how to check that they're valid UTF-8. */
+static bool
+read_string(struct tokenizer *t, struct gm_slice *s)
+{
+    size_t start;
+    unsigned char c;
+
+    if (!expect(t, '"'))
+        return false;
+    start = t->off;
+    for (; t->off < t->len; t->off++) {
+        c = t->data[t->off];
+        if (c == '"') {
+            s->data = t->data + start;
+            s->len = t->off - start;
+            t->off++;
+            return true;
+        }
+        if (c < 0x20 || c > 0x7E || c == '\\')
+            return false;
+    }
+    return false;
+}
+
+/* Read an integer that jansson would also read as an integer: no fractions,
+ * exponents, leading zeroes or values out of range. */
+static bool
+read_integer(struct tokenizer *t, json_int_t *val, struct gm_slice *s)
+{
+    size_t start;
+    bool negative;
+    uint64_t mag;
+    uint64_t limit;
+    int digit;
+
+    skip_space(t);
+    start = t->off;
+    negative = t->off < t->len && t->data[t->off] == '-';
+    if (negative)
+        t->off++;
+    if (t->off == t->len || t->data[t->off] < '0' || t->data[t->off] > '9')
+        return false;
+    if (t->data[t->off] == '0' && t->off + 1 < t->len
+            && t->data[t->off + 1] >= '0' && t->data[t->off + 1] <= '9')
+        return false;
+
+    limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+    mag = 0;
+    for (; t->off < t->len && t->data[t->off] >= '0'
+            && t->data[t->off] <= '9'; t->off++) {
+        digit = t->data[t->off] - '0';
+        if (mag > (limit - digit) / 10)
+            return false;
+        mag = mag * 10 + digit;
+    }
+    if (t->off < t->len && (t->data[t->off] == '.' || t->data[t->off] == 'e'
+                || t->data[t->off] == 'E'))
+        return false;
+
+    if (negative)
+        *val = mag == (uint64_t) INT64_MAX + 1 ? INT64_MIN : -(json_int_t) mag;
+    else
+        *val = mag;
+    if (s != NULL) {
+        s->data = t->data + start;
+        s->len = t->off - start;
+    }
+    return true;
+}
+
+/* Read the "fields" member: either "all" or a list of field names. */
+static bool
+read_fields(struct tokenizer *t, struct gm_request *req)
+{
+    struct gm_slice name;
+    unsigned int field;
+
+    if (peek(t, '"')) {
+        if (!read_string(t, &name) || !slice_is(name, "all"))
+            return false;
+        req->fields = ALL_BOARD_FIELDS | FIELD_LAST_MOVE;
+        return true;
+    }
+    if (!expect(t, '['))
+        return false;
+    req->fields = 0;
+    if (expect(t, ']'))
+        return true;
+    do {
+        if (!read_string(t, &name))
+            return false;
+        field = field_from_name(name.data, name.len);
+        if (field == 0)
+            return false;
+        req->fields |= field;
+    } while (expect(t, ','));
+    return expect(t, ']');
+}
+
+static bool
+read_member(struct tokenizer *t, struct gm_request *req, unsigned int *seen)
+{
+    struct gm_slice key;
+    struct gm_slice kind;
+    json_int_t val;
+    unsigned int bit;
+
+    if (!read_string(t, &key) || !expect(t, ':'))
+        return false;
+
+    if (slice_is(key, "kind")) {
+        bit = SEEN_KIND;
+        if (!read_string(t, &kind) || !kind_from_name(kind, &req->kind))
+            return false;
+    } else if (slice_is(key, "fields")) {
+        bit = SEEN_FIELDS;
+        if (!read_fields(t, req))
+            return false;
+    } else if (slice_is(key, "request_id")) {
+        bit = REQ_REQUEST_ID;
+        if (peek(t, '"')) {
+            if (!read_string(t, &req->request_id))
+                return false;
+            /* keep the quotes, so that the slice is JSON */
+            req->request_id.data--;
+            req->request_id.len += 2;
+        } else if (!read_integer(t, &val, &req->request_id)) {
+            return false;
+        }
+    } else if (slice_is(key, "move")) {
+        bit = REQ_MOVE_NOTATION;
+        if (!read_string(t, &req->move))
+            return false;
+    } else if (slice_is(key, "coordinates")) {
+        bit = REQ_COORDINATES;
+        if (!read_string(t, &req->coordinates))
+            return false;
+    } else if (slice_is(key, "pgn")) {
+        bit = REQ_PGN;
+        if (!read_string(t, &req->pgn))
+            return false;
+    } else if (slice_is(key, "fen")) {
+        bit = REQ_FEN;
+        if (!read_string(t, &req->fen))
+            return false;
+    } else if (slice_is(key, "termination")) {
+        bit = REQ_TERMINATION;
+        if (!read_string(t, &req->termination))
+            return false;
+    } else {
+        if (slice_is(key, "game_id"))
+            bit = REQ_GAME_ID;
+        else if (slice_is(key, "player"))
+            bit = REQ_PLAYER;
+        else if (slice_is(key, "player_white"))
+            bit = REQ_PLAYER_WHITE;
+        else if (slice_is(key, "player_black"))
+            bit = REQ_PLAYER_BLACK;
+        else
+            return false;
+        if (!read_integer(t, &val, NULL))
+            return false;
+        if (bit == REQ_GAME_ID)
+            req->game_id = val;
+        else if (bit == REQ_PLAYER)
+            req->player = val;
+        else if (bit == REQ_PLAYER_WHITE)
+            req->player_white = val;
+        else
+            req->player_black = val;
+    }
+
+    /* jansson keeps the last of a repeated member; rather than worry about
+     * matching that, leave repeats to jansson. */
+    if (*seen & bit)
+        return false;
+    *seen |= bit;
+    return true;
+}
+
+int
+decode_request(const char *msg, size_t len, struct gm_request *req)
+{
+    struct tokenizer t;
+    unsigned int seen;
+
+    memset(req, 0x00, sizeof(struct gm_request));
+    req->fields = SLIM_FIELDS;
+    t.data = msg;
+    t.len = len;
+    t.off = 0;
+    seen = 0;
+
+    if (!expect(&t, '{'))
+        return -1;
+    if (!peek(&t, '}')) {
+        do {
+            if (!read_member(&t, req, &seen))
+                return -1;
+        } while (expect(&t, ','));
+    }
+    if (!expect(&t, '}'))
+        return -1;
+    skip_space(&t);
+    if (t.off != t.len || !(seen & SEEN_KIND))
+        return -1;
+    req->present = seen & ~(SEEN_KIND | SEEN_FIELDS);
+    return 0;
+}
+
+bool
+requested_fields(json_t *req, unsigned int *fields)
+{
+    json_t *t;
+    json_t *name;
+    size_t i;
+    unsigned int field;
+
+    t = json_object_get(req, "fields");
+    if (t == NULL) {
+        *fields = SLIM_FIELDS;
+        return true;
+    }
+    if (json_is_string(t) && strcmp(json_string_value(t), "all") == 0) {
+        *fields = ALL_BOARD_FIELDS | FIELD_LAST_MOVE;
+        return true;
+    }
+    if (!json_is_array(t))
+        return false;
+
+    *fields = 0;
+    json_array_foreach(t, i, name) {
+        if (!json_is_string(name))
+            return false;
+        field = field_from_name(
+            json_string_value(name), json_string_length(name));
+        if (field == 0)
+            return false;
+        *fields |= field;
+    }
+    return true;
+}
+
+static void
+string_member(
+    json_t *json,
+    const char *key,
+    unsigned int bit,
+    struct gm_request *req,
+    struct gm_slice *s)
+{
+    json_t *t;
+
+    t = json_object_get(json, key);
+    if (!json_is_string(t))
+        return;
+    s->data = json_string_value(t);
+    s->len = json_string_length(t);
+    req->present |= bit;
+}
+
+/* Integers that aren't integers count as zero, as they always have, except
+ * for game IDs: the ID picks the lock a request runs under, and request_lane
+ * doesn't count one that isn't an integer, so neither can the handler. */
+static json_int_t
+integer_member(
+    json_t *json,
+    const char *key,
+    unsigned int bit,
+    struct gm_request *req)
+{
+    json_t *t;
+
+    t = json_object_get(json, key);
+    if (t == NULL || (bit == REQ_GAME_ID && !json_is_integer(t)))
+        return 0;
+    req->present |= bit;
+    return json_integer_value(t);
+}
+
+bool
+request_from_json(json_t *json, struct gm_request *req)
+{
+    json_t *t;
+
+    memset(req, 0x00, sizeof(struct gm_request));
+    t = json_object_get(json, "kind");
+    if (!json_is_string(t))
+        return false;
+    if (!kind_from_name((struct gm_slice) {
+                json_string_value(t), json_string_length(t) }, &req->kind))
+        return false;
+
+    req->unknown_field = !requested_fields(json, &req->fields);
+    req->game_id = integer_member(json, "game_id", REQ_GAME_ID, req);
+    req->player = integer_member(json, "player", REQ_PLAYER, req);
+    req->player_white = integer_member(
+        json, "player_white", REQ_PLAYER_WHITE, req);
+    req->player_black = integer_member(
+        json, "player_black", REQ_PLAYER_BLACK, req);
+    string_member(json, "move", REQ_MOVE_NOTATION, req, &req->move);
+    string_member(json, "coordinates", REQ_COORDINATES, req,
+                  &req->coordinates);
+    string_member(json, "pgn", REQ_PGN, req, &req->pgn);
+    string_member(json, "fen", REQ_FEN, req, &req->fen);
+    string_member(json, "termination", REQ_TERMINATION, req,
+                  &req->termination);
+    /* the request ID is only ever echoed back, which the caller does from
+     * the JSON it already has. */
+    return true;
+}
+
+int
+decoded_request_lane(const struct gm_request *req)
+{
+    /* reads don't need to wait their turn behind changes to the game */
+    if (req->kind == REQ_GET_STATE || req->kind == REQ_LEGAL_MOVES)
+        return -1;
+    if (req->kind == REQ_NEW_GAME || req->kind == REQ_GAME_FROM_PGN
+            || req->kind == REQ_GAME_FROM_FEN)
+        return CREATION_LANE;
+    if (!(req->present & REQ_GAME_ID))
+        return -1;
+    return req->game_id % GAME_SHARDS;
+}
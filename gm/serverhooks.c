@@ -23,123 +23,208 @@
 #include <grandmaster/gmutil.h>
 
 #include <jansson.h>
+#include <string.h>
 
-#define get(t, req, field) \
-    t = json_object_get(req, field); \
-    if (!t) return json_pack("{ss}", "error", "missing field " field);
+#define require(req, bit, field) \
+    if (!((req)->present & (bit))) \
+        return json_pack("{ss}", "error", "missing field " field);
 
-json_t *
-game_state(struct game_tree *gt, game_id_t game_id)
+/* The most games a single multi_get may ask for. */
+#define MAX_MULTI_GET 256
+
+/* Move notations and terminations are copied onto the stack if they're
+ * shorter than this, which they are unless something's wrong with them. */
+#define MAX_TOKEN_LEN 32
+
+/* Make a NUL-terminated copy of a string from a request, for the functions in
+ * core that need one: in buf if it fits, which must then be MAX_TOKEN_LEN
+ * long, or on the heap if it doesn't. Returns NULL if memory runs out. */
+static char *
+token_str(char *buf, struct gm_slice s)
 {
-    json_t *res;
-    struct move *move;
-    struct game *game;
+    if (s.len >= MAX_TOKEN_LEN)
+        return strndup(s.data, s.len);
+    memcpy(buf, s.data, s.len);
+    buf[s.len] = '\0';
+    return buf;
+}
 
-    game = get_game(gt, game_id);
-    move = game->current->move;
-    res = board_to_json(move->post_board);
-    json_object_set_new(
-        res, "termination",
-        json_string(termination_str(game->termination)));
-    return res;
+static json_t *
+current_state(
+    struct deferred_states *states,
+    struct game *game,
+    unsigned int fields)
+{
+    struct state_node *current;
+    termination_t termination;
+
+    read_game(game, &current, &termination);
+    return deferred_state(states, current, fields, termination);
 }
 
-json_t *
-handle_new_game(struct game_tree *gt, json_t *req)
+static json_t *
+game_state(
+    struct deferred_states *states,
+    struct game_tree *gt,
+    game_id_t game_id,
+    unsigned int fields)
 {
-    game_id_t game;
-    player_id_t white;
-    player_id_t black;
-    json_t *t;
+    return current_state(states, get_game(gt, game_id), fields);
+}
 
-    get(t, req, "player_white");
-    white = json_integer_value(t);
+static json_t *
+handle_new_game(
+    struct game_tree *gt,
+    const struct gm_request *req,
+    struct deferred_states *states)
+{
+    game_id_t game;
 
-    get(t, req, "player_black");
-    black = json_integer_value(t);
+    if (req->unknown_field)
+        return json_pack("{ss}", "error", "unknown field");
+    require(req, REQ_PLAYER_WHITE, "player_white");
+    require(req, REQ_PLAYER_BLACK, "player_black");
 
-    game = new_game(gt, white, black);
+    game = new_game(gt, req->player_white, req->player_black);
     return json_pack("{sIsosn}",
             "game_id", game,
-            "state", game_state(gt, game),
+            "state", game_state(states, gt, game, req->fields),
             "error" /* undefined */);
 }
 
-json_t *
-handle_game_from_pgn(struct game_tree *gt, json_t *req)
+static json_t *
+handle_game_from_pgn(
+    struct game_tree *gt,
+    const struct gm_request *req,
+    struct deferred_states *states)
 {
     game_id_t game;
-    player_id_t white;
-    player_id_t black;
-    const char *pgn;
-    json_t *t;
-
-    get(t, req, "player_white");
-    white = json_integer_value(t);
-
-    get(t, req, "player_black");
-    black = json_integer_value(t);
 
-    get(t, req, "pgn");
-    pgn = json_string_value(t);
+    if (req->unknown_field)
+        return json_pack("{ss}", "error", "unknown field");
+    require(req, REQ_PLAYER_WHITE, "player_white");
+    require(req, REQ_PLAYER_BLACK, "player_black");
+    require(req, REQ_PGN, "pgn");
 
-    game = new_game_from_pgn(gt, white, black, pgn);
+    game = new_game_from_pgn_len(gt, req->player_white, req->player_black,
+                                 req->pgn.data, req->pgn.len);
     if (game == NO_GAME)
         return json_pack("{ss}", "error", "could not parse PGN");
     return json_pack("{sIsosn}",
             "game_id", game,
-            "state", game_state(gt, game),
+            "state", game_state(states, gt, game, req->fields),
             "error" /* undefined */);
 }
 
-json_t *
-handle_move(struct game_tree *gt, json_t *req)
+static json_t *
+handle_game_from_fen(
+    struct game_tree *gt,
+    const struct gm_request *req,
+    struct deferred_states *states)
 {
-    game_id_t game_id;
-    player_id_t player;
-    const char *notation;
-    json_t *t;
-    bool success;
+    game_id_t game;
 
-    get(t, req, "player");
-    player = json_integer_value(t);
+    if (req->unknown_field)
+        return json_pack("{ss}", "error", "unknown field");
+    require(req, REQ_PLAYER_WHITE, "player_white");
+    require(req, REQ_PLAYER_BLACK, "player_black");
+    require(req, REQ_FEN, "fen");
 
-    get(t, req, "game_id");
-    game_id = json_integer_value(t);
+    game = new_game_from_fen(gt, req->player_white, req->player_black,
+                             req->fen.data, req->fen.len);
+    if (game == NO_GAME)
+        return json_pack("{ss}", "error", "not a legal position");
+    return json_pack("{sIsosn}",
+            "game_id", game,
+            "state", game_state(states, gt, game, req->fields),
+            "error" /* undefined */);
+}
+
+static json_t *
+handle_move(
+    struct game_tree *gt,
+    const struct gm_request *req,
+    struct deferred_states *states)
+{
+    char buf[MAX_TOKEN_LEN];
+    char *notation;
+    struct state_node *current;
+    termination_t termination;
+    bool success;
 
-    get(t, req, "move");
-    notation = json_string_value(t);
+    if (req->unknown_field)
+        return json_pack("{snss}", "state", "error", "unknown field");
+    require(req, REQ_PLAYER, "player");
+    require(req, REQ_GAME_ID, "game_id");
+    if (!(req->present & (REQ_MOVE_NOTATION | REQ_COORDINATES)))
+        return json_pack("{ss}", "error", "missing field move");
+    if ((req->present & REQ_MOVE_NOTATION) && (req->present & REQ_COORDINATES))
+        return json_pack(
+            "{snss}", "state", "error", "both move and coordinates given");
 
-    if (get_game(gt, game_id) == NULL) {
+    if (get_game(gt, req->game_id) == NULL) {
         return json_pack("{snss}", "state", "error", "game does not exist");
     }
 
-    success = make_move(gt, game_id, player, notation);
+    if (req->present & REQ_COORDINATES) {
+        /* engines get the SAN back, so they needn't write it themselves */
+        success = make_move_coordinates(
+            gt, req->game_id, req->player,
+            req->coordinates.data, req->coordinates.len);
+        if (!success)
+            return json_pack(
+                "{snss}", "state", "error", "could not perform move");
+        read_game(get_game(gt, req->game_id), &current, &termination);
+        return json_pack(
+            "{sssosn}", "move", current->move->algebraic,
+            "state", game_state(states, gt, req->game_id, req->fields),
+            "error");
+    }
+
+    notation = token_str(buf, req->move);
+    if (notation == NULL)
+        return json_pack("{snss}", "state", "error", "out of memory");
+    success = make_move(gt, req->game_id, req->player, notation);
+    if (notation != buf)
+        free(notation);
     if (success) {
-        return json_pack("{sosn}", "state", game_state(gt, game_id), "error");
+        return json_pack(
+            "{sosn}",
+            "state", game_state(states, gt, req->game_id, req->fields),
+            "error");
     }
     return json_pack("{snss}", "state", "error", "could not perform move");
 }
 
-json_t *
-handle_end_game(struct game_tree *gt, json_t *req)
+static json_t *
+handle_end_game(
+    struct game_tree *gt,
+    const struct gm_request *req,
+    struct deferred_states *states)
 {
     game_id_t game_id;
     player_id_t player;
     termination_t termination;
-    json_t *t;
+    char buf[MAX_TOKEN_LEN];
+    char *termination_str;
     bool success;
     struct game *game;
     color_t player_color;
 
-    get(t, req, "player");
-    player = json_integer_value(t);
-
-    get(t, req, "game_id");
-    game_id = json_integer_value(t);
+    if (req->unknown_field)
+        return json_pack("{snss}", "state", "error", "unknown field");
+    require(req, REQ_PLAYER, "player");
+    require(req, REQ_GAME_ID, "game_id");
+    require(req, REQ_TERMINATION, "termination");
 
-    get(t, req, "termination");
-    termination = termination_from_str(json_string_value(t));
+    player = req->player;
+    game_id = req->game_id;
+    termination_str = token_str(buf, req->termination);
+    if (termination_str == NULL)
+        return json_pack("{snss}", "state", "error", "out of memory");
+    termination = termination_from_str(termination_str);
+    if (termination_str != buf)
+        free(termination_str);
 
     if (get_game(gt, game_id) == NULL) {
         return json_pack("{snss}", "state", "error", "game does not exist");
@@ -185,7 +270,9 @@ handle_end_game(struct game_tree *gt, json_t *req)
             success = end_game(gt, game_id, termination);
             if (success) {
                 return json_pack(
-                    "{sosn}", "state", game_state(gt, game_id), "error");
+                    "{sosn}",
+                    "state", game_state(states, gt, game_id, req->fields),
+                    "error");
             }
             return json_pack("{snss}", "state", "error", "unknown error");
 
@@ -195,3 +282,126 @@ handle_end_game(struct game_tree *gt, json_t *req)
                 "error", "provided termination cannot be voluntary");
     }
 }
+
+static json_t *
+handle_get_state(
+    struct game_tree *gt,
+    const struct gm_request *req,
+    struct deferred_states *states)
+{
+    struct game *game;
+
+    if (req->unknown_field)
+        return json_pack("{snss}", "state", "error", "unknown field");
+    require(req, REQ_GAME_ID, "game_id");
+
+    game = get_game(gt, req->game_id);
+    if (game == NULL)
+        return json_pack("{snss}", "state", "error", "game does not exist");
+    return json_pack(
+        "{sosn}", "state", current_state(states, game, req->fields), "error");
+}
+
+static json_t *
+handle_legal_moves(struct game_tree *gt, const struct gm_request *req)
+{
+    struct game *game;
+    struct state_node *current;
+    struct legal_move *legal;
+    termination_t termination;
+    json_t *moves;
+    char coordinates[6];
+    size_t n;
+    size_t i;
+
+    if (req->unknown_field)
+        return json_pack("{snss}", "moves", "error", "unknown field");
+    require(req, REQ_GAME_ID, "game_id");
+
+    game = get_game(gt, req->game_id);
+    if (game == NULL)
+        return json_pack("{snss}", "moves", "error", "game does not exist");
+    read_game(game, &current, &termination);
+
+    moves = json_array();
+    /* a game that's been resigned or drawn has no moves left, whatever its
+     * position */
+    if (termination & TERM_GAME_OVER_MASK)
+        return json_pack("{sosn}", "moves", moves, "error");
+    if (!tree_legal_moves(gt, current, &legal, &n)) {
+        json_decref(moves);
+        return json_pack("{snss}", "moves", "error", "out of memory");
+    }
+    for (i = 0; i < n; i++) {
+        coordinates[0] = 'a' + legal[i].start.file;
+        coordinates[1] = '1' + legal[i].start.rank;
+        coordinates[2] = 'a' + legal[i].end.file;
+        coordinates[3] = '1' + legal[i].end.rank;
+        /* engines write promotions in lower case */
+        coordinates[4] = legal[i].promotion == 0 ? '\0'
+            : legal[i].promotion == KNIGHT ? 'n'
+            : legal[i].promotion == BISHOP ? 'b'
+            : legal[i].promotion == ROOK ? 'r' : 'q';
+        coordinates[5] = '\0';
+        json_array_append_new(moves, json_pack(
+            "{ssss}", "move", legal[i].san, "coordinates", coordinates));
+    }
+    free(legal);
+    return json_pack("{sosn}", "moves", moves, "error");
+}
+
+json_t *
+handle_multi_get(
+    struct game_tree *gt,
+    json_t *req,
+    struct deferred_states *states)
+{
+    json_t *ids;
+    json_t *id;
+    json_t *res;
+    struct game *game;
+    unsigned int fields;
+    size_t i;
+
+    if (!requested_fields(req, &fields))
+        return json_pack("{snss}", "states", "error", "unknown field");
+    ids = json_object_get(req, "game_ids");
+    if (!json_is_array(ids))
+        return json_pack("{ss}", "error", "missing field game_ids");
+    if (json_array_size(ids) > MAX_MULTI_GET)
+        return json_pack("{snss}", "states", "error", "too many games");
+
+    res = json_array();
+    json_array_foreach(ids, i, id) {
+        game = json_is_integer(id)
+            ? get_game(gt, json_integer_value(id)) : NULL;
+        json_array_append_new(res, game == NULL
+            ? json_null() : current_state(states, game, fields));
+    }
+    return json_pack("{sosn}", "states", res, "error");
+}
+
+json_t *
+handle_request(
+    struct game_tree *gt,
+    const struct gm_request *req,
+    struct deferred_states *states)
+{
+    switch (req->kind) {
+    case REQ_NEW_GAME:
+        return handle_new_game(gt, req, states);
+    case REQ_GAME_FROM_PGN:
+        return handle_game_from_pgn(gt, req, states);
+    case REQ_GAME_FROM_FEN:
+        return handle_game_from_fen(gt, req, states);
+    case REQ_MOVE:
+        return handle_move(gt, req, states);
+    case REQ_END_GAME:
+        return handle_end_game(gt, req, states);
+    case REQ_GET_STATE:
+        return handle_get_state(gt, req, states);
+    case REQ_LEGAL_MOVES:
+        return handle_legal_moves(gt, req);
+    }
+    return json_pack("{ss}", "error", "unknown kind");
+}
@@ -0,0 +1,318 @@
+/*
+ * statecache.c: cache of game states, as they're sent on the wire
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The cache is split into shards by node, each with its own lock and its own
+ * share of the memory budget, so that workers serializing different states
+ * rarely wait on each other. */
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024
+
+/* The encoded state of a node, for a single set of fields in a single
+ * encoding. Nodes are never freed once they're part of the tree, so the
+ * node pointer is a safe key for as long as the server runs. */
+struct cache_entry {
+    const struct state_node *node;
+    unsigned int fields;
+    bool binary;
+    char *data;
+    size_t len;
+    /* the next entry in the same bucket */
+    struct cache_entry *chain;
+    /* neighbours in the shard's list of entries, most recently used first */
+    struct cache_entry *newer;
+    struct cache_entry *older;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry *newest;
+    struct cache_entry *oldest;
+    size_t bytes;
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+/* the most memory each shard may use, or 0 if the cache is turned off */
+static size_t shard_budget = 0;
+
+void
+state_cache_init(size_t max_bytes)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        memset(&shards[i], 0x00, sizeof(struct cache_shard));
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    shard_budget = max_bytes / CACHE_SHARDS;
+}
+
+static size_t
+entry_hash(const struct state_node *node, unsigned int fields, bool binary)
+{
+    uintptr_t h;
+
+    /* nodes are allocated with at least 16-byte alignment, so the low bits
+     * of the pointer carry nothing. */
+    h = (uintptr_t) node >> 4;
+    h ^= h >> 17;
+    h = h * 31 + fields;
+    h = h * 2 + binary;
+    return h;
+}
+
+static void
+unlink_entry(struct cache_shard *shard, struct cache_entry *e)
+{
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        shard->newest = e->older;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        shard->oldest = e->newer;
+}
+
+static void
+push_newest(struct cache_shard *shard, struct cache_entry *e)
+{
+    e->newer = NULL;
+    e->older = shard->newest;
+    if (shard->newest != NULL)
+        shard->newest->newer = e;
+    shard->newest = e;
+    if (shard->oldest == NULL)
+        shard->oldest = e;
+}
+
+/* Drop the least recently used entries until the shard is within budget. */
+static void
+evict(struct cache_shard *shard)
+{
+    struct cache_entry *e;
+    struct cache_entry **p;
+    size_t bucket;
+
+    while (shard->bytes > shard_budget && shard->oldest != NULL) {
+        e = shard->oldest;
+        unlink_entry(shard, e);
+        bucket = entry_hash(e->node, e->fields, e->binary) % CACHE_BUCKETS;
+        for (p = &shard->buckets[bucket]; *p != e; p = &(*p)->chain);
+        *p = e->chain;
+        shard->bytes -= sizeof(struct cache_entry) + e->len;
+        free(e->data);
+        free(e);
+    }
+}
+
+static struct cache_entry *
+find_entry(
+    struct cache_shard *shard,
+    size_t bucket,
+    const struct state_node *node,
+    unsigned int fields,
+    bool binary)
+{
+    struct cache_entry *e;
+
+    for (e = shard->buckets[bucket]; e != NULL; e = e->chain)
+        if (e->node == node && e->fields == fields && e->binary == binary)
+            return e;
+    return NULL;
+}
+
+/* Look for a node's encoded state in the cache, appending it to out if it's
+ * there. Returns 1 if it was found, 0 if it wasn't, or -1 on error. */
+static int
+cache_get(
+    struct gm_buf *out,
+    const struct state_node *node,
+    unsigned int fields,
+    bool binary)
+{
+    struct cache_shard *shard;
+    struct cache_entry *e;
+    size_t h;
+    int res;
+
+    h = entry_hash(node, fields, binary);
+    shard = &shards[h % CACHE_SHARDS];
+    res = 0;
+    pthread_mutex_lock(&shard->lock);
+    e = find_entry(shard, h % CACHE_BUCKETS, node, fields, binary);
+    if (e != NULL) {
+        unlink_entry(shard, e);
+        push_newest(shard, e);
+        res = buf_append(out, e->data, e->len) ? -1 : 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return res;
+}
+
+/* Add a node's encoded state to the cache. Two workers may well encode the
+ * same state at the same time; the second one to get here just leaves the
+ * first one's entry in place. */
+static void
+cache_put(
+    const struct state_node *node,
+    unsigned int fields,
+    bool binary,
+    const char *data,
+    size_t len)
+{
+    struct cache_shard *shard;
+    struct cache_entry *e;
+    size_t h;
+
+    if (sizeof(struct cache_entry) + len > shard_budget)
+        return;
+    e = calloc(1, sizeof(struct cache_entry));
+    if (e == NULL)
+        return;
+    e->data = malloc(len);
+    if (e->data == NULL) {
+        free(e);
+        return;
+    }
+    memcpy(e->data, data, len);
+    e->len = len;
+    e->node = node;
+    e->fields = fields;
+    e->binary = binary;
+
+    h = entry_hash(node, fields, binary);
+    shard = &shards[h % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    if (find_entry(shard, h % CACHE_BUCKETS, node, fields, binary) != NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        free(e->data);
+        free(e);
+        return;
+    }
+    e->chain = shard->buckets[h % CACHE_BUCKETS];
+    shard->buckets[h % CACHE_BUCKETS] = e;
+    push_newest(shard, e);
+    shard->bytes += sizeof(struct cache_entry) + len;
+    evict(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+json_t *
+deferred_state(
+    struct deferred_states *states,
+    struct state_node *node,
+    unsigned int fields,
+    termination_t termination)
+{
+    struct deferred_state *new_states;
+    struct deferred_state *s;
+    size_t new_cap;
+
+    if (states->n == states->cap) {
+        new_cap = states->cap ? 2 * states->cap : 4;
+        new_states = realloc(
+            states->states, new_cap * sizeof(struct deferred_state));
+        if (new_states == NULL)
+            return NULL;
+        states->states = new_states;
+        states->cap = new_cap;
+    }
+    s = &states->states[states->n];
+    s->slot = json_object();
+    if (s->slot == NULL)
+        return NULL;
+    s->node = node;
+    s->fields = fields;
+    s->termination = termination;
+    states->n++;
+    /* one reference for the response, one for the list */
+    return json_incref(s->slot);
+}
+
+const struct deferred_state *
+find_deferred_state(const struct deferred_states *states, json_t *val)
+{
+    size_t i;
+
+    if (states == NULL || !json_is_object(val) || json_object_size(val) != 0)
+        return NULL;
+    for (i = 0; i < states->n; i++)
+        if (states->states[i].slot == val)
+            return &states->states[i];
+    return NULL;
+}
+
+void
+free_deferred_states(struct deferred_states *states)
+{
+    size_t i;
+
+    if (states == NULL)
+        return;
+    for (i = 0; i < states->n; i++)
+        json_decref(states->states[i].slot);
+    free(states->states);
+    memset(states, 0x00, sizeof(struct deferred_states));
+}
+
+int
+write_deferred_state(
+    struct gm_buf *out,
+    const struct deferred_state *state,
+    bool binary)
+{
+    struct state_node *node;
+    unsigned int fields;
+    termination_t termination;
+    size_t start;
+    bool cacheable;
+    int res;
+
+    node = state->node;
+    fields = state->fields;
+    termination = state->termination;
+
+    /* the cache only holds what nodes have in common across games, so a game
+     * that a player has ended by choice is rendered on its own. */
+    cacheable = shard_budget > 0
+        && (!(fields & FIELD_TERMINATION)
+            || termination == node->move->post_board->termination);
+    if (cacheable) {
+        res = cache_get(out, node, fields, binary);
+        if (res != 0)
+            return res < 0 ? -1 : 0;
+    }
+
+    start = out->len;
+    if (binary)
+        res = wire_write_state(out, node, fields, termination);
+    else
+        res = state_write_json(out, node, fields, termination);
+    if (res == 0 && cacheable)
+        cache_put(node, fields, binary, out->data + start, out->len - start);
+    return res;
+}
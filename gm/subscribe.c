@@ -0,0 +1,727 @@
+/*
+ * subscribe.c: pushing game updates to the connections that watch them
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Subscriptions and parked waits are only ever touched by the event loop
+ * thread, like the connections they belong to, so none of this needs
+ * locking. */
+
+#define WATCH_BUCKETS 1024
+
+/* The most games a single connection may subscribe to. */
+#define MAX_SUBSCRIPTIONS 1024
+
+/* Once this many bytes are waiting to be written to a subscriber, it stops
+ * getting every update; when it catches up, it gets the latest state of the
+ * games it missed updates to instead. */
+#define MAX_PUSH_PENDING (64 * 1024)
+
+/* The fields of the game states in updates, unless the subscriber asks for
+ * others: just what changes from one move to the next. */
+#define UPDATE_FIELDS (FIELD_FEN | FIELD_TERMINATION | FIELD_LAST_MOVE)
+
+/* Updates are encoded once for each set of fields and encoding the
+ * subscribers of a game want, up to this many; beyond that, they're encoded
+ * for each subscriber. */
+#define MAX_VARIANTS 8
+
+/* How long a wait_for_move request waits, in milliseconds, if it doesn't
+ * say, and the longest it may ask to wait. */
+#define DEFAULT_WAIT_MS 30000
+#define MAX_WAIT_MS 300000
+
+/* A game with at least one subscriber or parked wait. */
+struct watched_game {
+    game_id_t id;
+    /* the latest update to the game, which is what subscribers that fell
+     * behind catch up to */
+    struct gm_update last;
+    struct subscription *subs;
+    struct waiter *waiters;
+    struct watched_game *chain;
+};
+
+struct subscription {
+    struct gm_conn *conn;
+    struct watched_game *game;
+    unsigned int fields;
+    /* whether the subscriber has skipped updates since the last one it got */
+    bool behind;
+    struct subscription *next_in_game;
+    struct subscription *next_in_conn;
+};
+
+/* A parked wait_for_move request, waiting for its game to get past a ply. */
+struct waiter {
+    struct gm_job *job;
+    struct watched_game *game;
+    json_int_t ply;
+    unsigned int fields;
+    /* when the wait times out, in nanoseconds on the monotonic clock */
+    uint64_t deadline;
+    struct waiter *next_in_game;
+    struct waiter *next_in_conn;
+    /* neighbours in the list of all waiters, soonest deadline first */
+    struct waiter *sooner;
+    struct waiter *later;
+};
+
+struct encoded_update {
+    unsigned int fields;
+    bool binary;
+    char *msg;
+    size_t len;
+};
+
+static struct game_tree *tree = NULL;
+static struct watched_game *watched[WATCH_BUCKETS];
+static struct gm_conn *pushed_head = NULL;
+static struct waiter *soonest = NULL;
+static struct waiter *latest = NULL;
+static int timer_fd = -1;
+
+int
+subscriptions_init(struct game_tree *gt)
+{
+    tree = gt;
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return timer_fd == -1 ? -1 : 0;
+}
+
+int
+waiters_timer(void)
+{
+    return timer_fd;
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct watched_game **
+find_watched(game_id_t id)
+{
+    struct watched_game **p;
+
+    for (p = &watched[id % WATCH_BUCKETS]; *p != NULL; p = &(*p)->chain)
+        if ((*p)->id == id)
+            break;
+    return p;
+}
+
+static size_t
+pending_out(const struct gm_conn *conn)
+{
+    return conn->out.len - conn->out_sent;
+}
+
+static char *
+encode_update(
+    const struct gm_update *u,
+    unsigned int fields,
+    bool binary,
+    size_t *len)
+{
+    json_t *msg;
+    struct deferred_states states;
+
+    memset(&states, 0x00, sizeof(struct deferred_states));
+    msg = json_pack("{sssIso}",
+            "kind", "update",
+            "game_id", (json_int_t) u->game_id,
+            "state", deferred_state(&states, u->node, fields, u->termination));
+    if (msg == NULL) {
+        free_deferred_states(&states);
+        return NULL;
+    }
+    return response_str(msg, &states, binary, len);
+}
+
+/* Note that a connection has output the event loop doesn't know about. */
+static void
+mark_pushed(struct gm_conn *conn)
+{
+    if (!conn->pushed) {
+        conn->pushed = true;
+        conn->next_pushed = pushed_head;
+        pushed_head = conn;
+    }
+}
+
+static void
+push(struct gm_conn *conn, const char *msg, size_t len)
+{
+    if (frame_append(&conn->out, msg, len)) {
+        fprintf(stderr, "E: couldn't queue update\n");
+        return;
+    }
+    mark_pushed(conn);
+}
+
+/* Find a game's entry in the watched games, adding it if it isn't there.
+ * Returns NULL if memory runs out. */
+static struct watched_game *
+watch_game(struct game *game)
+{
+    struct watched_game **p;
+    struct watched_game *wg;
+
+    p = find_watched(game->id);
+    if (*p != NULL)
+        return *p;
+    wg = calloc(1, sizeof(struct watched_game));
+    if (wg == NULL)
+        return NULL;
+    wg->id = game->id;
+    wg->last.game_id = game->id;
+    wg->last.version = read_game(game, &wg->last.node, &wg->last.termination);
+    *p = wg;
+    return wg;
+}
+
+/* Forget a watched game if nothing is watching it anymore. */
+static void
+release_game(struct watched_game *wg)
+{
+    struct watched_game **p;
+
+    if (wg->subs != NULL || wg->waiters != NULL)
+        return;
+    p = find_watched(wg->id);
+    *p = wg->chain;
+    free(wg);
+}
+
+static json_t *
+add_subscription(
+    json_t *req,
+    struct gm_conn *conn,
+    struct deferred_states *states)
+{
+    json_t *t;
+    game_id_t game_id;
+    struct game *game;
+    struct watched_game *wg;
+    struct subscription *sub;
+    unsigned int fields;
+    size_t n_subs;
+
+    /* outside of a session, the connection closes after the response */
+    if (conn == NULL || !conn->session)
+        return json_pack(
+            "{snss}", "state", "error", "no session in progress");
+    fields = UPDATE_FIELDS;
+    if (json_object_get(req, "fields") != NULL
+            && !requested_fields(req, &fields))
+        return json_pack("{snss}", "state", "error", "unknown field");
+    t = json_object_get(req, "game_id");
+    if (!json_is_integer(t))
+        return json_pack("{ss}", "error", "missing field game_id");
+    game_id = json_integer_value(t);
+
+    game = get_game(tree, game_id);
+    if (game == NULL)
+        return json_pack("{snss}", "state", "error", "game does not exist");
+    n_subs = 0;
+    for (sub = conn->subs; sub != NULL; sub = sub->next_in_conn) {
+        if (sub->game->id == game_id)
+            return json_pack(
+                "{snss}", "state", "error", "already subscribed");
+        n_subs++;
+    }
+    if (n_subs >= MAX_SUBSCRIPTIONS)
+        return json_pack(
+            "{snss}", "state", "error", "too many subscriptions");
+
+    sub = calloc(1, sizeof(struct subscription));
+    if (sub == NULL)
+        return json_pack("{snss}", "state", "error", "out of memory");
+    wg = watch_game(game);
+    if (wg == NULL) {
+        free(sub);
+        return json_pack("{snss}", "state", "error", "out of memory");
+    }
+    sub->conn = conn;
+    sub->game = wg;
+    sub->fields = fields;
+    sub->next_in_game = wg->subs;
+    wg->subs = sub;
+    sub->next_in_conn = conn->subs;
+    conn->subs = sub;
+
+    /* changes that are still being carried out will be pushed once they're
+     * done, so the subscriber starts from the same state as everyone else */
+    return json_pack("{sosn}", "state",
+            deferred_state(
+                states, wg->last.node, fields, wg->last.termination),
+            "error");
+}
+
+/* Take a subscription out of its game's list of subscribers, forgetting the
+ * game if that was the last thing watching it. */
+static void
+unwatch(struct subscription *sub)
+{
+    struct subscription **s;
+
+    for (s = &sub->game->subs; *s != sub; s = &(*s)->next_in_game);
+    *s = sub->next_in_game;
+    release_game(sub->game);
+    if (sub->behind)
+        sub->conn->subs_behind--;
+    free(sub);
+}
+
+json_t *
+unsubscribe(json_t *req, struct gm_conn *conn)
+{
+    json_t *t;
+    struct subscription **s;
+    struct subscription *sub;
+
+    if (conn == NULL)
+        return json_pack("{ss}", "error", "not subscribed");
+    t = json_object_get(req, "game_id");
+    if (!json_is_integer(t))
+        return json_pack("{ss}", "error", "missing field game_id");
+
+    for (s = &conn->subs; *s != NULL; s = &(*s)->next_in_conn) {
+        sub = *s;
+        if (sub->game->id == (game_id_t) json_integer_value(t)) {
+            *s = sub->next_in_conn;
+            unwatch(sub);
+            return json_pack("{sn}", "error");
+        }
+    }
+    return json_pack("{ss}", "error", "not subscribed");
+}
+
+/* Start the timer for the soonest deadline of any parked wait, or stop it if
+ * there are none. */
+static void
+arm_timer(void)
+{
+    struct itimerspec its;
+
+    memset(&its, 0x00, sizeof(struct itimerspec));
+    if (soonest != NULL) {
+        its.it_value.tv_sec = soonest->deadline / 1000000000;
+        its.it_value.tv_nsec = soonest->deadline % 1000000000;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+        perror("E: couldn't set wait timer");
+}
+
+/* Put a waiter in the list of all waiters, in order of deadline. Most waits
+ * are for the same length of time, so the place for a new one is almost
+ * always at the end. */
+static void
+add_deadline(struct waiter *w)
+{
+    struct waiter *before;
+
+    for (before = latest; before != NULL && before->deadline > w->deadline;
+            before = before->sooner);
+    w->sooner = before;
+    w->later = before == NULL ? soonest : before->later;
+    if (w->sooner != NULL)
+        w->sooner->later = w;
+    else
+        soonest = w;
+    if (w->later != NULL)
+        w->later->sooner = w;
+    else
+        latest = w;
+}
+
+/* Take a waiter out of every list it's in. */
+static void
+unpark(struct waiter *w)
+{
+    struct waiter **p;
+
+    for (p = &w->game->waiters; *p != w; p = &(*p)->next_in_game);
+    *p = w->next_in_game;
+    for (p = &w->job->conn->waiters; *p != w; p = &(*p)->next_in_conn);
+    *p = w->next_in_conn;
+    if (w->sooner != NULL)
+        w->sooner->later = w->later;
+    else
+        soonest = w->later;
+    if (w->later != NULL)
+        w->later->sooner = w->sooner;
+    else
+        latest = w->sooner;
+}
+
+/* Send the response to a request the event loop carried out, taking
+ * ownership of it and of the states it's waiting on. */
+static void
+send_answer(
+    struct gm_job *job,
+    json_t *resp,
+    struct deferred_states *states)
+{
+    json_t *req_id;
+    struct gm_conn *conn;
+
+    req_id = json_object_get(job->req, "request_id");
+    if (req_id != NULL)
+        json_object_set(resp, "request_id", req_id);
+    job->resp_msg = response_str(resp, states, job->binary, &job->resp_len);
+    conn = return_job(job);
+    if (conn != NULL)
+        mark_pushed(conn);
+}
+
+/* Send a response that isn't waiting on any states. */
+static void
+answer(struct gm_job *job, json_t *resp)
+{
+    send_answer(job, resp, NULL);
+}
+
+void
+subscribe(struct gm_job *job)
+{
+    struct deferred_states states;
+
+    memset(&states, 0x00, sizeof(struct deferred_states));
+    send_answer(job, add_subscription(job->req, job->conn, &states), &states);
+}
+
+static void
+answer_state(
+    struct gm_job *job,
+    const struct gm_update *u,
+    unsigned int fields,
+    bool timed_out)
+{
+    struct deferred_states states;
+
+    memset(&states, 0x00, sizeof(struct deferred_states));
+    send_answer(job, json_pack("{sosbsn}",
+            "state", deferred_state(&states, u->node, fields, u->termination),
+            "timed_out", timed_out,
+            "error"), &states);
+}
+
+/* Whether a game has moved past a ply, or can't move at all anymore. */
+static bool
+past_ply(const struct gm_update *u, json_int_t ply)
+{
+    return u->node->move->post_board->ply_index > ply
+        || u->termination & TERM_GAME_OVER_MASK;
+}
+
+void
+wait_for_move(struct gm_job *job)
+{
+    json_t *req;
+    json_t *t;
+    json_int_t ply;
+    json_int_t timeout;
+    unsigned int fields;
+    struct game *game;
+    struct watched_game *wg;
+    struct waiter *w;
+
+    req = job->req;
+    if (!requested_fields(req, &fields)) {
+        answer(job, json_pack("{snss}", "state", "error", "unknown field"));
+        return;
+    }
+    t = json_object_get(req, "game_id");
+    if (!json_is_integer(t)) {
+        answer(job, json_pack(
+            "{snss}", "state", "error", "missing field game_id"));
+        return;
+    }
+    game = get_game(tree, json_integer_value(t));
+    t = json_object_get(req, "ply");
+    if (!json_is_integer(t)) {
+        answer(job, json_pack(
+            "{snss}", "state", "error", "missing field ply"));
+        return;
+    }
+    ply = json_integer_value(t);
+    t = json_object_get(req, "timeout");
+    timeout = DEFAULT_WAIT_MS;
+    if (t != NULL) {
+        if (!json_is_integer(t) || json_integer_value(t) < 0) {
+            answer(job, json_pack(
+                "{snss}", "state", "error", "invalid timeout"));
+            return;
+        }
+        timeout = json_integer_value(t);
+        if (timeout > MAX_WAIT_MS)
+            timeout = MAX_WAIT_MS;
+    }
+    if (game == NULL) {
+        answer(job, json_pack(
+            "{snss}", "state", "error", "game does not exist"));
+        return;
+    }
+
+    wg = watch_game(game);
+    if (wg == NULL) {
+        answer(job, json_pack("{snss}", "state", "error", "out of memory"));
+        return;
+    }
+    if (past_ply(&wg->last, ply) || timeout == 0) {
+        answer_state(job, &wg->last, fields, !past_ply(&wg->last, ply));
+        release_game(wg);
+        return;
+    }
+    w = calloc(1, sizeof(struct waiter));
+    if (w == NULL) {
+        release_game(wg);
+        answer(job, json_pack("{snss}", "state", "error", "out of memory"));
+        return;
+    }
+
+    w->job = job;
+    w->game = wg;
+    w->ply = ply;
+    w->fields = fields;
+    w->deadline = now_ns() + (uint64_t) timeout * 1000000;
+    w->next_in_game = wg->waiters;
+    wg->waiters = w;
+    w->next_in_conn = job->conn->waiters;
+    job->conn->waiters = w;
+    add_deadline(w);
+    if (soonest == w)
+        arm_timer();
+}
+
+/* Answer the parked waits on a game that its latest update lets go. */
+static void
+wake_waiters(struct watched_game *wg)
+{
+    struct waiter *w;
+    struct waiter *next;
+    bool rearm;
+
+    rearm = false;
+    for (w = wg->waiters; w != NULL; w = next) {
+        next = w->next_in_game;
+        if (!past_ply(&wg->last, w->ply))
+            continue;
+        rearm |= w == soonest;
+        unpark(w);
+        answer_state(w->job, &wg->last, w->fields, false);
+        free(w);
+    }
+    if (rearm)
+        arm_timer();
+}
+
+void
+expire_waiters(void)
+{
+    uint64_t expirations;
+    uint64_t now;
+    struct waiter *w;
+    struct watched_game *wg;
+
+    /* reading the timer just clears its readiness; we go by the clock */
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0
+            && errno != EAGAIN)
+        perror("E: couldn't read wait timer");
+
+    now = now_ns();
+    while (soonest != NULL && soonest->deadline <= now) {
+        w = soonest;
+        wg = w->game;
+        unpark(w);
+        answer_state(w->job, &wg->last, w->fields, true);
+        free(w);
+        release_game(wg);
+    }
+    arm_timer();
+}
+
+/* Find the encoding of an update for a subscriber among the ones made so far,
+ * making it if it's new. Returns NULL on error. Encodings that don't fit in
+ * the list are made in spare, for the caller to free. */
+static struct encoded_update *
+update_for(
+    const struct gm_update *u,
+    const struct subscription *sub,
+    struct encoded_update *variants,
+    size_t *n_variants,
+    struct encoded_update *spare)
+{
+    struct encoded_update *e;
+    size_t i;
+    bool binary;
+
+    binary = sub->conn->binary;
+    for (i = 0; i < *n_variants; i++)
+        if (variants[i].fields == sub->fields && variants[i].binary == binary)
+            return &variants[i];
+
+    e = *n_variants < MAX_VARIANTS ? &variants[(*n_variants)++] : spare;
+    e->fields = sub->fields;
+    e->binary = binary;
+    e->msg = encode_update(u, sub->fields, binary, &e->len);
+    if (e->msg == NULL) {
+        if (e != spare)
+            (*n_variants)--;
+        return NULL;
+    }
+    return e;
+}
+
+static void
+publish(const struct gm_update *u)
+{
+    struct watched_game *wg;
+    struct subscription *sub;
+    struct encoded_update variants[MAX_VARIANTS];
+    struct encoded_update spare;
+    struct encoded_update *e;
+    size_t n_variants;
+    size_t i;
+
+    wg = *find_watched(u->game_id);
+    if (wg == NULL)
+        return;
+    /* jobs can finish out of order once they've been logged; an update older
+     * than the one subscribers already have would only take them back. */
+    if ((int) (u->version - wg->last.version) <= 0)
+        return;
+    wg->last = *u;
+
+    n_variants = 0;
+    for (sub = wg->subs; sub != NULL; sub = sub->next_in_game) {
+        if (pending_out(sub->conn) >= MAX_PUSH_PENDING) {
+            if (!sub->behind) {
+                sub->behind = true;
+                sub->conn->subs_behind++;
+            }
+            continue;
+        }
+        spare.msg = NULL;
+        e = update_for(u, sub, variants, &n_variants, &spare);
+        if (e != NULL)
+            push(sub->conn, e->msg, e->len);
+        free(spare.msg);
+    }
+    for (i = 0; i < n_variants; i++)
+        free(variants[i].msg);
+
+    wake_waiters(wg);
+    release_game(wg);
+}
+
+void
+publish_updates(const struct gm_job *job)
+{
+    size_t i;
+
+    for (i = 0; i < job->n_updates; i++)
+        publish(&job->updates[i]);
+}
+
+bool
+catch_up(struct gm_conn *conn)
+{
+    struct subscription *sub;
+    char *msg;
+    size_t len;
+
+    for (sub = conn->subs; sub != NULL && conn->subs_behind > 0;
+            sub = sub->next_in_conn) {
+        if (!sub->behind)
+            continue;
+        if (pending_out(conn) >= MAX_PUSH_PENDING)
+            return false;
+        msg = encode_update(&sub->game->last, sub->fields, conn->binary, &len);
+        if (msg != NULL) {
+            push(conn, msg, len);
+            free(msg);
+        }
+        sub->behind = false;
+        conn->subs_behind--;
+    }
+    return true;
+}
+
+void
+drop_watches(struct gm_conn *conn)
+{
+    struct subscription *sub;
+    struct waiter *w;
+    struct watched_game *wg;
+    struct gm_conn **p;
+    bool rearm;
+
+    while (conn->subs != NULL) {
+        sub = conn->subs;
+        conn->subs = sub->next_in_conn;
+        unwatch(sub);
+    }
+    rearm = false;
+    while (conn->waiters != NULL) {
+        w = conn->waiters;
+        wg = w->game;
+        rearm |= w == soonest;
+        unpark(w);
+        /* there's nobody left to answer */
+        conn->in_flight--;
+        free_job(w->job);
+        free(w);
+        release_game(wg);
+    }
+    if (rearm)
+        arm_timer();
+    if (conn->pushed) {
+        for (p = &pushed_head; *p != conn; p = &(*p)->next_pushed);
+        *p = conn->next_pushed;
+        conn->pushed = false;
+    }
+}
+
+struct gm_conn *
+take_pushed_conn(void)
+{
+    struct gm_conn *conn;
+
+    conn = pushed_head;
+    if (conn != NULL) {
+        pushed_head = conn->next_pushed;
+        conn->pushed = false;
+    }
+    return conn;
+}
@@ -0,0 +1,825 @@
+/*
+ * uring.c: io_uring backend for the grandmaster server
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <stdio.h>
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 256
+
+/* Incoming data is received into a pool of buffers that the kernel picks
+ * from, so that idle connections don't each tie up a buffer of their own.
+ * RECV_BUFS must be a power of two. */
+#define RECV_BUFS 256
+#define RECV_BUF_LEN 4096
+#define RECV_GROUP 0
+
+/* What a completion is for. This lives in the low bits of its user_data; the
+ * rest is the connection it concerns, if any. */
+enum {
+    OP_ACCEPT = 0,
+    OP_WAKE,
+    OP_LOG,
+    OP_CANCEL,
+    OP_RECV,
+    OP_SEND,
+    OP_TIMER,
+};
+#define OP_MASK 0x7
+
+/* A connection, plus the state only this backend needs. Responses are queued
+ * in conn.out as usual; when we start sending them, they're swapped into
+ * "sending", which the kernel reads from until the send completes. */
+struct uring_conn {
+    /* must come first: release_conn frees the uring_conn through it */
+    struct gm_conn conn;
+    struct gm_buf sending;
+    size_t sending_off;
+    /* the number of operations on this connection we're waiting on */
+    unsigned int ops;
+    bool recv_armed;
+    bool send_armed;
+    bool peer_done;
+    bool closing;
+};
+
+struct ring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+static struct ring ring;
+
+static struct io_uring_buf_ring *buf_ring = NULL;
+static size_t buf_ring_len;
+static char *buf_mem = NULL;
+static unsigned short buf_tail;
+
+static int listen_sock;
+static int wake_fd;
+static uint64_t wake_count;
+
+static struct gm_log *aol_log;
+/* the batch of records being written, how much of it has been written, and
+ * the log position everything up to which is safely in the file */
+static struct gm_buf log_batch;
+static size_t log_batch_off;
+static uint64_t log_written;
+static bool log_busy;
+/* finished jobs whose records haven't been written yet */
+static struct gm_job *unlogged;
+
+static int
+ring_setup(unsigned int entries)
+{
+    struct io_uring_params p;
+    char *sq;
+    char *cq;
+
+    memset(&p, 0x00, sizeof(struct io_uring_params));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0)
+        return -1;
+
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_len > ring.sq_len)
+            ring.sq_len = ring.cq_len;
+        ring.cq_len = ring.sq_len;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+        goto close;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.fd,
+                           IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED)
+            goto unmap_sq;
+    }
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        goto unmap_cq;
+
+    sq = ring.sq_ptr;
+    ring.sq_head = (unsigned int *) (sq + p.sq_off.head);
+    ring.sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *) (sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    cq = ring.cq_ptr;
+    ring.cq_head = (unsigned int *) (cq + p.cq_off.head);
+    ring.cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return 0;
+
+unmap_cq:
+    if (ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_len);
+unmap_sq:
+    munmap(ring.sq_ptr, ring.sq_len);
+close:
+    close(ring.fd);
+    return -1;
+}
+
+static void
+ring_teardown(void)
+{
+    munmap(ring.sqes, ring.sqes_len);
+    if (ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_len);
+    munmap(ring.sq_ptr, ring.sq_len);
+    close(ring.fd);
+}
+
+/* Submit everything queued so far, and wait for at least min_complete
+ * completions. */
+static int
+ring_enter(unsigned int min_complete)
+{
+    unsigned int to_submit;
+
+    to_submit =
+        *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                   min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Get a fresh submission queue entry. Returns NULL if the queue is full and
+ * couldn't be submitted. */
+static struct io_uring_sqe *
+get_sqe(void)
+{
+    unsigned int tail;
+    unsigned int idx;
+    struct io_uring_sqe *sqe;
+
+    tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)
+            == ring.sq_entries) {
+        if (ring_enter(0) < 0)
+            return NULL;
+        if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)
+                == ring.sq_entries)
+            return NULL;
+    }
+    idx = tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static uint64_t
+tag(struct uring_conn *uc, unsigned int op)
+{
+    return (uint64_t) (uintptr_t) uc | op;
+}
+
+static void
+recycle_buf(unsigned short bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &buf_ring->bufs[buf_tail & (RECV_BUFS - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (buf_mem + bid * RECV_BUF_LEN);
+    buf->len = RECV_BUF_LEN;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static int
+setup_bufs(void)
+{
+    struct io_uring_buf_reg reg;
+    unsigned short i;
+
+    buf_ring_len = RECV_BUFS * sizeof(struct io_uring_buf);
+    buf_ring = mmap(NULL, buf_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        buf_ring = NULL;
+        return -1;
+    }
+    buf_mem = malloc(RECV_BUFS * RECV_BUF_LEN);
+    if (buf_mem == NULL)
+        return -1;
+
+    memset(&reg, 0x00, sizeof(struct io_uring_buf_reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) buf_ring;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_GROUP;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+        return -1;
+
+    buf_tail = 0;
+    for (i = 0; i < RECV_BUFS; i++)
+        recycle_buf(i);
+    return 0;
+}
+
+static void
+teardown_bufs(void)
+{
+    if (buf_ring != NULL)
+        munmap(buf_ring, buf_ring_len);
+    free(buf_mem);
+    buf_ring = NULL;
+    buf_mem = NULL;
+}
+
+static int
+arm_accept(void)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe();
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag(NULL, OP_ACCEPT);
+    return 0;
+}
+
+static int
+arm_wake(void)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe();
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &wake_count;
+    sqe->len = sizeof(wake_count);
+    sqe->user_data = tag(NULL, OP_WAKE);
+    return 0;
+}
+
+/* The wait timer is nonblocking, so rather than reading it we wait for it to
+ * become readable and let expire_waiters do the reading. */
+static int
+arm_timer(void)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe();
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = waiters_timer();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag(NULL, OP_TIMER);
+    return 0;
+}
+
+static int
+arm_recv(struct uring_conn *uc)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe();
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->conn.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = tag(uc, OP_RECV);
+    uc->recv_armed = true;
+    uc->ops++;
+    return 0;
+}
+
+/* Send whatever part of the current batch of responses hasn't gone out yet,
+ * starting a new batch if the last one is done. */
+static int
+arm_send(struct uring_conn *uc)
+{
+    struct io_uring_sqe *sqe;
+    struct gm_buf t;
+
+    if (uc->send_armed)
+        return 0;
+    if (uc->sending_off == uc->sending.len) {
+        if (uc->conn.out.len == 0)
+            return 0;
+        t = uc->sending;
+        uc->sending = uc->conn.out;
+        uc->sending_off = 0;
+        t.len = 0;
+        uc->conn.out = t;
+    }
+
+    sqe = get_sqe();
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uc->conn.fd;
+    sqe->addr = (uint64_t) (uintptr_t) (uc->sending.data + uc->sending_off);
+    sqe->len = uc->sending.len - uc->sending_off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = tag(uc, OP_SEND);
+    uc->send_armed = true;
+    uc->ops++;
+    return 0;
+}
+
+static void
+finish_close(struct uring_conn *uc)
+{
+    close(uc->conn.fd);
+    buf_free(&uc->sending);
+    release_conn(&uc->conn);
+}
+
+/* Close a connection once the operations we have outstanding on it have
+ * completed, cancelling the ones that might never complete on their own. */
+static void
+start_close(struct uring_conn *uc)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uc->closing)
+        return;
+    uc->closing = true;
+    if (uc->ops == 0) {
+        finish_close(uc);
+        return;
+    }
+    if (uc->recv_armed) {
+        sqe = get_sqe();
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = tag(uc, OP_RECV);
+            sqe->user_data = tag(NULL, OP_CANCEL);
+        } else {
+            /* shutting the socket down also ends the receive */
+            shutdown(uc->conn.fd, SHUT_RDWR);
+        }
+    }
+}
+
+/* Make whatever progress we can on a connection: start on the requests that
+ * have arrived, send the responses that are ready, and close it once it's
+ * done. */
+static void
+update_conn(struct uring_conn *uc)
+{
+    struct gm_conn *conn;
+    bool stalled;
+
+    if (uc->closing)
+        return;
+    conn = &uc->conn;
+
+    stalled = process_input(conn);
+    if (uc->peer_done && !stalled && conn->in_flight < MAX_IN_FLIGHT)
+        conn->close_after_write = true;
+
+    if (arm_send(uc))
+        goto close;
+    if (!uc->send_armed && uc->sending_off == uc->sending.len
+            && conn_done(conn))
+        goto close;
+    if (!uc->recv_armed && !uc->peer_done && conn_wants_input(conn))
+        if (arm_recv(uc))
+            goto close;
+    return;
+
+close:
+    start_close(uc);
+}
+
+static void
+accept_done(struct io_uring_cqe *cqe)
+{
+    struct uring_conn *uc;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !server_stopping())
+        if (arm_accept())
+            fprintf(stderr, "E: couldn't accept connections\n");
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        perror("E: accept error");
+        return;
+    }
+
+    uc = calloc(1, sizeof(struct uring_conn));
+    if (uc == NULL) {
+        fprintf(stderr, "E: couldn't allocate connection\n");
+        close(cqe->res);
+        return;
+    }
+    uc->conn.fd = cqe->res;
+    set_nodelay(uc->conn.fd);
+    update_conn(uc);
+}
+
+static void
+recv_done(struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+    unsigned short bid;
+    int err;
+
+    uc->recv_armed = false;
+    err = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0)
+            err = buf_append(
+                &uc->conn.in, buf_mem + bid * RECV_BUF_LEN, cqe->res);
+        recycle_buf(bid);
+    }
+    /* running out of buffers is only temporary; we'll try again below. */
+    if (err || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+        start_close(uc);
+        return;
+    }
+    if (cqe->res == 0)
+        uc->peer_done = true;
+    update_conn(uc);
+}
+
+static void
+send_done(struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+    uc->send_armed = false;
+    if (cqe->res < 0) {
+        start_close(uc);
+        return;
+    }
+    uc->sending_off += cqe->res;
+    if (uc->sending_off == uc->sending.len) {
+        uc->sending.len = 0;
+        uc->sending_off = 0;
+    }
+    update_conn(uc);
+}
+
+/* Start writing out the records that have been appended to the log since the
+ * last batch, if the last batch is done. */
+static void
+flush_log(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (log_busy)
+        return;
+    if (log_batch_off == log_batch.len) {
+        log_batch.len = 0;
+        log_batch_off = 0;
+        log_take_pending(aol_log, &log_batch);
+        if (log_batch.len == 0)
+            return;
+    }
+
+    sqe = get_sqe();
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fileno(aol_log->f);
+    sqe->off = (uint64_t) -1;
+    sqe->addr = (uint64_t) (uintptr_t) (log_batch.data + log_batch_off);
+    sqe->len = log_batch.len - log_batch_off;
+    sqe->user_data = tag(NULL, OP_LOG);
+    log_busy = true;
+}
+
+/* Send what has been pushed to connections other than the one we were
+ * dealing with: updates to subscribers, and answers to parked waits. */
+static void
+update_pushed(void)
+{
+    struct gm_conn *conn;
+
+    while ((conn = take_pushed_conn()) != NULL)
+        update_conn((struct uring_conn *) conn);
+}
+
+static void
+deliver_job(struct gm_job *job)
+{
+    struct gm_conn *conn;
+
+    conn = return_job(job);
+    if (conn != NULL)
+        update_conn((struct uring_conn *) conn);
+    update_pushed();
+}
+
+static void
+timer_done(struct io_uring_cqe *cqe)
+{
+    if (cqe->res < 0 && cqe->res != -EINTR) {
+        errno = -cqe->res;
+        perror("E: couldn't poll wait timer");
+    }
+    if (arm_timer())
+        fprintf(stderr, "E: couldn't wait on wait timer\n");
+    expire_waiters();
+    update_pushed();
+}
+
+static void
+log_done(struct io_uring_cqe *cqe)
+{
+    struct gm_job *job;
+    struct gm_job **p;
+    size_t written;
+
+    log_busy = false;
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        perror("E: couldn't write to append-only log");
+        /* there's nothing better to do than to carry on as if it had been
+         * written, which is what the epoll backend does too. */
+        written = log_batch.len - log_batch_off;
+    } else {
+        written = cqe->res;
+    }
+    log_batch_off += written;
+    log_written += written;
+
+    p = &unlogged;
+    while (*p != NULL) {
+        job = *p;
+        if (job->log_end <= log_written) {
+            *p = job->next;
+            deliver_job(job);
+        } else {
+            p = &job->next;
+        }
+    }
+    flush_log();
+}
+
+/* Hand the responses to finished jobs back to their connections, holding
+ * back the ones whose log records haven't been written yet. */
+static void
+wake_done(struct io_uring_cqe *cqe)
+{
+    struct gm_job *job;
+    struct gm_job *next;
+
+    if (cqe->res < 0 && cqe->res != -EINTR) {
+        errno = -cqe->res;
+        perror("E: couldn't read from worker eventfd");
+    }
+    if (arm_wake())
+        fprintf(stderr, "E: couldn't wait on workers\n");
+
+    for (job = take_finished_jobs(); job != NULL; job = next) {
+        next = job->next;
+        finish_lane(job);
+        if (job->log_end > log_written) {
+            job->next = unlogged;
+            unlogged = job;
+        } else {
+            deliver_job(job);
+        }
+    }
+    /* the jobs let go by the ones that finished may have been answered by
+     * the event loop already */
+    update_pushed();
+    flush_log();
+}
+
+static void
+handle_cqe(struct io_uring_cqe *cqe)
+{
+    struct uring_conn *uc;
+    unsigned int op;
+
+    op = cqe->user_data & OP_MASK;
+    uc = (struct uring_conn *) (uintptr_t)
+        (cqe->user_data & ~(uint64_t) OP_MASK);
+
+    switch (op) {
+    case OP_ACCEPT:
+        accept_done(cqe);
+        return;
+    case OP_WAKE:
+        wake_done(cqe);
+        return;
+    case OP_LOG:
+        log_done(cqe);
+        return;
+    case OP_TIMER:
+        timer_done(cqe);
+        return;
+    case OP_CANCEL:
+        return;
+    }
+
+    uc->ops--;
+    if (uc->closing) {
+        if (op == OP_RECV && cqe->flags & IORING_CQE_F_BUFFER)
+            recycle_buf(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (uc->ops == 0)
+            finish_close(uc);
+        return;
+    }
+    if (op == OP_RECV)
+        recv_done(uc, cqe);
+    else
+        send_done(uc, cqe);
+}
+
+/* Wait for at least one completion and handle everything that's complete. */
+static int
+reap(void)
+{
+    unsigned int head;
+    struct io_uring_cqe cqe;
+
+    if (ring_enter(1) < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("E: io_uring_enter error");
+        return -1;
+    }
+
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = ring.cqes[head & *ring.cq_mask];
+        head++;
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        handle_cqe(&cqe);
+    }
+    return 0;
+}
+
+static void
+write_all(int fd, const char *data, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("E: couldn't write to append-only log");
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+/* Write the records that are still waiting once the workers have stopped. */
+static void
+drain_log(void)
+{
+    while (log_busy)
+        if (reap())
+            return;
+
+    write_all(fileno(aol_log->f), log_batch.data + log_batch_off,
+              log_batch.len - log_batch_off);
+    log_batch.len = 0;
+    log_batch_off = 0;
+    log_take_pending(aol_log, &log_batch);
+    write_all(fileno(aol_log->f), log_batch.data, log_batch.len);
+}
+
+int
+run_uring_loop(
+    int listen_fd,
+    struct game_tree *gt,
+    struct gm_log *aol,
+    int n_workers)
+{
+    if (ring_setup(RING_ENTRIES)) {
+        perror("E: couldn't set up io_uring");
+        return -1;
+    }
+    if (setup_bufs()) {
+        perror("E: couldn't set up receive buffers");
+        teardown_bufs();
+        ring_teardown();
+        return -1;
+    }
+
+    /* unlike with epoll, we wait on this with a read, which needs it to
+     * block. */
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("E: eventfd error");
+        teardown_bufs();
+        ring_teardown();
+        return -1;
+    }
+
+    listen_sock = listen_fd;
+    aol_log = aol;
+    memset(&log_batch, 0x00, sizeof(struct gm_buf));
+    log_batch_off = 0;
+    log_written = 0;
+    log_busy = false;
+    unlogged = NULL;
+
+    if (arm_accept() || arm_wake() || arm_timer()) {
+        fprintf(stderr, "E: couldn't start io_uring loop\n");
+        goto close;
+    }
+    if (start_workers(gt, aol_log, n_workers, wake_fd))
+        goto close;
+
+    printf("I: serving with io_uring\n");
+    while (!server_stopping())
+        if (reap())
+            break;
+
+    /* let the workers finish what they've started, so that everything that
+     * has been carried out has also been logged. */
+    stop_workers();
+    drain_log();
+
+close:
+    buf_free(&log_batch);
+    close(wake_fd);
+    teardown_bufs();
+    ring_teardown();
+    return 0;
+}
+
+#else
+
+int
+run_uring_loop(
+    int listen_fd,
+    struct game_tree *gt,
+    struct gm_log *log,
+    int n_workers)
+{
+    (void) listen_fd;
+    (void) gt;
+    (void) log;
+    (void) n_workers;
+    fprintf(stderr, "E: gm was built without io_uring support\n");
+    return -1;
+}
+
+#endif
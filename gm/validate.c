@@ -0,0 +1,486 @@
+/*
+ * validate.c: batch checker for positions in FEN
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/core.h>
+#include <grandmaster/gmutil.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The input is read this much at a time, and each chunk of it is a batch of
+ * positions for one worker to check. */
+#define VALIDATE_CHUNK_LEN (256 * 1024)
+
+/* Validation runs in three stages, like an import: the calling thread reads
+ * the input a chunk of whole lines at a time, a pool of workers checks each
+ * position and writes out its report, and the reports are written out in the
+ * order the positions were read, by whichever worker finished the batch that
+ * is next in line. */
+struct validate_batch {
+    size_t seq;
+    char *text;
+    size_t len;
+    /* the line number of the first line in text */
+    size_t first_line;
+    struct gm_buf out;
+    size_t positions;
+    size_t illegal;
+    struct validate_batch *next;
+};
+
+struct validate_pipeline {
+    FILE *out;
+    int n_workers;
+    size_t positions;
+    size_t illegal;
+
+    /* guards everything up to write_lock */
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t room;
+    /* batches waiting to be checked, oldest first */
+    struct validate_batch *queue_head;
+    struct validate_batch *queue_tail;
+    /* batches that have been checked, waiting to be written, by seq */
+    struct validate_batch *checked;
+    size_t in_flight;
+    size_t next_seq;
+    size_t next_write;
+    bool read_all;
+    bool failed;
+
+    /* held by whichever thread is writing batches */
+    pthread_mutex_t write_lock;
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+buf_sink(const char *data, size_t len, void *arg)
+{
+    return buf_append(arg, data, len);
+}
+
+static void
+free_batch(struct validate_batch *batch)
+{
+    free(batch->text);
+    buf_free(&batch->out);
+    free(batch);
+}
+
+static bool
+is_blank(const char *line, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r')
+            return false;
+    return true;
+}
+
+/* Check one position and write its report, as a line of JSON. Returns 0 on
+ * success or -1 if memory ran out. */
+static int
+check_position(
+    struct validate_batch *batch,
+    const char *fen,
+    size_t len,
+    size_t line)
+{
+    struct json_writer w;
+    struct move *move;
+    struct board *b;
+    const char *err;
+
+    move = parse_fen(fen, len);
+    err = move == NULL ? "not a well-formed FEN" : illegal_position(move);
+
+    jw_init(&w, buf_sink, &batch->out);
+    jw_begin_object(&w);
+    jw_key(&w, "line");
+    jw_integer(&w, line);
+    jw_key(&w, "legal");
+    jw_bool(&w, err == NULL);
+    if (err != NULL) {
+        jw_key(&w, "error");
+        jw_string(&w, err);
+        batch->illegal++;
+    } else {
+        b = move->post_board;
+        jw_key(&w, "in_check");
+        jw_bool(&w, b->in_check);
+        jw_key(&w, "checkmate");
+        jw_bool(&w, b->termination == VICTORY_WHITE
+                || b->termination == VICTORY_BLACK);
+        jw_key(&w, "stalemate");
+        jw_bool(&w, b->termination == STALEMATE);
+        jw_key(&w, "draws");
+        jw_integer(&w, b->draws);
+    }
+    jw_end_object(&w);
+    if (w.err == 0)
+        w.err = buf_append(&batch->out, "\n", 1);
+    batch->positions++;
+
+    if (move != NULL)
+        free_move(move);
+    return w.err == 0 ? 0 : -1;
+}
+
+/* Check every position in a batch, one to a line; blank lines are skipped.
+ * Returns 0 on success or -1 if memory ran out. */
+static int
+check_batch(struct validate_batch *batch)
+{
+    const char *line;
+    const char *eol;
+    const char *end;
+    size_t line_no;
+
+    end = batch->text + batch->len;
+    line_no = batch->first_line;
+    for (line = batch->text; line < end; line = eol + 1, line_no++) {
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        if (is_blank(line, eol - line))
+            continue;
+        if (check_position(batch, line, eol - line, line_no))
+            return -1;
+    }
+    return 0;
+}
+
+/* Write out every checked batch whose turn it is, so that reports come out
+ * in the order of the input no matter which worker finished first. */
+static void
+write_checked(struct validate_pipeline *p)
+{
+    struct validate_batch *batch;
+    bool failed;
+    int res;
+
+    pthread_mutex_lock(&p->write_lock);
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        batch = p->checked;
+        if (batch == NULL || batch->seq != p->next_write) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        p->checked = batch->next;
+        failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+
+        res = 0;
+        if (!failed && fwrite(batch->out.data, 1, batch->out.len, p->out)
+                != batch->out.len)
+            res = -1;
+
+        pthread_mutex_lock(&p->lock);
+        if (res != 0)
+            p->failed = true;
+        p->positions += batch->positions;
+        p->illegal += batch->illegal;
+        p->next_write++;
+        p->in_flight--;
+        pthread_cond_broadcast(&p->room);
+        pthread_mutex_unlock(&p->lock);
+        free_batch(batch);
+    }
+    pthread_mutex_unlock(&p->write_lock);
+}
+
+static void *
+validate_worker(void *arg)
+{
+    struct validate_pipeline *p;
+    struct validate_batch *batch;
+    struct validate_batch **b;
+    bool failed;
+    int res;
+
+    p = arg;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->queue_head == NULL && !p->read_all)
+            pthread_cond_wait(&p->work_ready, &p->lock);
+        batch = p->queue_head;
+        if (batch == NULL) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        p->queue_head = batch->next;
+        if (p->queue_head == NULL)
+            p->queue_tail = NULL;
+        failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+
+        /* once validation has failed, batches are just thrown away */
+        res = failed ? 0 : check_batch(batch);
+
+        pthread_mutex_lock(&p->lock);
+        if (res != 0)
+            p->failed = true;
+        for (b = &p->checked; *b != NULL && (*b)->seq < batch->seq;
+                b = &(*b)->next);
+        batch->next = *b;
+        *b = batch;
+        pthread_mutex_unlock(&p->lock);
+        write_checked(p);
+    }
+}
+
+/* Pass a batch on to the workers, or check and write it right here if there
+ * are no workers. Returns 0 on success or -1 if validation has failed. */
+static int
+send_batch(struct validate_pipeline *p, struct validate_batch *batch)
+{
+    int res;
+
+    if (p->n_workers == 0) {
+        res = check_batch(batch);
+        if (res == 0 && fwrite(batch->out.data, 1, batch->out.len, p->out)
+                != batch->out.len)
+            res = -1;
+        p->positions += batch->positions;
+        p->illegal += batch->illegal;
+        free_batch(batch);
+        return res;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    /* don't read further ahead of the workers than they can use */
+    while (p->in_flight >= 4 * (size_t) p->n_workers && !p->failed)
+        pthread_cond_wait(&p->room, &p->lock);
+    res = p->failed ? -1 : 0;
+    if (res == 0) {
+        batch->seq = p->next_seq++;
+        batch->next = NULL;
+        if (p->queue_tail != NULL)
+            p->queue_tail->next = batch;
+        else
+            p->queue_head = batch;
+        p->queue_tail = batch;
+        p->in_flight++;
+        pthread_cond_signal(&p->work_ready);
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (res != 0)
+        free_batch(batch);
+    return res;
+}
+
+static size_t
+count_lines(const char *text, size_t len)
+{
+    const char *end;
+    size_t n;
+
+    n = 0;
+    end = text + len;
+    while ((text = memchr(text, '\n', end - text)) != NULL) {
+        text++;
+        n++;
+    }
+    return n;
+}
+
+/* Read the input a chunk at a time and pass the whole lines in each chunk on
+ * to be checked. Returns 0 on success or -1 on error. */
+static int
+read_input(struct validate_pipeline *p, FILE *in)
+{
+    struct validate_batch *batch;
+    const char *eol;
+    char *text;
+    char *next;
+    size_t len;
+    size_t cap;
+    size_t used;
+    size_t read_len;
+    size_t line;
+    bool last;
+
+    cap = VALIDATE_CHUNK_LEN;
+    text = malloc(cap);
+    if (text == NULL)
+        return -1;
+    len = 0;
+    line = 1;
+    last = false;
+
+    while (!last) {
+        read_len = fread(text + len, 1, cap - len, in);
+        if (read_len == 0 && ferror(in)) {
+            free(text);
+            return -1;
+        }
+        len += read_len;
+        last = read_len == 0;
+
+        /* a line that doesn't fit in the chunk gets a bigger one */
+        eol = memrchr(text, '\n', len);
+        used = last ? len : eol == NULL ? 0 : (size_t) (eol - text) + 1;
+        if (used == 0 && !last) {
+            cap *= 2;
+            next = realloc(text, cap);
+            if (next == NULL) {
+                free(text);
+                return -1;
+            }
+            text = next;
+            continue;
+        }
+
+        batch = calloc(1, sizeof(struct validate_batch));
+        cap = len - used + VALIDATE_CHUNK_LEN;
+        next = last ? NULL : malloc(cap);
+        if (batch == NULL || (!last && next == NULL)) {
+            free(batch);
+            free(next);
+            free(text);
+            return -1;
+        }
+        if (next != NULL)
+            memcpy(next, text + used, len - used);
+        batch->text = text;
+        batch->len = used;
+        batch->first_line = line;
+        line += count_lines(text, used);
+        len -= used;
+        text = next;
+
+        if (send_batch(p, batch)) {
+            free(text);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Check a stream of positions in FEN, one to a line, and report on each. */
+int
+validate_main(int argc, char *argv[])
+{
+    struct validate_pipeline p;
+    pthread_t *workers;
+    FILE *in;
+    double start;
+    double elapsed;
+    int n_workers;
+    int n_started;
+    int res;
+    int opt;
+    int i;
+
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    res = 0;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+        case 'j':
+            n_workers = atoi(optarg);
+            if (n_workers < 1)
+                res = 1;
+            break;
+        default:
+            res = 1;
+        }
+    }
+    if (res != 0 || argc - optind > 1) {
+        printf("usage: gm validate [-j workers] [path/to/positions.fen]\n");
+        return 1;
+    }
+
+    if (optind == argc || strcmp(argv[optind], "-") == 0) {
+        in = stdin;
+    } else {
+        in = fopen(argv[optind], "r");
+        if (in == NULL) {
+            perror("E: FEN file couldn't be opened");
+            return 1;
+        }
+    }
+
+    memset(&p, 0x00, sizeof(struct validate_pipeline));
+    p.out = stdout;
+    p.n_workers = n_workers > 1 ? n_workers : 0;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.work_ready, NULL);
+    pthread_cond_init(&p.room, NULL);
+    pthread_mutex_init(&p.write_lock, NULL);
+
+    workers = calloc(p.n_workers + 1, sizeof(pthread_t));
+    if (workers == NULL)
+        return 1;
+    for (n_started = 0; n_started < p.n_workers; n_started++)
+        if (pthread_create(&workers[n_started], NULL, validate_worker, &p))
+            break;
+    if (n_started == 0)
+        p.n_workers = 0;
+
+    start = now();
+    res = read_input(&p, in);
+
+    pthread_mutex_lock(&p.lock);
+    p.read_all = true;
+    if (res != 0)
+        p.failed = true;
+    pthread_cond_broadcast(&p.work_ready);
+    pthread_mutex_unlock(&p.lock);
+    for (i = 0; i < n_started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    if (p.failed)
+        res = -1;
+    if (fflush(stdout) != 0)
+        res = -1;
+    elapsed = now() - start;
+    if (in != stdin)
+        fclose(in);
+
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.work_ready);
+    pthread_cond_destroy(&p.room);
+    pthread_mutex_destroy(&p.write_lock);
+
+    /* the reports go to stdout, so the summary goes to stderr */
+    if (res != 0)
+        fprintf(stderr, "E: validation stopped after %zu positions\n",
+                p.positions);
+    fprintf(stderr, "I: validated %zu positions in %.3fs, %zu illegal\n",
+            p.positions, elapsed, p.illegal);
+    fprintf(stderr, "I: %.0f positions/s on %d workers\n",
+            elapsed > 0 ? p.positions / elapsed : 0,
+            p.n_workers > 1 ? p.n_workers : 1);
+    return res == 0 ? 0 : 1;
+}
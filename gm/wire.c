@@ -0,0 +1,791 @@
+/*
+ * wire.c: encoding protocol messages for the wire
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/* Value tags; see the "Binary encoding" section of PROTOCOL. */
+#define TAG_NULL 0x00
+#define TAG_FALSE 0x01
+#define TAG_TRUE 0x02
+#define TAG_INTEGER 0x03
+#define TAG_REAL 0x04
+#define TAG_STRING 0x05
+#define TAG_ARRAY 0x06
+#define TAG_OBJECT 0x07
+#define TAG_BOARD 0x08
+#define TAG_ACCESS_MAP 0x09
+
+/* Nested arrays and objects deeper than this are rejected when decoding, so
+ * that a malicious message can't run us out of stack. */
+#define MAX_DEPTH 32
+
+/* Object keys that are sent as their index in this table instead of by name.
+ * New keys may only ever be added to the end. */
+static const char *known_keys[] = {
+    "kind", "error", "state", "game_id", "player", "player_white",
+    "player_black", "move", "pgn", "termination", "request_id", "board",
+    "available_castles", "passant_file", "access_map", "ply_index", "fen",
+    "draws", "in_check", "session", "encoding", "requests", "responses",
+    "atomic", "fields", "last_move", "game_ids", "states", "ply", "timeout",
+    "timed_out", "coordinates", "moves",
+};
+#define N_KNOWN_KEYS (sizeof(known_keys) / sizeof(known_keys[0]))
+
+/* Piece types in the order of their codes in a packed board. */
+static const char piece_codes[] = "pNBRQK";
+
+struct reader {
+    const unsigned char *data;
+    size_t len;
+    size_t off;
+};
+
+static int
+put_byte(struct gm_buf *buf, unsigned char b)
+{
+    return buf_append(buf, &b, 1);
+}
+
+static int
+put_varint(struct gm_buf *buf, uint64_t v)
+{
+    unsigned char bytes[10];
+    size_t n;
+
+    n = 0;
+    while (v >= 0x80) {
+        bytes[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    bytes[n++] = v;
+    return buf_append(buf, bytes, n);
+}
+
+static int
+put_string(struct gm_buf *buf, const char *str, size_t len)
+{
+    if (put_varint(buf, len))
+        return -1;
+    return buf_append(buf, str, len);
+}
+
+/* Returns the code of the piece named by a board square, 0 for an empty
+ * square or -1 if it isn't a piece. */
+static int
+piece_code(json_t *square)
+{
+    const char *name;
+    const char *type;
+
+    if (json_is_null(square))
+        return 0;
+    if (!json_is_string(square) || json_string_length(square) != 2)
+        return -1;
+    name = json_string_value(square);
+    if (name[0] != 'w' && name[0] != 'b')
+        return -1;
+    type = strchr(piece_codes, name[1]);
+    if (type == NULL || name[1] == '\0')
+        return -1;
+    return (type - piece_codes + 1) | (name[0] == 'b' ? 0x8 : 0);
+}
+
+/* Whether a value is an 8x8 grid of arrays. */
+static bool
+is_grid(json_t *val, bool (*square_ok)(json_t *))
+{
+    json_t *rank;
+    size_t r;
+    size_t f;
+
+    if (!json_is_array(val) || json_array_size(val) != 8)
+        return false;
+    for (r = 0; r < 8; r++) {
+        rank = json_array_get(val, r);
+        if (!json_is_array(rank) || json_array_size(rank) != 8)
+            return false;
+        for (f = 0; f < 8; f++)
+            if (!square_ok(json_array_get(rank, f)))
+                return false;
+    }
+    return true;
+}
+
+static bool
+is_piece(json_t *square)
+{
+    return piece_code(square) >= 0;
+}
+
+static bool
+is_position(json_t *pos)
+{
+    json_t *t;
+    size_t i;
+
+    if (!json_is_array(pos) || json_array_size(pos) != 2)
+        return false;
+    for (i = 0; i < 2; i++) {
+        t = json_array_get(pos, i);
+        if (!json_is_integer(t)
+                || json_integer_value(t) < 0 || json_integer_value(t) > 7)
+            return false;
+    }
+    return true;
+}
+
+static bool
+is_accessors(json_t *square)
+{
+    size_t i;
+
+    if (!json_is_array(square))
+        return false;
+    for (i = 0; i < json_array_size(square); i++)
+        if (!is_position(json_array_get(square, i)))
+            return false;
+    return true;
+}
+
+/* Boards go out as 64 four-bit piece codes, rank by rank. */
+static int
+put_board(struct gm_buf *buf, json_t *board)
+{
+    unsigned char packed[32];
+    json_t *rank;
+    int r;
+    int f;
+    int i;
+
+    memset(packed, 0x00, sizeof(packed));
+    for (r = 0; r < 8; r++) {
+        rank = json_array_get(board, r);
+        for (f = 0; f < 8; f++) {
+            i = r * 8 + f;
+            packed[i / 2] |= piece_code(json_array_get(rank, f))
+                << (i % 2 ? 0 : 4);
+        }
+    }
+    if (put_byte(buf, TAG_BOARD))
+        return -1;
+    return buf_append(buf, packed, sizeof(packed));
+}
+
+/* Access maps go out as, for each square, the number of squares with access
+ * to it followed by each of those squares as a single byte. */
+static int
+put_access_map(struct gm_buf *buf, json_t *map)
+{
+    json_t *rank;
+    json_t *square;
+    json_t *pos;
+    size_t r;
+    size_t f;
+    size_t i;
+
+    if (put_byte(buf, TAG_ACCESS_MAP))
+        return -1;
+    for (r = 0; r < 8; r++) {
+        rank = json_array_get(map, r);
+        for (f = 0; f < 8; f++) {
+            square = json_array_get(rank, f);
+            if (put_varint(buf, json_array_size(square)))
+                return -1;
+            for (i = 0; i < json_array_size(square); i++) {
+                pos = json_array_get(square, i);
+                if (put_byte(buf,
+                        json_integer_value(json_array_get(pos, 0)) * 8
+                        + json_integer_value(json_array_get(pos, 1))))
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* The index of a key in known_keys, plus one, as it goes on the wire. */
+static uint64_t
+key_code(const char *key)
+{
+    size_t i;
+
+    for (i = 0; i < N_KNOWN_KEYS; i++)
+        if (strcmp(key, known_keys[i]) == 0)
+            return i + 1;
+    return 0;
+}
+
+static int
+put_key(struct gm_buf *buf, const char *key)
+{
+    uint64_t code;
+
+    code = key_code(key);
+    if (code != 0)
+        return put_varint(buf, code);
+    if (put_varint(buf, 0))
+        return -1;
+    return put_string(buf, key, strlen(key));
+}
+
+int
+wire_encode(
+    struct gm_buf *buf,
+    json_t *val,
+    const struct deferred_states *states)
+{
+    const struct deferred_state *state;
+    const char *key;
+    json_t *t;
+    size_t i;
+    uint64_t u;
+    json_int_t n;
+    double d;
+    unsigned char bytes[8];
+
+    switch (json_typeof(val)) {
+    case JSON_NULL:
+        return put_byte(buf, TAG_NULL);
+    case JSON_FALSE:
+        return put_byte(buf, TAG_FALSE);
+    case JSON_TRUE:
+        return put_byte(buf, TAG_TRUE);
+    case JSON_INTEGER:
+        /* zigzag, so that small negative numbers stay small */
+        n = json_integer_value(val);
+        u = n < 0 ? ~((uint64_t) n << 1) : (uint64_t) n << 1;
+        if (put_byte(buf, TAG_INTEGER))
+            return -1;
+        return put_varint(buf, u);
+    case JSON_REAL:
+        d = json_real_value(val);
+        memcpy(&u, &d, sizeof(u));
+        for (i = 0; i < 8; i++)
+            bytes[i] = u >> (56 - 8 * i);
+        if (put_byte(buf, TAG_REAL))
+            return -1;
+        return buf_append(buf, bytes, sizeof(bytes));
+    case JSON_STRING:
+        if (put_byte(buf, TAG_STRING))
+            return -1;
+        return put_string(
+            buf, json_string_value(val), json_string_length(val));
+    case JSON_ARRAY:
+        if (is_grid(val, is_piece))
+            return put_board(buf, val);
+        if (is_grid(val, is_accessors))
+            return put_access_map(buf, val);
+        if (put_byte(buf, TAG_ARRAY) || put_varint(buf, json_array_size(val)))
+            return -1;
+        json_array_foreach(val, i, t) {
+            if (wire_encode(buf, t, states))
+                return -1;
+        }
+        return 0;
+    case JSON_OBJECT:
+        state = find_deferred_state(states, val);
+        if (state != NULL)
+            return write_deferred_state(buf, state, true);
+        if (put_byte(buf, TAG_OBJECT)
+                || put_varint(buf, json_object_size(val)))
+            return -1;
+        json_object_foreach(val, key, t) {
+            if (put_key(buf, key) || wire_encode(buf, t, states))
+                return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static int
+buf_sink(const char *data, size_t len, void *arg)
+{
+    return buf_append(arg, data, len);
+}
+
+static void
+write_value(
+    struct json_writer *w,
+    json_t *val,
+    const struct deferred_states *states)
+{
+    const struct deferred_state *state;
+    const char *key;
+    json_t *t;
+    size_t i;
+
+    switch (json_typeof(val)) {
+    case JSON_NULL:
+        jw_null(w);
+        break;
+    case JSON_FALSE:
+        jw_bool(w, false);
+        break;
+    case JSON_TRUE:
+        jw_bool(w, true);
+        break;
+    case JSON_INTEGER:
+        jw_integer(w, json_integer_value(val));
+        break;
+    case JSON_REAL:
+        jw_real(w, json_real_value(val));
+        break;
+    case JSON_STRING:
+        jw_stringn(w, json_string_value(val), json_string_length(val));
+        break;
+    case JSON_ARRAY:
+        jw_begin_array(w);
+        json_array_foreach(val, i, t) {
+            write_value(w, t, states);
+        }
+        jw_end_array(w);
+        break;
+    case JSON_OBJECT:
+        state = find_deferred_state(states, val);
+        if (state != NULL) {
+            /* an empty raw value puts in the comma the state needs, after
+             * which the state can go straight into the buffer. */
+            jw_raw(w, "", 0);
+            if (w->err == 0 && write_deferred_state(w->arg, state, false))
+                w->err = -1;
+            break;
+        }
+        jw_begin_object(w);
+        json_object_foreach(val, key, t) {
+            jw_key(w, key);
+            write_value(w, t, states);
+        }
+        jw_end_object(w);
+        break;
+    }
+}
+
+int
+json_encode(
+    struct gm_buf *buf,
+    json_t *val,
+    const struct deferred_states *states)
+{
+    struct json_writer w;
+
+    jw_init(&w, buf_sink, buf);
+    write_value(&w, val, states);
+    return w.err;
+}
+
+int
+state_write_json(
+    struct gm_buf *buf,
+    const struct state_node *node,
+    unsigned int fields,
+    termination_t termination)
+{
+    struct json_writer w;
+    const struct move *move;
+
+    move = node->move;
+    jw_init(&w, buf_sink, buf);
+    jw_begin_object(&w);
+    /* the board only knows how the game could end from here; the game knows
+     * whether a player has chosen to end it. */
+    board_write_fields(move->post_board, fields & ~FIELD_TERMINATION, &w);
+    if (fields & FIELD_TERMINATION) {
+        jw_key(&w, "termination");
+        jw_string(&w, termination_str(termination));
+    }
+    if (fields & FIELD_LAST_MOVE) {
+        jw_key(&w, "last_move");
+        jw_string(&w, move->algebraic);
+    }
+    jw_end_object(&w);
+    return w.err;
+}
+
+static int
+put_int_member(struct gm_buf *buf, const char *key, json_int_t n)
+{
+    uint64_t u;
+
+    u = n < 0 ? ~((uint64_t) n << 1) : (uint64_t) n << 1;
+    if (put_varint(buf, key_code(key)) || put_byte(buf, TAG_INTEGER))
+        return -1;
+    return put_varint(buf, u);
+}
+
+static int
+put_string_member(struct gm_buf *buf, const char *key, const char *str)
+{
+    if (put_varint(buf, key_code(key)))
+        return -1;
+    if (str == NULL)
+        return put_byte(buf, TAG_NULL);
+    if (put_byte(buf, TAG_STRING))
+        return -1;
+    return put_string(buf, str, strlen(str));
+}
+
+static int
+put_board_squares(struct gm_buf *buf, const struct board *board)
+{
+    unsigned char packed[32];
+    const struct piece *p;
+    const char *type;
+    int code;
+    int i;
+
+    memset(packed, 0x00, sizeof(packed));
+    for (i = 0; i < 64; i++) {
+        p = &board->board[i / 8][i % 8];
+        if (p->piece_type == 0)
+            continue;
+        type = strchr(piece_codes, (char) p->piece_type);
+        if (type == NULL)
+            return -1;
+        code = (type - piece_codes + 1) | (p->color == BLACK ? 0x8 : 0);
+        packed[i / 2] |= code << (i % 2 ? 0 : 4);
+    }
+    if (put_byte(buf, TAG_BOARD))
+        return -1;
+    return buf_append(buf, packed, sizeof(packed));
+}
+
+static int
+put_board_access_map(struct gm_buf *buf, const struct access_map *map)
+{
+    const struct position *a;
+    int n;
+    int i;
+    int j;
+
+    if (put_byte(buf, TAG_ACCESS_MAP))
+        return -1;
+    for (i = 0; i < 64; i++) {
+        n = map->board[i / 8][i % 8].n_accessors;
+        if (put_varint(buf, n))
+            return -1;
+        for (j = 0; j < n; j++) {
+            a = &map->board[i / 8][i % 8].accessors[j];
+            if (put_byte(buf, a->rank * 8 + a->file))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int
+wire_write_state(
+    struct gm_buf *buf,
+    const struct state_node *node,
+    unsigned int fields,
+    termination_t termination)
+{
+    const struct move *move;
+    const struct board *b;
+    unsigned int f;
+    int n_members;
+
+    move = node->move;
+    b = move->post_board;
+    n_members = 0;
+    for (f = fields; f != 0; f &= f - 1)
+        n_members++;
+    if (put_byte(buf, TAG_OBJECT) || put_varint(buf, n_members))
+        return -1;
+
+    /* members go out in the same order as they do in JSON */
+    if (fields & FIELD_BOARD) {
+        if (put_varint(buf, key_code("board")) || put_board_squares(buf, b))
+            return -1;
+    }
+    if (fields & FIELD_AVAILABLE_CASTLES
+            && put_int_member(buf, "available_castles", b->available_castles))
+        return -1;
+    if (fields & FIELD_PASSANT_FILE
+            && put_int_member(buf, "passant_file", b->passant_file))
+        return -1;
+    if (fields & FIELD_ACCESS_MAP) {
+        if (put_varint(buf, key_code("access_map"))
+                || put_board_access_map(buf, b->access_map))
+            return -1;
+    }
+    if (fields & FIELD_PLY_INDEX
+            && put_int_member(buf, "ply_index", b->ply_index))
+        return -1;
+    if (fields & FIELD_PGN && put_string_member(buf, "pgn", b->pgn))
+        return -1;
+    if (fields & FIELD_FEN && put_string_member(buf, "fen", b->fen))
+        return -1;
+    if (fields & FIELD_TERMINATION && put_string_member(
+            buf, "termination", termination_str(termination)))
+        return -1;
+    if (fields & FIELD_DRAWS && put_int_member(buf, "draws", b->draws))
+        return -1;
+    if (fields & FIELD_IN_CHECK) {
+        if (put_varint(buf, key_code("in_check"))
+                || put_byte(buf, b->in_check ? TAG_TRUE : TAG_FALSE))
+            return -1;
+    }
+    if (fields & FIELD_LAST_MOVE
+            && put_string_member(buf, "last_move", move->algebraic))
+        return -1;
+    return 0;
+}
+
+static int
+get_byte(struct reader *r, unsigned char *b)
+{
+    if (r->off >= r->len)
+        return -1;
+    *b = r->data[r->off++];
+    return 0;
+}
+
+static int
+get_varint(struct reader *r, uint64_t *v)
+{
+    unsigned char b;
+    int shift;
+
+    *v = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        if (get_byte(r, &b))
+            return -1;
+        /* only the lowest bit of the tenth byte fits in 64 bits */
+        if (shift == 63 && b > 1)
+            return -1;
+        *v |= (uint64_t) (b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+/* Read a length and make sure that many bytes (or, for arrays and objects,
+ * at least that many elements' worth of bytes) are left in the message. */
+static int
+get_length(struct reader *r, size_t *len)
+{
+    uint64_t v;
+
+    if (get_varint(r, &v) || v > r->len - r->off)
+        return -1;
+    *len = v;
+    return 0;
+}
+
+static json_t *
+get_board(struct reader *r)
+{
+    json_t *board;
+    json_t *rank;
+    json_t *square;
+    char name[3];
+    int code;
+    int rk;
+    int f;
+    int i;
+
+    if (r->len - r->off < 32)
+        return NULL;
+    board = json_array();
+    for (rk = 0; rk < 8; rk++) {
+        rank = json_array();
+        for (f = 0; f < 8; f++) {
+            i = rk * 8 + f;
+            code = (r->data[r->off + i / 2] >> (i % 2 ? 0 : 4)) & 0xF;
+            if (code == 0) {
+                square = json_null();
+            } else if ((code & 0x7) == 0 || (code & 0x7) > 6) {
+                json_decref(rank);
+                json_decref(board);
+                return NULL;
+            } else {
+                name[0] = code & 0x8 ? 'b' : 'w';
+                name[1] = piece_codes[(code & 0x7) - 1];
+                name[2] = '\0';
+                square = json_string(name);
+            }
+            json_array_append_new(rank, square);
+        }
+        json_array_append_new(board, rank);
+    }
+    r->off += 32;
+    return board;
+}
+
+static json_t *
+get_access_map(struct reader *r)
+{
+    json_t *map;
+    json_t *rank;
+    json_t *square;
+    size_t n;
+    size_t i;
+    int rk;
+    int f;
+
+    map = json_array();
+    for (rk = 0; rk < 8; rk++) {
+        rank = json_array();
+        json_array_append_new(map, rank);
+        for (f = 0; f < 8; f++) {
+            if (get_length(r, &n))
+                goto fail;
+            square = json_array();
+            json_array_append_new(rank, square);
+            for (i = 0; i < n; i++) {
+                if (r->data[r->off] >= 64)
+                    goto fail;
+                json_array_append_new(square, json_pack(
+                    "[ii]", r->data[r->off] / 8, r->data[r->off] % 8));
+                r->off++;
+            }
+        }
+    }
+    return map;
+
+fail:
+    json_decref(map);
+    return NULL;
+}
+
+static json_t *
+get_value(struct reader *r, int depth);
+
+static json_t *
+get_object(struct reader *r, int depth)
+{
+    json_t *obj;
+    json_t *val;
+    uint64_t key_code;
+    size_t n;
+    size_t len;
+    size_t i;
+    char key[256];
+
+    if (get_length(r, &n))
+        return NULL;
+    obj = json_object();
+    for (i = 0; i < n; i++) {
+        if (get_varint(r, &key_code))
+            goto fail;
+        if (key_code > N_KNOWN_KEYS)
+            goto fail;
+        if (key_code == 0) {
+            if (get_length(r, &len) || len >= sizeof(key))
+                goto fail;
+            memcpy(key, r->data + r->off, len);
+            key[len] = '\0';
+            r->off += len;
+        } else {
+            strcpy(key, known_keys[key_code - 1]);
+        }
+        val = get_value(r, depth + 1);
+        if (val == NULL || json_object_set_new(obj, key, val))
+            goto fail;
+    }
+    return obj;
+
+fail:
+    json_decref(obj);
+    return NULL;
+}
+
+static json_t *
+get_value(struct reader *r, int depth)
+{
+    unsigned char tag;
+    json_t *res;
+    json_t *t;
+    uint64_t u;
+    double d;
+    size_t n;
+    size_t i;
+
+    if (depth > MAX_DEPTH || get_byte(r, &tag))
+        return NULL;
+
+    switch (tag) {
+    case TAG_NULL:
+        return json_null();
+    case TAG_FALSE:
+        return json_false();
+    case TAG_TRUE:
+        return json_true();
+    case TAG_INTEGER:
+        if (get_varint(r, &u))
+            return NULL;
+        return json_integer((json_int_t) (u & 1 ? ~(u >> 1) : u >> 1));
+    case TAG_REAL:
+        if (r->len - r->off < 8)
+            return NULL;
+        u = 0;
+        for (i = 0; i < 8; i++)
+            u = u << 8 | r->data[r->off++];
+        memcpy(&d, &u, sizeof(d));
+        return json_real(d);
+    case TAG_STRING:
+        if (get_length(r, &n))
+            return NULL;
+        res = json_stringn((const char *) r->data + r->off, n);
+        r->off += n;
+        return res;
+    case TAG_ARRAY:
+        if (get_length(r, &n))
+            return NULL;
+        res = json_array();
+        for (i = 0; i < n; i++) {
+            t = get_value(r, depth + 1);
+            if (t == NULL) {
+                json_decref(res);
+                return NULL;
+            }
+            json_array_append_new(res, t);
+        }
+        return res;
+    case TAG_OBJECT:
+        return get_object(r, depth);
+    case TAG_BOARD:
+        return get_board(r);
+    case TAG_ACCESS_MAP:
+        return get_access_map(r);
+    }
+    return NULL;
+}
+
+json_t *
+wire_decode(const char *data, size_t len)
+{
+    struct reader r;
+    json_t *res;
+
+    r.data = (const unsigned char *) data;
+    r.len = len;
+    r.off = 0;
+    res = get_value(&r, 0);
+    if (res != NULL && r.off != len) {
+        json_decref(res);
+        return NULL;
+    }
+    return res;
+}
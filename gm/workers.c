@@ -0,0 +1,271 @@
+/*
+ * workers.c: thread pool that carries out requests for the event loop
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <grandmaster/gmutil.h>
+#include <grandmaster/tree.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct game_tree *pool_gt = NULL;
+static struct gm_log *pool_log = NULL;
+static int pool_wake_fd = -1;
+
+static pthread_t *threads = NULL;
+static int n_threads = 0;
+static bool shutting_down = false;
+
+/* jobs waiting for a worker, oldest first */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct gm_job *queue_head = NULL;
+static struct gm_job *queue_tail = NULL;
+
+/* jobs that are done and waiting for the event loop to pick them up */
+static pthread_mutex_t finished_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gm_job *finished = NULL;
+
+/* How many JSON allocations requests made. Each worker keeps its own counts
+ * and adds them to these when it exits. */
+struct alloc_counts {
+    uint64_t requests;
+    struct gm_arena_stats total;
+    /* the most any single request made */
+    struct gm_arena_stats max;
+    /* requests that didn't fit in their worker's first arena chunk */
+    uint64_t spilled;
+};
+static pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct alloc_counts counts;
+
+static void
+count_allocs(struct alloc_counts *c, const struct gm_arena_stats *stats)
+{
+    c->requests++;
+    c->total.allocs += stats->allocs;
+    c->total.bytes += stats->bytes;
+    c->total.chunks += stats->chunks;
+    if (stats->allocs > c->max.allocs)
+        c->max.allocs = stats->allocs;
+    if (stats->bytes > c->max.bytes)
+        c->max.bytes = stats->bytes;
+    if (stats->chunks > c->max.chunks)
+        c->max.chunks = stats->chunks;
+    if (stats->chunks > 0)
+        c->spilled++;
+}
+
+static void
+merge_counts(const struct alloc_counts *c)
+{
+    pthread_mutex_lock(&counts_lock);
+    counts.requests += c->requests;
+    counts.total.allocs += c->total.allocs;
+    counts.total.bytes += c->total.bytes;
+    counts.total.chunks += c->total.chunks;
+    if (c->max.allocs > counts.max.allocs)
+        counts.max.allocs = c->max.allocs;
+    if (c->max.bytes > counts.max.bytes)
+        counts.max.bytes = c->max.bytes;
+    if (c->max.chunks > counts.max.chunks)
+        counts.max.chunks = c->max.chunks;
+    counts.spilled += c->spilled;
+    pthread_mutex_unlock(&counts_lock);
+}
+
+static void
+report_counts(void)
+{
+    if (counts.requests == 0)
+        return;
+    printf("I: %" PRIu64 " requests made %.1f JSON allocations (%.0f bytes) "
+           "each on average, and at most %zu (%zu bytes)\n",
+           counts.requests,
+           (double) counts.total.allocs / counts.requests,
+           (double) counts.total.bytes / counts.requests,
+           counts.max.allocs, counts.max.bytes);
+    printf("I: %" PRIu64 " requests needed more than one arena chunk\n",
+           counts.spilled);
+}
+
+static void
+complete_job(struct gm_job *job)
+{
+    uint64_t one;
+
+    pthread_mutex_lock(&finished_lock);
+    job->next = finished;
+    finished = job;
+    pthread_mutex_unlock(&finished_lock);
+
+    /* the eventfd counter saturates rather than blocks long before the event
+     * loop could fall that far behind, so a failed write here only means the
+     * loop already has a wakeup pending. */
+    one = 1;
+    if (write(pool_wake_fd, &one, sizeof(one)) != sizeof(one))
+        return;
+}
+
+static void *
+worker(void *arg)
+{
+    struct gm_job *job;
+    struct gm_arena arena;
+    struct alloc_counts local;
+    bool have_arena;
+
+    (void) arg;
+    memset(&local, 0x00, sizeof(struct alloc_counts));
+    have_arena = arena_init(&arena) == 0;
+    if (!have_arena)
+        fprintf(stderr, "W: couldn't allocate arena for worker\n");
+
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL && !shutting_down)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (queue_head == NULL) {
+            pthread_mutex_unlock(&queue_lock);
+            if (have_arena)
+                arena_free(&arena);
+            merge_counts(&local);
+            return NULL;
+        }
+        job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        job->next = NULL;
+        if (have_arena)
+            arena_begin(&arena);
+        execute_request(pool_gt, pool_log, job);
+        /* the response has been encoded by now, so none of the JSON values
+         * made for the request are still around. */
+        if (have_arena) {
+            count_allocs(&local, &arena.stats);
+            arena_reset(&arena);
+        }
+        complete_job(job);
+    }
+}
+
+int
+start_workers(
+    struct game_tree *gt,
+    struct gm_log *log,
+    int n_workers,
+    int wake_fd)
+{
+    int i;
+    int err;
+
+    pool_gt = gt;
+    pool_log = log;
+    pool_wake_fd = wake_fd;
+    shutting_down = false;
+
+    threads = calloc(n_workers, sizeof(pthread_t));
+    if (threads == NULL)
+        return -1;
+    for (i = 0; i < n_workers; i++) {
+        err = pthread_create(&threads[i], NULL, worker, NULL);
+        if (err) {
+            fprintf(stderr, "E: couldn't start worker: %s\n", strerror(err));
+            n_threads = i;
+            stop_workers();
+            return -1;
+        }
+    }
+    n_threads = n_workers;
+    return 0;
+}
+
+void
+stop_workers(void)
+{
+    int i;
+    struct gm_job *job;
+    struct gm_job *next;
+
+    pthread_mutex_lock(&queue_lock);
+    shutting_down = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    report_counts();
+    threads = NULL;
+    n_threads = 0;
+
+    /* nobody is left to deliver these */
+    while ((job = take_finished_jobs()) != NULL) {
+        while (job != NULL) {
+            next = job->next;
+            free_job(job);
+            job = next;
+        }
+    }
+}
+
+void
+submit_job(struct gm_job *job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail == NULL)
+        queue_head = job;
+    else
+        queue_tail->next = job;
+    queue_tail = job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+struct gm_job *
+take_finished_jobs(void)
+{
+    struct gm_job *res;
+
+    pthread_mutex_lock(&finished_lock);
+    res = finished;
+    finished = NULL;
+    pthread_mutex_unlock(&finished_lock);
+    return res;
+}
+
+void
+free_job(struct gm_job *job)
+{
+    if (job->req != NULL)
+        json_decref(job->req);
+    free(job->req_msg);
+    free(job->resp_msg);
+    if (job->updates != &job->one_update)
+        free(job->updates);
+    free(job);
+}
@@ -22,10 +22,17 @@
 
 #include <jansson.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define NO_PASSANT (-1)
 
+/* The starting position, in FEN. */
+#define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+/* The longest canonical SAN there is, like "Qa1xe5+" or "exd8=Q#". */
+#define MAX_SAN_LEN 7
+
 typedef enum {
     PAWN = 'p',
     ROOK = 'R',
@@ -82,6 +89,93 @@ typedef enum {
     DRAW_THREEFOLD = 0x02,
 } draws_t;
 
+/* The fields of a board's JSON representation, for choosing which of them
+ * board_fields_to_json includes. */
+typedef enum {
+    FIELD_BOARD = 0x001,
+    FIELD_AVAILABLE_CASTLES = 0x002,
+    FIELD_PASSANT_FILE = 0x004,
+    FIELD_ACCESS_MAP = 0x008,
+    FIELD_PLY_INDEX = 0x010,
+    FIELD_PGN = 0x020,
+    FIELD_FEN = 0x040,
+    FIELD_TERMINATION = 0x080,
+    FIELD_DRAWS = 0x100,
+    FIELD_IN_CHECK = 0x200,
+} board_field_t;
+
+#define ALL_BOARD_FIELDS 0x3FF
+
+/* Where a json_writer sends its output. Returns 0 on success or -1 on
+ * error. */
+typedef int (*json_sink_t)(const char *data, size_t len, void *arg);
+
+/* Writes JSON text straight to a sink as it's produced, instead of building a
+ * tree of json_t values and dumping it. The writer only keeps track of where
+ * commas go; callers are responsible for nesting things properly. Once the
+ * sink fails, nothing more is written and err is set. */
+struct json_writer {
+    json_sink_t sink;
+    void *arg;
+    /* whether the next value follows another one in the same array or
+     * object */
+    bool need_comma;
+    int err;
+};
+
+/* The kinds of token that PGN text is made of. */
+typedef enum {
+    /* the text has run out */
+    PGN_TOKEN_END = 0,
+    /* a tag pair, like [Event "F/S Return Match"] */
+    PGN_TOKEN_TAG,
+    /* a move number, like "12." or "12..." */
+    PGN_TOKEN_MOVE_NUMBER,
+    /* a move in standard algebraic notation, like "Nxe5+" */
+    PGN_TOKEN_SAN,
+    /* a game result: "1-0", "0-1", "1/2-1/2" or "*" */
+    PGN_TOKEN_RESULT,
+    /* a comment, either in braces or from a semicolon to the end of the
+     * line */
+    PGN_TOKEN_COMMENT,
+    /* a numeric annotation glyph, like "$14", or a suffix annotation like
+     * "!?" */
+    PGN_TOKEN_NAG,
+    /* the parentheses around a recursive annotation variation */
+    PGN_TOKEN_VARIATION_START,
+    PGN_TOKEN_VARIATION_END,
+    /* something that can't be a token, like an unterminated comment */
+    PGN_TOKEN_ERROR,
+} pgn_token_type_t;
+
+/* A token of PGN text. Tokens point into the text they were read from, which
+ * has to outlive them; nothing is copied. */
+struct pgn_token {
+    pgn_token_type_t type;
+    /* the whole token, as it appears in the text */
+    const char *text;
+    size_t len;
+    /* for tags, the tag name */
+    const char *name;
+    size_t name_len;
+    /* for tags, the value between the quotes, with any escapes left in; for
+     * comments, the text of the comment without its delimiters */
+    const char *value;
+    size_t value_len;
+    /* for move numbers, the number, and for NAGs, the glyph's number; suffix
+     * annotations are given the number of the glyph they stand for. */
+    int number;
+};
+
+/* Reads PGN text a token at a time. The text doesn't need to be
+ * NUL-terminated. */
+struct pgn_lexer {
+    const char *pgn;
+    size_t len;
+    /* the offset of the next token in the text */
+    size_t pos;
+};
+
 struct piece {
     piece_type_t piece_type;
     color_t color;
@@ -92,6 +186,26 @@ struct position {
     int8_t file;
 };
 
+/* A move in standard algebraic notation, broken into its parts. */
+struct san {
+    /* the piece that moves; castling is a king move */
+    piece_type_t piece;
+    /* the square the piece moves from, with -1 for the rank, the file or
+     * both where the notation leaves them out */
+    struct position start;
+    struct position end;
+    /* for castles, WHITE_KINGSIDE or WHITE_QUEENSIDE, whoever castles, and
+     * 0 for any other move; castles leave start and end unset */
+    castles_t castle;
+    bool capture;
+    /* the piece a pawn is promoted to, or 0 */
+    piece_type_t promotion;
+    /* '+' or '#' if the notation marks the move as check or mate */
+    char check;
+    /* the length of the notation without any suffix annotation */
+    size_t len;
+};
+
 struct move {
     struct position start;
     struct position end;
@@ -109,6 +223,35 @@ struct access_map {
     } board[8][8];
 };
 
+/* A move that can be made from a position. */
+struct legal_move {
+    struct position start;
+    struct position end;
+    /* the piece a pawn is promoted to, or 0 */
+    piece_type_t promotion;
+    /* the piece that moves */
+    piece_type_t piece;
+    /* the move's canonical SAN, less the check or mate marker, which can't
+     * be known without making the move */
+    char san[MAX_SAN_LEN + 1];
+    /* the marker, once the move has been made to find out: '+' or '#', or
+     * ' ' if it's neither, and '\0' until then */
+    char marker;
+};
+
+/* Every move that can be made from a position, with two hash tables of
+ * indexes into the list, one by SAN and one by squares, so that a move can be
+ * found without searching the board for the piece that makes it. */
+struct legal_moves {
+    size_t n;
+    struct legal_move *moves;
+    /* both tables have mask + 1 slots, which are NO_LEGAL_MOVE if empty */
+    size_t mask;
+    uint8_t *by_san;
+    uint8_t *by_squares;
+};
+#define NO_LEGAL_MOVE 0xFF
+
 struct board {
     struct piece board[8][8];
     struct access_map *access_map;
@@ -152,6 +295,56 @@ parse_algebraic(
     struct move *last_move,
     struct move **out);
 
+/* Like parse_algebraic, for notation that isn't NUL-terminated. */
+void
+parse_algebraic_len(
+    const char *notation,
+    size_t len,
+    struct move *last_move,
+    struct move **out);
+
+/* Make a move given in coordinate notation, like "e2e4", "e1g1" for a castle
+ * or "e7e8q" for a promotion. The move is given its canonical SAN. **out is
+ * set to null if the input was not a valid move. */
+void
+parse_coordinates(
+    const char *notation,
+    size_t len,
+    struct move *last_move,
+    struct move **out);
+
+/* Make the move from start to end, like parse_coordinates does. */
+void
+move_from_squares(
+    struct position start,
+    struct position end,
+    piece_type_t promotion,
+    struct move *last_move,
+    struct move **out);
+
+/* Read the squares of coordinate notation, without looking at the board.
+ * *promotion is set to 0 if the notation has no promotion. Returns false if
+ * the notation isn't well formed. */
+bool
+read_coordinates(
+    const char *notation,
+    size_t len,
+    struct position *start,
+    struct position *end,
+    piece_type_t *promotion);
+
+/* The canonical SAN for a move, with as much disambiguation as it needs and
+ * no more, worked out from the access map of the board it was made on. The
+ * move's post_board must be complete, in_check and termination included. */
+char *
+move_to_san(const struct move *move);
+
+/* Read standard algebraic notation, without looking at the board. Returns
+ * false if the notation isn't well formed; whether the move can be made is
+ * up to the caller to find out. */
+bool
+parse_san(const char *notation, size_t len, struct san *san);
+
 /* Returns true if the movement in the move struct represents a valid movement
  * for the piece that moved. Moves passed into this function must have their
  * post_board correctly filled out. */
@@ -170,6 +363,31 @@ in_check(struct move *move, color_t player);
 bool
 in_stalemate(struct move *move, color_t player);
 
+/* Lists the moves that can be made after the given move, which has to have
+ * its access map. Returns NULL if memory runs out. */
+struct legal_moves *
+find_legal_moves(const struct move *move);
+
+/* Find a move in a list of legal moves by its SAN, which needn't be
+ * canonical. Returns NULL if the notation isn't a legal move. */
+const struct legal_move *
+legal_move_by_san(
+    const struct legal_moves *legal,
+    const char *notation,
+    size_t len);
+
+/* Find a move in a list of legal moves by its squares. Returns NULL if no
+ * legal move goes from start to end with the given promotion. */
+const struct legal_move *
+legal_move_by_squares(
+    const struct legal_moves *legal,
+    struct position start,
+    struct position end,
+    piece_type_t promotion);
+
+void
+free_legal_moves(struct legal_moves *legal);
+
 /* Finds all pieces of the given color and type that has access to move->end,
  * respecting any preexisting values in move->start. Returns a list of positions
  * where accessible pieces are located. */
@@ -213,10 +431,86 @@ move_to_json(const struct move *);
 json_t *
 board_to_json(const struct board *board);
 
+/* Convert a board to JSON, including only the fields in the given bitset of
+ * board_field_t values. */
+json_t *
+board_fields_to_json(const struct board *board, unsigned int fields);
+
+/* Write the fields of a board in the given bitset of board_field_t values as
+ * members of the object the writer is in the middle of. The output matches
+ * board_fields_to_json. */
+void
+board_write_fields(
+    const struct board *board,
+    unsigned int fields,
+    struct json_writer *w);
+
+void
+jw_init(struct json_writer *w, json_sink_t sink, void *arg);
+
+void
+jw_begin_object(struct json_writer *w);
+
+void
+jw_end_object(struct json_writer *w);
+
+void
+jw_begin_array(struct json_writer *w);
+
+void
+jw_end_array(struct json_writer *w);
+
+/* Write the key of the next member of an object; the member's value must be
+ * written next. */
+void
+jw_key(struct json_writer *w, const char *key);
+
+/* Write a NUL-terminated string, or null if str is NULL. */
+void
+jw_string(struct json_writer *w, const char *str);
+
+void
+jw_stringn(struct json_writer *w, const char *str, size_t len);
+
+void
+jw_integer(struct json_writer *w, json_int_t val);
+
+void
+jw_real(struct json_writer *w, double val);
+
+void
+jw_bool(struct json_writer *w, bool val);
+
+void
+jw_null(struct json_writer *w);
+
+/* Write a value that is already encoded as JSON. */
+void
+jw_raw(struct json_writer *w, const char *json, size_t len);
+
 /* Convert a move to FEN. */
 char *
 move_to_fen(const struct move *);
 
+/* Parse a position in FEN into a move with no parent, as though the position
+ * had just come up in a game: the board is complete, check, termination and
+ * draws included, and the PGN is empty. The halfmove clock and the fullmove
+ * number may be given as "-" or left out. Returns NULL if the FEN isn't well
+ * formed; a well-formed FEN can still be an illegal position, which
+ * illegal_position finds out. */
+struct move *
+parse_fen(const char *fen, size_t n);
+
+/* Free a move struct, leaving its parent move untouched. */
+void
+free_move(struct move *move);
+
+/* Returns NULL if the position after the given move could come up in a
+ * game, or a description of why it couldn't if not. Only the position itself
+ * is looked at, not whether some line of play could lead to it. */
+const char *
+illegal_position(struct move *move);
+
 /* String representation for a termination state. */
 char *
 termination_str(termination_t term);
@@ -225,4 +519,25 @@ termination_str(termination_t term);
 termination_t
 termination_from_str(const char *);
 
+/* Start reading tokens from the given PGN text. */
+void
+pgn_lexer_init(struct pgn_lexer *lex, const char *pgn, size_t len);
+
+/* Read the next token, returning its type. At the end of the text, returns
+ * PGN_TOKEN_END, and keeps returning it. On PGN_TOKEN_ERROR, the lexer stays
+ * where it was, at the start of the bad token. */
+pgn_token_type_t
+pgn_next_token(struct pgn_lexer *lex, struct pgn_token *tok);
+
+/* Look for a tag with the given name in the tag section at the start of a
+ * game. If there is one, sets *value and *value_len to its value, as it
+ * appears in the text, and returns true. */
+bool
+pgn_find_tag(
+    const char *pgn,
+    size_t len,
+    const char *name,
+    const char **value,
+    size_t *value_len);
+
 #endif
@@ -17,37 +17,686 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#ifndef __GRANDMASTER_GMUTIL_H__
+#define __GRANDMASTER_GMUTIL_H__
+
 #include <grandmaster/core.h>
 #include <grandmaster/tree.h>
 
 #include <jansson.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #define MAX_MSG_LEN 16384
 
+/* Size of the length header that precedes every message on the wire. */
+#define MSG_HEADER_LEN 4
+
+/* Once this many response bytes are waiting to be written to a connection, we
+ * stop reading new requests from it until the client catches up. */
+#define MAX_PENDING_OUT (1 << 20)
+
+/* Games are split into this many shards by ID. Requests against games in the
+ * same shard are carried out one at a time, in the order they arrive; requests
+ * that create games get a lane of their own. Requests in the barrier lane
+ * (batches, which can touch any game) wait for everything that arrived before
+ * them to finish, and nothing that arrives after them starts until they're
+ * done. */
+#define GAME_SHARDS 64
+#define CREATION_LANE GAME_SHARDS
+#define N_LANES (GAME_SHARDS + 1)
+#define BARRIER_LANE N_LANES
+/* Subscriptions and parked waits live on the event loop thread, so subscribe
+ * and wait_for_move requests are carried out there rather than by a worker.
+ * They don't wait for any lane, but like everything else they wait for
+ * batches, which can add games and drop them again. */
+#define LOOP_LANE (-2)
+
+/* The last move played in a game, as a field of a game state alongside the
+ * board_field_t fields. It's not a property of the board, so it has to come
+ * from the node. */
+#define FIELD_LAST_MOVE 0x400
+
+/* The fields of the game state that are sent unless the request asks for
+ * others. The rest are much bigger and rarely wanted. */
+#define SLIM_FIELDS \
+    (FIELD_FEN | FIELD_TERMINATION | FIELD_DRAWS | FIELD_LAST_MOVE)
+
+/* The most requests from a single connection that may be waiting on workers
+ * at once. */
+#define MAX_IN_FLIGHT 1024
+
 struct aol_tx {
     FILE *f;
     char *path;
 };
 
+/* A growable byte buffer. Data lives in data[0, len); cap is the allocated
+ * size of data. */
+struct gm_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/* A game state that a response leaves out until the response is encoded,
+ * which lets the encoders take it from the state cache in whichever encoding
+ * they need. The response holds an empty object, "slot", in its place; the
+ * list keeps a reference to it, so that nothing else can be allocated at
+ * the same address while the list is around. */
+struct deferred_state {
+    json_t *slot;
+    struct state_node *node;
+    unsigned int fields;
+    termination_t termination;
+};
+
+/* The states a response is waiting on. */
+struct deferred_states {
+    struct deferred_state *states;
+    size_t n;
+    size_t cap;
+};
+
+/* The append-only log that successful requests are recorded in, one
+ * NUL-terminated record per request. Normally records are written to the file
+ * by whoever appends them; if "deferred" is set they're collected in
+ * "pending" instead, for the event loop to write out in batches. */
+struct gm_log {
+    FILE *f;
+    bool deferred;
+    pthread_mutex_t lock;
+    struct gm_buf pending;
+    /* the total length of all the records ever appended */
+    uint64_t appended;
+};
+
+/* A run of bytes inside a message, used instead of a copy of them. Slices
+ * aren't NUL-terminated. */
+struct gm_slice {
+    const char *data;
+    size_t len;
+};
+
+/* The kinds of request that can be read into a struct gm_request. */
+typedef enum {
+    REQ_NEW_GAME,
+    REQ_GAME_FROM_PGN,
+    REQ_GAME_FROM_FEN,
+    REQ_MOVE,
+    REQ_END_GAME,
+    REQ_GET_STATE,
+    REQ_LEGAL_MOVES
+} request_kind_t;
+
+/* Bits of struct gm_request's "present", for the members the request had. */
+#define REQ_GAME_ID 0x01
+#define REQ_PLAYER 0x02
+#define REQ_PLAYER_WHITE 0x04
+#define REQ_PLAYER_BLACK 0x08
+#define REQ_MOVE_NOTATION 0x10
+#define REQ_PGN 0x20
+#define REQ_TERMINATION 0x40
+#define REQ_REQUEST_ID 0x80
+#define REQ_COORDINATES 0x100
+#define REQ_FEN 0x200
+
+/* A request against the game tree with its members pulled out. Strings are
+ * slices of the message the request was read from (or of the JSON value it
+ * was converted from), so the request is only good for as long as that
+ * is. */
+struct gm_request {
+    request_kind_t kind;
+    unsigned int present;
+    game_id_t game_id;
+    player_id_t player;
+    player_id_t player_white;
+    player_id_t player_black;
+    struct gm_slice move;
+    /* a move in coordinate notation, like "e2e4" */
+    struct gm_slice coordinates;
+    struct gm_slice pgn;
+    struct gm_slice fen;
+    struct gm_slice termination;
+    /* the request_id as it appeared in the message, as JSON */
+    struct gm_slice request_id;
+    /* the game state fields the request asked for */
+    unsigned int fields;
+    /* set if the request asked for a field that doesn't exist */
+    bool unknown_field;
+};
+
+/* Counts of the JSON allocations made while carrying out a request. */
+struct gm_arena_stats {
+    size_t allocs;
+    size_t bytes;
+    /* chunks that had to be allocated beyond the arena's first */
+    size_t chunks;
+};
+
+struct arena_chunk;
+
+/* Memory that JSON values are allocated from while a worker carries out a
+ * request. Allocations just bump a pointer and freeing them does nothing;
+ * everything is given back at once when the request is done. */
+struct gm_arena {
+    /* the chunk the arena always has, and the ones it took on since the last
+     * reset */
+    struct arena_chunk *base;
+    struct arena_chunk *extra;
+    /* the chunk that small allocations come out of, and how much of it is
+     * used */
+    struct arena_chunk *cur;
+    size_t used;
+    struct gm_arena_stats stats;
+};
+
+/* A game as a request left it, for pushing to the game's subscribers. */
+struct gm_update {
+    game_id_t game_id;
+    struct state_node *node;
+    termination_t termination;
+    /* the game's version once the request had changed it */
+    unsigned int version;
+};
+
+struct gm_conn;
+struct subscription;
+struct waiter;
+
+/* A request handed from the event loop to a worker, and the response once the
+ * worker is done with it. */
+struct gm_job {
+    struct gm_conn *conn;
+    /* the position of this request among the untagged requests on its
+     * connection; responses to untagged requests go out in this order. */
+    uint64_t seq;
+    /* whether the request carries a request_id, in which case its response
+     * goes out as soon as it's ready. */
+    bool tagged;
+    /* the lane this request is ordered in, or -1 if it can run at any time,
+     * or LOOP_LANE if the event loop carries it out */
+    int lane;
+    /* whether the response goes out in the binary encoding */
+    bool binary;
+    /* the parsed request, or NULL if it was decoded straight into "decoded",
+     * whose slices point into req_msg. */
+    json_t *req;
+    struct gm_request decoded;
+    /* the text of the request, or NULL if it arrived in the binary encoding;
+     * the log always gets JSON. */
+    char *req_msg;
+    size_t req_len;
+    char *resp_msg;
+    size_t resp_len;
+    /* the position in the log just past this request's record, or 0 if it
+     * wasn't logged; with a deferred log, the response is held back until
+     * the log has been written up to here. */
+    uint64_t log_end;
+    /* the games the request changed; points at one_update if it changed just
+     * one, which is all that requests other than batches can change. */
+    struct gm_update *updates;
+    size_t n_updates;
+    struct gm_update one_update;
+    struct gm_job *next;
+};
+
+/* A client connection being served by the event loop. Incoming bytes are
+ * accumulated in "in" until a full message has arrived; outgoing bytes are
+ * queued in "out" and written as the socket becomes writable, with out_sent
+ * tracking how much of "out" has made it onto the wire. Connections are only
+ * ever touched by the event loop thread; workers only see jobs. */
+struct gm_conn {
+    /* the connection's socket, or -1 if it has been closed while requests
+     * from it were still being worked on. */
+    int fd;
+    struct gm_buf in;
+    struct gm_buf out;
+    size_t out_sent;
+    /* the set of events the event loop is currently waiting on. */
+    unsigned int watched;
+    /* whether the client has opened a session, in which case the connection
+     * carries any number of requests instead of just one. */
+    bool session;
+    /* whether messages on this connection are in the binary encoding rather
+     * than JSON; clients ask for it when they start a session. */
+    bool binary;
+    /* set once the last request on this connection has been read; the
+     * connection is closed as soon as every response has been written. */
+    bool close_after_write;
+    /* the seq to give the next untagged request on this connection */
+    uint64_t next_seq;
+    /* the seq of the next untagged response to be written */
+    uint64_t next_send;
+    /* the number of requests from this connection that workers have yet to
+     * finish */
+    size_t in_flight;
+    /* finished untagged jobs waiting on the responses to earlier requests */
+    struct gm_job *waiting;
+    /* the games the client has subscribed to, and how many of those
+     * subscriptions have skipped updates because the client wasn't reading
+     * them fast enough. */
+    struct subscription *subs;
+    unsigned int subs_behind;
+    /* the connection's parked wait_for_move requests */
+    struct waiter *waiters;
+    /* set while the connection is in the list of connections that have had
+     * updates pushed to them since the event loop last looked. */
+    bool pushed;
+    struct gm_conn *next_pushed;
+};
+
+/* Connect to the gm server on this host. Returns the connected socket, or -1
+ * on error. */
+int
+connect_gm();
+
 /* Receive a length-encoded string on the given socket. */
 char *
 read_str(int sock, ssize_t max_len);
 
+/* Receive a length-encoded message on the given socket, setting *len to its
+ * length. The message is NUL-terminated for convenience, but may contain NULs
+ * of its own. */
+char *
+read_msg(int sock, ssize_t max_len, size_t *len);
+
 /* Send a length-encoded string on the given socket. Returns 0 on success or -1
  * on error.*/
 int
 send_str(int sock, char *str);
 
+/* Send a length-encoded message on the given socket. Returns 0 on success or
+ * -1 on error. */
+int
+send_msg(int sock, const char *msg, size_t len);
+
+/* Append a value in the binary encoding described in PROTOCOL to the buffer,
+ * filling in the states it's waiting on from the list, which may be NULL if
+ * it isn't waiting on any. Returns 0 on success or -1 on error. */
+int
+wire_encode(
+    struct gm_buf *buf,
+    json_t *val,
+    const struct deferred_states *states);
+
+/* Decode a value in the binary encoding. Returns NULL if the message isn't a
+ * well-formed value. */
 json_t *
-handle_new_game(struct game_tree *gt, json_t *req);
+wire_decode(const char *data, size_t len);
+
+/* Append a value to the buffer as compact JSON, filling in states in the same
+ * way. Returns 0 on success or -1 on error. */
+int
+json_encode(
+    struct gm_buf *buf,
+    json_t *val,
+    const struct deferred_states *states);
+
+/* Append the state of a node, with the given fields, in a game with the given
+ * termination, to the buffer as JSON. Returns 0 on success or -1 on error. */
+int
+state_write_json(
+    struct gm_buf *buf,
+    const struct state_node *node,
+    unsigned int fields,
+    termination_t termination);
 
+/* The same, in the binary encoding. */
+int
+wire_write_state(
+    struct gm_buf *buf,
+    const struct state_node *node,
+    unsigned int fields,
+    termination_t termination);
+
+/* Set aside up to max_bytes for the state cache, which keeps the encoded game
+ * states of recently used nodes so that they don't have to be rendered again
+ * for every response that includes them. A budget of 0 turns the cache off. */
+void
+state_cache_init(size_t max_bytes);
+
+/* A stand-in for the state of a node, with the given fields, in a game with
+ * the given termination, which is added to the list of states the response
+ * is waiting on. Returns the empty object to put in the response where the
+ * state goes, or NULL if memory runs out. */
 json_t *
-handle_move(struct game_tree *gt, json_t *req);
+deferred_state(
+    struct deferred_states *states,
+    struct state_node *node,
+    unsigned int fields,
+    termination_t termination);
+
+/* Returns the state that a value in a response stands in for, or NULL if it
+ * isn't a stand-in from the list. */
+const struct deferred_state *
+find_deferred_state(const struct deferred_states *states, json_t *val);
+
+/* Append a deferred state to the buffer, in the binary encoding or as JSON.
+ * Returns 0 on success or -1 on error. */
+int
+write_deferred_state(
+    struct gm_buf *out,
+    const struct deferred_state *state,
+    bool binary);
+
+/* Release the list of states a response was waiting on, and the stand-ins
+ * it holds on to. */
+void
+free_deferred_states(struct deferred_states *states);
+
+/* Ensure that the buffer can hold at least len more bytes. Returns 0 on
+ * success or -1 if memory couldn't be allocated. */
+int
+buf_reserve(struct gm_buf *buf, size_t len);
 
+/* Append len bytes to the end of the buffer. Returns 0 on success or -1 on
+ * error. */
+int
+buf_append(struct gm_buf *buf, const void *data, size_t len);
+
+/* Drop the first n bytes of the buffer, shifting the remainder to the front. */
+void
+buf_consume(struct gm_buf *buf, size_t n);
+
+/* Free the storage associated with a buffer and reset it to empty. */
+void
+buf_free(struct gm_buf *buf);
+
+/* Look for a complete length-encoded message at the start of data. Returns 1
+ * and sets *msg_len if a full message (not including its header) is available
+ * at data + MSG_HEADER_LEN, 0 if more data is needed, or -1 if the header
+ * announces a message that is negative or longer than max_len. */
+int
+frame_ready(
+    const char *data,
+    size_t len,
+    ssize_t max_len,
+    size_t *msg_len);
+
+/* Append a length-encoded message to the buffer. Returns 0 on success or -1 on
+ * error. */
+int
+frame_append(struct gm_buf *buf, const char *msg, size_t msg_len);
+
+/* Turn off Nagle's algorithm on a socket. We always write whole batches of
+ * responses at once, so holding back small writes only adds latency. Returns
+ * 0 on success or -1 on error. */
+int
+set_nodelay(int fd);
+
+/* Put a file descriptor into nonblocking mode. Returns 0 on success or -1 on
+ * error. */
+int
+set_nonblocking(int fd);
+
+/* Read as much as is available from a nonblocking connection into its input
+ * buffer. Returns the number of bytes read, 0 if the peer closed the
+ * connection, or -1 on error. If no data is available, errno is set to EAGAIN
+ * and -1 is returned. */
+ssize_t
+conn_read(struct gm_conn *conn);
+
+/* Write as much of the connection's output buffer as the socket will accept.
+ * Returns 1 if the output buffer was fully drained, 0 if data remains to be
+ * written, or -1 on error. */
+int
+conn_flush(struct gm_conn *conn);
+
+/* Start on every complete request in the connection's input buffer that we
+ * can: requests about the connection itself are answered right away and the
+ * rest are handed to the workers. Outside of a session each connection
+ * carries a single request, so once we've seen one (or seen garbage) we stop
+ * reading and close after the response is written. Returns true if we stopped
+ * early, with complete requests still waiting, because the client has too
+ * much output waiting for it. */
+bool
+process_input(struct gm_conn *conn);
+
+/* Whether we should read more from the connection: we stop once it has sent
+ * its last request, has too much unsent output or has too many requests
+ * waiting on workers. */
+bool
+conn_wants_input(const struct gm_conn *conn);
+
+/* Whether every response on the connection has been written and it's time to
+ * close it. */
+bool
+conn_done(const struct gm_conn *conn);
+
+/* Free what a connection holds once its socket has been closed. If workers are
+ * still busy with requests from it, the connection itself lives on until
+ * return_job has seen the last of them. */
+void
+release_conn(struct gm_conn *conn);
+
+/* Let the next job in a finished job's lane start. */
+void
+finish_lane(struct gm_job *job);
+
+/* Hand a finished job's response to its connection. Returns the connection if
+ * it's still open, or NULL if it has been closed in the meantime. */
+struct gm_conn *
+return_job(struct gm_job *job);
+
+/* Handle requests that change the state of the connection they arrive on
+ * rather than the state of the game tree. Returns NULL if the request isn't a
+ * session request. The response is always in the encoding the request came
+ * in, even if the request changes the connection's encoding. */
 json_t *
-handle_game_from_pgn(struct game_tree *gt, json_t *req);
+handle_session(json_t *req, struct gm_conn *conn);
+
+/* Get subscriptions and waits ready to look up games in the given tree.
+ * Returns 0 on success or -1 on error. */
+int
+subscriptions_init(struct game_tree *gt);
 
+/* Subscribe a job's connection to updates to a game, and send the response
+ * to the request. */
+void
+subscribe(struct gm_job *job);
+
+/* Unsubscribe a connection from updates to a game, returning the response
+ * to the request. */
 json_t *
-handle_end_game(struct game_tree *gt, json_t *req);
+unsubscribe(json_t *req, struct gm_conn *conn);
+
+/* Push the changes a finished job made to the subscribers of the games it
+ * changed. Must only be called once the changes have been logged. */
+void
+publish_updates(const struct gm_job *job);
+
+/* Send the latest state of every game whose updates a connection has
+ * skipped, if it has room for them now. Returns false if some are still
+ * waiting for room. */
+bool
+catch_up(struct gm_conn *conn);
+
+/* Answer a wait_for_move request once its game has moved past the ply it
+ * names, or once it times out. Until then the request is parked, with its
+ * job counted as in flight on its connection but not given to a worker. */
+void
+wait_for_move(struct gm_job *job);
+
+/* A file descriptor that becomes readable when a parked wait may have timed
+ * out, whereupon the event loop must call expire_waiters. */
+int
+waiters_timer(void);
+
+/* Answer the parked waits that have timed out. */
+void
+expire_waiters(void);
+
+/* Drop every subscription and parked wait a connection has, as it goes
+ * away. */
+void
+drop_watches(struct gm_conn *conn);
+
+/* Take a connection that has had updates pushed to it, which the event loop
+ * needs to send, or NULL if there are none left. */
+struct gm_conn *
+take_pushed_conn(void);
+
+/* Returns the lane a request must be carried out in, or -1 if it doesn't
+ * touch any game. */
+int
+request_lane(json_t *req);
+
+/* The same, for a decoded request. */
+int
+decoded_request_lane(const struct gm_request *req);
+
+/* Read a JSON request of one of the kinds in request_kind_t straight out of
+ * its text, in a single pass and without building a JSON value for it.
+ * Only requests in the shape clients normally send are understood: an object
+ * with nothing but known members, and strings with nothing in them that
+ * needs escaping. Returns 0 on success, or -1 if the message has to go
+ * through the general JSON parser instead (which says what's wrong with it,
+ * if anything). */
+int
+decode_request(const char *msg, size_t len, struct gm_request *req);
+
+/* Fill in a struct gm_request from a parsed request. Returns false if the
+ * request isn't of a kind in request_kind_t. */
+bool
+request_from_json(json_t *json, struct gm_request *req);
+
+/* Returns the game state field with the given name, or 0 if there isn't
+ * one. */
+unsigned int
+field_from_name(const char *name, size_t len);
+
+/* Work out which fields of the game state a parsed request wants, from its
+ * "fields" member: either "all" or a list of field names. Returns false if the
+ * request names a field that doesn't exist. */
+bool
+requested_fields(json_t *req, unsigned int *fields);
+
+/* Carry out a job's request against the game tree, append it to the log if
+ * it succeeded, and fill in the job's response. The job's req_msg is what
+ * gets logged, if there is one; its log_end is set to the position just past
+ * its record, or 0 if nothing was logged. Safe to call from many threads at
+ * once. */
+void
+execute_request(struct game_tree *gt, struct gm_log *log, struct gm_job *job);
+
+/* Serialize a response, taking ownership of it and of the list of states
+ * it's waiting on, which may be NULL, and set *len to the length of the
+ * result. The returned string must be freed by the caller. */
+char *
+response_str(
+    json_t *resp,
+    struct deferred_states *states,
+    bool binary,
+    size_t *len);
+
+void
+log_init(struct gm_log *log, FILE *f, bool deferred);
+
+/* Append a record to the log. Returns the position in the log just past the
+ * new record. */
+uint64_t
+log_append(struct gm_log *log, const char *msg, size_t len);
+
+/* Move the records waiting to be written out of a deferred log into out,
+ * which must be empty. */
+void
+log_take_pending(struct gm_log *log, struct gm_buf *out);
+
+/* Serve connections on the listening socket with epoll until the server is
+ * asked to stop, carrying out requests on a pool of n_workers threads. The
+ * listening socket must already be bound and listening. */
+void
+run_event_loop(
+    int listen_fd,
+    struct game_tree *gt,
+    struct gm_log *log,
+    int n_workers);
+
+/* The same, but with all socket and log I/O done through io_uring. The log
+ * must be deferred. Returns -1 without serving anything if io_uring isn't
+ * available, or 0 once the server has been asked to stop. */
+int
+run_uring_loop(
+    int listen_fd,
+    struct game_tree *gt,
+    struct gm_log *log,
+    int n_workers);
+
+/* Route every JSON allocation in the process through hooks that allocate
+ * from the calling thread's arena, if it's in the middle of a request, and
+ * from the heap otherwise. Values can be freed from any thread, but a value
+ * allocated from an arena mustn't be used after the arena is reset. Must be
+ * called before any JSON value is created. */
+void
+arena_install(void);
+
+/* Set up an arena. Returns 0 on success or -1 on error. */
+int
+arena_init(struct gm_arena *arena);
+
+/* Have JSON values created on this thread come from the arena, until it's
+ * reset, and start counting them afresh. */
+void
+arena_begin(struct gm_arena *arena);
+
+/* Stop allocating from the arena and give back everything allocated from
+ * it. */
+void
+arena_reset(struct gm_arena *arena);
+
+/* Free an arena's memory for good. */
+void
+arena_free(struct gm_arena *arena);
+
+/* Start n_workers threads that carry out submitted jobs. Each time a job is
+ * finished, wake_fd (an eventfd) is signalled. Returns 0 on success or -1 on
+ * error. */
+int
+start_workers(
+    struct game_tree *gt,
+    struct gm_log *log,
+    int n_workers,
+    int wake_fd);
+
+/* Stop the worker threads once the jobs already submitted are finished. */
+void
+stop_workers(void);
+
+/* Hand a job to the worker pool. */
+void
+submit_job(struct gm_job *job);
+
+/* Take every job the workers have finished since the last call, as a linked
+ * list. */
+struct gm_job *
+take_finished_jobs(void);
+
+/* Free a job and everything it owns. */
+void
+free_job(struct gm_job *job);
+
+/* Returns true once the server has been asked to shut down. */
+bool
+server_stopping(void);
+
+/* Carry out a request against the game tree, returning its response. */
+json_t *
+handle_request(
+    struct game_tree *gt,
+    const struct gm_request *req,
+    struct deferred_states *states);
+
+/* Look up the states of a list of games. Like get_state, this only reads the
+ * game tree, so it's safe to call while the games are being changed. */
+json_t *
+handle_multi_get(
+    struct game_tree *gt,
+    json_t *req,
+    struct deferred_states *states);
+
+#endif
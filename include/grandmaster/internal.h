@@ -32,10 +32,17 @@
 void
 read_location(const char *str, struct position *result);
 
-/* Parse FEN data into a move. Private API because it makes a "truncated" move
- * with no hierarchy associated with it. */
-struct move *
-parse_fen(const char *fen, int n);
+/* Write the canonical SAN for the move from start to end on the given
+ * board, which has to have its access map, without the check or mate
+ * marker. san needs room for MAX_SAN_LEN + 1 characters. Returns the length
+ * of the SAN. */
+size_t
+write_san(
+    const struct board *b,
+    struct position start,
+    struct position end,
+    piece_type_t promotion,
+    char *san);
 
 /* Print a move to stdout. */
 void
@@ -70,10 +77,6 @@ load_default_board(struct board *b);
 void
 get_root(struct move *out);
 
-/* Free a move struct, leaving its parent move untouched. */
-void
-free_move(struct move *move);
-
 /* Free a move struct and all of its parents. */
 void
 free_move_tree(struct move *move);
@@ -21,8 +21,10 @@
 #define __GRANDMASTER_TREE_H__
 
 #include "grandmaster/core.h"
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 typedef uint64_t game_id_t;
@@ -30,11 +32,24 @@ typedef uint64_t player_id_t;
 
 #define NO_GAME ((game_id_t) -1)
 
+/* The most nodes that have their legal moves cached at once, unless
+ * set_legal_cache_size says otherwise. A cached list takes about a kilobyte. */
+#define LEGAL_CACHE_NODES 16384
+
+/* The children of a node form a singly-linked list through next_sibling,
+ * starting at first_child. The list only ever grows at its head, and only
+ * with an atomic compare-and-swap on first_child, so it can be read without
+ * locks while other threads add to it; next_sibling never changes once a node
+ * is in the list. Nodes are only freed along with the whole tree. */
 struct state_node {
     struct move *move;
-    size_t n_children;
-    struct state_node **children;
+    struct state_node *first_child;
+    struct state_node *next_sibling;
     struct state_node *parent;
+    /* the moves that can be made from here, which are listed the first time
+     * a move from here has to be resolved, and can be evicted again at any
+     * time; only read or written with the tree's legal_lock held. */
+    struct legal_moves *legal;
 };
 
 struct game {
@@ -43,13 +58,54 @@ struct game {
     player_id_t player_black;
     struct state_node *current;
     termination_t termination;
+    /* odd while current and termination are being changed, so that readers
+     * on other threads can tell whether they read a consistent pair. */
+    unsigned int version;
 };
 
+/* A game tree may be shared between threads: the tree's own structure (the
+ * list of states, the list of games and the children of each node) is safe to
+ * change concurrently. Changes to a single game (make_move and
+ * end_game) are not serialized against each other, so callers that share a
+ * tree must make sure that only one thread at a time changes any given
+ * game. Any number of threads may read a game with read_game while it's being
+ * changed. */
 struct game_tree {
+    /* the starting position, which is also states[0]; kept apart so that it
+     * can be read without taking states_lock. */
+    struct state_node *root;
     size_t n_states;
     struct state_node **states;
     size_t n_games;
     struct game **games;
+
+    /* the number of slots allocated in states, and how many of those have
+     * been set aside for nodes that are about to be added. */
+    size_t states_cap;
+    size_t states_reserved;
+    /* the number of slots allocated in games */
+    size_t games_cap;
+    /* guards states, n_states, states_cap and states_reserved */
+    pthread_mutex_t states_lock;
+    /* guards games, n_games and games_cap */
+    pthread_rwlock_t games_lock;
+
+    /* the nodes whose legal moves are cached, as a ring in the order they
+     * were cached, so that when it's full the oldest is evicted first. */
+    struct state_node **legal_nodes;
+    size_t legal_cap;
+    size_t legal_next;
+    /* guards legal_nodes, legal_cap, legal_next and the legal of each node */
+    pthread_rwlock_t legal_lock;
+
+    /* the positions that games have started from, root included, so that
+     * games started from the same FEN share a node; an open-addressed hash
+     * table of roots_cap slots, at most half of which are full. */
+    struct state_node **roots;
+    size_t n_roots;
+    size_t roots_cap;
+    /* guards roots, n_roots and roots_cap */
+    pthread_mutex_t roots_lock;
 };
 
 void
@@ -58,9 +114,54 @@ init_gametree(struct game_tree *gt);
 game_id_t
 new_game(struct game_tree *gt, player_id_t white, player_id_t black);
 
+/* Start a game at the given node of the tree, rather than at the start, as it
+ * stands after the given termination. */
+game_id_t
+new_game_at(
+    struct game_tree *gt,
+    player_id_t white,
+    player_id_t black,
+    struct state_node *node,
+    termination_t termination);
+
 struct game *
 get_game(struct game_tree *gt, game_id_t game);
 
+/* Find the node for the position in the given FEN, adding it to the tree as a
+ * root of its own if no game has started from it yet. Positions are the same
+ * if their boards, side to move, castles, en passant files and move counters
+ * are. Returns NULL if the FEN can't be parsed, if it isn't a legal position
+ * or if memory runs out. */
+struct state_node *
+tree_root_from_fen(struct game_tree *gt, const char *fen, size_t len);
+
+/* Start a game at the position in the given FEN. Returns NO_GAME if
+ * tree_root_from_fen can't find a node for it. */
+game_id_t
+new_game_from_fen(
+    struct game_tree *gt,
+    player_id_t white,
+    player_id_t black,
+    const char *fen,
+    size_t len);
+
+/* Find the node that the given move leads to from parent, adding it to the
+ * tree if no game has made the move yet. Returns NULL if the move can't be
+ * made there. Any number of threads may call this at once, from any nodes. */
+struct state_node *
+tree_child(
+    struct game_tree *gt,
+    struct state_node *parent,
+    const char *notation);
+
+/* Like tree_child, for notation that isn't NUL-terminated. */
+struct state_node *
+tree_child_len(
+    struct game_tree *gt,
+    struct state_node *parent,
+    const char *notation,
+    size_t len);
+
 bool
 make_move(
     struct game_tree *gt,
@@ -68,9 +169,66 @@ make_move(
     player_id_t player,
     const char *notation);
 
+/* Like tree_child, for a move in coordinate notation, like "e2e4" or
+ * "e7e8q". A move that isn't in the tree yet is given its canonical SAN. */
+struct state_node *
+tree_child_coordinates(
+    struct game_tree *gt,
+    struct state_node *parent,
+    const char *notation,
+    size_t len);
+
+/* Like make_move, for a move in coordinate notation. The SAN for the move is
+ * the algebraic of the game's new current move. */
+bool
+make_move_coordinates(
+    struct game_tree *gt,
+    game_id_t game,
+    player_id_t player,
+    const char *notation,
+    size_t len);
+
+/* List the moves that can be made from a node, with their SAN marked for
+ * check and mate. *moves is set to an array of *n moves, which the caller
+ * frees. Returns false if memory runs out. */
+bool
+tree_legal_moves(
+    struct game_tree *gt,
+    struct state_node *node,
+    struct legal_move **moves,
+    size_t *n);
+
+/* Change how many nodes can have their legal moves cached at once, which
+ * empties the cache. A size of 0 turns the cache off. Returns false if memory
+ * runs out, leaving the size as it was. */
+bool
+set_legal_cache_size(struct game_tree *gt, size_t n);
+
 bool
 end_game(struct game_tree *gt, game_id_t game, termination_t termination);
 
+/* Read where a game is and how it's terminated, as of some moment during the
+ * call. Never waits for, or holds up, a thread changing the game. Returns the
+ * game's version, which goes up every time the game changes. */
+unsigned int
+read_game(
+    struct game *game,
+    struct state_node **current,
+    termination_t *termination);
+
+/* Move a game to the given node and termination, in a way that read_game can
+ * see atomically. Only one thread at a time may change a given game. */
+void
+set_game(
+    struct game *game,
+    struct state_node *current,
+    termination_t termination);
+
+/* Drop every game but the first n_games, undoing their creation. The states
+ * that the dropped games passed through stay in the tree. */
+void
+truncate_games(struct game_tree *gt, size_t n_games);
+
 game_id_t
 new_game_from_pgn(
     struct game_tree *gt,
@@ -78,12 +236,68 @@ new_game_from_pgn(
     player_id_t black,
     const char *pgn);
 
+/* Like new_game_from_pgn, for PGN that isn't NUL-terminated. */
+game_id_t
+new_game_from_pgn_len(
+    struct game_tree *gt,
+    player_id_t white,
+    player_id_t black,
+    const char *pgn,
+    size_t len);
+
+/* The settings and results of a bulk import. Moves are counted in plies,
+ * and the time spent in each stage of the import in seconds; play_time is
+ * the total across all workers. */
+struct pgn_import {
+    /* the players every imported game is given */
+    player_id_t white;
+    player_id_t black;
+    /* how many threads to play games into the tree on; with one or none,
+     * everything is done on the calling thread. */
+    int n_workers;
+    /* if not NULL, called with the PGN of each good game just before it's
+     * added to the tree, one game at a time and in the order of the input.
+     * Returning a positive number rejects the game after all, and returning
+     * a negative number stops the import. */
+    int (*on_game)(const char *pgn, size_t len, void *arg);
+    void *arg;
+
+    size_t games;
+    size_t moves;
+    size_t rejects;
+    size_t bytes;
+    double scan_time;
+    double play_time;
+    double commit_time;
+};
+
+/* Read a stream of PGN games, like a PGN database, and add each one to the
+ * tree. Games are told apart by their tag sections and given IDs in the order
+ * they're read; games that can't be parsed are counted as rejects and
+ * skipped. Returns 0 once the stream has been read, or -1 if reading failed,
+ * memory ran out or on_game stopped the import. */
+int
+import_pgn(struct game_tree *gt, FILE *in, struct pgn_import *imp);
+
+/* Write the line of play that leads to node as a PGN game, along with every
+ * line in the tree that continues from it, as variations. Where more than one
+ * move has been made from a position, the first one made is the main line.
+ * A line that starts anywhere but the starting position is given SetUp and
+ * FEN tags. Returns 0 on success or -1 if writing failed or memory ran out. */
+int
+write_pgn_tree(struct state_node *node, FILE *out);
+
 void
 free_game_tree(struct game_tree *gt);
 
 json_t *
 game_tree_to_json(struct game_tree *gt);
 
+/* Write the same document as game_tree_to_json, without building it in memory
+ * first. Returns 0 on success or -1 if the writer's sink failed. */
+int
+game_tree_write_json(struct game_tree *gt, struct json_writer *w);
+
 void
 game_tree_from_json(json_t *doc, struct game_tree *gt);
 
@@ -58,9 +58,126 @@ is_threefold_available(const struct move *m) {
     return false;
 }
 
-int
-parse_castle(
-    const char *notation,
+static bool
+is_file(char c)
+{
+    return 'a' <= c && c <= 'h';
+}
+
+static bool
+is_rank(char c)
+{
+    return '1' <= c && c <= '8';
+}
+
+static bool
+is_piece(char c)
+{
+    return c == ROOK || c == KNIGHT || c == BISHOP || c == QUEEN || c == KING;
+}
+
+bool
+parse_san(const char *notation, size_t len, struct san *san)
+{
+    char coords[4];
+    size_t n_coords;
+    size_t capture_at;
+    size_t i;
+
+    san->piece = PAWN;
+    san->start.rank = -1;
+    san->start.file = -1;
+    san->end.rank = -1;
+    san->end.file = -1;
+    san->castle = 0;
+    san->capture = false;
+    san->promotion = 0;
+    san->check = '\0';
+    i = 0;
+
+    if (len >= 3 && (notation[0] == 'O' || notation[0] == '0')
+            && notation[1] == '-' && notation[2] == notation[0]) {
+        san->piece = KING;
+        san->castle = WHITE_KINGSIDE;
+        i = 3;
+        if (len >= 5 && notation[3] == '-' && notation[4] == notation[0]) {
+            san->castle = WHITE_QUEENSIDE;
+            i = 5;
+        }
+        goto suffix;
+    }
+
+    if (i < len && is_piece(notation[i]))
+        san->piece = notation[i++];
+
+    /* everything up to the promotion or the check is squares, which are the
+     * destination at the end and any disambiguation before that, and maybe
+     * an "x" just before the destination */
+    n_coords = 0;
+    capture_at = 0;
+    for (; i < len; i++) {
+        if (is_file(notation[i]) || is_rank(notation[i])) {
+            if (n_coords == 4)
+                return false;
+            coords[n_coords++] = notation[i];
+        } else if (notation[i] == 'x' && !san->capture) {
+            san->capture = true;
+            capture_at = n_coords;
+        } else {
+            break;
+        }
+    }
+    if (n_coords < 2 || !is_file(coords[n_coords - 2])
+            || !is_rank(coords[n_coords - 1]))
+        return false;
+    if (san->capture && capture_at != n_coords - 2)
+        return false;
+    san->end.file = coords[n_coords - 2] - 'a';
+    san->end.rank = coords[n_coords - 1] - '1';
+    switch (n_coords) {
+    case 4:
+        if (!is_file(coords[0]) || !is_rank(coords[1]))
+            return false;
+        san->start.file = coords[0] - 'a';
+        san->start.rank = coords[1] - '1';
+        break;
+    case 3:
+        if (is_file(coords[0]))
+            san->start.file = coords[0] - 'a';
+        else
+            san->start.rank = coords[0] - '1';
+        break;
+    }
+
+    if (san->piece == PAWN) {
+        /* a pawn only ever says which file it captures from */
+        if (san->start.rank != -1)
+            return false;
+        if (san->capture != (san->start.file != -1))
+            return false;
+        if (i < len && notation[i] == '=')
+            i++;
+        if (i < len && is_piece(notation[i]) && notation[i] != KING) {
+            if (san->end.rank != 0 && san->end.rank != 7)
+                return false;
+            san->promotion = notation[i++];
+        }
+    }
+
+suffix:
+    if (i < len && (notation[i] == '+' || notation[i] == '#'))
+        san->check = notation[i++];
+    san->len = i;
+    /* all that can follow the move is a suffix annotation */
+    for (; i < len; i++)
+        if (notation[i] != '!' && notation[i] != '?')
+            return false;
+    return true;
+}
+
+static bool
+resolve_castle(
+    const struct san *san,
     const struct move *last_move,
     struct move *out)
 {
@@ -69,18 +186,13 @@ parse_castle(
     int rook_start_file;
     int rook_end_file;
 
-    castle_type = 0;
-    if (!strncmp(notation, "0-0-0", 5) || !strncmp(notation, "O-O-O", 5)) {
-        castle_type = out->player == WHITE ? WHITE_QUEENSIDE : BLACK_QUEENSIDE;
-    }
-    else if (!strncmp(notation, "0-0", 3) || !strncmp(notation, "O-O", 3)) {
-        castle_type = out->player == WHITE ? WHITE_KINGSIDE : BLACK_KINGSIDE;
-    }
-
-    if (!castle_type)
-        return 0;
+    is_kingside = san->castle == WHITE_KINGSIDE;
+    if (out->player == WHITE)
+        castle_type = is_kingside ? WHITE_KINGSIDE : WHITE_QUEENSIDE;
+    else
+        castle_type = is_kingside ? BLACK_KINGSIDE : BLACK_QUEENSIDE;
     if (!(last_move->post_board->available_castles & castle_type))
-        return 0;
+        return false;
 
     if (out->player == BLACK) {
         out->start.rank = 7;
@@ -90,20 +202,15 @@ parse_castle(
         out->end.rank = 0;
     }
 
-    is_kingside = castle_type & (WHITE_KINGSIDE | BLACK_KINGSIDE);
     out->start.file = 4;
     out->end.file = is_kingside ? 6 : 2;
     rook_start_file = is_kingside ? 7 : 0;
     rook_end_file = is_kingside ? 5 : 3;
 
-    out->post_board = calloc(1, sizeof(struct board));
-    memcpy(out->post_board, last_move->post_board, sizeof(struct board));
-
-    out->post_board->access_map = NULL;
+    /* moves the king */
+    apply_movement(out);
 
     /* update available castles */
-    out->post_board->available_castles =
-        last_move->post_board->available_castles;
     if (out->player == BLACK) {
         out->post_board->available_castles &=
             ~(BLACK_KINGSIDE | BLACK_QUEENSIDE);
@@ -112,56 +219,36 @@ parse_castle(
             ~(WHITE_KINGSIDE | WHITE_QUEENSIDE);
     }
 
-
-    /* move the king */
-    out->post_board->board[out->end.rank][out->end.file] =
-        out->post_board->board[out->start.rank][out->start.file];
-    out->post_board->board[out->start.rank][out->start.file] =
-        (struct piece) { .color = 0, .piece_type = 0 };
-
     /* move the rook */
     out->post_board->board[out->end.rank][rook_end_file] =
         out->post_board->board[out->start.rank][rook_start_file];
     out->post_board->board[out->start.rank][rook_start_file] =
         (struct piece) { .color = 0, .piece_type = 0 };
 
-    return 1;
+    return true;
 }
 
-int
-parse_pawn(
-    const char *notation,
+static bool
+resolve_pawn(
+    const struct san *san,
     const struct move *last_move,
-    const bool is_capture,
     struct move *out)
 {
-    struct board *b;
-    int capture_rank;
+    const struct board *b;
+    const struct piece *pawn;
     color_t player;
-    bool is_passant;
 
-    player = opposite(last_move->player);
+    player = out->player;
     b = last_move->post_board;
 
-    out->start.file = notation[0] - 'a';
-    out->start.rank = 0;
-    out->end.file = notation[strlen(notation) - 2] - 'a';
-    out->end.rank = notation[strlen(notation) - 1] - '1';
-    if (!is_valid_position(out->start))
-        return 0;
-    if (!is_valid_position(out->end))
-        return 0;
-
-    is_passant = false;
-
-    if (is_capture) {
+    out->end = san->end;
+    out->start.file = san->capture ? san->start.file : san->end.file;
+    if (san->capture) {
         if (player == WHITE) {
             out->start.rank = out->end.rank - 1;
         } else {
             out->start.rank = out->end.rank + 1;
         }
-        is_passant =
-            !b->board[out->end.rank][out->end.file].piece_type;
     } else {
         if (player == WHITE) {
             if (out->end.rank == 3) {
@@ -185,42 +272,23 @@ parse_pawn(
             }
         }
     }
-
-    if (is_passant) {
-        out->post_board = calloc(1, sizeof(struct board));
-        memcpy(out->post_board, last_move->post_board, sizeof(struct board));
-
-        /* move the pawn */
-        out->post_board->board[out->end.rank][out->end.file] =
-            out->post_board->board[out->start.rank][out->start.file];
-        out->post_board->board[out->start.rank][out->start.file] =
-            (struct piece) { .color = 0, .piece_type = 0 };
-
-        /* remove the captured piece */
-        capture_rank = out->end.rank;
-        if (player == WHITE)
-            capture_rank--;
-        else
-            capture_rank++;
-        out->post_board->board[capture_rank][out->end.file] =
-            (struct piece) { .color = 0, .piece_type = 0 };
-    }
-    return 1;
-}
-
-size_t
-trim_commentary(const char *in)
-{
-    size_t end;
-    size_t in_len;
-    in_len = strlen(in);
-    for (end = 0; end < in_len; end++) {
-        if (in[end] == '!')
-            break;
-        if (in[end] == '?')
-            break;
+    if (!is_valid_position(out->start))
+        return false;
+    pawn = &b->board[out->start.rank][out->start.file];
+    if (pawn->piece_type != PAWN || pawn->color != player)
+        return false;
+
+    /* a pawn that reaches the last rank has to say what it becomes, and one
+     * that doesn't can't become anything */
+    if ((out->end.rank == 0 || out->end.rank == 7) != (san->promotion != 0))
+        return false;
+
+    apply_movement(out);
+    if (san->promotion != 0) {
+        out->post_board->board[out->end.rank][out->end.file].piece_type =
+            san->promotion;
     }
-    return end;
+    return true;
 }
 
 void
@@ -229,114 +297,49 @@ parse_algebraic(
     struct move *last_move,
     struct move **out)
 {
-    char *notation;
-    char *notation_head;
-    bool is_capture;
-    size_t capture_index; /* only set if is_capture */
-    size_t input_len;
-    size_t disambig_len;
+    parse_algebraic_len(input, strlen(input), last_move, out);
+}
+
+/* Resolve parsed notation against the board, making the move it stands for.
+ * However the move was written, it's given its canonical SAN. */
+static void
+resolve_san(
+    const struct san *san,
+    struct move *last_move,
+    struct move **out)
+{
     struct move *result;
     struct piece piece;
-    int i;
 
-    /* we modify the notation later to ease parsing, so we copy it here to avoid
-     * modifying our input. */
-    input_len = trim_commentary(input);
-    notation = calloc(input_len + 1, sizeof(char));
-    notation_head = notation;
-    strncpy(notation, input, input_len);
-    notation[input_len] = '\0';
+    *out = NULL;
+    if (last_move->post_board->termination & TERM_GAME_OVER_MASK)
+        return;
 
     /* create result and fill in known fields */
     result = calloc(1, sizeof(struct move));
     result->player = opposite(last_move->player);
-    result->algebraic = calloc(input_len + 1, sizeof(char));
-    strncpy(result->algebraic, notation, input_len);
     result->parent = last_move;
-
-    if (input_len < 2) {
-        alg_fail("input too short");
-    }
-    if (last_move->post_board->termination & TERM_GAME_OVER_MASK) {
-        alg_fail("game is over, termination %d",
-                 last_move->post_board->termination);
-    }
-
-    is_capture = false;
-
-    if (parse_castle(notation, last_move, result)) {
-        piece.piece_type = KING;
-        piece.color = result->player;
-        goto done;
-    }
-
+    piece.piece_type = san->piece;
     piece.color = result->player;
-    piece.piece_type = PAWN;
-    for (i = 0; i < (int) (sizeof(ALL_PIECES) / sizeof(piece_type_t)); i++) {
-        if ((int) ALL_PIECES[i] == notation[0]) {
-            piece.piece_type = notation[0];
-            /* strip the piece off the front of the notation */
-            notation++;
-            break;
-        }
-    }
-
-    capture_index = 0;
-    for (i = 0; notation[i] != '\0'; i++) {
-        if (notation[i] == 'x') {
-            is_capture = true;
-            capture_index = i;
-            break;
-        }
-    }
-
-    /* strip the check/checkmate annotation, we don't need that to determine the
-     * nature of the move. */
-    i = strlen(notation) - 1;
-    if (notation[i] == '#' || notation[i] == '+') {
-        notation[i] = '\0';
-    }
-    result->end.rank = -1;
-    result->end.file = -1;
-    read_location(&notation[strlen(notation) - 2], &result->end);
-    if (result->end.rank == -1 || result->end.file == -1) {
-        alg_fail("end location didn't parse");
-    }
-
-    if (piece.piece_type == PAWN) {
-        if (parse_pawn(notation, last_move, is_capture, result)) {
-            goto done;
-        }
-        alg_fail("failed to parse pawn movement");
-    }
 
-    if (is_capture) {
-        disambig_len = capture_index;
-    } else {
-        disambig_len = strlen(notation) - 2;
+    if (san->castle) {
+        if (!resolve_castle(san, last_move, result))
+            alg_fail("castle not available");
+        goto done;
     }
 
-    /* put in sentinel values so we can tell what was initialized (if anything)
-     * during disambiguation loading. */
-    result->start.rank = -1;
-    result->start.file = -1;
-    if (disambig_len == 2) {
-        /* easiest case: we have two disambig characters that give us the full
-         * location of the start piece. */
-        read_location(notation, &result->start);
+    if (san->piece == PAWN) {
+        if (!resolve_pawn(san, last_move, result))
+            alg_fail("failed to parse pawn movement");
         goto done;
-    } else if (disambig_len == 1) {
-        if ('a' <= notation[0] && notation[0] <= 'h') {
-            result->start.file = notation[0] - 'a';
-        } else if ('1' <= notation[0] && notation[0] <= '8') {
-            result->start.rank = notation[0] - '1';
-        } else {
-            alg_fail("invalid disambig char %c", notation[0]);
-        }
     }
 
+    /* find_piece_with_access fills in whatever the notation left out of the
+     * start position, and leaves -1 in it if it finds nothing */
+    result->start = san->start;
+    result->end = san->end;
     find_piece_with_access(piece, result);
-    if (result->start.rank == -1 || result->end.rank == -1)
+    if (result->start.rank == -1 || result->start.file == -1)
         alg_fail("no pieces with access to end location");
 
 done:
@@ -376,7 +379,7 @@ done:
         result->post_board->passant_file = NO_PASSANT;
     }
 
-    if (piece.piece_type == PAWN || is_capture) {
+    if (piece.piece_type == PAWN || san->capture) {
         result->post_board->fifty_move_counter = 0;
     } else {
         result->post_board->fifty_move_counter =
@@ -386,10 +389,12 @@ done:
     result->post_board->access_map = calloc(1, sizeof(struct access_map));
     build_access_map(result, result->post_board->access_map);
     result->post_board->ply_index = 1 + result->parent->post_board->ply_index;
-    result->post_board->pgn = create_pgn(result);
     result->post_board->fen = move_to_fen(result);
 
-    if (in_checkmate(result, opposite(result->player))) {
+    result->post_board->in_check =
+        in_check(result, opposite(result->player));
+    if (result->post_board->in_check
+            && in_checkmate(result, opposite(result->player))) {
         if (result->player == WHITE)
             result->post_board->termination = VICTORY_WHITE;
         else
@@ -397,6 +402,13 @@ done:
     } else if (in_stalemate(result, opposite(result->player))) {
         result->post_board->termination = STALEMATE;
     }
+
+    /* the SAN says whether the move gives check or mate, so it can only be
+     * worked out once the board is complete */
+    result->algebraic = move_to_san(result);
+    if (result->algebraic == NULL)
+        alg_fail("out of memory");
+    result->post_board->pgn = create_pgn(result);
     result->post_board->draws = DRAW_NONE;
 
     if (result->post_board->fifty_move_counter >= 100)
@@ -407,13 +419,236 @@ done:
     else if (is_threefold_available(result))
         result->post_board->draws |= DRAW_THREEFOLD;
 
-    free(notation_head);
     *out = result;
     return;
 
 error:
-    free(notation_head);
     free_move(result);
     *out = NULL;
     return;
 }
+
+void
+parse_algebraic_len(
+    const char *input,
+    size_t len,
+    struct move *last_move,
+    struct move **out)
+{
+    struct san san;
+
+    /* the notation is read without touching the heap, so that nothing needs
+     * allocating for a move that was never going to parse. */
+    *out = NULL;
+    if (!parse_san(input, len, &san))
+        return;
+    resolve_san(&san, last_move, out);
+}
+
+bool
+read_coordinates(
+    const char *notation,
+    size_t len,
+    struct position *start,
+    struct position *end,
+    piece_type_t *promotion)
+{
+    if (len != 4 && len != 5)
+        return false;
+    if (!is_file(notation[0]) || !is_rank(notation[1])
+            || !is_file(notation[2]) || !is_rank(notation[3]))
+        return false;
+    start->file = notation[0] - 'a';
+    start->rank = notation[1] - '1';
+    end->file = notation[2] - 'a';
+    end->rank = notation[3] - '1';
+
+    *promotion = 0;
+    if (len == 5) {
+        /* engines write promotions in lower case */
+        switch (notation[4]) {
+        case 'q': case 'Q': *promotion = QUEEN; break;
+        case 'r': case 'R': *promotion = ROOK; break;
+        case 'b': case 'B': *promotion = BISHOP; break;
+        case 'n': case 'N': *promotion = KNIGHT; break;
+        default: return false;
+        }
+    }
+    return true;
+}
+
+void
+parse_coordinates(
+    const char *notation,
+    size_t len,
+    struct move *last_move,
+    struct move **out)
+{
+    struct position start;
+    struct position end;
+    piece_type_t promotion;
+
+    *out = NULL;
+    if (!read_coordinates(notation, len, &start, &end, &promotion))
+        return;
+    move_from_squares(start, end, promotion, last_move, out);
+}
+
+void
+move_from_squares(
+    struct position start,
+    struct position end,
+    piece_type_t promotion,
+    struct move *last_move,
+    struct move **out)
+{
+    struct san san;
+    const struct piece *moving;
+    const struct piece *target;
+
+    *out = NULL;
+    moving = &last_move->post_board->board[start.rank][start.file];
+    target = &last_move->post_board->board[end.rank][end.file];
+    if (moving->color != opposite(last_move->player))
+        return;
+
+    /* the squares say everything the SAN would have, so there's nothing to
+     * search for */
+    san.piece = moving->piece_type;
+    san.start = start;
+    san.end = end;
+    san.castle = 0;
+    san.capture = target->piece_type != 0
+        || (san.piece == PAWN && start.file != end.file);
+    san.promotion = promotion;
+    san.check = '\0';
+    if (san.piece == KING && start.file == 4 && start.rank == end.rank
+            && abs(end.file - start.file) == 2) {
+        san.castle = end.file == 6 ? WHITE_KINGSIDE : WHITE_QUEENSIDE;
+    }
+    if (san.piece != PAWN && promotion != 0)
+        return;
+
+    resolve_san(&san, last_move, out);
+    /* a pawn's start square is worked out from where it's going, which has to
+     * be where the notation said it was */
+    if (*out != NULL && ((*out)->start.rank != start.rank
+                || (*out)->start.file != start.file)) {
+        free_move(*out);
+        *out = NULL;
+    }
+}
+
+/* Returns true if a piece other than the one moving from start could have
+ * moved to end, and sets *same_file and *same_rank if any of those pieces
+ * share the mover's file or rank. The access map already has every piece
+ * that can legally reach the square, so nothing needs trying. */
+static bool
+is_ambiguous(
+    const struct board *b,
+    struct position start,
+    struct position end,
+    bool *same_file,
+    bool *same_rank)
+{
+    const struct piece *mover;
+    const struct piece *other;
+    const struct position *accessors;
+    bool ambiguous;
+    int n;
+    int i;
+
+    mover = &b->board[start.rank][start.file];
+    accessors = b->access_map->board[end.rank][end.file].accessors;
+    n = b->access_map->board[end.rank][end.file].n_accessors;
+    ambiguous = false;
+    *same_file = false;
+    *same_rank = false;
+    for (i = 0; i < n; i++) {
+        if (accessors[i].rank == start.rank && accessors[i].file == start.file)
+            continue;
+        other = &b->board[accessors[i].rank][accessors[i].file];
+        if (other->color != mover->color
+                || other->piece_type != mover->piece_type)
+            continue;
+        ambiguous = true;
+        *same_file |= accessors[i].file == start.file;
+        *same_rank |= accessors[i].rank == start.rank;
+    }
+    return ambiguous;
+}
+
+size_t
+write_san(
+    const struct board *b,
+    struct position start,
+    struct position end,
+    piece_type_t promotion,
+    char *san)
+{
+    piece_type_t piece;
+    bool capture;
+    bool same_file;
+    bool same_rank;
+    size_t i;
+
+    piece = b->board[start.rank][start.file].piece_type;
+    i = 0;
+
+    if (piece == KING && abs(end.file - start.file) == 2) {
+        strcpy(san, end.file == 6 ? "O-O" : "O-O-O");
+        return strlen(san);
+    }
+
+    capture = b->board[end.rank][end.file].piece_type != 0
+        || (piece == PAWN && start.file != end.file);
+    if (piece == PAWN) {
+        if (capture)
+            san[i++] = 'a' + start.file;
+    } else {
+        san[i++] = piece;
+        if (is_ambiguous(b, start, end, &same_file, &same_rank)) {
+            /* the file is enough unless another piece shares it, in which
+             * case the rank is, unless another piece shares that too */
+            if (!same_file || same_rank)
+                san[i++] = 'a' + start.file;
+            if (same_file)
+                san[i++] = '1' + start.rank;
+        }
+    }
+    if (capture)
+        san[i++] = 'x';
+    san[i++] = 'a' + end.file;
+    san[i++] = '1' + end.rank;
+    if (promotion != 0) {
+        san[i++] = '=';
+        san[i++] = promotion;
+    }
+    san[i] = '\0';
+    return i;
+}
+
+char *
+move_to_san(const struct move *move)
+{
+    char san[MAX_SAN_LEN + 1];
+    const struct board *b;
+    piece_type_t promotion;
+    size_t i;
+
+    b = move->parent->post_board;
+    promotion = move->post_board->board[move->end.rank][move->end.file]
+        .piece_type;
+    if (b->board[move->start.rank][move->start.file].piece_type != PAWN
+            || promotion == PAWN)
+        promotion = 0;
+    i = write_san(b, move->start, move->end, promotion, san);
+
+    if (move->post_board->termination == VICTORY_WHITE
+            || move->post_board->termination == VICTORY_BLACK)
+        san[i++] = '#';
+    else if (move->post_board->in_check)
+        san[i++] = '+';
+    san[i] = '\0';
+    return strdup(san);
+}
@@ -31,7 +31,7 @@ load_default_board(struct board *b)
         WHITE_KINGSIDE | WHITE_QUEENSIDE | BLACK_KINGSIDE | BLACK_QUEENSIDE;
     b->passant_file = NO_PASSANT;
     b->ply_index = 0;
-    b->pgn = "";
+    b->pgn = strdup("");
 
     b->board[0][0] = (struct piece) { .color = WHITE, .piece_type = ROOK };
     b->board[0][1] = (struct piece) { .color = WHITE, .piece_type = KNIGHT };
@@ -78,14 +78,33 @@ load_default_board(struct board *b)
 void
 apply_movement(struct move *m)
 {
+    struct board *b;
+    bool is_passant;
+
     assert(m->parent->post_board != NULL);
     if (m->post_board == NULL) {
         m->post_board = calloc(1, sizeof(struct board));
-        memcpy(m->post_board, m->parent->post_board, sizeof(struct board));
-        m->post_board->board[m->end.rank][m->end.file] =
-            m->post_board->board[m->start.rank][m->start.file];
-        m->post_board->board[m->start.rank][m->start.file] =
+        b = m->post_board;
+        memcpy(b, m->parent->post_board, sizeof(struct board));
+        /* these belong to the parent; the move builds its own once it's
+         * known to be valid, and must not free the parent's if it isn't. */
+        b->access_map = NULL;
+        b->pgn = NULL;
+        b->fen = NULL;
+        /* a pawn moving diagonally to an empty square takes the pawn beside
+         * it en passant; whether that's allowed is up to the caller, but the
+         * board has to be right for the check test. */
+        is_passant =
+            b->board[m->start.rank][m->start.file].piece_type == PAWN
+            && m->start.file != m->end.file
+            && b->board[m->end.rank][m->end.file].piece_type == 0;
+        b->board[m->end.rank][m->end.file] =
+            b->board[m->start.rank][m->start.file];
+        b->board[m->start.rank][m->start.file] =
             (struct piece) { .color = 0, .piece_type = 0 };
+        if (is_passant)
+            b->board[m->start.rank][m->end.file] =
+                (struct piece) { .color = 0, .piece_type = 0 };
     }
 }
 
@@ -111,3 +130,108 @@ boards_equal(struct board *b1, struct board *b2)
     }
     return true;
 }
+
+/* Returns true if the given piece is on the given square. */
+static bool
+piece_at(
+    const struct board *b,
+    int rank,
+    int file,
+    color_t color,
+    piece_type_t piece_type)
+{
+    return b->board[rank][file].color == color
+        && b->board[rank][file].piece_type == piece_type;
+}
+
+/* Returns NULL if the player's pieces could all be on the board together, or
+ * why they couldn't if not. */
+static const char *
+illegal_army(const struct board *b, color_t color)
+{
+    const struct piece *p;
+    int counts[128];
+    int promoted;
+    int pieces;
+    int rank;
+    int file;
+
+    memset(counts, 0x00, sizeof(counts));
+    pieces = 0;
+    for (rank = 0; rank < 8; rank++) {
+        for (file = 0; file < 8; file++) {
+            p = &b->board[rank][file];
+            if (p->piece_type == 0 || p->color != color)
+                continue;
+            if (p->piece_type == PAWN && (rank == 0 || rank == 7))
+                return "pawn on the first or last rank";
+            counts[p->piece_type]++;
+            pieces++;
+        }
+    }
+    if (counts[KING] != 1)
+        return "each side needs exactly one king";
+    if (pieces > 16 || counts[PAWN] > 8)
+        return "too many pieces";
+    /* every piece beyond the ones a side starts with has to have been a pawn
+     * that was promoted */
+    promoted = 0;
+    if (counts[QUEEN] > 1)
+        promoted += counts[QUEEN] - 1;
+    if (counts[ROOK] > 2)
+        promoted += counts[ROOK] - 2;
+    if (counts[BISHOP] > 2)
+        promoted += counts[BISHOP] - 2;
+    if (counts[KNIGHT] > 2)
+        promoted += counts[KNIGHT] - 2;
+    if (promoted > 8 - counts[PAWN])
+        return "too many promoted pieces";
+    return NULL;
+}
+
+const char *
+illegal_position(struct move *move)
+{
+    struct board *b;
+    const char *err;
+    int home;
+    int dir;
+
+    b = move->post_board;
+    if ((err = illegal_army(b, WHITE)) != NULL)
+        return err;
+    if ((err = illegal_army(b, BLACK)) != NULL)
+        return err;
+
+    /* castling is only available while the king and the rook are at home */
+    if ((b->available_castles & (WHITE_KINGSIDE | WHITE_QUEENSIDE))
+            && !piece_at(b, 0, 4, WHITE, KING))
+        return "castle available without the king at home";
+    if ((b->available_castles & (BLACK_KINGSIDE | BLACK_QUEENSIDE))
+            && !piece_at(b, 7, 4, BLACK, KING))
+        return "castle available without the king at home";
+    if (((b->available_castles & WHITE_KINGSIDE)
+                && !piece_at(b, 0, 7, WHITE, ROOK))
+            || ((b->available_castles & WHITE_QUEENSIDE)
+                && !piece_at(b, 0, 0, WHITE, ROOK))
+            || ((b->available_castles & BLACK_KINGSIDE)
+                && !piece_at(b, 7, 7, BLACK, ROOK))
+            || ((b->available_castles & BLACK_QUEENSIDE)
+                && !piece_at(b, 7, 0, BLACK, ROOK)))
+        return "castle available without the rook at home";
+
+    /* an en passant file means the last move was a pawn moving two squares,
+     * through a square that's still empty */
+    if (b->passant_file != NO_PASSANT) {
+        home = move->player == WHITE ? 1 : 6;
+        dir = move->player == WHITE ? 1 : -1;
+        if (!piece_at(b, home + 2 * dir, b->passant_file, move->player, PAWN)
+                || b->board[home + dir][b->passant_file].piece_type != 0
+                || b->board[home][b->passant_file].piece_type != 0)
+            return "en passant without a pawn that just moved two squares";
+    }
+
+    if (in_check(move, move->player))
+        return "the side that just moved is in check";
+    return NULL;
+}
@@ -21,12 +21,13 @@
 #include "grandmaster/internal.h"
 
 #include <ctype.h>
-#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define MAX_NOTATION_LEN 63
 #define MAX_FEN_LEN 128
+/* keeps the move counters within what a board can hold */
+#define MAX_FEN_COUNTER 30000
 
 #ifdef DEBUG
 #  define fen_fail(...) do {\
@@ -99,12 +100,10 @@ board_to_fen(struct board *board, color_t player)
             fen[i++] = '6';
     }
 
-    fen[i++] = ' ';
-    fen[i++] = '-';
-    fen[i++] = ' ';
+    /* the fullmove number goes up after each of black's moves */
     i += snprintf(
-        &fen[i], MAX_FEN_LEN - i, "%d",
-        (int) ceil(board->ply_index / 2.));
+        &fen[i], MAX_FEN_LEN - i, " %d %d",
+        board->fifty_move_counter, board->ply_index / 2 + 1);
 
     return fen;
 }
@@ -142,50 +141,110 @@ load_piece(const char piece, struct piece *board)
     return board->piece_type != 0;
 }
 
+/* Skip the spaces between the fields of a FEN record. */
+static size_t
+skip_spaces(const char *fen, size_t n, size_t i)
+{
+    while (i < n && (fen[i] == ' ' || fen[i] == '\t'))
+        i++;
+    return i;
+}
+
+/* Read one of the counters at the end of a FEN record, leaving *val as it
+ * is if the counter is given as "-" or left out altogether, as some writers
+ * do. Returns false if the field is there but isn't a number. */
+static bool
+read_counter(const char *fen, size_t n, size_t *i, int *val)
+{
+    int res;
+    size_t start;
+
+    if (*i == n)
+        return true;
+    if (fen[*i] == '-') {
+        (*i)++;
+        return true;
+    }
+    res = 0;
+    for (start = *i; *i < n && '0' <= fen[*i] && fen[*i] <= '9'; (*i)++) {
+        res = 10 * res + fen[*i] - '0';
+        if (res > MAX_FEN_COUNTER)
+            return false;
+    }
+    if (*i == start)
+        return false;
+    *val = res;
+    return true;
+}
+
 struct move *
-parse_fen(const char *fen, int n)
+parse_fen(const char *fen, size_t n)
 {
     struct move *result;
     struct board *board;
-    int i;
+    struct piece *p;
+    int kings[2];
+    int halfmove;
+    int fullmove;
+    size_t i;
     int rank;
     int file;
 
+    /* callers may pass the length of the buffer the FEN is in, or a line
+     * with its newline still on it */
+    n = strnlen(fen, n);
+    while (n > 0 && isspace((unsigned char) fen[n - 1]))
+        n--;
     result = calloc(1, sizeof(struct move));
     board = calloc(1, sizeof(struct board));
+    if (result == NULL || board == NULL) {
+        free(result);
+        free(board);
+        return NULL;
+    }
     result->post_board = board;
+    board->passant_file = NO_PASSANT;
 
     /* read board */
-    i = 0;
+    kings[0] = kings[1] = 0;
+    i = skip_spaces(fen, n, 0);
     for (rank = 7; rank >= 0; rank--) {
-        for (file = 0; file < 8; file++) {
+        file = 0;
+        while (file < 8) {
             if (i >= n)
                 fen_fail("ran out of characters");
-            if ('1' <= fen[i] && fen[i] <= '9')
-                file += fen[i++] - '1';
-            else if (!load_piece(fen[i++], &board->board[rank][file]))
+            if ('1' <= fen[i] && fen[i] <= '8') {
+                file += fen[i++] - '0';
+                continue;
+            }
+            p = &board->board[rank][file];
+            if (!load_piece(fen[i++], p))
                 fen_fail("couldn't load piece %c", fen[i-1]);
+            if (p->piece_type == KING)
+                kings[p->color == WHITE]++;
+            file++;
         }
-        if (fen[i++] != '/' && rank != 0)
+        if (file > 8)
+            fen_fail("rank %d has more than 8 squares", rank + 1);
+        if (rank > 0 && (i >= n || fen[i++] != '/'))
             fen_fail("didn't find slash at end of rank");
     }
-    if (i >= n)
-        fen_fail("ran out of characters");
+    if (kings[0] != 1 || kings[1] != 1)
+        fen_fail("each side needs exactly one king");
 
     /* read next-to-play, which shows up in the resulting move as the opposite
      * of what's in the FEN, since here we're recording who moved last. */
+    i = skip_spaces(fen, n, i);
+    if (i >= n || (fen[i] != WHITE && fen[i] != BLACK))
+        fen_fail("no side to move");
     result->player = opposite(fen[i++]);
-    if (i >= n)
-        fen_fail("ran out of characters");
 
-    /* skip the space separator */
-    i++;
+    /* read available castles */
+    i = skip_spaces(fen, n, i);
     if (i >= n)
         fen_fail("ran out of characters");
-
-    /* read available castles */
     board->available_castles = 0;
-    while (fen[i] != ' ') {
+    for (; i < n && fen[i] != ' ' && fen[i] != '\t'; i++) {
         if (fen[i] == 'K')
             board->available_castles |= WHITE_KINGSIDE;
         else if (fen[i] == 'k')
@@ -198,15 +257,64 @@ parse_fen(const char *fen, int n)
             ; /* do nothing */
         else
             fen_fail("unknown castle type %c", fen[i]);
+    }
+
+    /* read the en passant square, which is behind the pawn that just moved
+     * two squares. En passant captures are checked against the move before
+     * them, so that's the move this one becomes. */
+    i = skip_spaces(fen, n, i);
+    if (i >= n)
+        fen_fail("ran out of characters");
+    if (fen[i] == '-') {
         i++;
-        if (i >= n)
-            fen_fail("ran out of characters");
+    } else {
+        if (i + 1 >= n || fen[i] < 'a' || fen[i] > 'h')
+            fen_fail("bad en passant square");
+        if (fen[i + 1] != (result->player == WHITE ? '3' : '6'))
+            fen_fail("en passant square on the wrong rank");
+        board->passant_file = fen[i] - 'a';
+        result->start.file = board->passant_file;
+        result->start.rank = result->player == WHITE ? 1 : 6;
+        result->end.file = board->passant_file;
+        result->end.rank = result->player == WHITE ? 3 : 4;
+        i += 2;
     }
 
-    /* TODO: en passant square */
+    /* read the halfmove clock and the fullmove number */
+    halfmove = 0;
+    fullmove = 1;
+    i = skip_spaces(fen, n, i);
+    if (!read_counter(fen, n, &i, &halfmove))
+        fen_fail("bad halfmove clock");
+    i = skip_spaces(fen, n, i);
+    if (!read_counter(fen, n, &i, &fullmove))
+        fen_fail("bad fullmove number");
+    if (i < n)
+        fen_fail("trailing characters");
+    /* some writers start counting at 0 */
+    if (fullmove < 1)
+        fullmove = 1;
+    board->fifty_move_counter = halfmove;
+    board->ply_index = 2 * (fullmove - 1) + (result->player == WHITE);
 
     board->access_map = calloc(1, sizeof(struct access_map));
+    board->fen = board_to_fen(board, result->player);
+    board->pgn = strdup("");
+    if (board->access_map == NULL || board->fen == NULL || board->pgn == NULL)
+        fen_fail("out of memory");
     build_access_map(result, board->access_map);
+
+    board->in_check = in_check(result, opposite(result->player));
+    if (board->in_check && in_checkmate(result, opposite(result->player))) {
+        if (result->player == WHITE)
+            board->termination = VICTORY_WHITE;
+        else
+            board->termination = VICTORY_BLACK;
+    } else if (in_stalemate(result, opposite(result->player))) {
+        board->termination = STALEMATE;
+    }
+    if (board->fifty_move_counter >= 100)
+        board->draws |= DRAW_50;
     return result;
 
 error:
@@ -23,7 +23,9 @@
 
 #include <assert.h>
 #include <jansson.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define json_set json_object_set_new_nocheck
@@ -138,6 +140,12 @@ print_move(const struct move *move)
 
 json_t *
 board_to_json(const struct board *board)
+{
+    return board_fields_to_json(board, ALL_BOARD_FIELDS);
+}
+
+json_t *
+board_fields_to_json(const struct board *board, unsigned int fields)
 {
     int rank;
     int file;
@@ -155,61 +163,167 @@ board_to_json(const struct board *board)
     char piece_name[3];
 
     board_root = json_object();
-    board_array = json_array();
 
-    for (rank = 0; rank < 8; rank++) {
-        rank_array = json_array();
-        for (file = 0; file < 8; file++) {
-            p = &board->board[rank][file];
-            if (p->piece_type == 0) {
-                temp = json_null();
-            } else {
-                snprintf(
-                    piece_name, 3, "%c%c",
-                    (char) p->color, (char) p->piece_type);
-                temp = json_string(piece_name);
+    if (fields & FIELD_BOARD) {
+        board_array = json_array();
+        for (rank = 0; rank < 8; rank++) {
+            rank_array = json_array();
+            for (file = 0; file < 8; file++) {
+                p = &board->board[rank][file];
+                if (p->piece_type == 0) {
+                    temp = json_null();
+                } else {
+                    snprintf(
+                        piece_name, 3, "%c%c",
+                        (char) p->color, (char) p->piece_type);
+                    temp = json_string(piece_name);
+                }
+                json_array_append_new(rank_array, temp);
             }
-            json_array_append_new(rank_array, temp);
+            json_array_append_new(board_array, rank_array);
         }
-        json_array_append_new(board_array, rank_array);
+        json_set(board_root, "board", board_array);
+    }
+
+    if (fields & FIELD_AVAILABLE_CASTLES) {
+        available_castles = json_integer(board->available_castles);
+        json_set(board_root, "available_castles", available_castles);
     }
 
-    json_set(board_root, "board", board_array);
+    if (fields & FIELD_PASSANT_FILE)
+        json_set(board_root, "passant_file",
+                 json_integer(board->passant_file));
+
+    if (fields & FIELD_ACCESS_MAP) {
+        map_array = json_array();
+        for (rank = 0; rank < 8; rank++) {
+            rank_array = json_array();
+            for (file = 0; file < 8; file++) {
+                access_array = json_array();
+                n_accessors =
+                    board->access_map->board[rank][file].n_accessors;
+                for (i = 0; i < n_accessors; i++) {
+                    a = &board->access_map->board[rank][file].accessors[i];
+                    temp = json_array();
+                    json_array_append_new(temp, json_integer(a->rank));
+                    json_array_append_new(temp, json_integer(a->file));
+                    json_array_append_new(access_array, temp);
+                }
+                json_array_append_new(rank_array, access_array);
+            }
+            json_array_append_new(map_array, rank_array);
+        }
+        json_set(board_root, "access_map", map_array);
+    }
 
-    available_castles = json_integer(board->available_castles);
-    json_set(board_root, "available_castles", available_castles);
+    if (fields & FIELD_PLY_INDEX)
+        json_set(board_root, "ply_index", json_integer(board->ply_index));
+    if (fields & FIELD_PGN)
+        json_set(board_root, "pgn", json_string(board->pgn));
+    if (fields & FIELD_FEN)
+        json_set(board_root, "fen", json_string(board->fen));
+
+    if (fields & FIELD_TERMINATION)
+        json_set(board_root, "termination",
+                 json_string(termination_str(board->termination)));
+    if (fields & FIELD_DRAWS)
+        json_set(board_root, "draws", json_integer(board->draws));
+    if (fields & FIELD_IN_CHECK)
+        json_set(board_root, "in_check", json_bool(board->in_check));
 
-    json_set(board_root, "passant_file", json_integer(board->passant_file));
+    return board_root;
+}
 
-    map_array = json_array();
-    for (rank = 0; rank < 8; rank++) {
-        rank_array = json_array();
-        for (file = 0; file < 8; file++) {
-            access_array = json_array();
-            n_accessors = board->access_map->board[rank][file].n_accessors;
-            for (i = 0; i < n_accessors; i++) {
-                a = &board->access_map->board[rank][file].accessors[i];
-                temp = json_array();
-                json_array_append_new(temp, json_integer(a->rank));
-                json_array_append_new(temp, json_integer(a->file));
-                json_array_append_new(access_array, temp);
+void
+board_write_fields(
+    const struct board *board,
+    unsigned int fields,
+    struct json_writer *w)
+{
+    int rank;
+    int file;
+    int i;
+    int n_accessors;
+    const struct position *a;
+    const struct piece *p;
+    char piece_name[2];
+
+    if (fields & FIELD_BOARD) {
+        jw_key(w, "board");
+        jw_begin_array(w);
+        for (rank = 0; rank < 8; rank++) {
+            jw_begin_array(w);
+            for (file = 0; file < 8; file++) {
+                p = &board->board[rank][file];
+                if (p->piece_type == 0) {
+                    jw_null(w);
+                } else {
+                    piece_name[0] = (char) p->color;
+                    piece_name[1] = (char) p->piece_type;
+                    jw_stringn(w, piece_name, 2);
+                }
             }
-            json_array_append_new(rank_array, access_array);
+            jw_end_array(w);
         }
-        json_array_append_new(map_array, rank_array);
+        jw_end_array(w);
     }
-    json_set(board_root, "access_map", map_array);
 
-    json_set(board_root, "ply_index", json_integer(board->ply_index));
-    json_set(board_root, "pgn", json_string(board->pgn));
-    json_set(board_root, "fen", json_string(board->fen));
+    if (fields & FIELD_AVAILABLE_CASTLES) {
+        jw_key(w, "available_castles");
+        jw_integer(w, board->available_castles);
+    }
+    if (fields & FIELD_PASSANT_FILE) {
+        jw_key(w, "passant_file");
+        jw_integer(w, board->passant_file);
+    }
 
-    json_set(board_root, "termination",
-             json_string(termination_str(board->termination)));
-    json_set(board_root, "draws", json_integer(board->draws));
-    json_set(board_root, "in_check", json_bool(board->in_check));
+    if (fields & FIELD_ACCESS_MAP) {
+        jw_key(w, "access_map");
+        jw_begin_array(w);
+        for (rank = 0; rank < 8; rank++) {
+            jw_begin_array(w);
+            for (file = 0; file < 8; file++) {
+                jw_begin_array(w);
+                n_accessors =
+                    board->access_map->board[rank][file].n_accessors;
+                for (i = 0; i < n_accessors; i++) {
+                    a = &board->access_map->board[rank][file].accessors[i];
+                    jw_begin_array(w);
+                    jw_integer(w, a->rank);
+                    jw_integer(w, a->file);
+                    jw_end_array(w);
+                }
+                jw_end_array(w);
+            }
+            jw_end_array(w);
+        }
+        jw_end_array(w);
+    }
 
-    return board_root;
+    if (fields & FIELD_PLY_INDEX) {
+        jw_key(w, "ply_index");
+        jw_integer(w, board->ply_index);
+    }
+    if (fields & FIELD_PGN) {
+        jw_key(w, "pgn");
+        jw_string(w, board->pgn);
+    }
+    if (fields & FIELD_FEN) {
+        jw_key(w, "fen");
+        jw_string(w, board->fen);
+    }
+    if (fields & FIELD_TERMINATION) {
+        jw_key(w, "termination");
+        jw_string(w, termination_str(board->termination));
+    }
+    if (fields & FIELD_DRAWS) {
+        jw_key(w, "draws");
+        jw_integer(w, board->draws);
+    }
+    if (fields & FIELD_IN_CHECK) {
+        jw_key(w, "in_check");
+        jw_bool(w, board->in_check);
+    }
 }
 
 json_t *
@@ -307,3 +421,113 @@ game_tree_to_json(struct game_tree *gt)
 
     return out;
 }
+
+/* Maps the moves of a tree's states back to their index in the tree, so that
+ * exporting a tree doesn't have to search the whole tree for the parent of
+ * every state. */
+struct state_index {
+    const struct move *move;
+    size_t id;
+};
+
+static int
+compare_state_index(const void *a, const void *b)
+{
+    uintptr_t ma;
+    uintptr_t mb;
+
+    ma = (uintptr_t) ((const struct state_index *) a)->move;
+    mb = (uintptr_t) ((const struct state_index *) b)->move;
+    return ma < mb ? -1 : ma > mb;
+}
+
+static size_t
+state_id(
+    const struct state_index *index,
+    size_t n_states,
+    const struct move *move)
+{
+    struct state_index key;
+    struct state_index *found;
+
+    key.move = move;
+    found = bsearch(&key, index, n_states, sizeof(struct state_index),
+                    compare_state_index);
+    assert(found != NULL);
+    return found->id;
+}
+
+int
+game_tree_write_json(struct game_tree *gt, struct json_writer *w)
+{
+    size_t i;
+    struct move *move;
+    struct game *game;
+    struct state_index *index;
+
+    index = calloc(gt->n_states, sizeof(struct state_index));
+    if (index == NULL && gt->n_states > 0)
+        return -1;
+    for (i = 0; i < gt->n_states; i++) {
+        index[i].move = gt->states[i]->move;
+        index[i].id = i;
+    }
+    qsort(index, gt->n_states, sizeof(struct state_index),
+          compare_state_index);
+
+    jw_begin_object(w);
+    jw_key(w, "states");
+    jw_begin_array(w);
+    for (i = 0; i < gt->n_states && w->err == 0; i++) {
+        move = gt->states[i]->move;
+        jw_begin_object(w);
+        jw_key(w, "algebraic");
+        jw_string(w, move->algebraic);
+        jw_key(w, "board");
+        if (move->post_board != NULL) {
+            jw_begin_object(w);
+            board_write_fields(move->post_board, ALL_BOARD_FIELDS, w);
+            jw_end_object(w);
+        } else {
+            jw_null(w);
+        }
+        jw_key(w, "start_rank");
+        jw_integer(w, move->start.rank);
+        jw_key(w, "start_file");
+        jw_integer(w, move->start.file);
+        jw_key(w, "end_rank");
+        jw_integer(w, move->end.rank);
+        jw_key(w, "end_file");
+        jw_integer(w, move->end.file);
+        jw_key(w, "id");
+        jw_integer(w, i);
+        jw_key(w, "parent");
+        if (move->parent == NULL)
+            jw_null(w);
+        else
+            jw_integer(w, state_id(index, gt->n_states, move->parent));
+        jw_end_object(w);
+    }
+    jw_end_array(w);
+
+    jw_key(w, "games");
+    jw_begin_array(w);
+    for (i = 0; i < gt->n_games && w->err == 0; i++) {
+        game = gt->games[i];
+        jw_begin_object(w);
+        jw_key(w, "id");
+        jw_integer(w, game->id);
+        jw_key(w, "white");
+        jw_integer(w, game->player_white);
+        jw_key(w, "black");
+        jw_integer(w, game->player_black);
+        jw_key(w, "current");
+        jw_integer(w, state_id(index, gt->n_states, game->current->move));
+        jw_end_object(w);
+    }
+    jw_end_array(w);
+    jw_end_object(w);
+
+    free(index);
+    return w->err ? -1 : 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * jsonwriter.c: writing JSON text without building it in memory first
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "grandmaster/core.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void
+emit(struct json_writer *w, const char *data, size_t len)
+{
+    if (w->err == 0 && len > 0)
+        w->err = w->sink(data, len, w->arg);
+}
+
+/* Separate a value from the one before it in the same array or object. */
+static void
+begin_value(struct json_writer *w)
+{
+    if (w->need_comma)
+        emit(w, ",", 1);
+    w->need_comma = false;
+}
+
+static void
+emit_string(struct json_writer *w, const char *str, size_t len)
+{
+    size_t i;
+    size_t run;
+    char esc[8];
+
+    emit(w, "\"", 1);
+    run = 0;
+    for (i = 0; i < len; i++) {
+        if ((unsigned char) str[i] >= 0x20 && str[i] != '"' && str[i] != '\\')
+            continue;
+        emit(w, str + run, i - run);
+        switch (str[i]) {
+        case '"':
+            strcpy(esc, "\\\"");
+            break;
+        case '\\':
+            strcpy(esc, "\\\\");
+            break;
+        case '\b':
+            strcpy(esc, "\\b");
+            break;
+        case '\f':
+            strcpy(esc, "\\f");
+            break;
+        case '\n':
+            strcpy(esc, "\\n");
+            break;
+        case '\r':
+            strcpy(esc, "\\r");
+            break;
+        case '\t':
+            strcpy(esc, "\\t");
+            break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char) str[i]);
+        }
+        emit(w, esc, strlen(esc));
+        run = i + 1;
+    }
+    emit(w, str + run, len - run);
+    emit(w, "\"", 1);
+}
+
+void
+jw_init(struct json_writer *w, json_sink_t sink, void *arg)
+{
+    w->sink = sink;
+    w->arg = arg;
+    w->need_comma = false;
+    w->err = 0;
+}
+
+void
+jw_begin_object(struct json_writer *w)
+{
+    begin_value(w);
+    emit(w, "{", 1);
+}
+
+void
+jw_end_object(struct json_writer *w)
+{
+    emit(w, "}", 1);
+    w->need_comma = true;
+}
+
+void
+jw_begin_array(struct json_writer *w)
+{
+    begin_value(w);
+    emit(w, "[", 1);
+}
+
+void
+jw_end_array(struct json_writer *w)
+{
+    emit(w, "]", 1);
+    w->need_comma = true;
+}
+
+void
+jw_key(struct json_writer *w, const char *key)
+{
+    begin_value(w);
+    emit_string(w, key, strlen(key));
+    emit(w, ":", 1);
+}
+
+void
+jw_string(struct json_writer *w, const char *str)
+{
+    if (str == NULL) {
+        jw_null(w);
+        return;
+    }
+    jw_stringn(w, str, strlen(str));
+}
+
+void
+jw_stringn(struct json_writer *w, const char *str, size_t len)
+{
+    begin_value(w);
+    emit_string(w, str, len);
+    w->need_comma = true;
+}
+
+void
+jw_integer(struct json_writer *w, json_int_t val)
+{
+    char num[32];
+
+    snprintf(num, sizeof(num), "%" JSON_INTEGER_FORMAT, val);
+    jw_raw(w, num, strlen(num));
+}
+
+void
+jw_real(struct json_writer *w, double val)
+{
+    char num[32];
+
+    snprintf(num, sizeof(num), "%.17g", val);
+    /* keep reals looking like reals when they're read back */
+    if (strpbrk(num, ".eEn") == NULL)
+        strcat(num, ".0");
+    jw_raw(w, num, strlen(num));
+}
+
+void
+jw_bool(struct json_writer *w, bool val)
+{
+    if (val)
+        jw_raw(w, "true", 4);
+    else
+        jw_raw(w, "false", 5);
+}
+
+void
+jw_null(struct json_writer *w)
+{
+    jw_raw(w, "null", 4);
+}
+
+void
+jw_raw(struct json_writer *w, const char *json, size_t len)
+{
+    begin_value(w);
+    emit(w, json, len);
+    w->need_comma = true;
+}
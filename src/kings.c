@@ -72,6 +72,36 @@ in_check(struct move *move, color_t player)
     return can_attack(move, king_position, opposite(player));
 }
 
+/* Whether the player can take the piece at threat en passant, which is only
+ * possible if it's the pawn that just moved two squares. The access map has
+ * the capture under the square the pawn moved through. */
+static bool
+can_take_passant(struct move *move, struct position threat, color_t player)
+{
+    struct board *b;
+    struct position *accessors;
+    struct position *p;
+    int n_accessors;
+    int rank;
+    int i;
+
+    b = move->post_board;
+    if (b->passant_file != threat.file
+            || move->end.rank != threat.rank || move->end.file != threat.file
+            || b->board[threat.rank][threat.file].piece_type != PAWN)
+        return false;
+    rank = threat.rank + (player == WHITE ? 1 : -1);
+    accessors = b->access_map->board[rank][threat.file].accessors;
+    n_accessors = b->access_map->board[rank][threat.file].n_accessors;
+    for (i = 0; i < n_accessors; i++) {
+        p = &accessors[i];
+        if (b->board[p->rank][p->file].color == player
+                && b->board[p->rank][p->file].piece_type == PAWN)
+            return true;
+    }
+    return false;
+}
+
 bool
 in_checkmate(struct move *move, color_t player)
 {
@@ -160,6 +190,10 @@ in_checkmate(struct move *move, color_t player)
         free(threats);
         return false;
     }
+    if (can_take_passant(move, threats[0], player)) {
+        free(threats);
+        return false;
+    }
 
     /* Last check: see if we can block the threatening piece. */
     if (can_block(move, threats[0], king_position, player)) {
@@ -0,0 +1,256 @@
+/*
+ * legal.c: lists of the moves that can be made from a position
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "grandmaster/core.h"
+#include "grandmaster/internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const piece_type_t promotions[] = { QUEEN, ROOK, BISHOP, KNIGHT };
+#define N_PROMOTIONS (sizeof(promotions) / sizeof(promotions[0]))
+
+/* FNV-1a, which is plenty for a few dozen short strings. */
+static size_t
+hash_san(const char *san, size_t len)
+{
+    uint32_t h;
+    size_t i;
+
+    h = 2166136261u;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) san[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t
+hash_squares(
+    struct position start,
+    struct position end,
+    piece_type_t promotion)
+{
+    uint32_t key;
+
+    key = (start.rank << 9 | start.file << 6 | end.rank << 3 | end.file)
+        ^ (uint32_t) promotion << 12;
+    return (key * 2654435761u) >> 8;
+}
+
+/* The length of SAN without its check or mate marker or any suffix
+ * annotation. */
+static size_t
+bare_len(const char *notation, size_t len)
+{
+    while (len > 0 && strchr("+#!?", notation[len - 1]) != NULL)
+        len--;
+    return len;
+}
+
+static void
+insert(uint8_t *table, size_t mask, size_t hash, size_t i)
+{
+    while (table[hash & mask] != NO_LEGAL_MOVE)
+        hash++;
+    table[hash & mask] = i;
+}
+
+static bool
+is_last_rank(int rank)
+{
+    return rank == 0 || rank == 7;
+}
+
+struct legal_moves *
+find_legal_moves(const struct move *move)
+{
+    const struct board *b;
+    const struct position *accessors;
+    struct legal_moves *legal;
+    struct legal_move *m;
+    struct position end;
+    color_t player;
+    size_t n;
+    size_t slots;
+    size_t i;
+    size_t p;
+    int j;
+
+    b = move->post_board;
+    player = opposite(move->player);
+
+    /* count first, so that everything fits in one allocation */
+    n = 0;
+    if (!(b->termination & TERM_GAME_OVER_MASK)) {
+        for (end.rank = 0; end.rank < 8; end.rank++) {
+            for (end.file = 0; end.file < 8; end.file++) {
+                accessors =
+                    b->access_map->board[end.rank][end.file].accessors;
+                for (j = 0;
+                        j < b->access_map->board[end.rank][end.file]
+                            .n_accessors;
+                        j++) {
+                    if (b->board[accessors[j].rank][accessors[j].file].color
+                            != player)
+                        continue;
+                    if (b->board[accessors[j].rank][accessors[j].file]
+                            .piece_type == PAWN && is_last_rank(end.rank))
+                        n += N_PROMOTIONS;
+                    else
+                        n++;
+                }
+            }
+        }
+    }
+    /* there are never anywhere near this many legal moves, but the tables
+     * couldn't index any more */
+    if (n >= NO_LEGAL_MOVE)
+        n = NO_LEGAL_MOVE - 1;
+    for (slots = 4; slots < 2 * n; slots *= 2);
+
+    legal = malloc(sizeof(struct legal_moves)
+                   + n * sizeof(struct legal_move) + 2 * slots);
+    if (legal == NULL)
+        return NULL;
+    legal->n = 0;
+    legal->mask = slots - 1;
+    legal->moves = (struct legal_move *) (legal + 1);
+    legal->by_san = (uint8_t *) (legal->moves + n);
+    legal->by_squares = legal->by_san + slots;
+    memset(legal->by_san, NO_LEGAL_MOVE, 2 * slots);
+
+    /* moves are listed by where they go, then in the order of the access
+     * map, which is the order the board is searched in when SAN doesn't say
+     * which piece moves */
+    for (end.rank = 0; end.rank < 8 && legal->n < n; end.rank++) {
+        for (end.file = 0; end.file < 8 && legal->n < n; end.file++) {
+            accessors = b->access_map->board[end.rank][end.file].accessors;
+            for (j = 0;
+                    j < b->access_map->board[end.rank][end.file].n_accessors
+                        && legal->n < n;
+                    j++) {
+                if (b->board[accessors[j].rank][accessors[j].file].color
+                        != player)
+                    continue;
+                for (p = 0; p < N_PROMOTIONS && legal->n < n; p++) {
+                    i = legal->n++;
+                    m = &legal->moves[i];
+                    m->start = accessors[j];
+                    m->end = end;
+                    m->piece = b->board[m->start.rank][m->start.file]
+                        .piece_type;
+                    m->promotion = 0;
+                    if (m->piece == PAWN && is_last_rank(end.rank))
+                        m->promotion = promotions[p];
+                    m->marker = '\0';
+                    insert(legal->by_san, legal->mask,
+                           hash_san(m->san, write_san(
+                               b, m->start, m->end, m->promotion, m->san)),
+                           i);
+                    insert(legal->by_squares, legal->mask,
+                           hash_squares(m->start, m->end, m->promotion), i);
+                    if (m->promotion == 0)
+                        break;
+                }
+            }
+        }
+    }
+    return legal;
+}
+
+/* Whether a move matches SAN that isn't canonical, like "Ngf3" where "Nf3"
+ * would do. */
+static bool
+san_matches(const struct san *san, const struct legal_move *m)
+{
+    if (san->castle) {
+        return m->piece == KING && abs(m->end.file - m->start.file) == 2
+            && m->end.file == (san->castle == WHITE_KINGSIDE ? 6 : 2);
+    }
+    if (m->piece != san->piece || m->promotion != san->promotion)
+        return false;
+    if (m->end.rank != san->end.rank || m->end.file != san->end.file)
+        return false;
+    if (san->start.rank != -1 && san->start.rank != m->start.rank)
+        return false;
+    if (san->start.file != -1 && san->start.file != m->start.file)
+        return false;
+    /* a pawn changes files exactly when it captures */
+    if (m->piece == PAWN && san->capture != (m->start.file != m->end.file))
+        return false;
+    return true;
+}
+
+const struct legal_move *
+legal_move_by_san(
+    const struct legal_moves *legal,
+    const char *notation,
+    size_t len)
+{
+    const struct legal_move *m;
+    struct san san;
+    size_t hash;
+    size_t i;
+
+    len = bare_len(notation, len);
+    for (hash = hash_san(notation, len);
+            legal->by_san[hash & legal->mask] != NO_LEGAL_MOVE; hash++) {
+        m = &legal->moves[legal->by_san[hash & legal->mask]];
+        if (strncmp(m->san, notation, len) == 0 && m->san[len] == '\0')
+            return m;
+    }
+
+    /* no canonical SAN matches, but the notation could still say more than
+     * it needs to */
+    if (!parse_san(notation, len, &san))
+        return NULL;
+    for (i = 0; i < legal->n; i++)
+        if (san_matches(&san, &legal->moves[i]))
+            return &legal->moves[i];
+    return NULL;
+}
+
+const struct legal_move *
+legal_move_by_squares(
+    const struct legal_moves *legal,
+    struct position start,
+    struct position end,
+    piece_type_t promotion)
+{
+    const struct legal_move *m;
+    size_t hash;
+
+    for (hash = hash_squares(start, end, promotion);
+            legal->by_squares[hash & legal->mask] != NO_LEGAL_MOVE; hash++) {
+        m = &legal->moves[legal->by_squares[hash & legal->mask]];
+        if (m->start.rank == start.rank && m->start.file == start.file
+                && m->end.rank == end.rank && m->end.file == end.file
+                && m->promotion == promotion)
+            return m;
+    }
+    return NULL;
+}
+
+void
+free_legal_moves(struct legal_moves *legal)
+{
+    /* everything is in the one allocation */
+    free(legal);
+}
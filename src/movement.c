@@ -23,7 +23,6 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
-#include <string.h>
 
 #define sign(x) (((x) > 0) - ((x) < 0))
 
@@ -204,18 +203,14 @@ castle_movement_valid(const struct move *move)
     struct position rook;
     int file_step;
 
-    if (move->algebraic == NULL)
-        return false;
-
+    /* the king's destination says which castle it is; the notation isn't
+     * consulted, since the move is only given its SAN once it's known to be
+     * valid */
     castle_type = 0;
-    if (!strncmp(move->algebraic, "0-0-0", 5) ||
-            !strncmp(move->algebraic, "O-O-O", 5)) {
-        castle_type = move->player == WHITE ? WHITE_QUEENSIDE : BLACK_QUEENSIDE;
-    }
-    else if (!strncmp(move->algebraic, "0-0", 3) ||
-            !strncmp(move->algebraic, "O-O", 3)) {
+    if (move->end.file == 6)
         castle_type = move->player == WHITE ? WHITE_KINGSIDE : BLACK_KINGSIDE;
-    }
+    else if (move->end.file == 2)
+        castle_type = move->player == WHITE ? WHITE_QUEENSIDE : BLACK_QUEENSIDE;
     if (castle_type == 0)
         move_fail("castle type doesn't match consts");
 
@@ -239,6 +234,9 @@ castle_movement_valid(const struct move *move)
         king_end.file = 2;
         rook.file = 0;
     }
+    if (move->start.rank != king.rank || move->start.file != king.file
+            || move->end.rank != king_end.rank)
+        move_fail("castle doesn't move the king to its castled square");
     if (any_between(king, rook, move->parent->post_board))
         return false;
 
@@ -269,6 +267,7 @@ is_movement_valid(struct move *move)
 {
     struct piece *piece;
     struct piece *captured;
+    bool valid;
 
     if (0 > move->start.rank || 7 < move->start.rank)
         return false;
@@ -288,22 +287,32 @@ is_movement_valid(struct move *move)
     if (captured->color == piece->color)
         return false;
 
-    if (captured->piece_type != KING && in_check(move, move->player))
-        return false;
-
     switch (piece->piece_type) {
         case PAWN:
-            return pawn_movement_valid(move);
+            valid = pawn_movement_valid(move);
+            break;
         case ROOK:
-            return rook_movement_valid(move);
+            valid = rook_movement_valid(move);
+            break;
         case KNIGHT:
-            return knight_movement_valid(move);
+            valid = knight_movement_valid(move);
+            break;
         case BISHOP:
-            return bishop_movement_valid(move);
+            valid = bishop_movement_valid(move);
+            break;
         case QUEEN:
-            return queen_movement_valid(move);
+            valid = queen_movement_valid(move);
+            break;
         case KING:
-            return king_movement_valid(move);
+            valid = king_movement_valid(move);
+            break;
+        default:
+            valid = false;
     }
-    return false;
+    /* checking whether the move leaves the king in check means looking for
+     * every piece that could attack it, so it's only worth doing for moves the
+     * piece could make at all. */
+    if (!valid)
+        return false;
+    return captured->piece_type == KING || !in_check(move, move->player);
 }
@@ -21,11 +21,18 @@
 #include "grandmaster/internal.h"
 #include "grandmaster/tree.h"
 
+#include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define MAX_NOTATION_LEN 63
+/* Variations nested deeper than this are rejected. */
+#define MAX_VARIATION_DEPTH 64
+
+/* Bulk imports read their input this much at a time. */
+#define IMPORT_CHUNK_LEN (1024 * 1024)
 
 #ifdef DEBUG
 #  define pgn_fail(...) do {\
@@ -37,57 +44,107 @@
 #  define pgn_fail(...) do { goto error; } while (0)
 #endif
 
-int
-read_ply(const char *pgn, const size_t n, size_t *const i, char *const notation)
-{
-    int notation_i;
-
-    // now consume all whitespace
-    while ((pgn[*i] == '\n' || pgn[*i] == ' ') && *i < n)
-        (*i)++;
-    if (*i == n)
-        return 1;
-
-    // we're now at the next ply of the move. copy chars until we hit
-    // whitespace.
-    notation_i = 0;
-    while (pgn[*i] != '\n' && pgn[*i] != ' '
-            && *i < n && notation_i < MAX_NOTATION_LEN)
-        notation[notation_i++] = pgn[(*i)++];
-    if (notation_i == MAX_NOTATION_LEN)
-        return 1;
-    notation[notation_i] = '\0';
-    return 0;
+/* How a game ended, from the result at the end of its movetext. */
+static termination_t
+result_termination(const struct pgn_token *tok, termination_t termination)
+{
+    if (tok->len == 3 && strncmp(tok->text, "1-0", 3) == 0)
+        return VICTORY_WHITE;
+    if (tok->len == 3 && strncmp(tok->text, "0-1", 3) == 0)
+        return VICTORY_BLACK;
+    if (tok->len == 7 && strncmp(tok->text, "1/2-1/2", 7) == 0)
+        return STALEMATE;
+    /* an unfinished game has nothing to record, but it is over as far as
+     * the PGN is concerned. */
+    return termination;
 }
 
-int
-read_termination(
-        struct game_tree *gt,
-        game_id_t game_id,
-        const char *pgn,
-        const int n,
-        int i)
+/* Play out a game from the start, or from the position in its FEN tag if it
+ * has one, adding the states it passes through to the tree, without creating
+ * a game. Variations are added to the tree too, as branches off the main
+ * line. On success, returns 0 and sets *node to the state the main line ends
+ * in and *termination to how it ended. Any number of threads may play games
+ * into the same tree at once. */
+static int
+play_pgn(
+    struct game_tree *gt,
+    const char *pgn,
+    size_t n,
+    struct state_node **node,
+    termination_t *termination)
 {
-    termination_t termination;
+    struct pgn_lexer lex;
+    struct pgn_token tok;
+    struct state_node *cur;
+    /* where each variation we're in branched off from, so we can go back
+     * there once it's over */
+    struct state_node *resume[MAX_VARIATION_DEPTH];
+    const char *fen;
+    size_t fen_len;
+    int depth;
 
-    /* first consume all whitespace */
-    while ((pgn[i] == '\n' || pgn[i] == ' ') && i < n)
-        i++;
-    if (i == n)
-        return 1;
-
-    if (strncmp(&pgn[i], "1-0", 3) == 0)
-        termination = VICTORY_WHITE;
-    else if (strncmp(&pgn[i], "0-1", 3) == 0)
-        termination = VICTORY_BLACK;
-    else if (strncmp(&pgn[i], "1/2-1/2", 7) == 0)
-        termination = STALEMATE;
-    else
-        return 1;
+    cur = gt->root;
+    if (pgn_find_tag(pgn, n, "FEN", &fen, &fen_len)) {
+        cur = tree_root_from_fen(gt, fen, fen_len);
+        if (cur == NULL)
+            pgn_fail("bad FEN tag %.*s", (int) fen_len, fen);
+    }
+    depth = 0;
+    *termination = cur->move->post_board->termination;
+    pgn_lexer_init(&lex, pgn, n);
+    for (;;) {
+        switch (pgn_next_token(&lex, &tok)) {
+        case PGN_TOKEN_SAN:
+            cur = tree_child_len(gt, cur, tok.text, tok.len);
+            if (cur == NULL)
+                pgn_fail("failed to parse ply %.*s", (int) tok.len, tok.text);
+            if (depth == 0)
+                *termination = cur->move->post_board->termination;
+            break;
+
+        case PGN_TOKEN_VARIATION_START:
+            /* a variation is played instead of the move before it */
+            if (cur->parent == NULL)
+                pgn_fail("variation before the first move");
+            if (depth == MAX_VARIATION_DEPTH)
+                pgn_fail("variations nested too deeply");
+            resume[depth++] = cur;
+            cur = cur->parent;
+            break;
+
+        case PGN_TOKEN_VARIATION_END:
+            if (depth == 0)
+                pgn_fail("unmatched end of variation at i = %zu", lex.pos);
+            cur = resume[--depth];
+            break;
 
-    if (end_game(gt, game_id, termination))
-        return 0;
-    return 1;
+        case PGN_TOKEN_RESULT:
+            if (depth > 0)
+                pgn_fail("result inside a variation");
+            *termination = result_termination(&tok, *termination);
+            goto done;
+
+        case PGN_TOKEN_END:
+            if (depth > 0)
+                pgn_fail("unterminated variation");
+            goto done;
+
+        case PGN_TOKEN_ERROR:
+            pgn_fail("bad token at i = %zu", lex.pos);
+
+        /* tags, move numbers, comments and annotations don't change the
+         * game */
+        default:
+            break;
+        }
+    }
+
+done:
+    *node = cur;
+    return 0;
+
+error:
+    return -1;
 }
 
 game_id_t
@@ -97,94 +154,485 @@ new_game_from_pgn(
     player_id_t black,
     const char *pgn)
 {
-    char notation[MAX_NOTATION_LEN+1];
+    return new_game_from_pgn_len(gt, white, black, pgn, strlen(pgn));
+}
+
+game_id_t
+new_game_from_pgn_len(
+    struct game_tree *gt,
+    player_id_t white,
+    player_id_t black,
+    const char *pgn,
+    size_t n)
+{
+    struct state_node *node;
+    termination_t termination;
+
+    /* the game is only created once its moves have all turned out to be
+     * good, so a bad one leaves no trace but the states it went through. */
+    if (play_pgn(gt, pgn, n, &node, &termination))
+        return NO_GAME;
+    return new_game_at(gt, white, black, node, termination);
+}
+
+/* Find where the game at the start of pgn ends, which is where the tag
+ * section of the next game starts: at the first line starting with a tag
+ * that comes after a line of movetext. Returns 0 if the text runs out
+ * first. */
+static size_t
+game_end(const char *pgn, size_t n)
+{
+    const char *eol;
+    size_t i;
+    size_t j;
+    bool in_moves;
+
+    in_moves = false;
+    for (i = 0; i < n; i = eol - pgn + 1) {
+        eol = memchr(pgn + i, '\n', n - i);
+        if (eol == NULL)
+            return 0;
+        for (j = i; pgn + j < eol && isspace((unsigned char) pgn[j]); j++);
+        if (pgn + j == eol)
+            continue;
+        if (pgn[j] != '[')
+            in_moves = true;
+        else if (in_moves)
+            return i;
+    }
+    return 0;
+}
+
+static bool
+is_blank(const char *pgn, size_t n)
+{
     size_t i;
-    size_t n;
-    int err;
-    bool success;
-    game_id_t game_id;
-
-    game_id = new_game(gt, white, black);
-    n = strlen(pgn);
-    for (i = 0; i < n; i++) {
-        /* strip out whitespace and metadata before reading the move */
-        while ((pgn[i] == ' ' || pgn[i] == '\n' || pgn[i] == '[') && i < n) {
-            /* ignore PGN metadata by nongreedily consuming until the closing
-             * square bracket. */
-            if (pgn[i] == '[') {
-                while (pgn[i] != ']' && i < n)
-                    i++;
-                if (i == n)
-                    pgn_fail("couldn't find matching square bracket");
+
+    for (i = 0; i < n; i++)
+        if (!isspace((unsigned char) pgn[i]))
+            return false;
+    return true;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* An import runs in three stages: one thread scans the input for the
+ * boundaries between games, a pool of workers plays each game into the tree,
+ * which is where moves are validated and where the states games have in
+ * common are shared, and the games that turned out to be good are then
+ * created one at a time, in the order they were read. Games are passed
+ * between the stages in batches, one for each chunk of input. */
+struct import_game {
+    size_t start;
+    size_t len;
+    bool valid;
+    struct state_node *node;
+    termination_t termination;
+};
+
+struct import_batch {
+    size_t seq;
+    char *text;
+    struct import_game *games;
+    size_t n_games;
+    struct import_batch *next;
+};
+
+struct import_pipeline {
+    struct game_tree *gt;
+    struct pgn_import *imp;
+    int n_workers;
+
+    /* guards everything up to commit_lock, and the stats in imp that the
+     * workers add to */
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t room;
+    /* batches waiting to be played, oldest first */
+    struct import_batch *queue_head;
+    struct import_batch *queue_tail;
+    /* batches that have been played, waiting to be committed, by seq */
+    struct import_batch *played;
+    size_t in_flight;
+    size_t next_seq;
+    size_t next_commit;
+    bool scanned;
+    bool failed;
+
+    /* held by whichever thread is committing batches */
+    pthread_mutex_t commit_lock;
+};
+
+static void
+free_batch(struct import_batch *batch)
+{
+    free(batch->text);
+    free(batch->games);
+    free(batch);
+}
+
+/* Play each game of a batch into the tree. */
+static void
+play_batch(struct import_pipeline *p, struct import_batch *batch)
+{
+    struct import_game *g;
+    size_t i;
+
+    for (i = 0; i < batch->n_games; i++) {
+        g = &batch->games[i];
+        g->valid = play_pgn(p->gt, batch->text + g->start, g->len,
+                            &g->node, &g->termination) == 0;
+    }
+}
+
+/* Create the games of a batch that were played successfully. Returns 0 on
+ * success or -1 if the import should stop. */
+static int
+commit_batch(struct import_pipeline *p, struct import_batch *batch)
+{
+    struct pgn_import *imp;
+    struct import_game *g;
+    size_t i;
+    int res;
+
+    imp = p->imp;
+    for (i = 0; i < batch->n_games; i++) {
+        g = &batch->games[i];
+        res = 0;
+        if (g->valid && imp->on_game != NULL)
+            res = imp->on_game(batch->text + g->start, g->len, imp->arg);
+        if (res < 0)
+            return -1;
+        if (!g->valid || res > 0) {
+            imp->rejects++;
+            continue;
+        }
+        if (new_game_at(p->gt, imp->white, imp->black,
+                        g->node, g->termination) == NO_GAME)
+            return -1;
+        imp->games++;
+        imp->moves += g->node->move->post_board->ply_index;
+    }
+    return 0;
+}
+
+/* Commit every played batch whose turn it is. Batches are committed in the
+ * order they were read, so that games get their IDs in the order they appear
+ * in the input no matter which worker finished first. */
+static void
+commit_played(struct import_pipeline *p)
+{
+    struct import_batch *batch;
+    double start;
+    bool failed;
+    int res;
+
+    pthread_mutex_lock(&p->commit_lock);
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        batch = p->played;
+        if (batch == NULL || batch->seq != p->next_commit) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        p->played = batch->next;
+        failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+
+        /* once the import has failed, batches are just thrown away */
+        start = now();
+        res = failed ? 0 : commit_batch(p, batch);
+        p->imp->commit_time += now() - start;
+        free_batch(batch);
+
+        pthread_mutex_lock(&p->lock);
+        if (res != 0)
+            p->failed = true;
+        p->next_commit++;
+        p->in_flight--;
+        pthread_cond_broadcast(&p->room);
+        pthread_mutex_unlock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->commit_lock);
+}
+
+static void
+add_played(struct import_pipeline *p, struct import_batch *batch)
+{
+    struct import_batch **b;
+
+    pthread_mutex_lock(&p->lock);
+    for (b = &p->played; *b != NULL && (*b)->seq < batch->seq;
+            b = &(*b)->next);
+    batch->next = *b;
+    *b = batch;
+    pthread_mutex_unlock(&p->lock);
+    commit_played(p);
+}
+
+static void *
+import_worker(void *arg)
+{
+    struct import_pipeline *p;
+    struct import_batch *batch;
+    double start;
+    double elapsed;
+    bool failed;
+
+    p = arg;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->queue_head == NULL && !p->scanned)
+            pthread_cond_wait(&p->work_ready, &p->lock);
+        batch = p->queue_head;
+        if (batch == NULL) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        p->queue_head = batch->next;
+        if (p->queue_head == NULL)
+            p->queue_tail = NULL;
+        failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+
+        start = now();
+        if (!failed)
+            play_batch(p, batch);
+        elapsed = now() - start;
+
+        pthread_mutex_lock(&p->lock);
+        p->imp->play_time += elapsed;
+        pthread_mutex_unlock(&p->lock);
+        add_played(p, batch);
+    }
+}
+
+/* Pass a scanned batch on to the workers, or play and commit it right here
+ * if there are no workers. Returns 0 on success or -1 if the import has
+ * failed. */
+static int
+send_batch(struct import_pipeline *p, struct import_batch *batch)
+{
+    double start;
+    int res;
+
+    if (p->n_workers == 0) {
+        start = now();
+        play_batch(p, batch);
+        p->imp->play_time += now() - start;
+        start = now();
+        res = commit_batch(p, batch);
+        p->imp->commit_time += now() - start;
+        free_batch(batch);
+        return res;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    /* don't read further ahead of the workers than they can use */
+    while (p->in_flight >= 4 * (size_t) p->n_workers && !p->failed)
+        pthread_cond_wait(&p->room, &p->lock);
+    res = p->failed ? -1 : 0;
+    if (res == 0) {
+        batch->seq = p->next_seq++;
+        batch->next = NULL;
+        if (p->queue_tail != NULL)
+            p->queue_tail->next = batch;
+        else
+            p->queue_head = batch;
+        p->queue_tail = batch;
+        p->in_flight++;
+        pthread_cond_signal(&p->work_ready);
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (res != 0)
+        free_batch(batch);
+    return res;
+}
+
+/* Split the first len bytes of text into games, and make a batch out of
+ * those that are complete. The incomplete game at the end, if there is one,
+ * is left out of the batch unless this is the end of the input; *used is set
+ * to the length of the text the batch covers. Returns NULL if memory ran
+ * out. */
+static struct import_batch *
+scan_batch(char *text, size_t len, bool last, size_t *used)
+{
+    struct import_batch *batch;
+    struct import_game *games;
+    size_t cap;
+    size_t off;
+    size_t end;
+
+    batch = calloc(1, sizeof(struct import_batch));
+    if (batch == NULL)
+        return NULL;
+    batch->text = text;
+    cap = 0;
+    off = 0;
+    for (;;) {
+        end = game_end(text + off, len - off);
+        if (end == 0) {
+            if (!last || is_blank(text + off, len - off))
+                break;
+            end = len - off;
+        }
+        if (batch->n_games == cap) {
+            cap = cap == 0 ? 64 : 2 * cap;
+            games = realloc(batch->games, cap * sizeof(struct import_game));
+            if (games == NULL) {
+                free(batch->games);
+                free(batch);
+                return NULL;
             }
-            i++;
+            batch->games = games;
         }
-        if (i == n)
-            return game_id;
-        /* find the next period, which marks the start of the move. at the end
-         * of this chunk, i points to the character after the period. */
-        while (pgn[i] != '.' && i < n)
-            i++;
-        if (i == n)
-            return game_id;
-        i++;
-
-        err = read_ply(pgn, n, &i, notation);
-        if (err)
-            pgn_fail("failed to read white ply at i = %lu", i);
-        success = make_move(gt, game_id, white, notation);
-        if (!success)
-            pgn_fail("failed to parse white ply %s", notation);
-        if (i == n)
-            return game_id;
-
-        /* TODO: use this! */
-        err = read_termination(gt, game_id, pgn, n, i);
-        if (!err)
-            return game_id;
-
-        err = read_ply(pgn, n, &i, notation);
-        if (err)
-            pgn_fail("failed to read black ply at i = %lu", i);
-        success = make_move(gt, game_id, black, notation);
-        if (!success)
-            pgn_fail("failed to parse black ply %s", notation);
-
-        /* TODO: use this! */
-        err = read_termination(gt, game_id, pgn, n, i);
-        if (!err)
-            return game_id;
+        batch->games[batch->n_games].start = off;
+        batch->games[batch->n_games].len = end;
+        batch->n_games++;
+        off += end;
     }
+    *used = off;
+    return batch;
+}
 
-    return game_id;
+/* Read the input a chunk at a time and pass the games in it on to be played,
+ * along with the rest of the input. Returns 0 on success or -1 on error. */
+static int
+scan_input(struct import_pipeline *p, FILE *in)
+{
+    struct import_batch *batch;
+    char *text;
+    char *next;
+    size_t len;
+    size_t cap;
+    size_t used;
+    size_t read_len;
+    double start;
+    bool last;
 
-error:
-    return NO_GAME;
+    cap = IMPORT_CHUNK_LEN;
+    text = malloc(cap);
+    if (text == NULL)
+        return -1;
+    len = 0;
+    last = false;
+
+    while (!last) {
+        start = now();
+        read_len = fread(text + len, 1, cap - len, in);
+        if (read_len == 0 && ferror(in)) {
+            free(text);
+            return -1;
+        }
+        len += read_len;
+        p->imp->bytes += read_len;
+        last = read_len == 0;
+
+        batch = scan_batch(text, len, last, &used);
+        if (batch == NULL) {
+            free(text);
+            return -1;
+        }
+        /* the next batch starts with the game this one left out, and has
+         * room for a chunk after it, however long that game is. */
+        cap = len - used + IMPORT_CHUNK_LEN;
+        next = last ? NULL : malloc(cap);
+        if (!last && next == NULL) {
+            free_batch(batch);
+            return -1;
+        }
+        if (next != NULL)
+            memcpy(next, text + used, len - used);
+        len -= used;
+        text = next;
+        p->imp->scan_time += now() - start;
+
+        if (send_batch(p, batch)) {
+            free(text);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+import_pgn(struct game_tree *gt, FILE *in, struct pgn_import *imp)
+{
+    struct import_pipeline p;
+    pthread_t *workers;
+    int n_started;
+    int res;
+    int i;
+
+    memset(&p, 0x00, sizeof(struct import_pipeline));
+    p.gt = gt;
+    p.imp = imp;
+    p.n_workers = imp->n_workers > 1 ? imp->n_workers : 0;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.work_ready, NULL);
+    pthread_cond_init(&p.room, NULL);
+    pthread_mutex_init(&p.commit_lock, NULL);
+
+    workers = calloc(p.n_workers + 1, sizeof(pthread_t));
+    if (workers == NULL)
+        return -1;
+    for (n_started = 0; n_started < p.n_workers; n_started++)
+        if (pthread_create(&workers[n_started], NULL, import_worker, &p))
+            break;
+    if (n_started == 0)
+        p.n_workers = 0;
+
+    res = scan_input(&p, in);
+
+    pthread_mutex_lock(&p.lock);
+    p.scanned = true;
+    if (res != 0)
+        p.failed = true;
+    pthread_cond_broadcast(&p.work_ready);
+    pthread_mutex_unlock(&p.lock);
+    for (i = 0; i < n_started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    if (p.failed)
+        res = -1;
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.work_ready);
+    pthread_cond_destroy(&p.room);
+    pthread_mutex_destroy(&p.commit_lock);
+    return res;
 }
 
 char *
 create_pgn(struct move *move)
 {
-    char *base;
+    const char *base;
     char *res;
     size_t base_len;
     int ret;
 
     /* if we're the root node, there's no need to include us in the PGN. */
     if (move->algebraic == NULL)
-        return "";
+        return strdup("");
 
-    if (move->parent != NULL) {
-        base = create_pgn(move->parent);
-        base_len = strlen(base);
-    } else {
+    /* the parent's PGN already covers the game up to this move, so there's
+     * no need to walk back to the root. */
+    if (move->parent != NULL)
+        base = move->parent->post_board->pgn;
+    else
         base = "";
-        base_len = 0;
-    }
 
-    /* propagate errors back up the stack. */
+    /* propagate errors back down the game. */
     if (base == NULL)
         return NULL;
+    base_len = strlen(base);
 
     if (move->player == WHITE) {
         if (base_len > 0)
@@ -196,8 +644,14 @@ create_pgn(struct move *move)
             ret = asprintf(&res, "%d.%s",
                 move->post_board->ply_index / 2 + 1,
                 move->algebraic);
-    } else {
+    } else if (base_len > 0) {
         ret = asprintf(&res, "%s %s", base, move->algebraic);
+    } else {
+        /* only a game started from a position with black to move can start
+         * with one of black's moves */
+        ret = asprintf(&res, "%d...%s",
+            move->post_board->ply_index / 2,
+            move->algebraic);
     }
 
     if (ret == -1) {
@@ -206,3 +660,146 @@ create_pgn(struct move *move)
     }
     return res;
 }
+
+/* Lines of exported PGN are kept to this many characters where possible. */
+#define PGN_LINE_LEN 79
+
+struct pgn_writer {
+    FILE *out;
+    size_t col;
+    /* whether the next token is separated from the last by a space */
+    bool space;
+    /* whether the next move needs its move number, which a black move only
+     * does at the start of a line of play */
+    bool number;
+};
+
+/* Write a token, made of a prefix like a move number and the rest of it. */
+static void
+write_token(struct pgn_writer *w, const char *prefix, const char *tok)
+{
+    size_t len;
+
+    len = strlen(prefix) + strlen(tok);
+    if (w->col > 0 && w->col + w->space + len > PGN_LINE_LEN) {
+        fputc('\n', w->out);
+        w->col = 0;
+    } else if (w->col > 0 && w->space) {
+        fputc(' ', w->out);
+        w->col++;
+    }
+    fputs(prefix, w->out);
+    fputs(tok, w->out);
+    w->col += len;
+    w->space = true;
+}
+
+static void
+write_move(struct pgn_writer *w, struct move *move)
+{
+    char number[32];
+    int ply;
+
+    ply = move->post_board->ply_index;
+    if (move->player == WHITE)
+        snprintf(number, sizeof(number), "%d.", (ply + 1) / 2);
+    else if (w->number)
+        snprintf(number, sizeof(number), "%d...", ply / 2);
+    else
+        number[0] = '\0';
+    write_token(w, number, move->algebraic);
+    w->number = false;
+}
+
+/* Write every line of play that continues from node. The first move made
+ * from a position is taken to be its main line, and any others become
+ * variations. Returns 0 on success or -1 if memory ran out. */
+static int
+write_lines(struct pgn_writer *w, struct state_node *node)
+{
+    struct state_node **children;
+    struct state_node *head;
+    struct state_node *child;
+    size_t n_children;
+    size_t i;
+
+    for (;;) {
+        /* children are only ever added to the front of the list, so the
+         * list from here on doesn't change under us */
+        head = __atomic_load_n(&node->first_child, __ATOMIC_ACQUIRE);
+        n_children = 0;
+        for (child = head; child != NULL; child = child->next_sibling)
+            n_children++;
+        if (n_children == 0)
+            return 0;
+        if (n_children == 1) {
+            node = head;
+            write_move(w, node->move);
+            continue;
+        }
+
+        /* which also means that the first one made is at the end */
+        children = malloc(n_children * sizeof(struct state_node *));
+        if (children == NULL)
+            return -1;
+        i = n_children;
+        for (child = head; child != NULL; child = child->next_sibling)
+            children[--i] = child;
+
+        write_move(w, children[0]->move);
+        for (i = 1; i < n_children; i++) {
+            write_token(w, "", "(");
+            w->space = false;
+            w->number = true;
+            write_move(w, children[i]->move);
+            if (write_lines(w, children[i])) {
+                free(children);
+                return -1;
+            }
+            w->space = false;
+            write_token(w, "", ")");
+            w->number = true;
+        }
+        node = children[0];
+        free(children);
+    }
+}
+
+int
+write_pgn_tree(struct state_node *node, FILE *out)
+{
+    struct pgn_writer w;
+    struct state_node **line;
+    struct state_node *n;
+    size_t len;
+    size_t i;
+    int res;
+
+    w.out = out;
+    w.col = 0;
+    w.space = false;
+    w.number = true;
+
+    /* the moves that lead to node come first, without variations */
+    len = node->move->post_board->ply_index;
+    line = calloc(len + 1, sizeof(struct state_node *));
+    if (line == NULL)
+        return -1;
+    for (i = len, n = node; i > 0 && n->parent != NULL; n = n->parent)
+        line[--i] = n;
+    /* a line that doesn't start at the starting position says where it
+     * does start */
+    if (strcmp(n->move->post_board->fen, START_FEN) != 0)
+        fprintf(out, "[SetUp \"1\"]\n[FEN \"%s\"]\n\n",
+                n->move->post_board->fen);
+    for (; i < len; i++)
+        write_move(&w, line[i]->move);
+    free(line);
+
+    res = write_lines(&w, node);
+    write_token(&w, "", "*");
+    fputc('\n', out);
+    if (ferror(out))
+        res = -1;
+    return res;
+}
@@ -0,0 +1,266 @@
+/*
+ * pgnlex.c: tokenizer for the PGN data interchange format
+ * Copyright (C) 2015, Haldean Brown
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "grandmaster/core.h"
+
+#include <string.h>
+
+/* Files written on other systems end their lines with "\r\n". */
+static bool
+is_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static bool
+is_digit(char c)
+{
+    return '0' <= c && c <= '9';
+}
+
+/* Characters that end a move or a result without being part of it. */
+static bool
+is_delimiter(char c)
+{
+    return is_space(c) || strchr("{};()[]$!?", c) != NULL;
+}
+
+/* Returns the numeric annotation glyph for the suffix annotation at the start
+ * of the text, setting *len to its length, or 0 if there isn't one. */
+static int
+suffix_nag(const char *pgn, size_t n, size_t *len)
+{
+    static const char *suffixes[] = { "!!", "??", "!?", "?!", "!", "?" };
+    static const int nags[] = { 3, 4, 5, 6, 1, 2 };
+    size_t i;
+    size_t l;
+
+    for (i = 0; i < sizeof(nags) / sizeof(nags[0]); i++) {
+        l = strlen(suffixes[i]);
+        if (n >= l && strncmp(pgn, suffixes[i], l) == 0) {
+            *len = l;
+            return nags[i];
+        }
+    }
+    return 0;
+}
+
+/* Returns the length of the result at the start of the text, or 0 if it
+ * doesn't start with one. */
+static size_t
+result_len(const char *pgn, size_t n)
+{
+    static const char *results[] = { "1-0", "0-1", "1/2-1/2", "*" };
+    size_t i;
+    size_t l;
+
+    for (i = 0; i < sizeof(results) / sizeof(results[0]); i++) {
+        l = strlen(results[i]);
+        if (n >= l && strncmp(pgn, results[i], l) == 0
+                && (n == l || is_delimiter(pgn[l])))
+            return l;
+    }
+    return 0;
+}
+
+/* Read a tag pair, which starts at the opening bracket. Returns the length
+ * of the tag pair, or 0 if it isn't well formed. */
+static size_t
+read_tag(const char *pgn, size_t n, struct pgn_token *tok)
+{
+    size_t i;
+
+    for (i = 1; i < n && is_space(pgn[i]); i++);
+    tok->name = pgn + i;
+    for (; i < n && !is_space(pgn[i]) && pgn[i] != '"' && pgn[i] != ']'; i++);
+    tok->name_len = pgn + i - tok->name;
+    for (; i < n && is_space(pgn[i]); i++);
+    if (tok->name_len == 0 || i == n || pgn[i] != '"')
+        return 0;
+
+    tok->value = pgn + ++i;
+    for (; i < n && pgn[i] != '"'; i++) {
+        /* the only escapes are for quotes and backslashes */
+        if (pgn[i] == '\\')
+            i++;
+    }
+    if (i >= n)
+        return 0;
+    tok->value_len = pgn + i - tok->value;
+    for (i++; i < n && is_space(pgn[i]); i++);
+    if (i == n || pgn[i] != ']')
+        return 0;
+    return i + 1;
+}
+
+void
+pgn_lexer_init(struct pgn_lexer *lex, const char *pgn, size_t len)
+{
+    lex->pgn = pgn;
+    lex->len = len;
+    lex->pos = 0;
+}
+
+pgn_token_type_t
+pgn_next_token(struct pgn_lexer *lex, struct pgn_token *tok)
+{
+    const char *pgn;
+    const char *end;
+    size_t n;
+    size_t i;
+
+    memset(tok, 0x00, sizeof(struct pgn_token));
+    for (;;) {
+        while (lex->pos < lex->len && is_space(lex->pgn[lex->pos]))
+            lex->pos++;
+        /* a percent sign at the start of a line escapes the whole line */
+        if (lex->pos < lex->len && lex->pgn[lex->pos] == '%'
+                && (lex->pos == 0 || lex->pgn[lex->pos - 1] == '\n')) {
+            end = memchr(lex->pgn + lex->pos, '\n', lex->len - lex->pos);
+            lex->pos = end == NULL ? lex->len : (size_t) (end - lex->pgn);
+            continue;
+        }
+        break;
+    }
+
+    pgn = lex->pgn + lex->pos;
+    n = lex->len - lex->pos;
+    tok->text = pgn;
+    if (n == 0) {
+        tok->type = PGN_TOKEN_END;
+        return tok->type;
+    }
+
+    i = 1;
+    switch (pgn[0]) {
+    case '[':
+        i = read_tag(pgn, n, tok);
+        tok->type = i > 0 ? PGN_TOKEN_TAG : PGN_TOKEN_ERROR;
+        break;
+
+    case '{':
+        end = memchr(pgn, '}', n);
+        if (end == NULL) {
+            tok->type = PGN_TOKEN_ERROR;
+            i = 0;
+            break;
+        }
+        tok->type = PGN_TOKEN_COMMENT;
+        tok->value = pgn + 1;
+        tok->value_len = end - pgn - 1;
+        i = end - pgn + 1;
+        break;
+
+    case ';':
+        end = memchr(pgn, '\n', n);
+        tok->type = PGN_TOKEN_COMMENT;
+        tok->value = pgn + 1;
+        i = end == NULL ? n : (size_t) (end - pgn);
+        tok->value_len = i - 1;
+        break;
+
+    case '(':
+        tok->type = PGN_TOKEN_VARIATION_START;
+        break;
+
+    case ')':
+        tok->type = PGN_TOKEN_VARIATION_END;
+        break;
+
+    case '$':
+        tok->type = PGN_TOKEN_NAG;
+        for (; i < n && is_digit(pgn[i]); i++)
+            tok->number = 10 * tok->number + pgn[i] - '0';
+        if (i == 1)
+            tok->type = PGN_TOKEN_ERROR;
+        break;
+
+    case '!':
+    case '?':
+        tok->type = PGN_TOKEN_NAG;
+        tok->number = suffix_nag(pgn, n, &i);
+        break;
+
+    case ']':
+    case '}':
+        tok->type = PGN_TOKEN_ERROR;
+        i = 0;
+        break;
+
+    default:
+        if ((i = result_len(pgn, n)) != 0) {
+            tok->type = PGN_TOKEN_RESULT;
+            break;
+        }
+        if (is_digit(pgn[0])) {
+            for (i = 0; i < n && is_digit(pgn[i]); i++)
+                tok->number = 10 * tok->number + pgn[i] - '0';
+            /* anything else starting with a digit, like "0-0", is a move */
+            if (i == n || pgn[i] == '.' || is_space(pgn[i])) {
+                for (; i < n && pgn[i] == '.'; i++);
+                tok->type = PGN_TOKEN_MOVE_NUMBER;
+                break;
+            }
+            tok->number = 0;
+        }
+        /* a move runs up to whatever comes next, except for any suffix
+         * annotation, which is a token of its own. */
+        for (i = 0; i < n && !is_delimiter(pgn[i]); i++);
+        tok->type = PGN_TOKEN_SAN;
+        break;
+    }
+
+    tok->len = i;
+    lex->pos += i;
+    return tok->type;
+}
+
+bool
+pgn_find_tag(
+    const char *pgn,
+    size_t len,
+    const char *name,
+    const char **value,
+    size_t *value_len)
+{
+    struct pgn_lexer lex;
+    struct pgn_token tok;
+    size_t name_len;
+
+    name_len = strlen(name);
+    pgn_lexer_init(&lex, pgn, len);
+    /* the tag section ends at the first token that isn't a tag or a
+     * comment */
+    for (;;) {
+        switch (pgn_next_token(&lex, &tok)) {
+        case PGN_TOKEN_TAG:
+            if (tok.name_len == name_len
+                    && strncmp(tok.name, name, name_len) == 0) {
+                *value = tok.value;
+                *value_len = tok.value_len;
+                return true;
+            }
+            break;
+        case PGN_TOKEN_COMMENT:
+            break;
+        default:
+            return false;
+        }
+    }
+}
@@ -24,43 +24,180 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* The number of slots the table of roots starts out with. */
+#define ROOTS_START 16
+
+/* FNV-1a over everything that tells positions apart. */
+static size_t
+position_hash(const struct move *move)
+{
+    const struct board *b;
+    uint64_t h;
+    int rank;
+    int file;
+
+    b = move->post_board;
+    h = 14695981039346656037ULL;
+    for (rank = 0; rank < 8; rank++) {
+        for (file = 0; file < 8; file++) {
+            h = (h ^ b->board[rank][file].piece_type) * 1099511628211ULL;
+            h = (h ^ b->board[rank][file].color) * 1099511628211ULL;
+        }
+    }
+    h = (h ^ move->player) * 1099511628211ULL;
+    h = (h ^ b->available_castles) * 1099511628211ULL;
+    h = (h ^ (uint8_t) b->passant_file) * 1099511628211ULL;
+    h = (h ^ b->fifty_move_counter) * 1099511628211ULL;
+    h = (h ^ b->ply_index) * 1099511628211ULL;
+    return h;
+}
+
+static bool
+same_position(struct move *m1, struct move *m2)
+{
+    return m1->player == m2->player
+        && m1->post_board->passant_file == m2->post_board->passant_file
+        && m1->post_board->fifty_move_counter
+            == m2->post_board->fifty_move_counter
+        && m1->post_board->ply_index == m2->post_board->ply_index
+        && boards_equal(m1->post_board, m2->post_board);
+}
+
+/* Find the root for the position after move, or the empty slot it would go
+ * in. Must be called with roots_lock held. */
+static struct state_node **
+find_root(struct game_tree *gt, struct move *move)
+{
+    struct state_node **slot;
+    size_t hash;
+
+    for (hash = position_hash(move);; hash++) {
+        slot = &gt->roots[hash & (gt->roots_cap - 1)];
+        if (*slot == NULL || same_position((*slot)->move, move))
+            return slot;
+    }
+}
+
+/* Add a node to the table of roots, which mustn't have its position yet.
+ * Must be called with roots_lock held, or before the tree is shared. Returns
+ * false if memory runs out. */
+static bool
+add_root(struct game_tree *gt, struct state_node *node)
+{
+    struct state_node **old;
+    size_t old_cap;
+    size_t i;
+
+    if (2 * (gt->n_roots + 1) > gt->roots_cap) {
+        old = gt->roots;
+        old_cap = gt->roots_cap;
+        gt->roots_cap = old_cap == 0 ? ROOTS_START : 2 * old_cap;
+        gt->roots = calloc(gt->roots_cap, sizeof(struct state_node *));
+        if (gt->roots == NULL) {
+            gt->roots = old;
+            gt->roots_cap = old_cap;
+            return false;
+        }
+        for (i = 0; i < old_cap; i++)
+            if (old[i] != NULL)
+                *find_root(gt, old[i]->move) = old[i];
+        free(old);
+    }
+    *find_root(gt, node->move) = node;
+    gt->n_roots++;
+    return true;
+}
+
 void
 init_gametree(struct game_tree *gt)
 {
+    pthread_rwlockattr_t attr;
+
+    pthread_mutex_init(&gt->states_lock, NULL);
+    /* lookups only hold the games lock for an instant, but there can be a
+     * lot of them; left to its default, the lock would let a steady stream
+     * of them keep new games from ever being added. */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(
+        &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&gt->games_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_rwlock_init(&gt->legal_lock, NULL);
+    pthread_mutex_init(&gt->roots_lock, NULL);
+
     gt->n_states = 1;
+    gt->states_cap = 1;
+    gt->states_reserved = 0;
     gt->states = calloc(1, sizeof(struct state_node *));
     gt->n_games = 0;
+    gt->games_cap = 0;
     gt->games = NULL;
+    gt->legal_nodes = calloc(LEGAL_CACHE_NODES, sizeof(struct state_node *));
+    gt->legal_cap = gt->legal_nodes == NULL ? 0 : LEGAL_CACHE_NODES;
+    gt->legal_next = 0;
+
+    gt->root = calloc(1, sizeof(struct state_node));
+    gt->root->first_child = NULL;
+    gt->root->next_sibling = NULL;
+    gt->root->parent = NULL;
+    gt->root->move = calloc(1, sizeof(struct move));
+    get_root(gt->root->move);
+    gt->states[0] = gt->root;
 
-    gt->states[0] = calloc(1, sizeof(struct state_node));
-    gt->states[0]->n_children = 0;
-    gt->states[0]->children = NULL;
-    gt->states[0]->parent = NULL;
-    gt->states[0]->move = calloc(1, sizeof(struct move));
-    get_root(gt->states[0]->move);
+    gt->n_roots = 0;
+    gt->roots_cap = 0;
+    gt->roots = NULL;
+    add_root(gt, gt->root);
 }
 
 game_id_t
 new_game(struct game_tree *gt, player_id_t white, player_id_t black)
+{
+    return new_game_at(gt, white, black, gt->root, AVAILABLE_MOVE);
+}
+
+game_id_t
+new_game_at(
+    struct game_tree *gt,
+    player_id_t white,
+    player_id_t black,
+    struct state_node *node,
+    termination_t termination)
 {
     struct game **new_games;
-    int i;
+    struct game *game;
+    size_t new_cap;
+    size_t i;
 
-    new_games = realloc(gt->games, (gt->n_games + 1) * sizeof(struct game *));
-    if (new_games == NULL) {
+    game = calloc(1, sizeof(struct game));
+    if (game == NULL)
         return NO_GAME;
+    game->player_white = white;
+    game->player_black = black;
+    game->current = node;
+    game->termination = termination;
+
+    pthread_rwlock_wrlock(&gt->games_lock);
+    /* bulk imports add millions of games, so the list grows geometrically
+     * rather than one game at a time. */
+    if (gt->n_games == gt->games_cap) {
+        new_cap = gt->games_cap == 0 ? 16 : 2 * gt->games_cap;
+        new_games = realloc(gt->games, new_cap * sizeof(struct game *));
+        if (new_games == NULL) {
+            pthread_rwlock_unlock(&gt->games_lock);
+            free(game);
+            return NO_GAME;
+        }
+        gt->games = new_games;
+        gt->games_cap = new_cap;
     }
     i = gt->n_games;
-    gt->games = new_games;
+    game->id = i;
+    gt->games[i] = game;
     gt->n_games++;
+    pthread_rwlock_unlock(&gt->games_lock);
 
-    gt->games[i] = calloc(1, sizeof(struct game));
-    gt->games[i]->id = i;
-    gt->games[i]->player_white = white;
-    gt->games[i]->player_black = black;
-    gt->games[i]->current = gt->states[0];
-
-    return gt->games[i]->id;
+    return game->id;
 }
 
 bool
@@ -76,98 +213,671 @@ moves_equivalent(struct move *m1, struct move *m2)
         return false;
     if (m1->end.file != m2->end.file)
         return false;
+    /* the same pawn move can end with different promotions */
+    if (m1->post_board->board[m1->end.rank][m1->end.file].piece_type
+            != m2->post_board->board[m2->end.rank][m2->end.file].piece_type)
+        return false;
     return true;
 }
 
+/* Make sure there's room in the list of states for one more node. Returns
+ * false if there isn't and we couldn't make room. */
+static bool
+reserve_state(struct game_tree *gt)
+{
+    struct state_node **new_states;
+    size_t new_cap;
+    bool res;
+
+    res = true;
+    pthread_mutex_lock(&gt->states_lock);
+    if (gt->n_states + gt->states_reserved == gt->states_cap) {
+        new_cap = 2 * gt->states_cap;
+        new_states = realloc(gt->states, new_cap * sizeof(struct state_node *));
+        if (new_states == NULL) {
+            res = false;
+            goto unlock;
+        }
+        gt->states = new_states;
+        gt->states_cap = new_cap;
+    }
+    gt->states_reserved++;
+unlock:
+    pthread_mutex_unlock(&gt->states_lock);
+    return res;
+}
+
+/* Fill a slot set aside by reserve_state, or give it back if node is NULL. */
+static void
+add_state(struct game_tree *gt, struct state_node *node)
+{
+    pthread_mutex_lock(&gt->states_lock);
+    gt->states_reserved--;
+    if (node != NULL)
+        gt->states[gt->n_states++] = node;
+    pthread_mutex_unlock(&gt->states_lock);
+}
+
+struct state_node *
+tree_root_from_fen(struct game_tree *gt, const char *fen, size_t len)
+{
+    struct state_node **slot;
+    struct state_node *node;
+    struct move *move;
+
+    /* the parsing is done before the lock is taken, so that games can be
+     * started from many FENs at once */
+    move = parse_fen(fen, len);
+    if (move == NULL)
+        return NULL;
+    if (illegal_position(move) != NULL) {
+        free_move(move);
+        return NULL;
+    }
+
+    node = NULL;
+    pthread_mutex_lock(&gt->roots_lock);
+    slot = find_root(gt, move);
+    if (*slot != NULL) {
+        node = *slot;
+        goto unlock;
+    }
+    if (!reserve_state(gt))
+        goto unlock;
+    node = calloc(1, sizeof(struct state_node));
+    if (node != NULL) {
+        node->move = move;
+        if (!add_root(gt, node)) {
+            free(node);
+            node = NULL;
+        }
+    }
+    add_state(gt, node);
+    if (node != NULL)
+        move = NULL;
+unlock:
+    pthread_mutex_unlock(&gt->roots_lock);
+    if (move != NULL)
+        free_move(move);
+    return node;
+}
+
+game_id_t
+new_game_from_fen(
+    struct game_tree *gt,
+    player_id_t white,
+    player_id_t black,
+    const char *fen,
+    size_t len)
+{
+    struct state_node *node;
+
+    node = tree_root_from_fen(gt, fen, len);
+    if (node == NULL)
+        return NO_GAME;
+    return new_game_at(
+        gt, white, black, node, node->move->post_board->termination);
+}
+
+/* Look for a sibling reached by the given move, starting at the node "from"
+ * and stopping before the node "until". */
+static struct state_node *
+find_child(
+    struct state_node *from,
+    struct state_node *until,
+    struct move *move)
+{
+    struct state_node *child;
+
+    for (child = from; child != until; child = child->next_sibling) {
+        if (moves_equivalent(move, child->move))
+            return child;
+    }
+    return NULL;
+}
+
+/* The length of a move's notation without its check or mate marker. */
+static size_t
+unmarked_len(const char *notation, size_t len)
+{
+    while (len > 0 && (notation[len - 1] == '+' || notation[len - 1] == '#'))
+        len--;
+    return len;
+}
+
+/* Look for a child reached by a move written as the given notation. Moves
+ * are stored with their canonical SAN, which a client may well have left the
+ * check marker off of, so that's ignored. The same notation always makes the
+ * same move from the same position, so a game following a line that's
+ * already in the tree, as most games in a big database do for their openings
+ * at least, doesn't need its moves parsed. */
+static struct state_node *
+find_notation(struct state_node *parent, const char *notation, size_t len)
+{
+    struct state_node *child;
+    const char *algebraic;
+
+    len = unmarked_len(notation, len);
+    for (child = __atomic_load_n(&parent->first_child, __ATOMIC_ACQUIRE);
+            child != NULL; child = child->next_sibling) {
+        algebraic = child->move->algebraic;
+        if (strncmp(algebraic, notation, len) == 0
+                && unmarked_len(algebraic, strlen(algebraic)) == len)
+            return child;
+    }
+    return NULL;
+}
+
+/* Returns the child of parent reached by node's move, adding node as that
+ * child if there isn't one yet. If some other thread adds an equivalent child
+ * first, that child is returned instead and node is left untouched. */
+static struct state_node *
+add_child(struct state_node *parent, struct state_node *node)
+{
+    struct state_node *head;
+    struct state_node *seen;
+    struct state_node *found;
+
+    head = __atomic_load_n(&parent->first_child, __ATOMIC_ACQUIRE);
+    found = find_child(head, NULL, node->move);
+    seen = head;
+    while (found == NULL) {
+        node->next_sibling = head;
+        if (__atomic_compare_exchange_n(
+                &parent->first_child, &head, node, false,
+                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return node;
+        /* someone else got there first; "head" now holds the new head of the
+         * list, and only the children in front of the ones we've already
+         * looked at could be the move we're trying to add. */
+        found = find_child(head, seen, node->move);
+        seen = head;
+    }
+    return found;
+}
+
+/* Add a freshly made move to the tree as a child of parent, if there isn't a
+ * child for the same move already. The move is owned by the tree afterwards,
+ * and freed if it isn't needed. */
+static struct state_node *
+add_move(struct game_tree *gt, struct state_node *parent, struct move *move)
+{
+    struct state_node *node;
+    struct state_node *child;
+
+    child = find_child(
+        __atomic_load_n(&parent->first_child, __ATOMIC_ACQUIRE), NULL, move);
+    if (child != NULL) {
+        free_move(move);
+        return child;
+    }
+
+    node = calloc(1, sizeof(struct state_node));
+    if (node == NULL) {
+        free_move(move);
+        return NULL;
+    }
+    node->move = move;
+    node->first_child = NULL;
+    node->next_sibling = NULL;
+    node->parent = parent;
+
+    /* the list of states has to have room for the node before we publish it
+     * as a child, since once it's published there's no taking it back. */
+    if (!reserve_state(gt)) {
+        free(node);
+        free_move(move);
+        return NULL;
+    }
+
+    child = add_child(parent, node);
+    if (child == node) {
+        add_state(gt, node);
+    } else {
+        /* another game made the same move at the same time. Nobody else
+         * ever saw our node, so we can free it right away. */
+        add_state(gt, NULL);
+        free(node);
+        free_move(move);
+    }
+    return child;
+}
+
+/* Parse a move that isn't in the tree as written, and add it if it isn't
+ * there at all. */
+static struct state_node *
+add_notation(
+    struct game_tree *gt,
+    struct state_node *parent,
+    const char *notation,
+    size_t len)
+{
+    struct move *move;
+
+    move = NULL;
+    parse_algebraic_len(notation, len, parent->move, &move);
+    if (move == NULL)
+        return NULL;
+    return add_move(gt, parent, move);
+}
+
+/* Returns the node's legal moves with the tree's legal_lock held for
+ * reading, listing and caching them first if they aren't cached yet. Returns
+ * NULL, without the lock held, if they can't be cached. Whatever's returned
+ * can be evicted as soon as the lock is released. */
+static const struct legal_moves *
+lock_legal_moves(struct game_tree *gt, struct state_node *node)
+{
+    struct legal_moves *legal;
+    struct state_node *evicted;
+
+    for (;;) {
+        pthread_rwlock_rdlock(&gt->legal_lock);
+        if (node->legal != NULL)
+            return node->legal;
+        pthread_rwlock_unlock(&gt->legal_lock);
+
+        /* the list is made without the lock held, so that other threads can
+         * go on using the cache in the meantime */
+        legal = find_legal_moves(node->move);
+        if (legal == NULL)
+            return NULL;
+
+        pthread_rwlock_wrlock(&gt->legal_lock);
+        if (gt->legal_cap == 0) {
+            pthread_rwlock_unlock(&gt->legal_lock);
+            free_legal_moves(legal);
+            return NULL;
+        }
+        if (node->legal == NULL) {
+            evicted = gt->legal_nodes[gt->legal_next];
+            if (evicted != NULL) {
+                free_legal_moves(evicted->legal);
+                evicted->legal = NULL;
+            }
+            gt->legal_nodes[gt->legal_next] = node;
+            gt->legal_next = (gt->legal_next + 1) % gt->legal_cap;
+            node->legal = legal;
+        } else {
+            /* some other thread got there first */
+            free_legal_moves(legal);
+        }
+        pthread_rwlock_unlock(&gt->legal_lock);
+    }
+}
+
 bool
-make_move(
+set_legal_cache_size(struct game_tree *gt, size_t n)
+{
+    struct state_node **nodes;
+    size_t i;
+
+    nodes = NULL;
+    if (n > 0) {
+        nodes = calloc(n, sizeof(struct state_node *));
+        if (nodes == NULL)
+            return false;
+    }
+
+    pthread_rwlock_wrlock(&gt->legal_lock);
+    for (i = 0; i < gt->legal_cap; i++) {
+        if (gt->legal_nodes[i] != NULL) {
+            free_legal_moves(gt->legal_nodes[i]->legal);
+            gt->legal_nodes[i]->legal = NULL;
+        }
+    }
+    free(gt->legal_nodes);
+    gt->legal_nodes = nodes;
+    gt->legal_cap = n;
+    gt->legal_next = 0;
+    pthread_rwlock_unlock(&gt->legal_lock);
+    return true;
+}
+
+/* Look for a child reached by the move between the given squares; like
+ * find_notation, this saves making a move that's already in the tree. */
+static struct state_node *
+find_squares(
+    struct state_node *parent,
+    struct position start,
+    struct position end,
+    piece_type_t promotion)
+{
+    struct state_node *child;
+    struct move *move;
+    piece_type_t piece;
+
+    piece = promotion != 0 ? promotion
+        : parent->move->post_board->board[start.rank][start.file].piece_type;
+    for (child = __atomic_load_n(&parent->first_child, __ATOMIC_ACQUIRE);
+            child != NULL; child = child->next_sibling) {
+        move = child->move;
+        if (move->start.rank == start.rank && move->start.file == start.file
+                && move->end.rank == end.rank && move->end.file == end.file
+                && move->post_board->board[end.rank][end.file].piece_type
+                    == piece)
+            return child;
+    }
+    return NULL;
+}
+
+/* Returns the child reached by a move that's known to be legal. */
+static struct state_node *
+add_legal_move(
     struct game_tree *gt,
-    game_id_t game_id,
-    player_id_t player,
+    struct state_node *parent,
+    const struct legal_move *legal)
+{
+    struct state_node *child;
+    struct move *move;
+
+    child = find_squares(parent, legal->start, legal->end, legal->promotion);
+    if (child != NULL)
+        return child;
+    move_from_squares(
+        legal->start, legal->end, legal->promotion, parent->move, &move);
+    if (move == NULL)
+        return NULL;
+    return add_move(gt, parent, move);
+}
+
+struct state_node *
+tree_child(
+    struct game_tree *gt,
+    struct state_node *parent,
     const char *notation)
+{
+    return tree_child_len(gt, parent, notation, strlen(notation));
+}
+
+struct state_node *
+tree_child_len(
+    struct game_tree *gt,
+    struct state_node *parent,
+    const char *notation,
+    size_t len)
+{
+    struct state_node *child;
+    const struct legal_moves *legal;
+    const struct legal_move *found;
+    struct legal_move move;
+
+    child = find_notation(parent, notation, len);
+    if (child != NULL)
+        return child;
+
+    /* a move that's new here is looked up in the position's legal moves
+     * rather than searched for on the board; if that's not possible, the
+     * notation has to be parsed the long way */
+    legal = lock_legal_moves(gt, parent);
+    if (legal == NULL)
+        return add_notation(gt, parent, notation, len);
+    found = legal_move_by_san(legal, notation, len);
+    if (found != NULL)
+        move = *found;
+    pthread_rwlock_unlock(&gt->legal_lock);
+    if (found == NULL)
+        return NULL;
+    return add_legal_move(gt, parent, &move);
+}
+
+/* Find a game that the given player is to move in. */
+static struct game *
+game_to_move(struct game_tree *gt, game_id_t game_id, player_id_t player)
 {
     struct game *game;
-    struct move *move;
-    struct move *t;
-    struct state_node **new_children;
-    struct state_node **new_states;
-    size_t i;
-    size_t j;
 
     game = get_game(gt, game_id);
     if (game == NULL)
-        return false;
+        return NULL;
 
     if (game->current->move->player == WHITE) {
         if (game->player_black != player)
-            return false;
+            return NULL;
     } else {
         if (game->player_white != player)
-            return false;
+            return NULL;
     }
+    return game;
+}
 
-    move = NULL;
-    parse_algebraic(notation, game->current->move, &move);
-    if (move == NULL)
+bool
+make_move(
+    struct game_tree *gt,
+    game_id_t game_id,
+    player_id_t player,
+    const char *notation)
+{
+    struct game *game;
+    struct state_node *child;
+
+    game = game_to_move(gt, game_id, player);
+    if (game == NULL)
         return false;
 
-    for (i = 0; i < game->current->n_children; i++) {
-        t = game->current->children[i]->move;
-        if (moves_equivalent(move, t)) {
-            free_move(move);
-            game->current = game->current->children[i];
-            return true;
-        }
+    child = tree_child(gt, game->current, notation);
+    if (child == NULL)
+        return false;
+    set_game(game, child, child->move->post_board->termination);
+    return true;
+}
+
+struct state_node *
+tree_child_coordinates(
+    struct game_tree *gt,
+    struct state_node *parent,
+    const char *notation,
+    size_t len)
+{
+    struct state_node *child;
+    const struct legal_moves *legal;
+    const struct legal_move *found;
+    struct legal_move move;
+    struct move *made;
+
+    if (!read_coordinates(notation, len, &move.start, &move.end,
+                          &move.promotion))
+        return NULL;
+    child = find_squares(parent, move.start, move.end, move.promotion);
+    if (child != NULL)
+        return child;
+
+    legal = lock_legal_moves(gt, parent);
+    if (legal == NULL) {
+        move_from_squares(
+            move.start, move.end, move.promotion, parent->move, &made);
+        if (made == NULL)
+            return NULL;
+        return add_move(gt, parent, made);
+    }
+    found = legal_move_by_squares(
+        legal, move.start, move.end, move.promotion);
+    pthread_rwlock_unlock(&gt->legal_lock);
+    if (found == NULL)
+        return NULL;
+    return add_legal_move(gt, parent, &move);
+}
+
+bool
+make_move_coordinates(
+    struct game_tree *gt,
+    game_id_t game_id,
+    player_id_t player,
+    const char *notation,
+    size_t len)
+{
+    struct game *game;
+    struct state_node *child;
+
+    game = game_to_move(gt, game_id, player);
+    if (game == NULL)
+        return false;
+
+    child = tree_child_coordinates(gt, game->current, notation, len);
+    if (child == NULL)
+        return false;
+    set_game(game, child, child->move->post_board->termination);
+    return true;
+}
+
+/* Find out whether a legal move gives check or mate, which takes making it,
+ * unless some game has made it already. Returns '\0' if memory runs out. */
+static char
+legal_move_marker(struct state_node *node, const struct legal_move *legal)
+{
+    struct state_node *child;
+    struct move *move;
+    const char *san;
+    char marker;
+
+    child = find_squares(node, legal->start, legal->end, legal->promotion);
+    if (child != NULL) {
+        move = child->move;
+    } else {
+        move_from_squares(
+            legal->start, legal->end, legal->promotion, node->move, &move);
+        if (move == NULL)
+            return '\0';
     }
+    san = move->algebraic;
+    marker = san[strlen(san) - 1];
+    if (marker != '+' && marker != '#')
+        marker = ' ';
+    if (child == NULL)
+        free_move(move);
+    return marker;
+}
 
-    new_states = realloc(
-        gt->states,
-        (gt->n_states + 1) * sizeof(struct state_node *));
-    if (new_states == NULL)
+bool
+tree_legal_moves(
+    struct game_tree *gt,
+    struct state_node *node,
+    struct legal_move **moves,
+    size_t *n)
+{
+    const struct legal_moves *legal;
+    struct legal_move *res;
+    size_t len;
+    size_t i;
+    bool marked;
+
+    legal = lock_legal_moves(gt, node);
+    if (legal == NULL)
         return false;
-    i = gt->n_states;
-    gt->n_states++;
-    gt->states = new_states;
-
-    gt->states[i] = calloc(1, sizeof(struct state_node));
-    gt->states[i]->move = move;
-    gt->states[i]->n_children = 0;
-    gt->states[i]->children = NULL;
-    gt->states[i]->parent = game->current;
-
-    new_children = realloc(
-        game->current->children,
-        (game->current->n_children + 1) * sizeof(struct state_node *));
-    if (new_children == NULL)
+    *n = legal->n;
+    res = malloc((legal->n + 1) * sizeof(struct legal_move));
+    if (res != NULL)
+        memcpy(res, legal->moves, legal->n * sizeof(struct legal_move));
+    pthread_rwlock_unlock(&gt->legal_lock);
+    if (res == NULL)
         return false;
-    game->current->children = new_children;
-    j = game->current->n_children;
-    game->current->n_children++;
-    game->current->children[j] = gt->states[i];
 
-    game->current = gt->states[i];
-    game->termination = game->current->move->post_board->termination;
+    /* the markers are found once for the position and kept with its moves,
+     * so that only the first listing has to make every move */
+    marked = true;
+    for (i = 0; i < *n; i++) {
+        if (res[i].marker == '\0') {
+            res[i].marker = legal_move_marker(node, &res[i]);
+            if (res[i].marker == '\0') {
+                free(res);
+                return false;
+            }
+            marked = false;
+        }
+    }
+    if (!marked) {
+        pthread_rwlock_wrlock(&gt->legal_lock);
+        /* if the list was evicted and made again, it's the same list */
+        if (node->legal != NULL)
+            for (i = 0; i < *n; i++)
+                node->legal->moves[i].marker = res[i].marker;
+        pthread_rwlock_unlock(&gt->legal_lock);
+    }
+
+    for (i = 0; i < *n; i++) {
+        if (res[i].marker != ' ') {
+            len = strlen(res[i].san);
+            res[i].san[len] = res[i].marker;
+            res[i].san[len + 1] = '\0';
+        }
+    }
+    *moves = res;
     return true;
 }
 
 struct game *
 get_game(struct game_tree *gt, game_id_t game)
 {
-    size_t i;
-    for (i = 0; i < gt->n_games; i++) {
-        if (gt->games[i]->id == game)
-            return gt->games[i];
-    }
-    return NULL;
+    struct game *res;
+
+    pthread_rwlock_rdlock(&gt->games_lock);
+    /* games are given IDs in the order they're created and only ever dropped
+     * from the end, so a game's ID is its index. */
+    res = game < gt->n_games ? gt->games[game] : NULL;
+    pthread_rwlock_unlock(&gt->games_lock);
+    return res;
 }
 
 bool
 end_game(struct game_tree *gt, game_id_t game_id, termination_t termination)
 {
-    get_game(gt, game_id)->termination = termination;
+    struct game *game;
+
+    game = get_game(gt, game_id);
+    set_game(game, game->current, termination);
     return true;
 }
 
+unsigned int
+read_game(
+    struct game *game,
+    struct state_node **current,
+    termination_t *termination)
+{
+    unsigned int version;
+
+    for (;;) {
+        version = __atomic_load_n(&game->version, __ATOMIC_ACQUIRE);
+        *current = __atomic_load_n(&game->current, __ATOMIC_RELAXED);
+        *termination = __atomic_load_n(&game->termination, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!(version & 1)
+                && __atomic_load_n(&game->version, __ATOMIC_RELAXED) == version)
+            return version;
+    }
+}
+
+void
+set_game(
+    struct game *game,
+    struct state_node *current,
+    termination_t termination)
+{
+    unsigned int version;
+
+    /* there's only ever one writer, so the version needn't be incremented
+     * atomically; it only has to be seen to change around the writes. */
+    version = game->version;
+    __atomic_store_n(&game->version, version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&game->current, current, __ATOMIC_RELAXED);
+    __atomic_store_n(&game->termination, termination, __ATOMIC_RELAXED);
+    __atomic_store_n(&game->version, version + 2, __ATOMIC_RELEASE);
+}
+
+void
+truncate_games(struct game_tree *gt, size_t n_games)
+{
+    size_t i;
+
+    pthread_rwlock_wrlock(&gt->games_lock);
+    for (i = n_games; i < gt->n_games; i++)
+        free(gt->games[i]);
+    if (n_games < gt->n_games)
+        gt->n_games = n_games;
+    pthread_rwlock_unlock(&gt->games_lock);
+}
+
 void
 get_root(struct move *out)
 {
@@ -192,6 +902,8 @@ free_move(struct move *move)
     if (move->post_board != NULL) {
         if (move->post_board->access_map != NULL)
             free(move->post_board->access_map);
+        free(move->post_board->pgn);
+        free(move->post_board->fen);
         free(move->post_board);
     }
     if (move->algebraic != NULL)
@@ -205,13 +917,21 @@ free_game_tree(struct game_tree *gt)
     size_t i;
 
     for (i = 0; i < gt->n_states; i++) {
+        free_legal_moves(gt->states[i]->legal);
         free_move(gt->states[i]->move);
         free(gt->states[i]);
     }
     free(gt->states);
+    free(gt->legal_nodes);
+    free(gt->roots);
 
     for (i = 0; i < gt->n_games; i++) {
         free(gt->games[i]);
     }
     free(gt->games);
+
+    pthread_mutex_destroy(&gt->states_lock);
+    pthread_rwlock_destroy(&gt->games_lock);
+    pthread_rwlock_destroy(&gt->legal_lock);
+    pthread_mutex_destroy(&gt->roots_lock);
 }